@@ -62,11 +62,13 @@ typedef nvs_handle_t nvs_handle IDF_DEPRECATED("Replace with nvs_handle_t");
 #define ESP_ERR_NVS_WRONG_ENCRYPTION        (ESP_ERR_NVS_BASE + 0x19)  /*!< NVS partition is marked as encrypted with generic flash encryption. This is forbidden since the NVS encryption works differently. */
 
 #define ESP_ERR_NVS_CONTENT_DIFFERS         (ESP_ERR_NVS_BASE + 0x18)  /*!< Internal error; never returned by nvs API functions.  NVS key is different in comparison */
+#define ESP_ERR_NVS_VALUE_CHANGED           (ESP_ERR_NVS_BASE + 0x1a)  /*!< The stored value doesn't equal the expected one, see nvs_cas_* */
 
 #define NVS_DEFAULT_PART_NAME               "nvs"   /*!< Default partition name of the NVS partition in the partition table */
 
 #define NVS_PART_NAME_MAX_SIZE              16   /*!< maximum length of partition name (excluding null terminator) */
 #define NVS_KEY_NAME_MAX_SIZE               16   /*!< Maximal length of NVS key name (including null terminator) */
+#define NVS_LOG_RECORD_MAX_SIZE             24   /*!< Maximal size of a record appended with nvs_append_log */
 
 /**
  * @brief Mode of opening the non-volatile storage
@@ -97,6 +99,8 @@ typedef enum {
     NVS_TYPE_I64   = 0x18,  /*!< Type int64_t */
     NVS_TYPE_STR   = 0x21,  /*!< Type string */
     NVS_TYPE_BLOB  = 0x42,  /*!< Type blob */
+    NVS_TYPE_COUNTER = 0x34, /*!< Counter of type uint32_t, see nvs_inc_counter */
+    NVS_TYPE_LOG   = 0x50,  /*!< Log of records, see nvs_append_log */
     NVS_TYPE_ANY   = 0xff   /*!< Must be last */
 } nvs_type_t;
 
@@ -114,6 +118,13 @@ typedef struct {
  */
 typedef struct nvs_opaque_iterator_t *nvs_iterator_t;
 
+/**
+ * Caller-owned memory holding an iterator, see nvs_entry_find_in_place
+ */
+typedef struct {
+    uint64_t reserved[24];  /*!< Internal state of the iterator */
+} nvs_iterator_buffer_t;
+
 /**
  * @brief      Open non-volatile storage with a given namespace from the default NVS partition
  *
@@ -234,6 +245,49 @@ esp_err_t nvs_set_str (nvs_handle_t handle, const char* key, const char* value);
  */
 esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length);
 
+/**
+ * @brief Description of one value written by nvs_set_items
+ */
+typedef struct {
+    const char *key;    /*!< Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty. */
+    nvs_type_t type;    /*!< Type of the value. NVS_TYPE_ANY isn't allowed. */
+    const void *value;  /*!< Pointer to the value: an integer of the given type, a zero-terminated string or blob data */
+    size_t length;      /*!< Length of blob data in bytes. Ignored for other types. */
+    esp_err_t err;      /*!< Result of writing this value, set by nvs_set_items */
+} nvs_set_item_t;
+
+/**
+ * @brief       Set several values at once
+ *
+ * Writes the values described by items under a single lock. Values which are stored already are
+ * found in one pass over the pages and left alone. The other values, apart from blobs, are written
+ * together to consecutive entries of the active page and the entries holding their previous values
+ * are erased afterwards. This needs far fewer flash operations than setting the values one by one.
+ * Blobs are written separately, after the other values.
+ *
+ * If a key appears several times with the same type, the last value is written. The values are not
+ * written atomically: after a power loss, some of them may have been updated and others not.
+ * Note that actual storage will not be updated until nvs_commit function is called.
+ *
+ * The result of each value is stored in its err field and has the same meaning as the result of
+ * the corresponding nvs_set_* function. Additionally, ESP_ERR_INVALID_ARG is stored if key or value
+ * is NULL or type is not a valid type.
+ *
+ * @param[in]     handle     Handle obtained from nvs_open function.
+ *                           Handles that were opened read only cannot be used.
+ * @param[inout]  items      Array of count values to write.
+ * @param[in]     count      Number of values.
+ *
+ * @return
+ *             - ESP_OK if all values were set successfully
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+ *             - ESP_ERR_INVALID_ARG if items is NULL and count is not 0
+ *             - ESP_ERR_NO_MEM if memory for the write buffer could not be allocated
+ *             - otherwise the error of the first value which couldn't be set
+ */
+esp_err_t nvs_set_items(nvs_handle_t handle, nvs_set_item_t *items, size_t count);
+
 /**@{*/
 /**
  * @brief      get value for given key
@@ -339,6 +393,288 @@ esp_err_t nvs_get_str (nvs_handle_t handle, const char* key, char* out_value, si
 esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length);
 /**@}*/
 
+/**
+ * @brief Callback providing the buffer a string or blob is read into by nvs_get_str_alloc and nvs_get_blob_alloc
+ *
+ * It is called while the NVS partition is locked, so it must not call NVS functions.
+ *
+ * @param[in]  arg     The argument passed to nvs_get_str_alloc or nvs_get_blob_alloc.
+ * @param[in]  length  Length of the value in bytes. For strings this includes the zero terminator.
+ *
+ * @return Pointer to a buffer of at least length bytes, or NULL if there is none
+ */
+typedef void *(*nvs_alloc_cb_t)(void *arg, size_t length);
+
+/**@{*/
+/**
+ * @brief      Get a string or blob value of unknown length
+ *
+ * The value is looked up once. The callback is then called with its length
+ * and the value is read into the buffer it returns, e.g. memory allocated
+ * with malloc. Compared to querying the length with nvs_get_str or
+ * nvs_get_blob first, this saves a search of the partition.
+ *
+ * The callback isn't called if the value can't be found.
+ *
+ * @param[in]  handle  Handle obtained from nvs_open function.
+ * @param[in]  key     Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[in]  alloc   Callback providing the buffer for the value.
+ * @param[in]  arg     Argument passed to alloc.
+ * @param[out] length  If not NULL, set to the length of the value once it is found.
+ *                     For nvs_get_str_alloc this includes the zero terminator.
+ *
+ * @return
+ *             - ESP_OK if the value was retrieved successfully
+ *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_INVALID_ARG if alloc is NULL
+ *             - ESP_ERR_NO_MEM if alloc returned NULL
+ */
+esp_err_t nvs_get_str_alloc (nvs_handle_t handle, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t* length);
+esp_err_t nvs_get_blob_alloc(nvs_handle_t handle, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t* length);
+/**@}*/
+
+/**
+ * @brief      Get a part of a blob value for given key
+ *
+ * Reads length bytes, starting at byte offset of the value, into out_value.
+ * Only the flash entries which hold this range are read, so the buffer
+ * can be much smaller than the value. If the range doesn't cover the whole
+ * value, the checksum of the data can't be verified.
+ *
+ * @param[in]     handle     Handle obtained from nvs_open function.
+ * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[in]     offset     Offset of the first byte to read.
+ * @param         out_value  Pointer to the output buffer of at least length bytes.
+ * @param[in]     length     Number of bytes to read.
+ *
+ * @return
+ *             - ESP_OK if the range was retrieved successfully
+ *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_KEY_TOO_LONG if key name is too long
+ *             - ESP_ERR_NVS_INVALID_LENGTH if the range exceeds the value
+ */
+esp_err_t nvs_get_blob_range(nvs_handle_t handle, const char* key, size_t offset, void* out_value, size_t length);
+
+/**
+ * @brief Description of one value read by nvs_get_items
+ */
+typedef struct {
+    const char *key;    /*!< Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty. */
+    nvs_type_t type;    /*!< Type of the value, as it was set. NVS_TYPE_ANY isn't allowed. */
+    void *out_value;    /*!< Output buffer. For strings and blobs it may be NULL to only look up length. */
+    size_t length;      /*!< Size of out_value in bytes. For strings and blobs it is set to the size of the value,
+                             including the zero terminator of strings. Ignored for integer types. */
+    esp_err_t err;      /*!< Result of reading this value, set by nvs_get_items */
+} nvs_get_item_t;
+
+/**
+ * @brief      Get several values at once
+ *
+ * Reads the values described by items under a single lock. All pages of the partition are
+ * visited once for the whole array instead of once for each key, so reading many small values
+ * this way is faster than calling nvs_get_* for each of them. Blobs are looked up separately,
+ * after the other values.
+ *
+ * The result of each value is stored in its err field and has the same meaning as the result of
+ * the corresponding nvs_get_* function. Additionally, ESP_ERR_INVALID_ARG is stored if key is NULL,
+ * type is not a valid type or out_value is NULL for an integer type.
+ *
+ * @param[in]     handle     Handle obtained from nvs_open function.
+ * @param[inout]  items      Array of count values to read.
+ * @param[in]     count      Number of values.
+ *
+ * @return
+ *             - ESP_OK if all values were retrieved successfully
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_INVALID_ARG if items is NULL and count is not 0
+ *             - otherwise the error of the first value which couldn't be retrieved
+ */
+esp_err_t nvs_get_items(nvs_handle_t handle, nvs_get_item_t *items, size_t count);
+
+/**@{*/
+/**
+ * @brief      Add to an integer value
+ *
+ * Adds delta to the value of key and stores the result. A key which doesn't
+ * exist yet is created, starting at 0. The result wraps around like unsigned
+ * arithmetic of the type's size; a value can be decreased by passing a
+ * negative delta, converted to the type for unsigned types.
+ *
+ * Unlike a nvs_get_* followed by a nvs_set_*, the value is looked up once
+ * and no other call on the partition can change it in between. The new
+ * value is written before the old one is erased, so after a power loss
+ * either of them is found.
+ *
+ * @param[in]  handle     Handle obtained from nvs_open function.
+ *                        Handles that were opened read only cannot be used.
+ * @param[in]  key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[in]  delta      Value to add.
+ * @param[out] out_value  If not NULL, set to the new value.
+ *
+ * @return
+ *             - ESP_OK if the value was updated successfully
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+ *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
+ *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+ *               underlying storage to save the value
+ *             - ESP_ERR_NVS_REMOVE_FAILED if the old value couldn't be erased, see nvs_set_i8
+ */
+esp_err_t nvs_inc_i8  (nvs_handle_t handle, const char* key, int8_t delta, int8_t* out_value);
+esp_err_t nvs_inc_u8  (nvs_handle_t handle, const char* key, uint8_t delta, uint8_t* out_value);
+esp_err_t nvs_inc_i16 (nvs_handle_t handle, const char* key, int16_t delta, int16_t* out_value);
+esp_err_t nvs_inc_u16 (nvs_handle_t handle, const char* key, uint16_t delta, uint16_t* out_value);
+esp_err_t nvs_inc_i32 (nvs_handle_t handle, const char* key, int32_t delta, int32_t* out_value);
+esp_err_t nvs_inc_u32 (nvs_handle_t handle, const char* key, uint32_t delta, uint32_t* out_value);
+esp_err_t nvs_inc_i64 (nvs_handle_t handle, const char* key, int64_t delta, int64_t* out_value);
+esp_err_t nvs_inc_u64 (nvs_handle_t handle, const char* key, uint64_t delta, uint64_t* out_value);
+/**@}*/
+
+/**@{*/
+/**
+ * @brief      Replace an integer value if it has the expected value
+ *
+ * Sets the value of key to desired if its stored value equals *expected.
+ * Otherwise the value is left alone and *expected is set to the stored
+ * value, so the caller can compute a new desired value and try again.
+ * The comparison and the write happen under the same lock, with a single
+ * look-up of the key. Power loss behaves as for nvs_inc_i8.
+ *
+ * @param[in]     handle    Handle obtained from nvs_open function.
+ *                          Handles that were opened read only cannot be used.
+ * @param[in]     key       Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[inout]  expected  Pointer to the value the stored value is compared with.
+ * @param[in]     desired   The value to set.
+ *
+ * @return
+ *             - ESP_OK if the value equalled *expected and has been replaced
+ *             - ESP_ERR_NVS_VALUE_CHANGED if the value didn't equal *expected
+ *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+ *             - ESP_ERR_INVALID_ARG if expected is NULL
+ *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+ *               underlying storage to save the value
+ *             - ESP_ERR_NVS_REMOVE_FAILED if the old value couldn't be erased, see nvs_set_i8
+ */
+esp_err_t nvs_cas_i8  (nvs_handle_t handle, const char* key, int8_t* expected, int8_t desired);
+esp_err_t nvs_cas_u8  (nvs_handle_t handle, const char* key, uint8_t* expected, uint8_t desired);
+esp_err_t nvs_cas_i16 (nvs_handle_t handle, const char* key, int16_t* expected, int16_t desired);
+esp_err_t nvs_cas_u16 (nvs_handle_t handle, const char* key, uint16_t* expected, uint16_t desired);
+esp_err_t nvs_cas_i32 (nvs_handle_t handle, const char* key, int32_t* expected, int32_t desired);
+esp_err_t nvs_cas_u32 (nvs_handle_t handle, const char* key, uint32_t* expected, uint32_t desired);
+esp_err_t nvs_cas_i64 (nvs_handle_t handle, const char* key, int64_t* expected, int64_t desired);
+esp_err_t nvs_cas_u64 (nvs_handle_t handle, const char* key, uint64_t* expected, uint64_t desired);
+/**@}*/
+
+/**
+ * @brief      Add to a counter
+ *
+ * Counters are uint32_t values of type NVS_TYPE_COUNTER, which are meant to
+ * be incremented often. Besides its value, a counter has
+ * CONFIG_NVS_COUNTER_DATA_ENTRIES data entries whose bits are cleared one by
+ * one, each cleared bit adding 1 to the value. An increment by delta thus
+ * writes delta bits, usually a single word of flash, in place. Only when the
+ * bits run out is the counter written again, with a new value and erased data
+ * entries. On encrypted partitions, every increment writes a new counter.
+ *
+ * A key which doesn't exist yet is created, starting at 0. Counters are
+ * separate from uint32_t values of the same key set with nvs_set_u32.
+ *
+ * @param[in]  handle     Handle obtained from nvs_open function.
+ *                        Handles that were opened read only cannot be used.
+ * @param[in]  key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[in]  delta      Value to add. Large values are better added with nvs_inc_u32,
+ *                        since every cleared bit counts 1.
+ * @param[out] out_value  If not NULL, set to the new value.
+ *
+ * @return
+ *             - ESP_OK if the counter was updated successfully
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+ *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
+ *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+ *               underlying storage to save the value
+ *             - ESP_ERR_NVS_REMOVE_FAILED if the old counter couldn't be erased, see nvs_set_i8
+ */
+esp_err_t nvs_inc_counter(nvs_handle_t handle, const char* key, uint32_t delta, uint32_t* out_value);
+
+/**
+ * @brief      Get the value of a counter
+ *
+ * @param[in]     handle     Handle obtained from nvs_open function.
+ * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[out]    out_value  Pointer to the output value.
+ *
+ * @return
+ *             - ESP_OK if the value was retrieved successfully
+ *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
+ */
+esp_err_t nvs_get_counter(nvs_handle_t handle, const char* key, uint32_t* out_value);
+
+/**
+ * @brief      Append a record to a log
+ *
+ * Logs hold small records, such as reset reasons or fault codes, which are
+ * numbered by increasing sequence numbers starting at 0. A log is stored in
+ * blocks of CONFIG_NVS_LOG_BLOCK_RECORDS data entries which are left erased
+ * when the block is written, and each record is written into the next of
+ * them. Appending a record thus writes a single entry of 32 bytes, and a
+ * block entry once per block.
+ *
+ * Instead of copying full blocks to a new page, the garbage collection
+ * drops them once a newer block of the log is full as well, so the oldest
+ * records of a log are lost when space is needed. The newest full block is
+ * always kept. Sequence numbers aren't reused, records which have been
+ * dropped leave a gap.
+ *
+ * @param[in]  handle     Handle obtained from nvs_open function.
+ *                        Handles that were opened read only cannot be used.
+ * @param[in]  key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[in]  record     Pointer to the record.
+ * @param[in]  size       Size of the record, at most NVS_LOG_RECORD_MAX_SIZE bytes.
+ * @param[out] out_seq    If not NULL, set to the sequence number of the record.
+ *
+ * @return
+ *             - ESP_OK if the record was appended successfully
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+ *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
+ *             - ESP_ERR_NVS_VALUE_TOO_LONG if the record is longer than NVS_LOG_RECORD_MAX_SIZE
+ *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+ *               underlying storage to save the record. This is also returned if
+ *               the record filled its block and the next block couldn't be
+ *               written, the record is appended in this case.
+ */
+esp_err_t nvs_append_log(nvs_handle_t handle, const char* key, const void* record, size_t size, uint32_t* out_seq);
+
+/**
+ * @brief      Read a record of a log
+ *
+ * Reads the first record of the log whose sequence number is *seq or
+ * higher. All records are read in order by starting at 0 and passing the
+ * sequence number of the previous record plus 1.
+ *
+ * @param[in]     handle     Handle obtained from nvs_open function.
+ * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+ * @param[inout]  seq        Lowest sequence number to read, set to the sequence number of the record.
+ * @param         out_record Pointer to the output buffer. May be NULL, in this case only seq and size are set.
+ * @param[inout]  size       Size of the output buffer, set to the size of the record.
+ *
+ * @return
+ *             - ESP_OK if a record was read successfully
+ *             - ESP_ERR_NVS_NOT_FOUND if the log has no record with such a sequence number
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
+ *             - ESP_ERR_NVS_INVALID_LENGTH if size is not sufficient to store the record
+ *             - ESP_ERR_INVALID_ARG if seq or size is NULL
+ */
+esp_err_t nvs_read_log(nvs_handle_t handle, const char* key, uint32_t* seq, void* out_record, size_t* size);
+
 /**
  * @brief      Erase key-value pair with given key name.
  *
@@ -363,6 +699,12 @@ esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key);
  *
  * Note that actual storage may not be updated until nvs_commit function is called.
  *
+ * Unless it only has a few entries, the namespace is erased by writing a single tombstone
+ * entry. The entries of the erased key-value pairs are reclaimed later by the garbage
+ * collection, until then nvs_get_stats counts them as used. Tombstones are an on-flash
+ * format change: firmware without support for them may find the erased key-value pairs again
+ * in a namespace it creates later.
+ *
  * @param[in]  handle  Storage handle obtained with nvs_open.
  *                     Handles that were opened read only cannot be used.
  *
@@ -490,6 +832,12 @@ esp_err_t nvs_get_used_entry_count(nvs_handle_t handle, size_t* used_entries);
 /**
  * @brief       Create an iterator to enumerate NVS entries based on one or more parameters
  *
+ * The iterator lists the entries as they were when it was created; entries which are written, changed
+ * or erased afterwards don't affect it, and writes aren't blocked between calls to nvs_entry_next.
+ * Until the iterator is released, flash pages freed by writes are kept until they are needed again.
+ * If one of its pages had to be erased before the iteration reached it, nvs_entry_advance fails with
+ * ESP_ERR_NVS_INVALID_STATE; nvs_entry_next can't tell this from the end of the iteration.
+ *
  * \code{c}
  * // Example of listing all the key-value pairs of any type under specified partition and namespace
  * nvs_iterator_t it = nvs_entry_find(partition, namespace, NVS_TYPE_ANY);
@@ -520,6 +868,54 @@ esp_err_t nvs_get_used_entry_count(nvs_handle_t handle, size_t* used_entries);
  */
 nvs_iterator_t nvs_entry_find(const char *part_name, const char *namespace_name, nvs_type_t type);
 
+/**
+ * @brief       Create an iterator like nvs_entry_find, but in memory provided by the caller
+ *
+ * No memory is allocated for the iterator itself. The state kept for listing the entries as they were when
+ * the iterator was created is reused from iterators released before, so iterating a partition repeatedly
+ * doesn't allocate any memory after the first time.
+ *
+ * The returned iterator is used like one returned by nvs_entry_find. nvs_entry_next and nvs_release_iterator
+ * don't free it, the buffer can be reused once nvs_entry_find_in_place or nvs_entry_next has returned NULL,
+ * or after nvs_release_iterator.
+ *
+ * @param[in]   part_name       Partition name
+ *
+ * @param[in]   namespace_name  Set this value if looking for entries with
+ *                              a specific namespace. Pass NULL otherwise.
+ *
+ * @param[in]   type            One of nvs_type_t values.
+ *
+ * @param[in]   buffer          Memory holding the iterator until it's released. Must be non-NULL.
+ *
+ * @return
+ *          Iterator used to enumerate all the entries found,
+ *          or NULL if no entry satisfying criteria was found.
+ */
+nvs_iterator_t nvs_entry_find_in_place(const char *part_name, const char *namespace_name, nvs_type_t type, nvs_iterator_buffer_t *buffer);
+
+/**
+ * @brief       Create an iterator like nvs_entry_find, which only lists the entries whose keys start with key_prefix
+ *
+ * The entries are filtered while the flash is read, no other entries are returned to the caller.
+ *
+ * @param[in]   part_name       Partition name
+ *
+ * @param[in]   namespace_name  Set this value if looking for entries with
+ *                              a specific namespace. Pass NULL otherwise.
+ *
+ * @param[in]   type            One of nvs_type_t values.
+ *
+ * @param[in]   key_prefix      Beginning of the keys of the entries. Pass NULL or "" to list all the keys.
+ *
+ * @return
+ *          Iterator used to enumerate all the entries found,
+ *          or NULL if no entry satisfying criteria was found.
+ *          Iterator obtained through this function has to be released
+ *          using nvs_release_iterator when not used any more.
+ */
+nvs_iterator_t nvs_entry_find_prefix(const char *part_name, const char *namespace_name, nvs_type_t type, const char *key_prefix);
+
 /**
  * @brief       Returns next item matching the iterator criteria, NULL if no such item exists.
  *
@@ -529,9 +925,29 @@ nvs_iterator_t nvs_entry_find(const char *part_name, const char *namespace_name,
  *
  * @return
  *          NULL if no entry was found, valid nvs_iterator_t otherwise.
+ *          Use nvs_entry_advance to find out whether all the entries have been listed.
  */
 nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator);
 
+/**
+ * @brief       Move the iterator to the next item matching its criteria
+ *
+ * Like nvs_entry_next, but reports why no other item is returned. Once this function fails,
+ * the iterator has been released and *iterator is set to NULL.
+ *
+ * @param[inout] iterator    Pointer to an iterator obtained from nvs_entry_find or a similar function.
+ *
+ * @return
+ *             - ESP_OK if *iterator points to the next entry
+ *             - ESP_ERR_NVS_NOT_FOUND if all the entries have been listed
+ *             - ESP_ERR_NVS_INVALID_STATE if a page holding entries which weren't listed yet
+ *               had to be erased, or if the partition has been initialized again, since the
+ *               iterator was created
+ *             - ESP_ERR_INVALID_ARG if iterator or *iterator is NULL
+ *             - Other error codes from the underlying storage driver.
+ */
+esp_err_t nvs_entry_advance(nvs_iterator_t *iterator);
+
 /**
  * @brief       Fills nvs_entry_info_t structure with information about entry pointed to by the iterator.
  *
@@ -541,6 +957,48 @@ nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator);
  */
 void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t *out_info);
 
+/**
+ * @brief       Get the value of the entry pointed to by the iterator
+ *
+ * The value is read from where the iterator has found the entry, without looking up its key again, so
+ * reading all the values of a namespace costs a single pass over the flash. Like the entry itself, the
+ * value is the one which was stored when the iterator was created. Blobs, whose chunks are looked up
+ * by key, and counters, which are incremented in place, may have changed since.
+ *
+ * Lengths work like for nvs_get_str and nvs_get_blob: if out_value is NULL, only the required length
+ * is stored in length. For strings, it includes the zero terminator. For integers and counters,
+ * it is the size of the type.
+ *
+ * @param[in]     iterator   Iterator obtained from nvs_entry_find or nvs_entry_next function. Must be non-NULL.
+ * @param         out_value  Pointer to the output value. May be NULL to query the length.
+ * @param[inout]  length     Points to the length available in out_value, set to the length of the value.
+ *
+ * @return
+ *             - ESP_OK if the value was retrieved successfully
+ *             - ESP_ERR_NVS_INVALID_LENGTH if length is not sufficient to store the value
+ *             - ESP_ERR_NVS_TYPE_MISMATCH if the entry is a log, whose records are read with nvs_read_log
+ *             - ESP_ERR_NVS_INVALID_STATE if the page of the entry had to be erased since the iterator was created
+ *             - ESP_ERR_NVS_NOT_FOUND if the blob has been erased since
+ *             - ESP_ERR_INVALID_ARG if iterator or length is NULL
+ */
+esp_err_t nvs_entry_get_value(nvs_iterator_t iterator, void *out_value, size_t *length);
+
+/**
+ * @brief       Get a part of the blob pointed to by the iterator, like nvs_get_blob_range
+ *
+ * @param[in]     iterator   Iterator obtained from nvs_entry_find or nvs_entry_next function. Must be non-NULL.
+ * @param[in]     offset     Offset of the first byte to read.
+ * @param         out_value  Pointer to the output buffer of at least length bytes.
+ * @param[in]     length     Number of bytes to read.
+ *
+ * @return
+ *             - ESP_OK if the range was retrieved successfully
+ *             - ESP_ERR_NVS_TYPE_MISMATCH if the entry isn't a blob
+ *             - ESP_ERR_NVS_NOT_FOUND if the blob has been erased since the iterator was created
+ *             - ESP_ERR_NVS_INVALID_LENGTH if the range exceeds the value
+ */
+esp_err_t nvs_entry_get_blob_range(nvs_iterator_t iterator, size_t offset, void *out_value, size_t length);
+
 /**
  * @brief       Release iterator
  *
@@ -4,6 +4,7 @@
 #include <string>
 #include <memory>
 #include <type_traits>
+#include <vector>
 
 #include "nvs.h"
 
@@ -25,6 +26,10 @@ enum class ItemType : uint8_t {
     BLOB = 0x41,
     BLOB_DATA = NVS_TYPE_BLOB,
     BLOB_IDX  = 0x48,
+    BLOB_REF  = 0x49,
+    COUNTER   = NVS_TYPE_COUNTER,
+    LOG       = NVS_TYPE_LOG,
+    NS_TOMBSTONE = 0x60,
     ANY  = NVS_TYPE_ANY
 };
 
@@ -119,6 +124,26 @@ public:
      */
     virtual esp_err_t set_blob(const char *key, const void* blob, size_t len) = 0;
 
+    /**
+     * @brief      Set several values at once
+     *
+     * The values which differ from the stored ones are written to flash together. The result of each value is
+     * stored in its err field.
+     *
+     * @note compare to \ref nvs_set_items in nvs.h
+     *
+     * @param[inout]  items      Array of count values to write.
+     * @param[in]     count      Number of values.
+     *
+     * @return
+     *             - ESP_OK if all values were set successfully
+     *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+     *             - ESP_ERR_INVALID_ARG if items is nullptr and count is not 0
+     *             - ESP_ERR_NO_MEM if memory for the write buffer could not be allocated
+     *             - otherwise the error of the first value which couldn't be set
+     */
+    virtual esp_err_t set_items(nvs_set_item_t* items, size_t count) = 0;
+
     /**
      * @brief      get value for given key
      *
@@ -150,6 +175,292 @@ public:
     virtual esp_err_t get_string(const char *key, char* out_str, size_t len) = 0;
     virtual esp_err_t get_blob(const char *key, void* out_blob, size_t len) = 0;
 
+    /**
+     * @brief      get a string or blob value whose length isn't known in advance
+     *
+     * The entry is looked up only once, and value is resized to the length of the data before it is read.
+     * For strings, the zero terminator isn't part of value.
+     *
+     * In case of any error, value is not modified.
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[out]    value      The value.
+     *
+     * @return
+     *             - ESP_OK if the value was retrieved successfully
+     *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+     */
+    esp_err_t get_string(const char *key, std::string &value);
+    esp_err_t get_blob(const char *key, std::vector<uint8_t> &value);
+
+    /**
+     * @brief      Read a part of a blob value
+     *
+     * Reads len bytes, starting at byte offset of the value, into out_blob. Only the flash entries which hold
+     * this range are read, so the value doesn't have to fit into RAM. If the range doesn't cover the whole value,
+     * the checksum of the data can't be verified.
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[in]     offset     Offset of the first byte to read.
+     * @param         out_blob   Pointer to the output buffer of at least len bytes.
+     * @param[in]     len        Number of bytes to read.
+     *
+     * @return
+     *             - ESP_OK if the range was retrieved successfully
+     *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+     *             - ESP_ERR_NVS_KEY_TOO_LONG if key name is too long
+     *             - ESP_ERR_NVS_INVALID_LENGTH if the range exceeds the value
+     */
+    virtual esp_err_t get_blob_range(const char *key, size_t offset, void* out_blob, size_t len) = 0;
+
+    /**
+     * @brief      Read several values at once
+     *
+     * All pages are visited once for the whole array instead of once for each key. The result of each value
+     * is stored in its err field.
+     *
+     * @note compare to \ref nvs_get_items in nvs.h
+     *
+     * @param[inout]  items      Array of count values to read.
+     * @param[in]     count      Number of values.
+     *
+     * @return
+     *             - ESP_OK if all values were retrieved successfully
+     *             - ESP_ERR_INVALID_ARG if items is nullptr and count is not 0
+     *             - otherwise the error of the first value which couldn't be retrieved
+     */
+    virtual esp_err_t get_items(nvs_get_item_t* items, size_t count) = 0;
+
+    /**
+     * @brief      Add to an integer value
+     *
+     * Adds delta to the value of key, which is created with value 0 if it doesn't exist. The value is looked up
+     * once and updated under the same lock.
+     *
+     * @note compare to \ref nvs_inc_i8 in nvs.h
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[in]     delta      Value to add. Its type selects the type of the value, as for \ref set_item.
+     * @param[out]    value      The new value.
+     *
+     * @return
+     *             - ESP_OK if the value was updated successfully
+     *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+     *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+     *               underlying storage to save the value
+     *             - ESP_ERR_NVS_REMOVE_FAILED if the old value couldn't be erased, see \ref set_item
+     */
+    template<typename T>
+    esp_err_t increment_item(const char *key, T delta, T &value);
+
+    /**
+     * @brief      Replace an integer value if it has the expected value
+     *
+     * Sets the value of key to desired if it equals expected. Otherwise expected is set to the stored value.
+     *
+     * @note compare to \ref nvs_cas_i8 in nvs.h
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[inout]  expected   The value the stored value is compared with.
+     * @param[in]     desired    The value to set.
+     *
+     * @return
+     *             - ESP_OK if the value equalled expected and has been replaced
+     *             - ESP_ERR_NVS_VALUE_CHANGED if the value didn't equal expected
+     *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+     *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+     *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+     *               underlying storage to save the value
+     *             - ESP_ERR_NVS_REMOVE_FAILED if the old value couldn't be erased, see \ref set_item
+     */
+    template<typename T>
+    esp_err_t compare_and_swap_item(const char *key, T &expected, T desired);
+
+    /**
+     * @brief      Add to a counter, which is incremented by clearing bits in place
+     *
+     * @note compare to \ref nvs_inc_counter in nvs.h
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[in]     delta      Value to add.
+     * @param[out]    value      The new value.
+     *
+     * @return
+     *             - ESP_OK if the counter was updated successfully
+     *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+     *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+     *               underlying storage to save the value
+     */
+    esp_err_t increment_counter(const char *key, uint32_t delta, uint32_t &value);
+
+    /**
+     * @brief      Get the value of a counter
+     *
+     * @note compare to \ref nvs_get_counter in nvs.h
+     *
+     * @return
+     *             - ESP_OK if the value was retrieved successfully
+     *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+     */
+    esp_err_t get_counter(const char *key, uint32_t &value);
+
+    /**
+     * @brief      Start reading a blob value piece by piece
+     *
+     * Subsequent calls to \ref read_blob return the value in order. Only one blob can be read at a time through
+     * a handle; opening another one replaces the current reader. The blob must not be modified while it is
+     * being read.
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[out]    size       Size of the complete value.
+     *
+     * @return
+     *             - ESP_OK if the reader was opened successfully
+     *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+     *             - ESP_ERR_NVS_KEY_TOO_LONG if key name is too long
+     */
+    virtual esp_err_t open_blob_reader(const char *key, size_t &size) = 0;
+
+    /**
+     * @brief      Read the next part of the blob opened with \ref open_blob_reader
+     *
+     * @param         out_blob   Pointer to the output buffer of at least len bytes.
+     * @param[in]     len        Maximal number of bytes to read.
+     * @param[out]    read_len   Number of bytes actually read. Smaller than len only at the end of the value.
+     *
+     * @return
+     *             - ESP_OK if the data was retrieved successfully
+     *             - ESP_ERR_NVS_INVALID_STATE if no blob is being read through this handle
+     *             - ESP_ERR_NVS_NOT_FOUND if a part of the value has vanished
+     */
+    virtual esp_err_t read_blob(void* out_blob, size_t len, size_t &read_len) = 0;
+
+    /**
+     * @brief      Start writing a blob value piece by piece
+     *
+     * Instead of passing the whole value to \ref set_blob, it can be passed in pieces to \ref append_blob.
+     * The data is collected in a buffer of buffer_size bytes which is written to flash as a blob data chunk
+     * whenever it is full, so the complete value never has to be held in RAM. The previous value of the key
+     * is replaced only when \ref finalize_blob succeeds. If writing is aborted or power is lost before that,
+     * the previous value stays intact.
+     *
+     * Only one blob can be written at a time through a handle. The key is reserved while its blob is being
+     * written: other writes and erases of the key, and erasing its namespace, fail with
+     * ESP_ERR_NVS_INVALID_STATE until the blob is finalized or aborted.
+     *
+     * @param[in]  key          Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[in]  buffer_size  Size of the buffer which is allocated until the blob is finalized or aborted.
+     *                          A blob consists of at most 127 chunks and each chunk holds at most one buffer of
+     *                          data, so larger buffers allow for larger blobs. Values above 4000 are
+     *                          reduced to 4000.
+     *
+     * @return
+     *             - ESP_OK if the writer was opened successfully
+     *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+     *             - ESP_ERR_NVS_INVALID_STATE if another blob is already being written through this handle,
+     *               or if the key is being written by another writer
+     *             - ESP_ERR_NVS_KEY_TOO_LONG if key name is too long
+     *             - ESP_ERR_INVALID_ARG if buffer_size is 0
+     *             - ESP_ERR_NO_MEM if the buffer could not be allocated
+     */
+    virtual esp_err_t open_blob_writer(const char *key, size_t buffer_size) = 0;
+
+    /**
+     * @brief      Append data to the blob opened with \ref open_blob_writer
+     *
+     * In case of any error, the written data is discarded as with \ref abort_blob.
+     *
+     * @return
+     *             - ESP_OK if the data was appended successfully
+     *             - ESP_ERR_NVS_INVALID_STATE if no blob is being written through this handle
+     *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+     *               underlying storage to save the value
+     *             - ESP_ERR_NVS_VALUE_TOO_LONG if the value needs more than 127 chunks
+     */
+    virtual esp_err_t append_blob(const void* data, size_t len) = 0;
+
+    /**
+     * @brief      Write out the remaining data of the blob opened with \ref open_blob_writer and make it the
+     *             new value of its key
+     *
+     * @return
+     *             - ESP_OK if value was set successfully
+     *             - ESP_ERR_NVS_INVALID_STATE if no blob is being written through this handle
+     *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+     *               underlying storage to save the value
+     *             - ESP_ERR_NVS_REMOVE_FAILED if the old value wasn't removed because flash
+     *               write operation has failed. The value was written however, and
+     *               update will be finished after re-initialization of nvs, provided that
+     *               flash operation doesn't fail again.
+     */
+    virtual esp_err_t finalize_blob() = 0;
+
+    /**
+     * @brief      Discard the blob opened with \ref open_blob_writer, keeping the previous value of its key
+     *
+     * Does nothing if no blob is being written through this handle.
+     */
+    virtual esp_err_t abort_blob() = 0;
+
+    /**
+     * @brief      Append a record to a log
+     *
+     * @note compare to \ref nvs_append_log in nvs.h
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[in]     record     Pointer to the record.
+     * @param[in]     size       Size of the record, at most NVS_LOG_RECORD_MAX_SIZE bytes.
+     * @param[out]    seq        Sequence number of the record.
+     *
+     * @return
+     *             - ESP_OK if the record was appended successfully
+     *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+     *             - ESP_ERR_NVS_VALUE_TOO_LONG if the record is too long
+     *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+     *               underlying storage to save the record
+     */
+    virtual esp_err_t append_log(const char *key, const void* record, size_t size, uint32_t &seq) = 0;
+
+    /**
+     * @brief      Read the first record of a log with sequence number seq or higher
+     *
+     * @note compare to \ref nvs_read_log in nvs.h
+     *
+     * @param[in]     key        Key name. Maximal length is (NVS_KEY_NAME_MAX_SIZE-1) characters. Shouldn't be empty.
+     * @param[inout]  seq        Lowest sequence number to read, set to the sequence number of the record.
+     * @param         record     Pointer to the output buffer, may be nullptr to only look the record up.
+     * @param[inout]  size       Size of the buffer, set to the size of the record.
+     *
+     * @return
+     *             - ESP_OK if a record was read successfully
+     *             - ESP_ERR_NVS_NOT_FOUND if the log has no such record
+     *             - ESP_ERR_NVS_INVALID_LENGTH if size is not sufficient to store the record
+     */
+    virtual esp_err_t read_log(const char *key, uint32_t &seq, void* record, size_t &size) = 0;
+
+    /**
+     * @brief      List the keys of the namespace in key order, optionally limited to a range
+     *
+     * Keys are compared like strcmp does. The keys of a namespace are added to an ordered index the first time
+     * they are listed, and the index is kept up to date as entries are written and erased, so later calls don't
+     * read the flash. The index holds CONFIG_NVS_ORDERED_INDEX_KEYS keys of all namespaces at most. Namespaces
+     * which don't fit are listed by reading the item headers of all pages, using no more memory than entries.
+     *
+     * To list a range in batches, call the function again with the key of the last entry as from. That entry is
+     * listed first again.
+     *
+     * @param[in]     from       First key of the range, nullptr to start with the first key of the namespace.
+     * @param[in]     to         Key after the range, which isn't listed itself. nullptr to end with the last key.
+     * @param[out]    entries    Array of count entries, filled with the key and type of each key listed.
+     * @param[inout]  count      Number of entries, set to the number of keys listed.
+     *
+     * @return
+     *             - ESP_OK if the keys were listed successfully, count is smaller than before if no other keys
+     *               are in the range
+     *             - ESP_ERR_INVALID_ARG if entries is nullptr and count isn't 0
+     */
+    virtual esp_err_t list_keys(const char *from, const char *to, nvs_entry_info_t *entries, size_t &count) = 0;
+
     /**
      * @brief Looks up the size of an entry's data.
      *
@@ -157,6 +468,16 @@ public:
      */
     virtual esp_err_t get_item_size(ItemType datatype, const char *key, size_t &size) = 0;
 
+    /**
+     * @brief Reads a string or blob entry of unknown size.
+     *
+     * The entry is looked up once, then alloc is called with the size of its data for the buffer it is read into.
+     * For strings, this size includes the zero terminator.
+     *
+     * @note compare to \ref nvs_get_str_alloc and \ref nvs_get_blob_alloc in nvs.h
+     */
+    virtual esp_err_t get_item_alloc(ItemType datatype, const char *key, nvs_alloc_cb_t alloc, void *arg, size_t &size) = 0;
+
     /**
      * @brief Erases an entry.
      */
@@ -195,6 +516,13 @@ protected:
     virtual esp_err_t set_typed_item(ItemType datatype, const char *key, const void* data, size_t dataSize) = 0;
 
     virtual esp_err_t get_typed_item(ItemType datatype, const char *key, void* data, size_t dataSize) = 0;
+
+    /**
+     * Integer values are passed in the low bytes of the uint64_t arguments, see Storage::incrementItem.
+     */
+    virtual esp_err_t increment_typed_item(ItemType datatype, const char *key, uint64_t delta, uint64_t &value) = 0;
+
+    virtual esp_err_t compare_and_swap_typed_item(ItemType datatype, const char *key, uint64_t &expected, uint64_t desired) = 0;
 };
 
 /**
@@ -230,6 +558,131 @@ std::unique_ptr<NVSHandle> open_nvs_handle(const char *ns_name,
         nvs_open_mode_t open_mode,
         esp_err_t *err = nullptr);
 
+/**
+ * @brief The entry an iteration of \ref Entries is on, valid until the iteration moves on.
+ */
+class Entry
+{
+public:
+    explicit Entry(nvs_iterator_t it) : mIt(it) { }
+
+    nvs_entry_info_t info() const
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(mIt, &info);
+        return info;
+    }
+
+    /**
+     * @brief Reads the value of the entry, see \ref nvs_entry_get_value.
+     */
+    esp_err_t get_value(void *out_value, size_t &length) const
+    {
+        return nvs_entry_get_value(mIt, out_value, &length);
+    }
+
+    /**
+     * @brief Reads a part of the blob of the entry, see \ref nvs_entry_get_blob_range.
+     */
+    esp_err_t get_blob_range(size_t offset, void *out_value, size_t length) const
+    {
+        return nvs_entry_get_blob_range(mIt, offset, out_value, length);
+    }
+
+private:
+    nvs_iterator_t mIt;
+};
+
+/**
+ * @brief The entries of a partition, for iterating them with a range-based for loop.
+ *
+ * The iterator is held in the object itself, see \ref nvs_entry_find_in_place, so iterating doesn't allocate
+ * memory for it and it's released when the object goes out of scope, also when the loop is left early:
+ *
+ *     for (nvs::Entry entry : nvs::Entries("nvs", "namespace")) {
+ *         nvs_entry_info_t info = entry.info();
+ *         ...
+ *     }
+ *
+ * The entries can only be iterated once. If the loop ends because a page of the partition had to be erased
+ * before it was reached, error() tells so.
+ */
+class Entries
+{
+public:
+    class Iterator
+    {
+    public:
+        Iterator(nvs_iterator_t *it, esp_err_t *err) : mIt(it), mErr(err) { }
+
+        Entry operator*() const
+        {
+            return Entry(*mIt);
+        }
+
+        Iterator& operator++()
+        {
+            esp_err_t err = nvs_entry_advance(mIt);
+            if (err != ESP_ERR_NVS_NOT_FOUND) {
+                *mErr = err;
+            }
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) const
+        {
+            return atEnd() != other.atEnd();
+        }
+
+    private:
+        bool atEnd() const
+        {
+            return mIt == nullptr || *mIt == nullptr;
+        }
+
+        nvs_iterator_t *mIt;
+        esp_err_t *mErr;
+    };
+
+    /**
+     * @brief Finds the entries like \ref nvs_entry_find. There are none if the partition can't be iterated.
+     */
+    explicit Entries(const char *part_name, const char *namespace_name = nullptr, nvs_type_t type = NVS_TYPE_ANY)
+        : mIt(nvs_entry_find_in_place(part_name, namespace_name, type, &mBuffer)) { }
+
+    Entries(const Entries&) = delete;
+
+    Entries& operator=(const Entries&) = delete;
+
+    ~Entries()
+    {
+        nvs_release_iterator(mIt);
+    }
+
+    Iterator begin()
+    {
+        return Iterator(&mIt, &mErr);
+    }
+
+    Iterator end()
+    {
+        return Iterator(nullptr, nullptr);
+    }
+
+    /**
+     * @brief Why the iteration ended, see \ref nvs_entry_advance. ESP_OK if all the entries have been listed.
+     */
+    esp_err_t error() const
+    {
+        return mErr;
+    }
+
+private:
+    nvs_iterator_buffer_t mBuffer;
+    nvs_iterator_t mIt;
+    esp_err_t mErr = ESP_OK;
+};
+
 // Helper functions for template usage
 /**
  * Help to translate all integral types into ItemType.
@@ -266,6 +719,68 @@ esp_err_t NVSHandle::get_item(const char *key, T &value) {
     return get_typed_item(itemTypeOf(value), key, &value, sizeof(value));
 }
 
+template<typename T>
+esp_err_t NVSHandle::increment_item(const char *key, T delta, T &value) {
+    uint64_t result;
+    esp_err_t err = increment_typed_item(itemTypeOf(delta), key, static_cast<uint64_t>(delta), result);
+    if (err == ESP_OK) {
+        value = static_cast<T>(result);
+    }
+    return err;
+}
+
+template<typename T>
+esp_err_t NVSHandle::compare_and_swap_item(const char *key, T &expected, T desired) {
+    uint64_t current = static_cast<uint64_t>(expected);
+    esp_err_t err = compare_and_swap_typed_item(itemTypeOf(desired), key, current, static_cast<uint64_t>(desired));
+    if (err == ESP_ERR_NVS_VALUE_CHANGED) {
+        expected = static_cast<T>(current);
+    }
+    return err;
+}
+
+inline esp_err_t NVSHandle::increment_counter(const char *key, uint32_t delta, uint32_t &value) {
+    uint64_t result;
+    esp_err_t err = increment_typed_item(ItemType::COUNTER, key, delta, result);
+    if (err == ESP_OK) {
+        value = static_cast<uint32_t>(result);
+    }
+    return err;
+}
+
+inline esp_err_t NVSHandle::get_counter(const char *key, uint32_t &value) {
+    return get_typed_item(ItemType::COUNTER, key, &value, sizeof(value));
+}
+
+inline esp_err_t NVSHandle::get_string(const char *key, std::string &value) {
+    std::string str;
+    size_t size;
+    esp_err_t err = get_item_alloc(ItemType::SZ, key, [](void *arg, size_t length) -> void* {
+        std::string *str = static_cast<std::string*>(arg);
+        str->resize(length);
+        return &(*str)[0];
+    }, &str, size);
+    if (err == ESP_OK) {
+        str.pop_back();
+        value.swap(str);
+    }
+    return err;
+}
+
+inline esp_err_t NVSHandle::get_blob(const char *key, std::vector<uint8_t> &value) {
+    std::vector<uint8_t> blob;
+    size_t size;
+    esp_err_t err = get_item_alloc(ItemType::BLOB, key, [](void *arg, size_t length) -> void* {
+        std::vector<uint8_t> *blob = static_cast<std::vector<uint8_t>*>(arg);
+        blob->resize(length);
+        return blob->data();
+    }, &blob, size);
+    if (err == ESP_OK) {
+        value.swap(blob);
+    }
+    return err;
+}
+
 } // nvs
 
 #endif // NVS_HANDLE_HPP_
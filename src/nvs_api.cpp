@@ -55,9 +55,7 @@ uint32_t NVSHandleEntry::s_nvs_next_handle;
 
 extern "C" void nvs_dump(const char *partName);
 
-#ifdef ESP_PLATFORM
-SemaphoreHandle_t nvs::Lock::mSemaphore = nullptr;
-#endif
+nvs::RWLock nvs::Lock::mRegistry;
 
 using namespace std;
 using namespace nvs;
@@ -264,26 +262,28 @@ extern "C" void nvs_close(nvs_handle_t handle)
 
 extern "C" esp_err_t nvs_erase_key(nvs_handle_t c_handle, const char* key)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s %s\r\n", __func__, key);
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    Lock lock(handle->getLock());
 
     return handle->erase_item(key);
 }
 
 extern "C" esp_err_t nvs_erase_all(nvs_handle_t c_handle)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s\r\n", __func__);
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    Lock lock(handle->getLock());
 
     return handle->erase_all();
 }
@@ -291,13 +291,14 @@ extern "C" esp_err_t nvs_erase_all(nvs_handle_t c_handle)
 template<typename T>
 static esp_err_t nvs_set(nvs_handle_t c_handle, const char* key, T value)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s %s %d %d", __func__, key, sizeof(T), (uint32_t) value);
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    Lock lock(handle->getLock());
 
     return handle->set_item(key, value);
 }
@@ -344,51 +345,68 @@ extern "C" esp_err_t nvs_set_u64 (nvs_handle_t handle, const char* key, uint64_t
 
 extern "C" esp_err_t nvs_commit(nvs_handle_t c_handle)
 {
-    Lock lock;
-    // no-op for now, to be used when intermediate cache is added
+    SharedLock registryLock;
+    // values are written immediately, only partitions which buffer writes have anything to do
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    Lock lock(handle->getLock());
     return handle->commit();
 }
 
 extern "C" esp_err_t nvs_set_str(nvs_handle_t c_handle, const char* key, const char* value)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s %s %s", __func__, key, value);
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    Lock lock(handle->getLock());
     return handle->set_string(key, value);
 }
 
 extern "C" esp_err_t nvs_set_blob(nvs_handle_t c_handle, const char* key, const void* value, size_t length)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s %s %d", __func__, key, length);
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    Lock lock(handle->getLock());
     return handle->set_blob(key, value, length);
 }
 
+extern "C" esp_err_t nvs_set_items(nvs_handle_t c_handle, nvs_set_item_t* items, size_t count)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %d", __func__, count);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    Lock lock(handle->getLock());
+    return handle->set_items(items, count);
+}
+
 
 template<typename T>
 static esp_err_t nvs_get(nvs_handle_t c_handle, const char* key, T* out_value)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s %s %d", __func__, key, sizeof(T));
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    SharedLock lock(handle->getLock());
     return handle->get_item(key, *out_value);
 }
 
@@ -432,34 +450,74 @@ extern "C" esp_err_t nvs_get_u64 (nvs_handle_t c_handle, const char* key, uint64
     return nvs_get(c_handle, key, out_value);
 }
 
+/* The buffer passed to nvs_get_str or nvs_get_blob, used as long as the value fits into it */
+struct CallerBuffer {
+    void* data;
+    size_t length;
+    bool tooSmall;
+};
+
+static void* use_caller_buffer(void* arg, size_t length)
+{
+    CallerBuffer* buffer = static_cast<CallerBuffer*>(arg);
+    buffer->tooSmall = length > buffer->length;
+    return buffer->tooSmall ? nullptr : buffer->data;
+}
+
 static esp_err_t nvs_get_str_or_blob(nvs_handle_t c_handle, nvs::ItemType type, const char* key, void* out_value, size_t* length)
 {
-    Lock lock;
+    SharedLock registryLock;
     ESP_LOGD(TAG, "%s %s", __func__, key);
     NVSHandleSimple *handle;
     auto err = nvs_find_ns_handle(c_handle, &handle);
     if (err != ESP_OK) {
         return err;
     }
+    SharedLock lock(handle->getLock());
 
     size_t dataSize;
-    err = handle->get_item_size(type, key, dataSize);
-    if (err != ESP_OK) {
-        return err;
-    }
-
-    if (length == nullptr) {
-        return ESP_ERR_NVS_INVALID_LENGTH;
-    } else if (out_value == nullptr) {
+    if (length == nullptr || out_value == nullptr) {
+        err = handle->get_item_size(type, key, dataSize);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (length == nullptr) {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
         *length = dataSize;
         return ESP_OK;
-    } else if (*length < dataSize) {
+    }
+
+    /* The value is found once, and read if it fits */
+    CallerBuffer buffer = {out_value, *length, false};
+    err = handle->get_item_alloc(type, key, use_caller_buffer, &buffer, dataSize);
+    if (buffer.tooSmall) {
         *length = dataSize;
         return ESP_ERR_NVS_INVALID_LENGTH;
     }
+    if (err == ESP_OK) {
+        *length = dataSize;
+    }
+    return err;
+}
 
-    *length = dataSize;
-    return handle->get_typed_item(type, key, out_value, dataSize);
+static esp_err_t nvs_get_str_or_blob_alloc(nvs_handle_t c_handle, nvs::ItemType type, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t* length)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s", __func__, key);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    SharedLock lock(handle->getLock());
+
+    size_t dataSize;
+    err = handle->get_item_alloc(type, key, alloc, arg, dataSize);
+    if (err == ESP_OK && length != nullptr) {
+        *length = dataSize;
+    }
+    return err;
 }
 
 extern "C" esp_err_t nvs_get_str(nvs_handle_t c_handle, const char* key, char* out_value, size_t* length)
@@ -472,9 +530,226 @@ extern "C" esp_err_t nvs_get_blob(nvs_handle_t c_handle, const char* key, void*
     return nvs_get_str_or_blob(c_handle, nvs::ItemType::BLOB, key, out_value, length);
 }
 
+extern "C" esp_err_t nvs_get_str_alloc(nvs_handle_t c_handle, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t* length)
+{
+    return nvs_get_str_or_blob_alloc(c_handle, nvs::ItemType::SZ, key, alloc, arg, length);
+}
+
+extern "C" esp_err_t nvs_get_blob_alloc(nvs_handle_t c_handle, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t* length)
+{
+    return nvs_get_str_or_blob_alloc(c_handle, nvs::ItemType::BLOB, key, alloc, arg, length);
+}
+
+extern "C" esp_err_t nvs_get_blob_range(nvs_handle_t c_handle, const char* key, size_t offset, void* out_value, size_t length)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s %d %d", __func__, key, offset, length);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    SharedLock lock(handle->getLock());
+    return handle->get_blob_range(key, offset, out_value, length);
+}
+
+extern "C" esp_err_t nvs_get_items(nvs_handle_t c_handle, nvs_get_item_t* items, size_t count)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %d", __func__, count);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    SharedLock lock(handle->getLock());
+    return handle->get_items(items, count);
+}
+
+template<typename T>
+static esp_err_t nvs_inc(nvs_handle_t c_handle, const char* key, T delta, T* out_value)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s %d", __func__, key, sizeof(T));
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    Lock lock(handle->getLock());
+    T value;
+    err = handle->increment_item(key, delta, value);
+    if (err == ESP_OK && out_value != nullptr) {
+        *out_value = value;
+    }
+    return err;
+}
+
+extern "C" esp_err_t nvs_inc_i8  (nvs_handle_t c_handle, const char* key, int8_t delta, int8_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_u8  (nvs_handle_t c_handle, const char* key, uint8_t delta, uint8_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_i16 (nvs_handle_t c_handle, const char* key, int16_t delta, int16_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_u16 (nvs_handle_t c_handle, const char* key, uint16_t delta, uint16_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_i32 (nvs_handle_t c_handle, const char* key, int32_t delta, int32_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_u32 (nvs_handle_t c_handle, const char* key, uint32_t delta, uint32_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_i64 (nvs_handle_t c_handle, const char* key, int64_t delta, int64_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+extern "C" esp_err_t nvs_inc_u64 (nvs_handle_t c_handle, const char* key, uint64_t delta, uint64_t* out_value)
+{
+    return nvs_inc(c_handle, key, delta, out_value);
+}
+
+template<typename T>
+static esp_err_t nvs_cas(nvs_handle_t c_handle, const char* key, T* expected, T desired)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s %d", __func__, key, sizeof(T));
+    if (expected == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    Lock lock(handle->getLock());
+    return handle->compare_and_swap_item(key, *expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_i8  (nvs_handle_t c_handle, const char* key, int8_t* expected, int8_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_u8  (nvs_handle_t c_handle, const char* key, uint8_t* expected, uint8_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_i16 (nvs_handle_t c_handle, const char* key, int16_t* expected, int16_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_u16 (nvs_handle_t c_handle, const char* key, uint16_t* expected, uint16_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_i32 (nvs_handle_t c_handle, const char* key, int32_t* expected, int32_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_u32 (nvs_handle_t c_handle, const char* key, uint32_t* expected, uint32_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_i64 (nvs_handle_t c_handle, const char* key, int64_t* expected, int64_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_cas_u64 (nvs_handle_t c_handle, const char* key, uint64_t* expected, uint64_t desired)
+{
+    return nvs_cas(c_handle, key, expected, desired);
+}
+
+extern "C" esp_err_t nvs_inc_counter(nvs_handle_t c_handle, const char* key, uint32_t delta, uint32_t* out_value)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s %d", __func__, key, delta);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    Lock lock(handle->getLock());
+    uint32_t value;
+    err = handle->increment_counter(key, delta, value);
+    if (err == ESP_OK && out_value != nullptr) {
+        *out_value = value;
+    }
+    return err;
+}
+
+extern "C" esp_err_t nvs_get_counter(nvs_handle_t c_handle, const char* key, uint32_t* out_value)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s", __func__, key);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    SharedLock lock(handle->getLock());
+    return handle->get_counter(key, *out_value);
+}
+
+extern "C" esp_err_t nvs_append_log(nvs_handle_t c_handle, const char* key, const void* record, size_t size, uint32_t* out_seq)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s %d", __func__, key, size);
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    Lock lock(handle->getLock());
+    uint32_t seq;
+    err = handle->append_log(key, record, size, seq);
+    if (err == ESP_OK && out_seq != nullptr) {
+        *out_seq = seq;
+    }
+    return err;
+}
+
+extern "C" esp_err_t nvs_read_log(nvs_handle_t c_handle, const char* key, uint32_t* seq, void* out_record, size_t* size)
+{
+    SharedLock registryLock;
+    ESP_LOGD(TAG, "%s %s", __func__, key);
+    if (seq == nullptr || size == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    NVSHandleSimple *handle;
+    auto err = nvs_find_ns_handle(c_handle, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    SharedLock lock(handle->getLock());
+    return handle->read_log(key, *seq, out_record, *size);
+}
+
 extern "C" esp_err_t nvs_get_stats(const char* part_name, nvs_stats_t* nvs_stats)
 {
-    Lock lock;
+    SharedLock registryLock;
     nvs::Storage* pStorage;
 
     if (nvs_stats == nullptr) {
@@ -489,6 +764,7 @@ extern "C" esp_err_t nvs_get_stats(const char* part_name, nvs_stats_t* nvs_stats
     if (pStorage == nullptr) {
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
+    SharedLock lock(pStorage->getLock());
 
     if(!pStorage->isValid()){
         return ESP_ERR_NVS_INVALID_STATE;
@@ -499,7 +775,7 @@ extern "C" esp_err_t nvs_get_stats(const char* part_name, nvs_stats_t* nvs_stats
 
 extern "C" esp_err_t nvs_get_used_entry_count(nvs_handle_t c_handle, size_t* used_entries)
 {
-    Lock lock;
+    SharedLock registryLock;
     if(used_entries == nullptr){
         return ESP_ERR_INVALID_ARG;
     }
@@ -510,6 +786,7 @@ extern "C" esp_err_t nvs_get_used_entry_count(nvs_handle_t c_handle, size_t* use
     if (err != ESP_OK) {
         return err;
     }
+    SharedLock lock(handle->getLock());
 
     size_t used_entry_count;
     err = handle->get_used_entry_count(used_entry_count);
@@ -638,11 +915,20 @@ extern "C" esp_err_t nvs_flash_read_security_cfg(const esp_partition_t* partitio
 
 #endif
 
-static nvs_iterator_t create_iterator(nvs::Storage *storage, nvs_type_t type)
+static_assert(sizeof(nvs_opaque_iterator_t) <= sizeof(nvs_iterator_buffer_t), "nvs_iterator_buffer_t is too small");
+static_assert(alignof(nvs_opaque_iterator_t) <= alignof(nvs_iterator_buffer_t), "nvs_iterator_buffer_t is misaligned");
+
+static nvs_iterator_t create_iterator(nvs::Storage *storage, nvs_type_t type, nvs_iterator_buffer_t *buffer)
 {
-    nvs_iterator_t it = (nvs_iterator_t)calloc(1, sizeof(nvs_opaque_iterator_t));
-    if (it == nullptr) {
-        return nullptr;
+    nvs_iterator_t it;
+    if (buffer != nullptr) {
+        it = new (buffer) nvs_opaque_iterator_t();
+        it->inPlace = true;
+    } else {
+        it = (nvs_iterator_t)calloc(1, sizeof(nvs_opaque_iterator_t));
+        if (it == nullptr) {
+            return nullptr;
+        }
     }
 
     it->storage = storage;
@@ -651,41 +937,81 @@ static nvs_iterator_t create_iterator(nvs::Storage *storage, nvs_type_t type)
     return it;
 }
 
-extern "C" nvs_iterator_t nvs_entry_find(const char *part_name, const char *namespace_name, nvs_type_t type)
+static void destroy_iterator(nvs_iterator_t it)
 {
-    Lock lock;
+    it->storage->releaseEntryIterator(it);
+    if (!it->inPlace) {
+        free(it);
+    }
+}
+
+static nvs_iterator_t find_entry(const char *part_name, const char *namespace_name, nvs_type_t type, const char *key_prefix,
+        nvs_iterator_buffer_t *buffer)
+{
+    SharedLock registryLock;
     nvs::Storage *pStorage;
 
     pStorage = lookup_storage_from_name(part_name);
     if (pStorage == nullptr) {
         return nullptr;
     }
+    SharedLock lock(pStorage->getLock());
 
-    nvs_iterator_t it = create_iterator(pStorage, type);
+    nvs_iterator_t it = create_iterator(pStorage, type, buffer);
     if (it == nullptr) {
         return nullptr;
     }
 
-    bool entryFound = pStorage->findEntry(it, namespace_name);
+    bool entryFound = pStorage->findEntry(it, namespace_name, key_prefix);
     if (!entryFound) {
-        free(it);
+        destroy_iterator(it);
         return nullptr;
     }
 
     return it;
 }
 
-extern "C" nvs_iterator_t nvs_entry_next(nvs_iterator_t it)
+extern "C" nvs_iterator_t nvs_entry_find(const char *part_name, const char *namespace_name, nvs_type_t type)
 {
-    Lock lock;
-    assert(it);
+    return find_entry(part_name, namespace_name, type, nullptr, nullptr);
+}
 
-    bool entryFound = it->storage->nextEntry(it);
-    if (!entryFound) {
-        free(it);
+extern "C" nvs_iterator_t nvs_entry_find_prefix(const char *part_name, const char *namespace_name, nvs_type_t type, const char *key_prefix)
+{
+    return find_entry(part_name, namespace_name, type, key_prefix, nullptr);
+}
+
+extern "C" nvs_iterator_t nvs_entry_find_in_place(const char *part_name, const char *namespace_name, nvs_type_t type, nvs_iterator_buffer_t *buffer)
+{
+    if (buffer == nullptr) {
         return nullptr;
     }
+    return find_entry(part_name, namespace_name, type, nullptr, buffer);
+}
 
+extern "C" esp_err_t nvs_entry_advance(nvs_iterator_t *iterator)
+{
+    if (iterator == nullptr || *iterator == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    nvs_iterator_t it = *iterator;
+    esp_err_t err;
+    {
+        SharedLock registryLock;
+        SharedLock lock(it->storage->getLock());
+        err = it->storage->nextEntry(it);
+        if (err != ESP_OK) {
+            destroy_iterator(it);
+            *iterator = nullptr;
+        }
+    }
+    return err;
+}
+
+extern "C" nvs_iterator_t nvs_entry_next(nvs_iterator_t it)
+{
+    assert(it);
+    nvs_entry_advance(&it);
     return it;
 }
 
@@ -694,7 +1020,31 @@ extern "C" void nvs_entry_info(nvs_iterator_t it, nvs_entry_info_t *out_info)
     *out_info = it->entry_info;
 }
 
+extern "C" esp_err_t nvs_entry_get_value(nvs_iterator_t it, void *out_value, size_t *length)
+{
+    if (it == nullptr || length == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    SharedLock registryLock;
+    SharedLock lock(it->storage->getLock());
+    return it->storage->readEntryValue(it, out_value, *length);
+}
+
+extern "C" esp_err_t nvs_entry_get_blob_range(nvs_iterator_t it, size_t offset, void *out_value, size_t length)
+{
+    if (it == nullptr || (out_value == nullptr && length != 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    SharedLock registryLock;
+    SharedLock lock(it->storage->getLock());
+    return it->storage->readEntryBlobRange(it, offset, out_value, length);
+}
+
 extern "C" void nvs_release_iterator(nvs_iterator_t it)
 {
-    free(it);
+    if (it == nullptr) {
+        return;
+    }
+    SharedLock registryLock;
+    destroy_iterator(it);
 }
@@ -0,0 +1,192 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "nvs_compress.hpp"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace nvs
+{
+
+/* Parameters of the LZ4 block format. The last match has to start at least MF_LIMIT bytes
+ * before the end of the input and the last LAST_LITERALS bytes are always literals. */
+static const size_t MIN_MATCH = 4;
+static const size_t MF_LIMIT = 12;
+static const size_t LAST_LITERALS = 5;
+static const size_t MAX_OFFSET = 65535;
+
+/* The match finder remembers the last position of each hashed 4-byte sequence.
+ * The table is allocated on the heap since NVS may be called from tasks with small stacks. */
+static const size_t HASH_BITS = 10;
+static const uint16_t NO_POSITION = 0xffff;
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline size_t hash32(uint32_t val)
+{
+    return (val * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Writes the extension bytes of a length whose 4-bit field in the token is saturated */
+static bool writeLength(size_t len, uint8_t* dst, size_t& op, size_t dstCapacity)
+{
+    for (len -= 15; ; len -= 255) {
+        if (op == dstCapacity) {
+            return false;
+        }
+        if (len < 255) {
+            dst[op++] = static_cast<uint8_t>(len);
+            return true;
+        }
+        dst[op++] = 255;
+    }
+}
+
+static bool writeSequence(const uint8_t* literals, size_t litLen, size_t offset, size_t matchLen,
+        uint8_t* dst, size_t& op, size_t dstCapacity)
+{
+    if (op == dstCapacity) {
+        return false;
+    }
+    size_t token = op++;
+    dst[token] = static_cast<uint8_t>(((litLen < 15) ? litLen : 15) << 4);
+    if (litLen >= 15 && !writeLength(litLen, dst, op, dstCapacity)) {
+        return false;
+    }
+    if (litLen > dstCapacity - op) {
+        return false;
+    }
+    memcpy(dst + op, literals, litLen);
+    op += litLen;
+
+    if (matchLen == 0) {
+        return true;
+    }
+    if (dstCapacity - op < 2) {
+        return false;
+    }
+    dst[op++] = static_cast<uint8_t>(offset);
+    dst[op++] = static_cast<uint8_t>(offset >> 8);
+    matchLen -= MIN_MATCH;
+    dst[token] |= (matchLen < 15) ? matchLen : 15;
+    return matchLen < 15 || writeLength(matchLen, dst, op, dstCapacity);
+}
+
+size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity)
+{
+    if (srcSize > UINT16_MAX) {
+        return 0;
+    }
+
+    uint16_t* table = new (std::nothrow) uint16_t[1 << HASH_BITS];
+    if (!table) {
+        return 0;
+    }
+    std::fill_n(table, 1 << HASH_BITS, NO_POSITION);
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+    bool fits = true;
+    while (fits && srcSize >= MF_LIMIT && ip + MF_LIMIT <= srcSize) {
+        uint32_t seq = read32(src + ip);
+        size_t h = hash32(seq);
+        size_t ref = table[h];
+        table[h] = static_cast<uint16_t>(ip);
+        if (ref == NO_POSITION || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
+
+        size_t matchLen = MIN_MATCH;
+        while (ip + matchLen < srcSize - LAST_LITERALS && src[ref + matchLen] == src[ip + matchLen]) {
+            ++matchLen;
+        }
+        fits = writeSequence(src + anchor, ip - anchor, ip - ref, matchLen, dst, op, dstCapacity);
+        ip += matchLen;
+        anchor = ip;
+    }
+    delete[] table;
+
+    if (!fits || !writeSequence(src + anchor, srcSize - anchor, 0, 0, dst, op, dstCapacity)) {
+        return 0;
+    }
+    return op;
+}
+
+/* Reads the extension bytes of a length whose 4-bit field in the token is saturated */
+static bool readLength(const uint8_t* src, size_t srcSize, size_t& ip, size_t& len)
+{
+    uint8_t b;
+    do {
+        if (ip == srcSize) {
+            return false;
+        }
+        b = src[ip++];
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool decompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < srcSize) {
+        uint8_t token = src[ip++];
+
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !readLength(src, srcSize, ip, litLen)) {
+            return false;
+        }
+        if (litLen > srcSize - ip || litLen > dstSize - op) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == srcSize) {
+            break;
+        }
+
+        if (srcSize - ip < 2) {
+            return false;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return false;
+        }
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !readLength(src, srcSize, ip, matchLen)) {
+            return false;
+        }
+        matchLen += MIN_MATCH;
+        if (matchLen > dstSize - op) {
+            return false;
+        }
+        /* Matches may overlap the output they are copied to */
+        for (size_t i = 0; i < matchLen; ++i, ++op) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == dstSize;
+}
+
+} // namespace nvs
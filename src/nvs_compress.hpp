@@ -0,0 +1,41 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef nvs_compress_hpp
+#define nvs_compress_hpp
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nvs
+{
+
+/**
+ * Compresses srcSize bytes from src into dst, using the LZ4 block format.
+ * Inputs are limited to 64 kB, which is more than any item can hold.
+ *
+ * @return size of the compressed data, or 0 if it doesn't fit into dstCapacity bytes
+ *         or the scratch memory could not be allocated
+ */
+size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity);
+
+/**
+ * Decompresses LZ4 block data from src into dst.
+ *
+ * @return false if the data is malformed or doesn't decompress to exactly dstSize bytes
+ */
+bool decompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize);
+
+} // namespace nvs
+
+#endif /* nvs_compress_hpp */
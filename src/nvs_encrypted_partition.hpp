@@ -33,6 +33,11 @@ public:
 
     esp_err_t write(size_t dst_offset, const void* src, size_t size) override;
 
+    bool is_encrypted() override
+    {
+        return true;
+    }
+
 protected:
     mbedtls_aes_xts_context mEctxt;
     mbedtls_aes_xts_context mDctxt;
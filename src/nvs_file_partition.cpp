@@ -0,0 +1,263 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "esp_spi_flash.h"
+#include "nvs_file_partition.hpp"
+
+namespace nvs {
+
+FilePartition::FilePartition(const char *partition_name)
+    : mFd(-1), mSize(0), mDirectIO(false), mSyncInterval(0), mUnsynced(0)
+{
+    strncpy(mPartitionName, partition_name, sizeof(mPartitionName) - 1);
+    mPartitionName[sizeof(mPartitionName) - 1] = 0;
+}
+
+FilePartition::~FilePartition()
+{
+    if (mFd >= 0) {
+        if (mUnsynced != 0) {
+            fsync(mFd);
+        }
+        close(mFd);
+    }
+}
+
+esp_err_t FilePartition::init(const char *path, uint32_t size, bool direct_io, uint32_t sync_interval)
+{
+    if (mFd >= 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size == 0 || size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    int flags = O_RDWR | O_CREAT;
+    if (direct_io) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        return ESP_ERR_NOT_SUPPORTED;
+#endif
+    }
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        return (direct_io && errno == EINVAL) ? ESP_ERR_NOT_SUPPORTED : ESP_FAIL;
+    }
+
+    struct stat st;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (fstat(fd, &st) != 0 || end < 0) {
+        close(fd);
+        return ESP_FAIL;
+    }
+    if (end < static_cast<off_t>(size) && (!S_ISREG(st.st_mode) || end % SPI_FLASH_SEC_SIZE != 0)) {
+        close(fd);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mFd = fd;
+    mSize = size;
+    mDirectIO = direct_io;
+    mSyncInterval = sync_interval;
+    mUnsynced = 0;
+
+    alignas(BLOCK_SIZE) uint8_t erased[SPI_FLASH_SEC_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+    for (size_t offset = end; offset < size; offset += SPI_FLASH_SEC_SIZE) {
+        if (transfer(true, offset, erased, sizeof(erased)) != ESP_OK) {
+            close(mFd);
+            mFd = -1;
+            return ESP_FAIL;
+        }
+    }
+    if (end < static_cast<off_t>(size) && sync() != ESP_OK) {
+        close(mFd);
+        mFd = -1;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t FilePartition::sync()
+{
+    if (mFd < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (fsync(mFd) != 0) {
+        return ESP_ERR_FLASH_OP_FAIL;
+    }
+    mUnsynced = 0;
+    return ESP_OK;
+}
+
+esp_err_t FilePartition::flush()
+{
+    return (mUnsynced != 0) ? sync() : ESP_OK;
+}
+
+const char *FilePartition::get_partition_name()
+{
+    return mPartitionName;
+}
+
+esp_err_t FilePartition::transfer(bool write, size_t offset, void* data, size_t size)
+{
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t done = write ? pwrite(mFd, p, size, offset) : pread(mFd, p, size, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return ESP_ERR_FLASH_OP_FAIL;
+        }
+        p += done;
+        offset += done;
+        size -= done;
+    }
+    return ESP_OK;
+}
+
+esp_err_t FilePartition::read_raw(size_t src_offset, void* dst, size_t size)
+{
+    if (mFd < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (src_offset > mSize || size > mSize - src_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!mDirectIO) {
+        return transfer(false, src_offset, dst, size);
+    }
+
+    // O_DIRECT only transfers whole blocks from and to aligned memory
+    alignas(BLOCK_SIZE) uint8_t block[BLOCK_SIZE];
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    while (size > 0) {
+        size_t skip = src_offset % BLOCK_SIZE;
+        size_t n = std::min(BLOCK_SIZE - skip, size);
+        esp_err_t err = transfer(false, src_offset - skip, block, BLOCK_SIZE);
+        if (err != ESP_OK) {
+            return err;
+        }
+        memcpy(out, block + skip, n);
+        out += n;
+        src_offset += n;
+        size -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t FilePartition::read(size_t src_offset, void* dst, size_t size)
+{
+    return read_raw(src_offset, dst, size);
+}
+
+esp_err_t FilePartition::program(size_t dst_offset, const uint8_t* src, size_t size)
+{
+    alignas(BLOCK_SIZE) uint8_t block[BLOCK_SIZE];
+    while (size > 0) {
+        size_t skip = dst_offset % BLOCK_SIZE;
+        size_t n = std::min(BLOCK_SIZE - skip, size);
+        size_t ioOffset = mDirectIO ? dst_offset - skip : dst_offset;
+        size_t ioSize = mDirectIO ? BLOCK_SIZE : n;
+        uint8_t* data = mDirectIO ? block + skip : block;
+
+        esp_err_t err = transfer(false, ioOffset, block, ioSize);
+        if (err != ESP_OK) {
+            return err;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if ((~data[i] & src[i]) != 0) {   // are we trying to set some 0 bits to 1?
+                return ESP_ERR_FLASH_OP_FAIL;
+            }
+        }
+        memcpy(data, src, n);
+        err = transfer(true, ioOffset, block, ioSize);
+        if (err != ESP_OK) {
+            return err;
+        }
+        src += n;
+        dst_offset += n;
+        size -= n;
+    }
+    return modified();
+}
+
+esp_err_t FilePartition::write_raw(size_t dst_offset, const void* src, size_t size)
+{
+    if (mFd < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (dst_offset > mSize || size > mSize - dst_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return program(dst_offset, static_cast<const uint8_t*>(src), size);
+}
+
+esp_err_t FilePartition::write(size_t dst_offset, const void* src, size_t size)
+{
+    return write_raw(dst_offset, src, size);
+}
+
+esp_err_t FilePartition::erase_range(size_t dst_offset, size_t size)
+{
+    if (mFd < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size % SPI_FLASH_SEC_SIZE != 0 || dst_offset > mSize || size > mSize - dst_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (dst_offset % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    alignas(BLOCK_SIZE) uint8_t erased[SPI_FLASH_SEC_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+    for (size_t offset = dst_offset; offset < dst_offset + size; offset += SPI_FLASH_SEC_SIZE) {
+        esp_err_t err = transfer(true, offset, erased, sizeof(erased));
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return modified();
+}
+
+esp_err_t FilePartition::modified()
+{
+    ++mUnsynced;
+    if (mSyncInterval != 0 && mUnsynced >= mSyncInterval) {
+        return sync();
+    }
+    return ESP_OK;
+}
+
+uint32_t FilePartition::get_address()
+{
+    return 0;
+}
+
+uint32_t FilePartition::get_size()
+{
+    return mSize;
+}
+
+} // nvs
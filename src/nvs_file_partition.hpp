@@ -0,0 +1,132 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NVS_FILE_PARTITION_HPP_
+#define NVS_FILE_PARTITION_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include "partition.hpp"
+
+namespace nvs {
+
+/**
+ * Partition stored in a file or block device, for running NVS on POSIX hosts.
+ *
+ * The file behaves like NOR flash: writes may only clear bits, and erase_range sets whole sectors to 0xff.
+ * Offsets are relative to the beginning of the file, so the partition is initialized with
+ * NVSPartitionManager::init_custom(&partition, 0, size / SPI_FLASH_SEC_SIZE).
+ */
+class FilePartition : public Partition {
+public:
+    /**
+     * @param partition_name the name under which the partition is registered, at most 16 characters
+     */
+    FilePartition(const char *partition_name);
+
+    /**
+     * Synchronizes the pending modifications and closes the file.
+     */
+    virtual ~FilePartition();
+
+    /**
+     * Opens the file, creating it if it doesn't exist. A regular file shorter than size is extended
+     * with erased sectors.
+     *
+     * @param path          file or block device holding the partition
+     * @param size          partition size in bytes, a multiple of SPI_FLASH_SEC_SIZE
+     * @param direct_io     bypass the page cache of the host (O_DIRECT). Each access then reads and writes
+     *                      whole aligned blocks, and the file system has to support it.
+     * @param sync_interval number of writes and erases after which the file is synchronized to the storage
+     *                      device, 0 to synchronize only in sync(), nvs_commit and when the partition is
+     *                      destroyed.
+     *                      NVS relies on its writes reaching the flash in order; if the host loses power,
+     *                      only sync_interval 1 guarantees that, larger intervals trade it for throughput.
+     *
+     * @return
+     *      - ESP_OK on success
+     *      - ESP_ERR_INVALID_SIZE if size isn't a multiple of SPI_FLASH_SEC_SIZE or the device is too small
+     *      - ESP_ERR_NOT_SUPPORTED if direct_io is requested but not supported by the host
+     *      - ESP_ERR_INVALID_STATE if the partition is already initialized
+     *      - ESP_FAIL if the file can't be opened or extended
+     */
+    esp_err_t init(const char *path, uint32_t size, bool direct_io = false, uint32_t sync_interval = 1);
+
+    /**
+     * Writes the pending modifications to the storage device (fsync).
+     */
+    esp_err_t sync();
+
+    /**
+     * Synchronizes the pending modifications, so that nvs_commit makes them durable whatever the sync_interval.
+     */
+    esp_err_t flush() override;
+
+    const char *get_partition_name() override;
+
+    esp_err_t read_raw(size_t src_offset, void* dst, size_t size) override;
+
+    esp_err_t read(size_t src_offset, void* dst, size_t size) override;
+
+    /**
+     * @return
+     *      - ESP_OK on success
+     *      - ESP_ERR_INVALID_SIZE if the range isn't within the partition
+     *      - ESP_ERR_FLASH_OP_FAIL if some bit would change from 0 to 1, in which case the write stops
+     *        before that byte, or if the file can't be accessed
+     */
+    esp_err_t write_raw(size_t dst_offset, const void* src, size_t size) override;
+
+    esp_err_t write(size_t dst_offset, const void* src, size_t size) override;
+
+    /**
+     * @return
+     *      - ESP_OK on success
+     *      - ESP_ERR_INVALID_SIZE if size isn't a multiple of SPI_FLASH_SEC_SIZE or the range isn't within
+     *        the partition
+     *      - ESP_ERR_INVALID_ARG if dst_offset isn't aligned to SPI_FLASH_SEC_SIZE
+     *      - ESP_ERR_FLASH_OP_FAIL if the file can't be written
+     */
+    esp_err_t erase_range(size_t dst_offset, size_t size) override;
+
+    /**
+     * @return 0, offsets are relative to the beginning of the file.
+     */
+    uint32_t get_address() override;
+
+    uint32_t get_size() override;
+
+protected:
+    /**
+     * Unit of I/O with direct_io, large enough for the logical block size of common devices.
+     */
+    static const size_t BLOCK_SIZE = 4096;
+
+    esp_err_t transfer(bool write, size_t offset, void* data, size_t size);
+
+    esp_err_t program(size_t dst_offset, const uint8_t* src, size_t size);
+
+    esp_err_t modified();
+
+    char mPartitionName[17]; // at most 16 characters as in the partition table
+    int mFd;
+    uint32_t mSize;
+    bool mDirectIO;
+    uint32_t mSyncInterval;
+    uint32_t mUnsynced;
+};
+
+} // nvs
+
+#endif // NVS_FILE_PARTITION_HPP_
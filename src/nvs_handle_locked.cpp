@@ -25,58 +25,160 @@ NVSHandleLocked::~NVSHandleLocked() {
 }
 
 esp_err_t NVSHandleLocked::set_string(const char *key, const char* str) {
-    Lock lock;
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
     return handle->set_string(key, str);
 }
 
 esp_err_t NVSHandleLocked::set_blob(const char *key, const void* blob, size_t len) {
-    Lock lock;
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
     return handle->set_blob(key, blob, len);
 }
 
+esp_err_t NVSHandleLocked::set_items(nvs_set_item_t* items, size_t count) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->set_items(items, count);
+}
+
 esp_err_t NVSHandleLocked::get_string(const char *key, char* out_str, size_t len) {
-    Lock lock;
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
     return handle->get_string(key, out_str, len);
 }
 
 esp_err_t NVSHandleLocked::get_blob(const char *key, void* out_blob, size_t len) {
-    Lock lock;
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
     return handle->get_blob(key, out_blob, len);
 }
 
+esp_err_t NVSHandleLocked::get_blob_range(const char *key, size_t offset, void* out_blob, size_t len) {
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
+    return handle->get_blob_range(key, offset, out_blob, len);
+}
+
+esp_err_t NVSHandleLocked::get_items(nvs_get_item_t* items, size_t count) {
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
+    return handle->get_items(items, count);
+}
+
+esp_err_t NVSHandleLocked::open_blob_reader(const char *key, size_t &size) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->open_blob_reader(key, size);
+}
+
+esp_err_t NVSHandleLocked::read_blob(void* out_blob, size_t len, size_t &read_len) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->read_blob(out_blob, len, read_len);
+}
+
+esp_err_t NVSHandleLocked::open_blob_writer(const char *key, size_t buffer_size) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->open_blob_writer(key, buffer_size);
+}
+
+esp_err_t NVSHandleLocked::append_blob(const void* data, size_t len) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->append_blob(data, len);
+}
+
+esp_err_t NVSHandleLocked::finalize_blob() {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->finalize_blob();
+}
+
+esp_err_t NVSHandleLocked::abort_blob() {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->abort_blob();
+}
+
+esp_err_t NVSHandleLocked::append_log(const char *key, const void* record, size_t size, uint32_t &seq) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->append_log(key, record, size, seq);
+}
+
+esp_err_t NVSHandleLocked::read_log(const char *key, uint32_t &seq, void* record, size_t &size) {
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
+    return handle->read_log(key, seq, record, size);
+}
+
+esp_err_t NVSHandleLocked::list_keys(const char *from, const char *to, nvs_entry_info_t *entries, size_t &count) {
+    SharedLock registryLock;
+    // not shared, the first listing of a namespace adds it to the ordered index
+    Lock lock(handle->getLock());
+    return handle->list_keys(from, to, entries, count);
+}
+
 esp_err_t NVSHandleLocked::get_item_size(ItemType datatype, const char *key, size_t &size) {
-    Lock lock;
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
     return handle->get_item_size(datatype, key, size);
 }
 
+esp_err_t NVSHandleLocked::get_item_alloc(ItemType datatype, const char *key, nvs_alloc_cb_t alloc, void *arg, size_t &size) {
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
+    return handle->get_item_alloc(datatype, key, alloc, arg, size);
+}
+
 esp_err_t NVSHandleLocked::erase_item(const char* key) {
-    Lock lock;
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
     return handle->erase_item(key);
 }
 
 esp_err_t NVSHandleLocked::erase_all() {
-    Lock lock;
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
     return handle->erase_all();
 }
 
 esp_err_t NVSHandleLocked::commit() {
-    Lock lock;
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
     return handle->commit();
 }
 
 esp_err_t NVSHandleLocked::get_used_entry_count(size_t& usedEntries) {
-    Lock lock;
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
     return handle->get_used_entry_count(usedEntries);
 }
 
 esp_err_t NVSHandleLocked::set_typed_item(ItemType datatype, const char *key, const void* data, size_t dataSize) {
-    Lock lock;
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
     return handle->set_typed_item(datatype, key, data, dataSize);
 }
 
 esp_err_t NVSHandleLocked::get_typed_item(ItemType datatype, const char *key, void* data, size_t dataSize) {
-    Lock lock;
+    SharedLock registryLock;
+    SharedLock lock(handle->getLock());
     return handle->get_typed_item(datatype, key, data, dataSize);
 }
 
+esp_err_t NVSHandleLocked::increment_typed_item(ItemType datatype, const char *key, uint64_t delta, uint64_t &value) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->increment_typed_item(datatype, key, delta, value);
+}
+
+esp_err_t NVSHandleLocked::compare_and_swap_typed_item(ItemType datatype, const char *key, uint64_t &expected, uint64_t desired) {
+    SharedLock registryLock;
+    Lock lock(handle->getLock());
+    return handle->compare_and_swap_typed_item(datatype, key, expected, desired);
+}
+
 } // namespace nvs
@@ -38,12 +38,42 @@ public:
 
     esp_err_t set_blob(const char *key, const void* blob, size_t len) override;
 
+    esp_err_t set_items(nvs_set_item_t* items, size_t count) override;
+
     esp_err_t get_string(const char *key, char* out_str, size_t len) override;
 
     esp_err_t get_blob(const char *key, void* out_blob, size_t len) override;
 
+    using NVSHandle::get_string;
+
+    using NVSHandle::get_blob;
+
+    esp_err_t get_blob_range(const char *key, size_t offset, void* out_blob, size_t len) override;
+
+    esp_err_t get_items(nvs_get_item_t* items, size_t count) override;
+
+    esp_err_t open_blob_reader(const char *key, size_t &size) override;
+
+    esp_err_t read_blob(void* out_blob, size_t len, size_t &read_len) override;
+
+    esp_err_t open_blob_writer(const char *key, size_t buffer_size) override;
+
+    esp_err_t append_blob(const void* data, size_t len) override;
+
+    esp_err_t finalize_blob() override;
+
+    esp_err_t abort_blob() override;
+
+    esp_err_t append_log(const char *key, const void*record, size_t size, uint32_t &seq) override;
+
+    esp_err_t read_log(const char *key, uint32_t &seq, void*record, size_t &size) override;
+
+    esp_err_t list_keys(const char *from, const char *to, nvs_entry_info_t *entries, size_t &count) override;
+
     esp_err_t get_item_size(ItemType datatype, const char *key, size_t &size) override;
 
+    esp_err_t get_item_alloc(ItemType datatype, const char *key, nvs_alloc_cb_t alloc, void *arg, size_t &size) override;
+
     esp_err_t erase_item(const char* key) override;
 
     esp_err_t erase_all() override;
@@ -57,6 +87,10 @@ protected:
 
     esp_err_t get_typed_item(ItemType datatype, const char *key, void* data, size_t dataSize) override;
 
+    esp_err_t increment_typed_item(ItemType datatype, const char *key, uint64_t delta, uint64_t &value) override;
+
+    esp_err_t compare_and_swap_typed_item(ItemType datatype, const char *key, uint64_t &expected, uint64_t desired) override;
+
 private:
     NVSHandleSimple *handle;
 };
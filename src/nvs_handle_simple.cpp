@@ -18,6 +18,11 @@
 namespace nvs {
 
 NVSHandleSimple::~NVSHandleSimple() {
+    if (valid) {
+        mStoragePtr->abortBlobWriter(mBlobWriter);
+    } else {
+        delete[] mBlobWriter.buffer;
+    }
     NVSPartitionManager::get_instance()->close_handle(this);
 }
 
@@ -33,7 +38,46 @@ esp_err_t NVSHandleSimple::get_typed_item(ItemType datatype, const char *key, vo
 {
     if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
 
-    return mStoragePtr->readItem(mNsIndex, datatype, key, data, dataSize);
+    if (datatype == ItemType::BLOB || key == nullptr || strlen(key) > Item::MAX_KEY_LENGTH
+            || mHintsBusy.exchange(true, std::memory_order_acquire)) {
+        return mStoragePtr->readItem(mNsIndex, datatype, key, data, dataSize);
+    }
+    LocationHint* hint = getLocationHint(datatype, key);
+    esp_err_t err = mStoragePtr->readItem(mNsIndex, datatype, key, data, dataSize, hint->location);
+    mHintsBusy.store(false, std::memory_order_release);
+    return err;
+}
+
+esp_err_t NVSHandleSimple::increment_typed_item(ItemType datatype, const char *key, uint64_t delta, uint64_t &value)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (mReadOnly) return ESP_ERR_NVS_READ_ONLY;
+
+    return mStoragePtr->incrementItem(mNsIndex, datatype, key, delta, value);
+}
+
+esp_err_t NVSHandleSimple::compare_and_swap_typed_item(ItemType datatype, const char *key, uint64_t &expected, uint64_t desired)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (mReadOnly) return ESP_ERR_NVS_READ_ONLY;
+
+    return mStoragePtr->compareAndSwapItem(mNsIndex, datatype, key, expected, desired);
+}
+
+NVSHandleSimple::LocationHint* NVSHandleSimple::getLocationHint(ItemType datatype, const char *key)
+{
+    for (auto& hint : mHints) {
+        if (hint.location.page != nullptr && hint.datatype == datatype && strncmp(hint.key, key, sizeof(hint.key)) == 0) {
+            return &hint;
+        }
+    }
+    LocationHint* hint = &mHints[mNextHint];
+    mNextHint = (mNextHint + 1) % NVS_HANDLE_LOCATION_HINTS;
+    strncpy(hint->key, key, sizeof(hint->key) - 1);
+    hint->key[sizeof(hint->key) - 1] = 0;
+    hint->datatype = datatype;
+    hint->location.page = nullptr;
+    return hint;
 }
 
 esp_err_t NVSHandleSimple::set_string(const char *key, const char* str)
@@ -52,6 +96,15 @@ esp_err_t NVSHandleSimple::set_blob(const char *key, const void* blob, size_t le
     return mStoragePtr->writeItem(mNsIndex, nvs::ItemType::BLOB, key, blob, len);
 }
 
+esp_err_t NVSHandleSimple::set_items(nvs_set_item_t* items, size_t count)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (mReadOnly) return ESP_ERR_NVS_READ_ONLY;
+    if (items == nullptr && count != 0) return ESP_ERR_INVALID_ARG;
+
+    return mStoragePtr->writeItems(mNsIndex, items, count);
+}
+
 esp_err_t NVSHandleSimple::get_string(const char *key, char* out_str, size_t len)
 {
     if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
@@ -66,6 +119,93 @@ esp_err_t NVSHandleSimple::get_blob(const char *key, void* out_blob, size_t len)
     return mStoragePtr->readItem(mNsIndex, nvs::ItemType::BLOB, key, out_blob, len);
 }
 
+esp_err_t NVSHandleSimple::get_blob_range(const char *key, size_t offset, void* out_blob, size_t len)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    return mStoragePtr->readBlobRange(mNsIndex, key, offset, out_blob, len);
+}
+
+esp_err_t NVSHandleSimple::get_items(nvs_get_item_t* items, size_t count)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (items == nullptr && count != 0) return ESP_ERR_INVALID_ARG;
+
+    return mStoragePtr->readItems(mNsIndex, items, count);
+}
+
+esp_err_t NVSHandleSimple::open_blob_reader(const char *key, size_t &size)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    esp_err_t err = mStoragePtr->openBlobReader(mNsIndex, key, mBlobReader);
+    if (err == ESP_OK) {
+        size = mBlobReader.dataSize;
+    }
+    return err;
+}
+
+esp_err_t NVSHandleSimple::read_blob(void* out_blob, size_t len, size_t &read_len)
+{
+    read_len = 0;
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    return mStoragePtr->readBlobReader(mBlobReader, out_blob, len, read_len);
+}
+
+esp_err_t NVSHandleSimple::open_blob_writer(const char *key, size_t buffer_size)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (mReadOnly) return ESP_ERR_NVS_READ_ONLY;
+
+    return mStoragePtr->openBlobWriter(mNsIndex, key, buffer_size, mBlobWriter);
+}
+
+esp_err_t NVSHandleSimple::append_blob(const void* data, size_t len)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    return mStoragePtr->appendBlobWriter(mBlobWriter, data, len);
+}
+
+esp_err_t NVSHandleSimple::finalize_blob()
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    return mStoragePtr->finalizeBlobWriter(mBlobWriter);
+}
+
+esp_err_t NVSHandleSimple::abort_blob()
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    mStoragePtr->abortBlobWriter(mBlobWriter);
+    return ESP_OK;
+}
+
+esp_err_t NVSHandleSimple::append_log(const char *key, const void *record, size_t size, uint32_t &seq)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (mReadOnly) return ESP_ERR_NVS_READ_ONLY;
+
+    return mStoragePtr->appendLogRecord(mNsIndex, key, record, size, seq);
+}
+
+esp_err_t NVSHandleSimple::read_log(const char *key, uint32_t &seq, void *record, size_t &size)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+
+    return mStoragePtr->readLogRecord(mNsIndex, key, seq, record, size);
+}
+
+esp_err_t NVSHandleSimple::list_keys(const char *from, const char *to, nvs_entry_info_t *entries, size_t &count)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (entries == nullptr && count != 0) return ESP_ERR_INVALID_ARG;
+
+    return mStoragePtr->listKeys(mNsIndex, from, to, entries, count);
+}
+
 esp_err_t NVSHandleSimple::get_item_size(ItemType datatype, const char *key, size_t &size)
 {
     if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
@@ -73,6 +213,14 @@ esp_err_t NVSHandleSimple::get_item_size(ItemType datatype, const char *key, siz
     return mStoragePtr->getItemDataSize(mNsIndex, datatype, key, size);
 }
 
+esp_err_t NVSHandleSimple::get_item_alloc(ItemType datatype, const char *key, nvs_alloc_cb_t alloc, void *arg, size_t &size)
+{
+    if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (alloc == nullptr || (datatype != ItemType::SZ && datatype != ItemType::BLOB)) return ESP_ERR_INVALID_ARG;
+
+    return mStoragePtr->readItem(mNsIndex, datatype, key, alloc, arg, size);
+}
+
 esp_err_t NVSHandleSimple::erase_item(const char* key)
 {
     if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
@@ -86,14 +234,20 @@ esp_err_t NVSHandleSimple::erase_all()
     if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
     if (mReadOnly) return ESP_ERR_NVS_READ_ONLY;
 
-    return mStoragePtr->eraseNamespace(mNsIndex);
+    uint8_t nsIndex;
+    esp_err_t err = mStoragePtr->eraseNamespace(mNsIndex, nsIndex);
+    if (err == ESP_OK && nsIndex != mNsIndex) {
+        NVSPartitionManager::get_instance()->move_handles(mStoragePtr, mNsIndex, nsIndex);
+        mNsIndex = nsIndex;
+    }
+    return err;
 }
 
 esp_err_t NVSHandleSimple::commit()
 {
     if (!valid) return ESP_ERR_NVS_INVALID_HANDLE;
 
-    return ESP_OK;
+    return mStoragePtr->flush();
 }
 
 esp_err_t NVSHandleSimple::get_used_entry_count(size_t& used_entries)
@@ -127,7 +281,7 @@ bool NVSHandleSimple::findEntry(nvs_opaque_iterator_t* it, const char* name) {
 }
 
 bool NVSHandleSimple::nextEntry(nvs_opaque_iterator_t* it) {
-    return mStoragePtr->nextEntry(it);
+    return mStoragePtr->nextEntry(it) == ESP_OK;
 }
 
 }
@@ -20,6 +20,12 @@
 
 #include "nvs_handle.hpp"
 
+#ifdef CONFIG_NVS_HANDLE_LOCATION_HINTS
+#define NVS_HANDLE_LOCATION_HINTS CONFIG_NVS_HANDLE_LOCATION_HINTS
+#else
+#define NVS_HANDLE_LOCATION_HINTS 4
+#endif
+
 namespace nvs {
 
 /**
@@ -37,7 +43,9 @@ public:
         mStoragePtr(StoragePtr),
         mNsIndex(nsIndex),
         mReadOnly(readOnly),
-        valid(1)
+        valid(1),
+        mNextHint(0),
+        mHintsBusy(false)
     { }
 
     ~NVSHandleSimple();
@@ -46,16 +54,50 @@ public:
 
     esp_err_t get_typed_item(ItemType datatype, const char *key, void *data, size_t dataSize) override;
 
+    esp_err_t increment_typed_item(ItemType datatype, const char *key, uint64_t delta, uint64_t &value) override;
+
+    esp_err_t compare_and_swap_typed_item(ItemType datatype, const char *key, uint64_t &expected, uint64_t desired) override;
+
     esp_err_t set_string(const char *key, const char *str) override;
 
     esp_err_t set_blob(const char *key, const void *blob, size_t len) override;
 
+    esp_err_t set_items(nvs_set_item_t *items, size_t count) override;
+
     esp_err_t get_string(const char *key, char *out_str, size_t len) override;
 
     esp_err_t get_blob(const char *key, void *out_blob, size_t len) override;
 
+    using NVSHandle::get_string;
+
+    using NVSHandle::get_blob;
+
+    esp_err_t get_blob_range(const char *key, size_t offset, void *out_blob, size_t len) override;
+
+    esp_err_t get_items(nvs_get_item_t *items, size_t count) override;
+
+    esp_err_t open_blob_reader(const char *key, size_t &size) override;
+
+    esp_err_t read_blob(void *out_blob, size_t len, size_t &read_len) override;
+
+    esp_err_t open_blob_writer(const char *key, size_t buffer_size) override;
+
+    esp_err_t append_blob(const void *data, size_t len) override;
+
+    esp_err_t finalize_blob() override;
+
+    esp_err_t abort_blob() override;
+
+    esp_err_t append_log(const char *key, const void *record, size_t size, uint32_t &seq) override;
+
+    esp_err_t read_log(const char *key, uint32_t &seq, void *record, size_t &size) override;
+
+    esp_err_t list_keys(const char *from, const char *to, nvs_entry_info_t *entries, size_t &count) override;
+
     esp_err_t get_item_size(ItemType datatype, const char *key, size_t &size) override;
 
+    esp_err_t get_item_alloc(ItemType datatype, const char *key, nvs_alloc_cb_t alloc, void *arg, size_t &size) override;
+
     esp_err_t erase_item(const char *key) override;
 
     esp_err_t erase_all() override;
@@ -76,6 +118,11 @@ public:
 
     bool nextEntry(nvs_opaque_iterator_t *it);
 
+    RWLock& getLock()
+    {
+        return mStoragePtr->getLock();
+    }
+
 private:
     /**
      * The underlying storage's object.
@@ -98,6 +145,39 @@ private:
      * Upon opening, a handle is valid. It becomes invalid if the underlying storage is de-initialized.
      */
     uint8_t valid;
+
+    /**
+     * State of the blob which is being written through open_blob_writer/append_blob/finalize_blob, if any.
+     */
+    BlobWriter mBlobWriter;
+
+    /**
+     * Position within the blob which is being read through open_blob_reader/read_blob, if any.
+     */
+    BlobReader mBlobReader;
+
+    /**
+     * Location of a value read through get_typed_item, which lets reading it again skip the search of the pages.
+     */
+    struct LocationHint {
+        char key[Item::MAX_KEY_LENGTH + 1];
+        ItemType datatype;
+        Storage::ItemLocation location;
+    };
+
+    LocationHint* getLocationHint(ItemType datatype, const char *key);
+
+    /**
+     * The values read last, replaced in turn.
+     */
+    LocationHint mHints[NVS_HANDLE_LOCATION_HINTS];
+
+    size_t mNextHint;
+
+    /**
+     * Set while a reader uses mHints. Readers share the storage lock, so others just search the pages meanwhile.
+     */
+    std::atomic<bool> mHintsBusy;
 };
 
 } // nvs
@@ -0,0 +1,225 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "esp_spi_flash.h"
+#include "nvs_mmap_partition.hpp"
+
+namespace nvs {
+
+MmapPartition::MmapPartition(const char *partition_name)
+    : mFd(-1), mData(nullptr), mSize(0), mPolicy(SyncPolicy::COMMIT), mPeriod(0), mDirtyBegin(0), mDirtyEnd(0)
+{
+    strncpy(mPartitionName, partition_name, sizeof(mPartitionName) - 1);
+    mPartitionName[sizeof(mPartitionName) - 1] = 0;
+}
+
+MmapPartition::~MmapPartition()
+{
+    if (mData != nullptr) {
+        sync();
+        munmap(mData, mSize);
+    }
+    if (mFd >= 0) {
+        close(mFd);
+    }
+}
+
+esp_err_t MmapPartition::init(const char *path, uint32_t size, SyncPolicy policy, uint32_t period_ms)
+{
+    if (mData != nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size == 0 || size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return ESP_FAIL;
+    }
+    struct stat st;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (fstat(fd, &st) != 0 || end < 0) {
+        close(fd);
+        return ESP_FAIL;
+    }
+    if (end < static_cast<off_t>(size)) {
+        if (!S_ISREG(st.st_mode) || end % SPI_FLASH_SEC_SIZE != 0) {
+            close(fd);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return ESP_FAIL;
+        }
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return ESP_FAIL;
+    }
+    mFd = fd;
+    mData = static_cast<uint8_t*>(data);
+    mSize = size;
+    mPolicy = policy;
+    mPeriod = std::chrono::milliseconds(period_ms);
+    mLastSync = std::chrono::steady_clock::now();
+    mDirtyBegin = mDirtyEnd = 0;
+
+    // the file is extended with zeros, the added sectors are erased
+    if (end < static_cast<off_t>(size)) {
+        memset(mData + end, 0xff, size - end);
+        mDirtyBegin = end;
+        mDirtyEnd = size;
+        return sync();
+    }
+    return ESP_OK;
+}
+
+esp_err_t MmapPartition::sync()
+{
+    if (mData == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    mLastSync = std::chrono::steady_clock::now();
+    if (mDirtyBegin == mDirtyEnd) {
+        return ESP_OK;
+    }
+    // msync needs a page-aligned address
+    size_t begin = mDirtyBegin - mDirtyBegin % static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    if (msync(mData + begin, mDirtyEnd - begin, MS_SYNC) != 0) {
+        return ESP_ERR_FLASH_OP_FAIL;
+    }
+    mDirtyBegin = mDirtyEnd = 0;
+    return ESP_OK;
+}
+
+esp_err_t MmapPartition::flush()
+{
+    if (mPolicy == SyncPolicy::PERIODIC) {
+        return modified(0, 0);
+    }
+    return (mPolicy == SyncPolicy::COMMIT) ? sync() : ESP_OK;
+}
+
+const char *MmapPartition::get_partition_name()
+{
+    return mPartitionName;
+}
+
+esp_err_t MmapPartition::read_raw(size_t src_offset, void* dst, size_t size)
+{
+    const void* src = get_mapped_ptr(src_offset, size);
+    if (src == nullptr) {
+        return (mData == nullptr) ? ESP_ERR_INVALID_STATE : ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, src, size);
+    return ESP_OK;
+}
+
+esp_err_t MmapPartition::read(size_t src_offset, void* dst, size_t size)
+{
+    return read_raw(src_offset, dst, size);
+}
+
+esp_err_t MmapPartition::write_raw(size_t dst_offset, const void* src, size_t size)
+{
+    if (mData == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (dst_offset > mSize || size > mSize - dst_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t* in = static_cast<const uint8_t*>(src);
+    uint8_t* out = mData + dst_offset;
+    for (size_t i = 0; i < size; ++i) {
+        if ((~out[i] & in[i]) != 0) {   // are we trying to set some 0 bits to 1?
+            return ESP_ERR_FLASH_OP_FAIL;
+        }
+    }
+    memcpy(out, in, size);
+    return modified(dst_offset, size);
+}
+
+esp_err_t MmapPartition::write(size_t dst_offset, const void* src, size_t size)
+{
+    return write_raw(dst_offset, src, size);
+}
+
+esp_err_t MmapPartition::erase_range(size_t dst_offset, size_t size)
+{
+    if (mData == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size % SPI_FLASH_SEC_SIZE != 0 || dst_offset > mSize || size > mSize - dst_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (dst_offset % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(mData + dst_offset, 0xff, size);
+    return modified(dst_offset, size);
+}
+
+const void* MmapPartition::get_mapped_ptr(size_t src_offset, size_t size)
+{
+    if (mData == nullptr || src_offset > mSize || size > mSize - src_offset) {
+        return nullptr;
+    }
+    return mData + src_offset;
+}
+
+esp_err_t MmapPartition::modified(size_t offset, size_t size)
+{
+    if (size != 0) {
+        if (mDirtyBegin == mDirtyEnd) {
+            mDirtyBegin = offset;
+            mDirtyEnd = offset + size;
+        } else {
+            mDirtyBegin = std::min(mDirtyBegin, offset);
+            mDirtyEnd = std::max(mDirtyEnd, offset + size);
+        }
+    }
+
+    switch (mPolicy) {
+    case SyncPolicy::EACH_WRITE:
+        return sync();
+    case SyncPolicy::PERIODIC:
+        if (std::chrono::steady_clock::now() - mLastSync >= mPeriod) {
+            return sync();
+        }
+        return ESP_OK;
+    default:
+        return ESP_OK;
+    }
+}
+
+uint32_t MmapPartition::get_address()
+{
+    return 0;
+}
+
+uint32_t MmapPartition::get_size()
+{
+    return mSize;
+}
+
+} // nvs
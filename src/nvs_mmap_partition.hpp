@@ -0,0 +1,124 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NVS_MMAP_PARTITION_HPP_
+#define NVS_MMAP_PARTITION_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "partition.hpp"
+
+namespace nvs {
+
+/**
+ * Partition stored in a memory-mapped image file, for host tools and simulators.
+ *
+ * Reads and writes access the mapping directly, and NVS reads entries in place through get_mapped_ptr.
+ * Like FilePartition, the image behaves like NOR flash and offsets are relative to the beginning of the file.
+ * When the modified pages are written back to the file (msync) is set by the SyncPolicy.
+ */
+class MmapPartition : public Partition {
+public:
+    enum class SyncPolicy {
+        EACH_WRITE, /*!< after each write and erase, before it returns */
+        COMMIT,     /*!< in nvs_commit */
+        PERIODIC,   /*!< on the first write, erase or nvs_commit after the period has passed since the last sync */
+    };
+
+    /**
+     * @param partition_name the name under which the partition is registered, at most 16 characters
+     */
+    MmapPartition(const char *partition_name);
+
+    /**
+     * Synchronizes the pending modifications and unmaps the file.
+     */
+    virtual ~MmapPartition();
+
+    /**
+     * Maps the file, creating it if it doesn't exist. A regular file shorter than size is extended with
+     * erased sectors.
+     *
+     * @param path      image file holding the partition
+     * @param size      partition size in bytes, a multiple of SPI_FLASH_SEC_SIZE
+     * @param policy    when modifications are synchronized to the file
+     * @param period_ms minimum time between two synchronizations with SyncPolicy::PERIODIC
+     *
+     * @return
+     *      - ESP_OK on success
+     *      - ESP_ERR_INVALID_SIZE if size isn't a multiple of SPI_FLASH_SEC_SIZE or the file is too small
+     *      - ESP_ERR_INVALID_STATE if the partition is already initialized
+     *      - ESP_FAIL if the file can't be opened, extended or mapped
+     */
+    esp_err_t init(const char *path, uint32_t size, SyncPolicy policy = SyncPolicy::COMMIT, uint32_t period_ms = 1000);
+
+    /**
+     * Writes the modified pages of the mapping to the file (msync).
+     */
+    esp_err_t sync();
+
+    esp_err_t flush() override;
+
+    const char *get_partition_name() override;
+
+    esp_err_t read_raw(size_t src_offset, void* dst, size_t size) override;
+
+    esp_err_t read(size_t src_offset, void* dst, size_t size) override;
+
+    /**
+     * @return
+     *      - ESP_OK on success
+     *      - ESP_ERR_INVALID_SIZE if the range isn't within the partition
+     *      - ESP_ERR_FLASH_OP_FAIL if some bit would change from 0 to 1, nothing is written then
+     */
+    esp_err_t write_raw(size_t dst_offset, const void* src, size_t size) override;
+
+    esp_err_t write(size_t dst_offset, const void* src, size_t size) override;
+
+    /**
+     * @return
+     *      - ESP_OK on success
+     *      - ESP_ERR_INVALID_SIZE if size isn't a multiple of SPI_FLASH_SEC_SIZE or the range isn't within
+     *        the partition
+     *      - ESP_ERR_INVALID_ARG if dst_offset isn't aligned to SPI_FLASH_SEC_SIZE
+     */
+    esp_err_t erase_range(size_t dst_offset, size_t size) override;
+
+    const void* get_mapped_ptr(size_t src_offset, size_t size) override;
+
+    /**
+     * @return 0, offsets are relative to the beginning of the file.
+     */
+    uint32_t get_address() override;
+
+    uint32_t get_size() override;
+
+protected:
+    esp_err_t modified(size_t offset, size_t size);
+
+    char mPartitionName[17]; // at most 16 characters as in the partition table
+    int mFd;
+    uint8_t* mData;
+    uint32_t mSize;
+    SyncPolicy mPolicy;
+    std::chrono::milliseconds mPeriod;
+    std::chrono::steady_clock::time_point mLastSync;
+    size_t mDirtyBegin; // range of the mapping modified since the last sync
+    size_t mDirtyEnd;
+};
+
+} // nvs
+
+#endif // NVS_MMAP_PARTITION_HPP_
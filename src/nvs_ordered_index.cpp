@@ -0,0 +1,134 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nvs_ordered_index.hpp"
+
+namespace nvs
+{
+
+esp_err_t OrderedIndex::addNamespace(uint8_t nsIndex)
+{
+    if (!mKeys) {
+        mKeys.reset(new (std::nothrow) Key[mCapacity]);
+        if (!mKeys) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    mIndexed.set(nsIndex, true);
+    return ESP_OK;
+}
+
+void OrderedIndex::dropNamespace(uint8_t nsIndex)
+{
+    if (!isIndexed(nsIndex)) {
+        return;
+    }
+    Key* begin = lowerBound(nsIndex, "");
+    Key* end = begin;
+    while (end != mKeys.get() + mCount && end->nsIndex == nsIndex) {
+        ++end;
+    }
+    std::move(end, mKeys.get() + mCount, begin);
+    mCount -= end - begin;
+    mIndexed.set(nsIndex, false);
+}
+
+void OrderedIndex::clear()
+{
+    mCount = 0;
+    mKeys.reset();
+    std::fill_n(mIndexed.data(), mIndexed.byteSize() / 4, 0);
+    std::fill_n(mTooLarge.data(), mTooLarge.byteSize() / 4, 0);
+}
+
+nvs_type_t OrderedIndex::listedType(ItemType datatype)
+{
+    switch (datatype) {
+    case ItemType::BLOB:
+    case ItemType::BLOB_DATA:
+    case ItemType::BLOB_IDX:
+    case ItemType::BLOB_REF:
+        return NVS_TYPE_BLOB;
+    default:
+        return static_cast<nvs_type_t>(datatype);
+    }
+}
+
+OrderedIndex::Key* OrderedIndex::lowerBound(uint8_t nsIndex, const char* key) const
+{
+    return std::lower_bound(mKeys.get(), mKeys.get() + mCount, nsIndex, [key](const Key& k, uint8_t ns) {
+        return k.nsIndex < ns || (k.nsIndex == ns && strncmp(k.key, key, sizeof(k.key)) < 0);
+    });
+}
+
+void OrderedIndex::countItem(const Item& item, bool add)
+{
+    if (!isIndexed(item.nsIndex)) {
+        return;
+    }
+
+    Key* pos = lowerBound(item.nsIndex, item.key);
+    bool found = pos != mKeys.get() + mCount && pos->nsIndex == item.nsIndex
+            && strncmp(pos->key, item.key, sizeof(pos->key)) == 0;
+    if (!add) {
+        if (found && --pos->itemCount == 0) {
+            std::move(pos + 1, mKeys.get() + mCount, pos);
+            --mCount;
+        }
+        return;
+    }
+    if (found) {
+        ++pos->itemCount;
+        return;
+    }
+
+    if (mCount == mCapacity) {
+        // make room by dropping the other namespaces, or this one if it takes all the room
+        for (size_t ns = 0; ns < mIndexed.count(); ++ns) {
+            if (ns != item.nsIndex) {
+                dropNamespace(static_cast<uint8_t>(ns));
+            }
+        }
+        if (mCount == mCapacity) {
+            dropNamespace(item.nsIndex);
+            mTooLarge.set(item.nsIndex, true);
+            return;
+        }
+        pos = lowerBound(item.nsIndex, item.key);
+    }
+
+    std::move_backward(pos, mKeys.get() + mCount, mKeys.get() + mCount + 1);
+    pos->nsIndex = item.nsIndex;
+    pos->type = static_cast<uint8_t>(listedType(item.datatype));
+    pos->itemCount = 1;
+    strncpy(pos->key, item.key, sizeof(pos->key) - 1);
+    pos->key[sizeof(pos->key) - 1] = 0;
+    ++mCount;
+}
+
+void OrderedIndex::listKeys(uint8_t nsIndex, const char* from, const char* to, nvs_entry_info_t* entries, size_t& count) const
+{
+    size_t listed = 0;
+    for (Key* k = lowerBound(nsIndex, (from != nullptr) ? from : ""); k != mKeys.get() + mCount && listed < count; ++k) {
+        if (k->nsIndex != nsIndex || (to != nullptr && strncmp(k->key, to, sizeof(k->key)) >= 0)) {
+            break;
+        }
+        strncpy(entries[listed].key, k->key, sizeof(entries[listed].key));
+        entries[listed].type = static_cast<nvs_type_t>(k->type);
+        ++listed;
+    }
+    count = listed;
+}
+
+} // namespace nvs
@@ -0,0 +1,102 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef nvs_ordered_index_hpp
+#define nvs_ordered_index_hpp
+
+#include <memory>
+#include "nvs.h"
+#include "nvs_types.hpp"
+#include "compressed_enum_table.hpp"
+#include "sdkconfig.h"
+
+#ifdef CONFIG_NVS_ORDERED_INDEX_KEYS
+#define NVS_ORDERED_INDEX_KEYS CONFIG_NVS_ORDERED_INDEX_KEYS
+#else
+#define NVS_ORDERED_INDEX_KEYS 256
+#endif
+
+namespace nvs
+{
+
+/**
+ * Keys of some namespaces in key order, for listing them by range without reading the pages.
+ *
+ * A namespace is added when its keys are listed the first time. From then on, the pages report every item
+ * of it which is written, erased or copied, and the index counts the items of each key; a key is listed
+ * while it has any. At most capacity keys are held. When a key doesn't fit, the other namespaces are
+ * dropped; a namespace which doesn't fit on its own is dropped and marked as too large, its keys are
+ * found by reading the pages instead.
+ */
+class OrderedIndex
+{
+public:
+    OrderedIndex(size_t capacity) : mCapacity(capacity)
+    {
+        clear();
+    }
+
+    bool isIndexed(uint8_t nsIndex) const
+    {
+        return mIndexed.get(nsIndex);
+    }
+
+    bool isTooLarge(uint8_t nsIndex) const
+    {
+        return mTooLarge.get(nsIndex);
+    }
+
+    /**
+     * Starts counting the items of the namespace, the caller adds its existing items with countItem.
+     * Returns ESP_ERR_NO_MEM if the keys can't be allocated.
+     */
+    esp_err_t addNamespace(uint8_t nsIndex);
+
+    void dropNamespace(uint8_t nsIndex);
+
+    void clear();
+
+    void countItem(const Item& item, bool add);
+
+    /**
+     * Lists the keys of the namespace in [from, to) in key order. A null from or to leaves the range open at
+     * that end. At most count entries are filled, count is set to the number of entries filled.
+     */
+    void listKeys(uint8_t nsIndex, const char* from, const char* to, nvs_entry_info_t* entries, size_t& count) const;
+
+    /**
+     * Type under which items of datatype are listed, blobs are stored as several types of items.
+     */
+    static nvs_type_t listedType(ItemType datatype);
+
+protected:
+    struct Key
+    {
+        uint8_t nsIndex;
+        uint8_t type;
+        uint16_t itemCount;
+        char key[Item::MAX_KEY_LENGTH + 1];
+    };
+
+    Key* lowerBound(uint8_t nsIndex, const char* key) const;
+
+    size_t mCapacity;
+    size_t mCount = 0;
+    std::unique_ptr<Key[]> mKeys;
+    CompressedEnumTable<bool, 1, 256> mIndexed;
+    CompressedEnumTable<bool, 1, 256> mTooLarge;
+};
+
+} // namespace nvs
+
+#endif /* nvs_ordered_index_hpp */
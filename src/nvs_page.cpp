@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "nvs_page.hpp"
+#include "nvs_compress.hpp"
+#include "nvs_platform.hpp"
 #if defined(ESP_PLATFORM)
 #include <esp32/rom/crc.h>
 #else
@@ -19,11 +21,12 @@
 #endif
 #include <cstdio>
 #include <cstring>
+#include <memory>
 
 namespace nvs
 {
 
-Page::Page() : mPartition(nullptr) { }
+Page::Page() : mPins(0), mPartition(nullptr) { }
 
 uint32_t Page::Header::calculateCrc32()
 {
@@ -94,6 +97,10 @@ esp_err_t Page::load(Partition *partition, uint32_t sectorNumber)
         mLoadEntryTable();
         break;
 
+    case PageState::RETIRED:
+        // its items are also stored on other pages, the page is only kept until it is used again
+        break;
+
     default:
         mState = PageState::CORRUPT;
         break;
@@ -122,7 +129,7 @@ esp_err_t Page::writeEntry(const Item& item)
         mFirstUsedEntry = mNextFreeEntry;
     }
 
-    ++mUsedEntryCount;
+    addUsedEntries(1);
     ++mNextFreeEntry;
 
     return ESP_OK;
@@ -135,6 +142,21 @@ esp_err_t Page::writeEntryData(const uint8_t* data, size_t size)
     assert(mFirstUsedEntry != INVALID_ENTRY);
     const uint16_t count = size / ENTRY_SIZE;
 
+    auto err = writeEntryDataAt(mNextFreeEntry, data, size);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = alterEntryRangeState(mNextFreeEntry, mNextFreeEntry + count, EntryState::WRITTEN);
+    if (err != ESP_OK) {
+        return err;
+    }
+    addUsedEntries(count);
+    mNextFreeEntry += count;
+    return ESP_OK;
+}
+
+esp_err_t Page::writeEntryDataAt(size_t index, const uint8_t* data, size_t size)
+{
     const uint8_t* buf = data;
 
 #ifdef ESP_PLATFORM
@@ -155,7 +177,7 @@ esp_err_t Page::writeEntryData(const uint8_t* data, size_t size)
     }
 #endif //ESP_PLATFORM
 
-    auto rc = mPartition->write(getEntryAddress(mNextFreeEntry), buf, size);
+    auto rc = mPartition->write(getEntryAddress(index), buf, size);
 
 #ifdef ESP_PLATFORM
     if (buf != data) {
@@ -166,16 +188,10 @@ esp_err_t Page::writeEntryData(const uint8_t* data, size_t size)
         mState = PageState::INVALID;
         return rc;
     }
-    auto err = alterEntryRangeState(mNextFreeEntry, mNextFreeEntry + count, EntryState::WRITTEN);
-    if (err != ESP_OK) {
-        return err;
-    }
-    mUsedEntryCount += count;
-    mNextFreeEntry += count;
     return ESP_OK;
 }
 
-esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx)
+esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx, bool tryCompress)
 {
     Item item;
     esp_err_t err;
@@ -204,10 +220,36 @@ esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, c
         return ESP_ERR_NVS_VALUE_TOO_LONG;
     }
 
+#if NVS_COALESCE_WRITES
+    /* Small items are assembled on the stack and written with one write. Larger ones are written below, straight
+     * from data, and their states are set with one write as well */
+    if (getEntryCount(datatype, dataSize) <= COALESCE_STACK_ENTRIES) {
+        Item entries[COALESCE_STACK_ENTRIES];
+        size_t count = encodeItem(nsIndex, datatype, key, data, dataSize, tryCompress, entries, chunkIdx);
+        return writeEntries(entries, count);
+    }
+#endif
+
+    const uint8_t* payload = static_cast<const uint8_t*>(data);
+    size_t payloadSize = dataSize;
+    std::unique_ptr<uint8_t[]> compressed;
+    if (tryCompress && isVariableLengthType(datatype) && dataSize > ENTRY_SIZE) {
+        /* Compression is only used if it saves at least one entry */
+        size_t capacity = ((dataSize + ENTRY_SIZE - 1) & ~(ENTRY_SIZE - 1)) - ENTRY_SIZE;
+        compressed.reset(new (std::nothrow) uint8_t[capacity]);
+        if (compressed) {
+            size_t compressedSize = compress(payload, dataSize, compressed.get(), capacity);
+            if (compressedSize) {
+                payload = compressed.get();
+                payloadSize = compressedSize;
+            }
+        }
+    }
+
     size_t totalSize = ENTRY_SIZE;
     size_t entriesCount = 1;
     if (isVariableLengthType(datatype)) {
-        size_t roundedSize = (dataSize + ENTRY_SIZE - 1) & ~(ENTRY_SIZE - 1);
+        size_t roundedSize = (payloadSize + ENTRY_SIZE - 1) & ~(ENTRY_SIZE - 1);
         totalSize += roundedSize;
         entriesCount += roundedSize / ENTRY_SIZE;
     }
@@ -237,39 +279,206 @@ esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, c
         if (err != ESP_OK) {
             return err;
         }
+        countItem(item, true);
     } else {
         const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
         item.varLength.dataCrc32 = Item::calculateCrc32(src, dataSize);
         item.varLength.dataSize = dataSize;
-        item.varLength.reserved = 0xffff;
+        item.varLength.compressedSize = (payload != src) ? payloadSize : UNCOMPRESSED;
         item.crc32 = item.calculateCrc32();
+#if NVS_COALESCE_WRITES
+        err = writeEntries(item, payload, payloadSize);
+        if (err != ESP_OK) {
+            // the item wasn't written, so it mustn't be found
+            mHashList.erase(mNextFreeEntry);
+        }
+        return err;
+#else
         err = writeEntry(item);
         if (err != ESP_OK) {
             return err;
         }
+        countItem(item, true);
 
-        size_t left = dataSize / ENTRY_SIZE * ENTRY_SIZE;
+        size_t left = payloadSize / ENTRY_SIZE * ENTRY_SIZE;
         if (left > 0) {
-            err = writeEntryData(static_cast<const uint8_t*>(data), left);
+            err = writeEntryData(payload, left);
             if (err != ESP_OK) {
                 return err;
             }
         }
 
-        size_t tail = dataSize - left;
+        size_t tail = payloadSize - left;
         if (tail > 0) {
             std::fill_n(item.rawData, ENTRY_SIZE, 0xff);
-            memcpy(item.rawData, static_cast<const uint8_t*>(data) + left, tail);
+            memcpy(item.rawData, payload + left, tail);
             err = writeEntry(item);
             if (err != ESP_OK) {
                 return err;
             }
         }
+#endif
+    }
+    return ESP_OK;
+}
+
+size_t Page::getEntryCount(ItemType datatype, size_t dataSize)
+{
+    if (!isVariableLengthType(datatype)) {
+        return 1;
+    }
+    return 1 + (dataSize + ENTRY_SIZE - 1) / ENTRY_SIZE;
+}
+
+size_t Page::encodeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, bool tryCompress, Item* dst, uint8_t chunkIdx)
+{
+    assert(strlen(key) <= Item::MAX_KEY_LENGTH);
+    assert(dataSize <= CHUNK_MAX_SIZE);
+
+    if (!isVariableLengthType(datatype)) {
+        dst[0] = Item(nsIndex, datatype, 1, key, chunkIdx);
+        memcpy(dst[0].data, data, dataSize);
+        dst[0].crc32 = dst[0].calculateCrc32();
+        return 1;
+    }
+
+    /* Data entries are filled like writeItem fills them, compressed data is only kept if it saves an entry */
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+    size_t entryCount = getEntryCount(datatype, dataSize);
+    uint8_t* payload = reinterpret_cast<uint8_t*>(dst + 1);
+    size_t payloadSize = 0;
+    if (tryCompress && dataSize > ENTRY_SIZE) {
+        payloadSize = compress(src, dataSize, payload, (entryCount - 2) * ENTRY_SIZE);
+    }
+    const bool isCompressed = payloadSize != 0;
+    if (!isCompressed) {
+        memcpy(payload, src, dataSize);
+        payloadSize = dataSize;
+    }
+    entryCount = getEntryCount(datatype, payloadSize);
+    std::fill(payload + payloadSize, payload + (entryCount - 1) * ENTRY_SIZE, 0xff);
+
+    dst[0] = Item(nsIndex, datatype, entryCount, key, chunkIdx);
+    dst[0].varLength.dataCrc32 = Item::calculateCrc32(src, dataSize);
+    dst[0].varLength.dataSize = dataSize;
+    dst[0].varLength.compressedSize = isCompressed ? payloadSize : UNCOMPRESSED;
+    dst[0].crc32 = dst[0].calculateCrc32();
+    return entryCount;
+}
+
+esp_err_t Page::writeEntries(const Item* entries, size_t count)
+{
+    if (mState == PageState::INVALID) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    if (mState == PageState::UNINITIALIZED) {
+        auto err = initialize();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (mState == PageState::FULL || mNextFreeEntry == INVALID_ENTRY || mNextFreeEntry + count > ENTRY_COUNT) {
+        return ESP_ERR_NVS_PAGE_FULL;
+    }
+
+    esp_err_t rc = ESP_OK;
+    size_t inserted;
+    for (inserted = 0; inserted < count; inserted += entries[inserted].span) {
+        rc = mHashList.insert(entries[inserted], mNextFreeEntry + inserted);
+        if (rc != ESP_OK) {
+            break;
+        }
+    }
 
+    if (rc == ESP_OK) {
+        rc = mPartition->write(getEntryAddress(mNextFreeEntry), entries, count * ENTRY_SIZE);
+        if (rc != ESP_OK) {
+            mState = PageState::INVALID;
+        }
+    }
+    if (rc == ESP_OK) {
+        rc = markEntriesWritten(count);
+    }
+    if (rc != ESP_OK) {
+        // the items weren't written, so they mustn't be found
+        for (size_t i = 0; i < inserted; i += entries[i].span) {
+            mHashList.erase(mNextFreeEntry + i);
+        }
+        return rc;
+    }
+    for (size_t i = 0; i < count; i += entries[i].span) {
+        countItem(entries[i], true);
     }
     return ESP_OK;
 }
 
+esp_err_t Page::writeEntries(const Item& header, const uint8_t* payload, size_t payloadSize)
+{
+    assert(mNextFreeEntry + header.span <= ENTRY_COUNT);
+
+    auto rc = mPartition->write(getEntryAddress(mNextFreeEntry), &header, sizeof(header));
+    if (rc != ESP_OK) {
+        mState = PageState::INVALID;
+        return rc;
+    }
+
+    size_t left = payloadSize / ENTRY_SIZE * ENTRY_SIZE;
+    if (left > 0) {
+        rc = writeEntryDataAt(mNextFreeEntry + 1, payload, left);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+    }
+
+    size_t tail = payloadSize - left;
+    if (tail > 0) {
+        Item last;
+        std::fill_n(last.rawData, ENTRY_SIZE, 0xff);
+        memcpy(last.rawData, payload + left, tail);
+        rc = mPartition->write(getEntryAddress(mNextFreeEntry + 1 + left / ENTRY_SIZE), &last, sizeof(last));
+        if (rc != ESP_OK) {
+            mState = PageState::INVALID;
+            return rc;
+        }
+    }
+
+    rc = markEntriesWritten(header.span);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+    countItem(header, true);
+    return ESP_OK;
+}
+
+esp_err_t Page::markEntriesWritten(size_t count)
+{
+    /* The states are written once all entries are, from the first word on, so that after a power loss only the
+     * entries after the last state written are unmarked. Loading the page erases them, and the items they
+     * belong to. The words are adjacent and written with one write, which isn't atomic though: the flash may
+     * program them one after the other. */
+    const size_t end = mNextFreeEntry + count;
+    for (size_t i = mNextFreeEntry; i < end; ++i) {
+        mEntryTable.set(i, EntryState::WRITTEN);
+    }
+    size_t firstWord = mEntryTable.getWordIndex(mNextFreeEntry);
+    size_t wordCount = mEntryTable.getWordIndex(end - 1) - firstWord + 1;
+    auto rc = mPartition->write_raw(mBaseAddress + ENTRY_TABLE_OFFSET + static_cast<uint32_t>(firstWord) * 4,
+            mEntryTable.data() + firstWord, wordCount * sizeof(uint32_t));
+    if (rc != ESP_OK) {
+        mState = PageState::INVALID;
+        return rc;
+    }
+
+    if (mFirstUsedEntry == INVALID_ENTRY) {
+        mFirstUsedEntry = mNextFreeEntry;
+    }
+    addUsedEntries(count);
+    mNextFreeEntry = end;
+    return ESP_OK;
+}
+
 esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize, uint8_t chunkIdx, VerOffset chunkStart)
 {
     size_t index = 0;
@@ -283,9 +492,44 @@ esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, vo
     if (rc != ESP_OK) {
         return rc;
     }
+    return readItemAt(index, item, data, dataSize);
+}
 
-    if (!isVariableLengthType(datatype)) {
-        if (dataSize != getAlignmentForType(datatype)) {
+bool Page::isReadOnly() const
+{
+    return mLock != nullptr && mLock->isShared();
+}
+
+esp_err_t Page::readItemAt(size_t index, const Item& item, void* data, size_t dataSize)
+{
+    auto rc = readItemValue(index, item, data, dataSize);
+    if (rc == ESP_ERR_NVS_NOT_FOUND && !isReadOnly()) {
+        rc = eraseEntryAndSpan(index);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return rc;
+}
+
+esp_err_t Page::readItemValue(size_t index, const Item& item, void* data, size_t dataSize) const
+{
+    if (item.datatype == ItemType::COUNTER) {
+        if (dataSize != sizeof(uint32_t)) {
+            return ESP_ERR_NVS_TYPE_MISMATCH;
+        }
+        uint32_t value;
+        size_t clearedBits;
+        auto rc = readCounterAt(index, item, value, clearedBits);
+        if (rc == ESP_OK) {
+            memcpy(data, &value, sizeof(value));
+        }
+        return rc;
+    }
+
+    if (!isVariableLengthType(item.datatype)) {
+        if (dataSize != getAlignmentForType(item.datatype)) {
             return ESP_ERR_NVS_TYPE_MISMATCH;
         }
 
@@ -297,26 +541,119 @@ esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, vo
         return ESP_ERR_NVS_INVALID_LENGTH;
     }
 
-    uint8_t* dst = reinterpret_cast<uint8_t*>(data);
-    size_t left = item.varLength.dataSize;
-    for (size_t i = index + 1; i < index + item.span; ++i) {
-        Item ditem;
-        rc = readEntry(i, ditem);
+    return readItemData(index, item, reinterpret_cast<uint8_t*>(data));
+}
+
+esp_err_t Page::readItemData(size_t index, const Item& item, uint8_t* dst) const
+{
+    const bool isCompressed = item.varLength.compressedSize != UNCOMPRESSED;
+    const size_t storedSize = isCompressed ? item.varLength.compressedSize : item.varLength.dataSize;
+    if ((storedSize + ENTRY_SIZE - 1) / ENTRY_SIZE + 1 > item.span) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    std::unique_ptr<uint8_t[]> compressed;
+    const uint8_t* stored = getMappedEntries(index + 1, (storedSize + ENTRY_SIZE - 1) / ENTRY_SIZE);
+    if (stored != nullptr) {
+        if (!isCompressed) {
+            memcpy(dst, stored, storedSize);
+        }
+    } else {
+        uint8_t* out = dst;
+        if (isCompressed) {
+            compressed.reset(new (std::nothrow) uint8_t[storedSize]);
+            if (!compressed) {
+                return ESP_ERR_NO_MEM;
+            }
+            out = compressed.get();
+        }
+        stored = out;
+
+        size_t left = storedSize;
+        for (size_t i = index + 1; left > 0; ++i) {
+            Item ditem;
+            auto rc = readEntry(i, ditem);
+            if (rc != ESP_OK) {
+                return rc;
+            }
+            size_t willCopy = ENTRY_SIZE;
+            willCopy = (left < willCopy)?left:willCopy;
+            memcpy(out, ditem.rawData, willCopy);
+            left -= willCopy;
+            out += willCopy;
+        }
+    }
+    // compressed data is decoded straight from the mapping, without copying it first
+    if (isCompressed && !decompress(stored, storedSize, dst, item.varLength.dataSize)) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (Item::calculateCrc32(dst, item.varLength.dataSize) != item.varLength.dataCrc32) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t Page::readItemRange(uint8_t nsIndex, ItemType datatype, const char* key, size_t offset, void* data, size_t dataSize, uint8_t chunkIdx)
+{
+    size_t index = 0;
+    Item item;
+
+    if (mState == PageState::INVALID) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    esp_err_t rc = findItem(nsIndex, datatype, key, index, item, chunkIdx);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+
+    if (!isVariableLengthType(datatype)) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+
+    if (offset > item.varLength.dataSize || dataSize > item.varLength.dataSize - offset) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    if (offset == 0 && dataSize == item.varLength.dataSize) {
+        return readItem(nsIndex, datatype, key, data, dataSize, chunkIdx);
+    }
+
+    if (item.varLength.compressedSize != UNCOMPRESSED) {
+        /* Compressed data can only be decoded as a whole */
+        std::unique_ptr<uint8_t[]> buf(new (std::nothrow) uint8_t[item.varLength.dataSize]);
+        if (!buf) {
+            return ESP_ERR_NO_MEM;
+        }
+        rc = readItemData(index, item, buf.get());
         if (rc != ESP_OK) {
             return rc;
         }
-        size_t willCopy = ENTRY_SIZE;
-        willCopy = (left < willCopy)?left:willCopy;
-        memcpy(dst, ditem.rawData, willCopy);
-        left -= willCopy;
-        dst += willCopy;
+        memcpy(data, buf.get() + offset, dataSize);
+        return ESP_OK;
     }
-    if (Item::calculateCrc32(reinterpret_cast<uint8_t*>(data), item.varLength.dataSize) != item.varLength.dataCrc32) {
-        rc = eraseEntryAndSpan(index);
+
+    /* Only the entries overlapping the range are read. The data CRC covers the whole item,
+     * so it can't be verified here */
+    const uint8_t* mapped = getMappedEntries(index + 1, (item.varLength.dataSize + ENTRY_SIZE - 1) / ENTRY_SIZE);
+    if (mapped != nullptr) {
+        memcpy(data, mapped + offset, dataSize);
+        return ESP_OK;
+    }
+    uint8_t* dst = reinterpret_cast<uint8_t*>(data);
+    size_t skip = offset % ENTRY_SIZE;
+    for (size_t i = index + 1 + offset / ENTRY_SIZE; dataSize > 0; ++i) {
+        Item ditem;
+        rc = readEntry(i, ditem);
         if (rc != ESP_OK) {
             return rc;
         }
-        return ESP_ERR_NVS_NOT_FOUND;
+        size_t willCopy = ENTRY_SIZE - skip;
+        willCopy = (dataSize < willCopy)?dataSize:willCopy;
+        memcpy(dst, ditem.rawData + skip, willCopy);
+        skip = 0;
+        dataSize -= willCopy;
+        dst += willCopy;
     }
     return ESP_OK;
 }
@@ -334,9 +671,22 @@ esp_err_t Page::cmpItem(uint8_t nsIndex, ItemType datatype, const char* key, con
     if (rc != ESP_OK) {
         return rc;
     }
+    return cmpItemAt(index, item, data, dataSize);
+}
 
-    if (!isVariableLengthType(datatype)) {
-        if (dataSize != getAlignmentForType(datatype)) {
+esp_err_t Page::cmpItemAt(size_t index, const Item& item, const void* data, size_t dataSize)
+{
+    if (item.datatype == ItemType::COUNTER) {
+        uint32_t value;
+        auto rc = readItemAt(index, item, &value, dataSize);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        return memcmp(data, &value, sizeof(value)) ? ESP_ERR_NVS_CONTENT_DIFFERS : ESP_OK;
+    }
+
+    if (!isVariableLengthType(item.datatype)) {
+        if (dataSize != getAlignmentForType(item.datatype)) {
             return ESP_ERR_NVS_TYPE_MISMATCH;
         }
 
@@ -350,11 +700,37 @@ esp_err_t Page::cmpItem(uint8_t nsIndex, ItemType datatype, const char* key, con
         return ESP_ERR_NVS_INVALID_LENGTH;
     }
 
+    if (item.varLength.compressedSize != UNCOMPRESSED) {
+        /* Most modifications are already detected by the checksum, without decompressing */
+        if (Item::calculateCrc32(reinterpret_cast<const uint8_t*>(data), item.varLength.dataSize) != item.varLength.dataCrc32) {
+            return ESP_ERR_NVS_CONTENT_DIFFERS;
+        }
+        std::unique_ptr<uint8_t[]> buf(new (std::nothrow) uint8_t[item.varLength.dataSize]);
+        if (!buf) {
+            return ESP_ERR_NO_MEM;
+        }
+        auto rc = readItemData(index, item, buf.get());
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        if (memcmp(data, buf.get(), item.varLength.dataSize)) {
+            return ESP_ERR_NVS_CONTENT_DIFFERS;
+        }
+        return ESP_OK;
+    }
+
     const uint8_t* dst = reinterpret_cast<const uint8_t*>(data);
     size_t left = item.varLength.dataSize;
-    for (size_t i = index + 1; i < index + item.span; ++i) {
+    const uint8_t* mapped = getMappedEntries(index + 1, (left + ENTRY_SIZE - 1) / ENTRY_SIZE);
+    if (mapped != nullptr && left <= (item.span - 1) * ENTRY_SIZE) {
+        if (memcmp(dst, mapped, left)) {
+            return ESP_ERR_NVS_CONTENT_DIFFERS;
+        }
+        left = 0;
+    }
+    for (size_t i = index + 1; left > 0 && i < index + item.span; ++i) {
         Item ditem;
-        rc = readEntry(i, ditem);
+        auto rc = readEntry(i, ditem);
         if (rc != ESP_OK) {
             return rc;
         }
@@ -393,57 +769,217 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, ui
 
 esp_err_t Page::eraseEntryAndSpan(size_t index)
 {
-    auto state = mEntryTable.get(index);
-    assert(state == EntryState::WRITTEN || state == EntryState::EMPTY);
+    return eraseItemsAt(&index, 1);
+}
 
-    size_t span = 1;
-    if (state == EntryState::WRITTEN) {
-        Item item;
-        auto rc = readEntry(index, item);
-        if (rc != ESP_OK) {
-            return rc;
-        }
-        if (item.calculateCrc32() != item.crc32) {
-            mHashList.erase(index, false);
-            rc = alterEntryState(index, EntryState::ERASED);
-            --mUsedEntryCount;
-            ++mErasedEntryCount;
+esp_err_t Page::eraseItemsAt(const size_t* indices, size_t count)
+{
+    /* The states of all items are changed first, then each word of the entry state table which has changed
+     * is written once. Words are written from the last one on, so that the header of an item is erased last. */
+    uint32_t changedWords = 0;
+    ++mItemGeneration;
+    for (size_t k = 0; k < count; ++k) {
+        const size_t index = indices[k];
+        auto state = mEntryTable.get(index);
+        assert(state == EntryState::WRITTEN || state == EntryState::EMPTY);
+
+        size_t span = 1;
+        if (state == EntryState::WRITTEN) {
+            Item item;
+            auto rc = readEntry(index, item);
             if (rc != ESP_OK) {
                 return rc;
             }
-        } else {
-            mHashList.erase(index);
-            span = item.span;
-            for (ptrdiff_t i = index + span - 1; i >= static_cast<ptrdiff_t>(index); --i) {
-                if (mEntryTable.get(i) == EntryState::WRITTEN) {
-                    --mUsedEntryCount;
-                }
+            if (item.calculateCrc32() != item.crc32) {
+                mHashList.erase(index, false);
+                removeUsedEntries(1);
                 ++mErasedEntryCount;
-            }
-            if (span == 1) {
-                rc = alterEntryState(index, EntryState::ERASED);
             } else {
-                rc = alterEntryRangeState(index, index + span, EntryState::ERASED);
+                mHashList.erase(index);
+                countItem(item, false);
+                span = item.span;
+                const bool erasedNamespace = mErasedNamespaces && mErasedNamespaces->get(item.nsIndex);
+                for (size_t i = index; i < index + span; ++i) {
+                    if (mEntryTable.get(i) == EntryState::WRITTEN) {
+                        removeUsedEntries(1);
+                        if (erasedNamespace && mErasedNamespaceEntryCount > 0) {
+                            --mErasedNamespaceEntryCount;
+                        }
+                    }
+                    ++mErasedEntryCount;
+                }
             }
-            if (rc != ESP_OK) {
-                return rc;
+        }
+
+        for (size_t i = index; i < index + span; ++i) {
+            mEntryTable.set(i, EntryState::ERASED);
+            changedWords |= 1u << mEntryTable.getWordIndex(i);
+        }
+
+        if (index + span > mNextFreeEntry) {
+            mNextFreeEntry = index + span;
+        }
+    }
+
+    for (ptrdiff_t wordIndex = mEntryTable.byteSize() / sizeof(uint32_t) - 1; wordIndex >= 0; --wordIndex) {
+        if (!(changedWords & (1u << wordIndex))) {
+            continue;
+        }
+        uint32_t word = mEntryTable.data()[wordIndex];
+        auto rc = mPartition->write_raw(mBaseAddress + ENTRY_TABLE_OFFSET + static_cast<uint32_t>(wordIndex) * 4,
+                &word, sizeof(word));
+        if (rc != ESP_OK) {
+            mState = PageState::INVALID;
+            return rc;
+        }
+    }
+
+    if (mFirstUsedEntry != INVALID_ENTRY && mEntryTable.get(mFirstUsedEntry) != EntryState::WRITTEN) {
+        updateFirstUsedEntry(mFirstUsedEntry, 1);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t Page::writeReservedItem(Item& item, size_t& index)
+{
+    if (mState == PageState::INVALID) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    if (mState == PageState::UNINITIALIZED) {
+        auto err = initialize();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (mState == PageState::FULL) {
+        return ESP_ERR_NVS_PAGE_FULL;
+    }
+
+    if (mNextFreeEntry == INVALID_ENTRY || mNextFreeEntry + item.span > ENTRY_COUNT) {
+        return ESP_ERR_NVS_PAGE_FULL;
+    }
+
+    const size_t dataEntries = item.span - 1;
+    item.crc32 = item.calculateCrc32();
+    index = mNextFreeEntry;
+    auto err = mHashList.insert(item, mNextFreeEntry);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = writeEntry(item);
+    if (err != ESP_OK) {
+        return err;
+    }
+    countItem(item, true);
+    if (dataEntries == 0) {
+        return ESP_OK;
+    }
+
+    /* Erased flash has all bits set already. As for other items, the header is marked as written first, so that
+     * an item whose data entries aren't all marked is erased when the page is loaded. */
+    return reserveEntries(dataEntries);
+}
+
+esp_err_t Page::readCounterAt(size_t index, const Item& item, uint32_t& value, size_t& clearedBits) const
+{
+    /* Bits are cleared in order, from the lowest bit of the first word on */
+    clearedBits = 0;
+    for (size_t i = index + 1; i < index + item.span; ++i) {
+        Item entry;
+        auto rc = readEntry(i, entry);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        const uint32_t* words = reinterpret_cast<const uint32_t*>(entry.rawData);
+        for (size_t w = 0; w < ENTRY_SIZE / sizeof(uint32_t); ++w) {
+            for (uint32_t bits = ~words[w]; bits & 1; bits >>= 1) {
+                ++clearedBits;
+            }
+            if (words[w] != 0) {
+                value = item.counter.base + clearedBits;
+                return ESP_OK;
             }
         }
-    } else {
-        auto rc = alterEntryState(index, EntryState::ERASED);
+    }
+    value = item.counter.base + clearedBits;
+    return ESP_OK;
+}
+
+esp_err_t Page::incrementCounterAt(size_t index, size_t clearedBits, size_t count)
+{
+    const size_t wordBits = sizeof(uint32_t) * 8;
+    const size_t endBit = clearedBits + count;
+    uint32_t words[ENTRY_SIZE / sizeof(uint32_t)];
+    size_t first = clearedBits / wordBits;
+    while (first * wordBits < endBit) {
+        size_t n = 0;
+        for (; n < sizeof(words) / sizeof(words[0]) && (first + n) * wordBits < endBit; ++n) {
+            size_t cleared = std::min(endBit - (first + n) * wordBits, wordBits);
+            words[n] = (cleared == wordBits) ? 0 : (UINT32_MAX << cleared);
+        }
+        auto rc = mPartition->write(getEntryAddress(index + 1) + first * sizeof(uint32_t), words, n * sizeof(uint32_t));
         if (rc != ESP_OK) {
+            mState = PageState::INVALID;
             return rc;
         }
+        first += n;
     }
+    return ESP_OK;
+}
 
-    if (index == mFirstUsedEntry) {
-        updateFirstUsedEntry(index, span);
+esp_err_t Page::findFreeLogSlot(size_t index, const Item& item, size_t& slot) const
+{
+    size_t low = 0;
+    size_t high = item.span - 1;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        LogRecord record;
+        auto rc = readLogRecordAt(index, mid, record);
+        if (rc == ESP_ERR_NVS_NOT_FOUND) {
+            high = mid;
+        } else if (rc == ESP_OK) {
+            low = mid + 1;
+        } else {
+            return rc;
+        }
     }
+    slot = low;
+    return ESP_OK;
+}
+
+bool Page::isLogBlockFull(size_t index, const Item& item) const
+{
+    LogRecord record;
+    return item.span < 2 || readLogRecordAt(index, item.span - 2, record) != ESP_ERR_NVS_NOT_FOUND;
+}
 
-    if (index + span > mNextFreeEntry) {
-        mNextFreeEntry = index + span;
+esp_err_t Page::writeLogRecordAt(size_t index, size_t slot, const LogRecord& record)
+{
+    auto rc = mPartition->write(getEntryAddress(index + 1 + slot), &record, sizeof(record));
+    if (rc != ESP_OK) {
+        mState = PageState::INVALID;
     }
+    return rc;
+}
 
+esp_err_t Page::readLogRecordAt(size_t index, size_t slot, LogRecord& record) const
+{
+    /* Erased entries are recognized before decryption */
+    const uint32_t address = getEntryAddress(index + 1 + slot);
+    auto rc = mPartition->read_raw(address, &record, sizeof(record));
+    if (rc != ESP_OK) {
+        return rc;
+    }
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(&record);
+    if (std::all_of(words, words + sizeof(record) / sizeof(uint32_t), [](uint32_t word) { return word == UINT32_MAX; })) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (mPartition->is_encrypted()) {
+        return mPartition->read(address, &record, sizeof(record));
+    }
     return ESP_OK;
 }
 
@@ -463,7 +999,18 @@ void Page::updateFirstUsedEntry(size_t index, size_t span)
     }
 }
 
-esp_err_t Page::copyItems(Page& other)
+esp_err_t Page::reserveEntries(size_t count)
+{
+    auto err = alterEntryRangeState(mNextFreeEntry, mNextFreeEntry + count, EntryState::WRITTEN);
+    if (err != ESP_OK) {
+        return err;
+    }
+    addUsedEntries(count);
+    mNextFreeEntry += count;
+    return ESP_OK;
+}
+
+esp_err_t Page::copyItems(Page& other, const TLogBlockTable* droppedLogBlocks)
 {
     if (mFirstUsedEntry == INVALID_ENTRY) {
         return ESP_ERR_NVS_NOT_FOUND;
@@ -491,6 +1038,26 @@ esp_err_t Page::copyItems(Page& other)
             return err;
         }
 
+        const bool isValid = entry.crc32 == entry.calculateCrc32();
+        if (isValid) {
+            // the items are counted by the page they are copied to
+            countItem(entry, false);
+        }
+
+        /* Full log blocks hold the oldest records of their log, which are dropped instead of copied once a newer
+         * full block is kept */
+        const bool isLog = entry.datatype == ItemType::LOG && isValid;
+        if (isLog && droppedLogBlocks && droppedLogBlocks->get(readEntryIndex)) {
+            readEntryIndex += entry.span;
+            continue;
+        }
+
+        /* Items of erased namespaces are only kept until the garbage collection gets to them */
+        if (mErasedNamespaces && mErasedNamespaces->get(entry.nsIndex) && isValid) {
+            readEntryIndex += entry.span;
+            continue;
+        }
+
         err = other.mHashList.insert(entry, other.mNextFreeEntry);
         if (err != ESP_OK) {
             return err;
@@ -500,12 +1067,25 @@ esp_err_t Page::copyItems(Page& other)
         if (err != ESP_OK) {
             return err;
         }
+        if (isValid) {
+            other.countItem(entry, true);
+        }
         size_t span = entry.span;
         size_t end = readEntryIndex + span;
 
         assert(end <= ENTRY_COUNT);
 
         for (size_t i = readEntryIndex + 1; i < end; ++i) {
+            /* Erased records are left erased, which encrypted partitions wouldn't do when copying them. Records
+             * are written in order, so the remaining ones are erased as well. */
+            LogRecord record;
+            if (isLog && readLogRecordAt(readEntryIndex, i - readEntryIndex - 1, record) == ESP_ERR_NVS_NOT_FOUND) {
+                err = other.reserveEntries(end - i);
+                if (err != ESP_OK) {
+                    return err;
+                }
+                break;
+            }
             readEntry(i, entry);
             err = other.writeEntry(entry);
             if (err != ESP_OK) {
@@ -518,6 +1098,62 @@ esp_err_t Page::copyItems(Page& other)
     return ESP_OK;
 }
 
+esp_err_t Page::startCounting(EntryCounts* counts)
+{
+    mEntryCounts = counts;
+    if (mState == PageState::ACTIVE || mState == PageState::FULL) {
+        mEntryCounts->used += mUsedEntryCount;
+    }
+    return countItems(true);
+}
+
+/* Reads the headers without erasing corrupted items like findItem does */
+esp_err_t Page::countItems(bool add)
+{
+    if (mEntryCounts == nullptr || (mState != PageState::ACTIVE && mState != PageState::FULL)) {
+        return ESP_OK;
+    }
+
+    const size_t end = std::min(mNextFreeEntry, static_cast<size_t>(ENTRY_COUNT));
+    for (size_t i = mFirstUsedEntry; i < end; ++i) {
+        if (mEntryTable.get(i) != EntryState::WRITTEN) {
+            continue;
+        }
+        Item item;
+        auto err = readEntry(i, item);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (item.crc32 != item.calculateCrc32()) {
+            continue;
+        }
+        countItem(item, add);
+        if (hasDataEntries(item.datatype)) {
+            i += item.span - 1;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t Page::countErasedNamespaceEntries()
+{
+    mErasedNamespaceEntryCount = 0;
+    if (mErasedNamespaces == nullptr) {
+        return ESP_OK;
+    }
+
+    size_t itemIndex = 0;
+    Item item;
+    esp_err_t err;
+    while ((err = findItem(NS_ANY, ItemType::ANY, nullptr, itemIndex, item)) == ESP_OK) {
+        if (mErasedNamespaces->get(item.nsIndex)) {
+            mErasedNamespaceEntryCount += item.span;
+        }
+        itemIndex += item.span;
+    }
+    return (err == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : err;
+}
+
 esp_err_t Page::mLoadEntryTable()
 {
     // for states where we actually care about data in the page, read entry state table
@@ -627,7 +1263,7 @@ esp_err_t Page::mLoadEntryTable()
             // search for potential duplicate item
             size_t duplicateIndex = mHashList.find(0, item);
 
-            if (isVariableLengthType(item.datatype)) {
+            if (hasDataEntries(item.datatype)) {
                 span = item.span;
                 bool needErase = false;
                 for (size_t j = i; j < i + span; ++j) {
@@ -646,14 +1282,15 @@ esp_err_t Page::mLoadEntryTable()
             /* Note that logic for duplicate detections works fine even
              * when old-format blob is present along with new-format blob-index
              * for same key on active page. Since datatype is not used in hash calculation,
-             * old-format blob will be removed.*/
-            if (duplicateIndex < i) {
+             * old-format blob will be removed.
+             * The blocks of a log all have the same key, they aren't duplicates of each other. */
+            if (duplicateIndex < i && item.datatype != ItemType::LOG) {
                 eraseEntryAndSpan(duplicateIndex);
             }
         }
 
         // check that last item is not duplicate
-        if (lastItemIndex != INVALID_ENTRY) {
+        if (lastItemIndex != INVALID_ENTRY && item.datatype != ItemType::LOG) {
             size_t findItemIndex = 0;
             Item dupItem;
             if (findItem(item.nsIndex, item.datatype, item.key, findItemIndex, dupItem) == ESP_OK) {
@@ -700,7 +1337,7 @@ esp_err_t Page::mLoadEntryTable()
 
             size_t span = item.span;
 
-            if (isVariableLengthType(item.datatype)) {
+            if (hasDataEntries(item.datatype)) {
                 for (size_t j = i + 1; j < i + span; ++j) {
                     if (mEntryTable.get(j) != EntryState::WRITTEN) {
                         eraseEntryAndSpan(i);
@@ -794,6 +1431,11 @@ esp_err_t Page::alterPageState(PageState state)
 
 esp_err_t Page::readEntry(size_t index, Item& dst) const
 {
+    const uint8_t* mapped = getMappedEntries(index, 1);
+    if (mapped != nullptr) {
+        memcpy(&dst, mapped, sizeof(dst));
+        return ESP_OK;
+    }
     auto rc = mPartition->read(getEntryAddress(index), &dst, sizeof(dst));
     if (rc != ESP_OK) {
         return rc;
@@ -803,7 +1445,7 @@ esp_err_t Page::readEntry(size_t index, Item& dst) const
 
 esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, size_t &itemIndex, Item& item, uint8_t chunkIdx, VerOffset chunkStart)
 {
-    if (mState == PageState::CORRUPT || mState == PageState::INVALID || mState == PageState::UNINITIALIZED) {
+    if (mState == PageState::CORRUPT || mState == PageState::RETIRED || mState == PageState::INVALID || mState == PageState::UNINITIALIZED) {
         return ESP_ERR_NVS_NOT_FOUND;
     }
 
@@ -840,12 +1482,18 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
 
         auto rc = readEntry(i, item);
         if (rc != ESP_OK) {
-            mState = PageState::INVALID;
+            if (!isReadOnly()) {
+                mState = PageState::INVALID;
+            }
             return rc;
         }
 
         auto crc32 = item.calculateCrc32();
         if (item.crc32 != crc32) {
+            /* Readers skip the corrupted item, it is erased by the next writer coming across it */
+            if (isReadOnly()) {
+                continue;
+            }
             rc = eraseEntryAndSpan(i);
             if (rc != ESP_OK) {
                 mState = PageState::INVALID;
@@ -854,7 +1502,7 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
             continue;
         }
 
-        if (isVariableLengthType(item.datatype)) {
+        if (hasDataEntries(item.datatype)) {
             next = i + item.span;
         }
 
@@ -867,10 +1515,14 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
         }
         /* For blob data, chunkIndex should match*/
         if (chunkIdx != CHUNK_ANY
-                && datatype == ItemType::BLOB_DATA
+                && (datatype == ItemType::BLOB_DATA || datatype == ItemType::NS_TOMBSTONE)
                 && item.chunkIndex != chunkIdx) {
             continue;
         }
+        /* Tombstones have the name of the namespace they were written for, see Storage::eraseNamespace */
+        if (key != nullptr && item.datatype == ItemType::NS_TOMBSTONE && datatype != ItemType::NS_TOMBSTONE) {
+            continue;
+        }
         /* Blob-index will match the <ns,key> with blob data.
          * Skip data chunks when searching for blob index*/
         if (datatype == ItemType::BLOB_IDX
@@ -883,11 +1535,20 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
                 && item.blobIndex.chunkStart != chunkStart) {
             continue;
         }
+        /* A blob is stored either with an index or as a reference to a shared blob. While it is
+         * converted from one to the other both exist, so they must not hide each other */
+        if (datatype == ItemType::BLOB_IDX && item.datatype == ItemType::BLOB_REF) {
+            continue;
+        }
+        if (datatype == ItemType::BLOB_REF
+                && (item.datatype == ItemType::BLOB_IDX || item.datatype == ItemType::BLOB_DATA || item.datatype == ItemType::BLOB)) {
+            continue;
+        }
 
 
         if (datatype != ItemType::ANY && item.datatype != datatype) {
-            if (key == nullptr && nsIndex == NS_ANY && chunkIdx == CHUNK_ANY) {
-                continue; // continue for bruteforce search on blob indices.
+            if (key == nullptr && ((nsIndex == NS_ANY && chunkIdx == CHUNK_ANY) || nsIndex == NS_INDEX)) {
+                continue; // continue for bruteforce search on blob indices, namespaces and tombstones.
             }
             itemIndex = i;
             return ESP_ERR_NVS_TYPE_MISMATCH;
@@ -901,9 +1562,27 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
     return ESP_ERR_NVS_NOT_FOUND;
 }
 
+esp_err_t Page::findItemAt(size_t index, uint32_t itemGeneration, uint8_t nsIndex, ItemType datatype, const char* key, Item& item) const
+{
+    if (itemGeneration != mItemGeneration || (mState != PageState::ACTIVE && mState != PageState::FULL)
+            || index >= ENTRY_COUNT || mEntryTable.get(index) != EntryState::WRITTEN) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    auto rc = readEntry(index, item);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+    if (item.calculateCrc32() != item.crc32 || item.nsIndex != nsIndex || item.datatype != datatype
+            || strncmp(key, item.key, Item::MAX_KEY_LENGTH) != 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
 esp_err_t Page::getSeqNumber(uint32_t& seqNumber) const
 {
-    if (mState != PageState::UNINITIALIZED && mState != PageState::INVALID && mState != PageState::CORRUPT) {
+    if (mState != PageState::UNINITIALIZED && mState != PageState::INVALID && mState != PageState::CORRUPT
+            && mState != PageState::RETIRED) {
         seqNumber = mSeqNumber;
         return ESP_OK;
     }
@@ -931,28 +1610,103 @@ esp_err_t Page::setVersion(uint8_t ver)
 
 esp_err_t Page::erase()
 {
-    auto rc = mPartition->erase_range(mBaseAddress, SPI_FLASH_SEC_SIZE);
+    // the items of a page which is freed are no longer counted once they have been copied
+    auto rc = countItems(false);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+    if (mState == PageState::ACTIVE || mState == PageState::FULL || mState == PageState::FREEING) {
+        removeUsedEntries(mUsedEntryCount);
+    }
+    rc = mPartition->erase_range(mBaseAddress, SPI_FLASH_SEC_SIZE);
     if (rc != ESP_OK) {
         mState = PageState::INVALID;
         return rc;
     }
     mUsedEntryCount = 0;
     mErasedEntryCount = 0;
+    mErasedNamespaceEntryCount = 0;
     mFirstUsedEntry = INVALID_ENTRY;
     mNextFreeEntry = INVALID_ENTRY;
     mState = PageState::UNINITIALIZED;
     mHashList.clear();
+    ++mGeneration;
+    ++mItemGeneration;
     return ESP_OK;
 }
 
+void Page::takeSnapshot(Snapshot& snapshot)
+{
+    snapshot.page = this;
+    snapshot.generation = mGeneration;
+    snapshot.entries = mEntryTable;
+    ++mPins;
+}
+
+void Page::releaseSnapshot(Snapshot& snapshot)
+{
+    --snapshot.page->mPins;
+}
+
+esp_err_t Page::findItem(const Snapshot& snapshot, uint8_t nsIndex, ItemType datatype, size_t &itemIndex, Item& item) const
+{
+    if (snapshot.generation != mGeneration) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    for (size_t i = itemIndex; i < ENTRY_COUNT; ++i) {
+        if (snapshot.entries.get(i) != EntryState::WRITTEN) {
+            continue;
+        }
+        auto rc = readEntry(i, item);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        if (item.calculateCrc32() != item.crc32 || item.span == 0 || item.span > ENTRY_COUNT - i) {
+            continue;
+        }
+        if ((nsIndex != NS_ANY && item.nsIndex != nsIndex)
+                || (datatype != ItemType::ANY && item.datatype != datatype)) {
+            i += item.span - 1;
+            continue;
+        }
+        itemIndex = i;
+        return ESP_OK;
+    }
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t Page::readItemAt(const Snapshot& snapshot, size_t index, const Item& item, void* data, size_t dataSize) const
+{
+    if (snapshot.generation != mGeneration) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    return readItemValue(index, item, data, dataSize);
+}
+
 esp_err_t Page::markFreeing()
 {
     if (mState != PageState::FULL && mState != PageState::ACTIVE) {
         return ESP_ERR_NVS_INVALID_STATE;
     }
+    ++mItemGeneration;
     return alterPageState(PageState::FREEING);
 }
 
+esp_err_t Page::markRetired()
+{
+    if (mState != PageState::FREEING) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    auto err = alterPageState(PageState::RETIRED);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // the items have been copied, the entries of the page are free once it is erased
+    removeUsedEntries(mUsedEntryCount);
+    return ESP_OK;
+}
+
 esp_err_t Page::markFull()
 {
     if (mState != PageState::ACTIVE) {
@@ -972,12 +1726,25 @@ size_t Page::getVarDataTailroom() const
     return ((mNextFreeEntry < (ENTRY_COUNT-1)) ? ((ENTRY_COUNT - mNextFreeEntry - 1) * ENTRY_SIZE): 0);
 }
 
+size_t Page::getFreeEntryCount() const
+{
+    if (mState == PageState::UNINITIALIZED) {
+        return ENTRY_COUNT;
+    } else if (mState != PageState::ACTIVE || mNextFreeEntry >= ENTRY_COUNT) {
+        return 0;
+    }
+    return ENTRY_COUNT - mNextFreeEntry;
+}
+
 const char* Page::pageStateToName(PageState ps)
 {
     switch (ps) {
         case PageState::CORRUPT:
             return "CORRUPT";
 
+        case PageState::RETIRED:
+            return "RETIRED";
+
         case PageState::ACTIVE:
             return "ACTIVE";
 
@@ -1028,33 +1795,4 @@ void Page::debugDump() const
     }
 }
 
-esp_err_t Page::calcEntries(nvs_stats_t &nvsStats)
-{
-    assert(mState != PageState::FREEING);
-
-    nvsStats.total_entries += ENTRY_COUNT;
-
-    switch (mState) {
-        case PageState::UNINITIALIZED:
-        case PageState::CORRUPT:
-            nvsStats.free_entries += ENTRY_COUNT;
-            break;
-
-        case PageState::FULL:
-        case PageState::ACTIVE:
-            nvsStats.used_entries += mUsedEntryCount;
-            nvsStats.free_entries += ENTRY_COUNT - mUsedEntryCount; // it's equivalent free + erase entries.
-            break;
-
-        case PageState::INVALID:
-            return ESP_ERR_INVALID_STATE;
-            break;
-
-        default:
-            assert(false && "Unhandled state");
-            break;
-    }
-    return ESP_OK;
-}
-
 } // namespace nvs
@@ -20,15 +20,24 @@
 #include <type_traits>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
 #include "esp_spi_flash.h"
 #include "compressed_enum_table.hpp"
 #include "intrusive_list.h"
 #include "nvs_item_hash_list.hpp"
+#include "nvs_ordered_index.hpp"
 #include "partition.hpp"
 
+#ifdef CONFIG_NVS_COALESCE_WRITES
+#define NVS_COALESCE_WRITES 1
+#else
+#define NVS_COALESCE_WRITES 0
+#endif
+
 namespace nvs
 {
 
+class RWLock;
 
 class Page : public intrusive_list_node<Page>
 {
@@ -37,6 +46,7 @@ public:
     static const uint32_t PSB_FULL = 0x2;
     static const uint32_t PSB_FREEING = 0x4;
     static const uint32_t PSB_CORRUPT = 0x8;
+    static const uint32_t PSB_RETIRED = 0x10;
 
     static const uint32_t ESB_WRITTEN = 0x1;
     static const uint32_t ESB_ERASED = 0x2;
@@ -51,11 +61,16 @@ public:
 
     static const uint8_t NS_INDEX = 0;
     static const uint8_t NS_ANY = 255;
+    static const uint8_t NS_SHARED = 254; // Blobs referenced by several keys, see Storage::writeSharedBlob
 
     static const uint8_t CHUNK_ANY = Item::CHUNK_ANY;
 
+    static const size_t COALESCE_STACK_ENTRIES = 8; // items up to this size are assembled on the stack
+
     static const uint8_t NVS_VERSION = 0xfe; // Decrement to upgrade
 
+    static const uint16_t UNCOMPRESSED = 0xffff; // Item::varLength::compressedSize of data stored as is
+
     enum class PageState : uint32_t {
         // All bits set, default state after flash erase. Page has not been initialized yet.
         UNINITIALIZED = 0xffffffff,
@@ -74,6 +89,11 @@ public:
         // It will be erased once we run out out free pages.
         CORRUPT       = FREEING & ~PSB_CORRUPT,
 
+        // Items were copied by the garbage collection while a snapshot was still reading the page.
+        // It is erased once it is no longer read, or before it is used again after a restart.
+        // Older versions, which don't know this state, treat the page as corrupt.
+        RETIRED       = CORRUPT & ~PSB_RETIRED,
+
         // Page object wasn't loaded from flash memory
         INVALID       = 0
     };
@@ -93,18 +113,110 @@ public:
 
     esp_err_t setVersion(uint8_t version);
 
-    esp_err_t writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx = CHUNK_ANY);
+    esp_err_t writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx = CHUNK_ANY, bool tryCompress = false);
 
     esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize, uint8_t chunkIdx = CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
 
+    /**
+     * Reads the data of item, which findItem has found at index.
+     */
+    esp_err_t readItemAt(size_t index, const Item& item, void* data, size_t dataSize);
+
+    esp_err_t readItemRange(uint8_t nsIndex, ItemType datatype, const char* key, size_t offset, void* data, size_t dataSize, uint8_t chunkIdx = CHUNK_ANY);
+
     esp_err_t cmpItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx = CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
 
+    /**
+     * Compares the data of item, which findItem has found at index.
+     */
+    esp_err_t cmpItemAt(size_t index, const Item& item, const void* data, size_t dataSize);
+
+    /**
+     * Number of entries an item takes if its data isn't compressed.
+     */
+    static size_t getEntryCount(ItemType datatype, size_t dataSize);
+
+    /**
+     * Lays out an item the way writeItem writes it, the header followed by the data entries. dst must have room
+     * for getEntryCount entries. Returns the number of entries used, which is smaller if the data is compressed.
+     */
+    static size_t encodeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, bool tryCompress, Item* dst, uint8_t chunkIdx = CHUNK_ANY);
+
+    /**
+     * Writes items laid out by encodeItem with a single write, then marks them as written with a single, though not
+     * atomic, write of the words of the entry state table they are in. Returns ESP_ERR_NVS_PAGE_FULL without writing anything if
+     * they don't fit.
+     */
+    esp_err_t writeEntries(const Item* entries, size_t count);
+
+    /**
+     * Writes a variable length item whose header has been filled like encodeItem fills it: the header, the full
+     * data entries straight from payload and the last, padded one, then marks them as written like the other
+     * overload. Nothing is assembled in RAM, whatever the size of the item. The header is inserted into the hash
+     * list by the caller, which also erases it from there if this fails.
+     */
+    esp_err_t writeEntries(const Item& header, const uint8_t* payload, size_t payloadSize);
+
+    /**
+     * Erases the items which findItem has found at indices, writing each word of the entry state table once.
+     */
+    esp_err_t eraseItemsAt(const size_t* indices, size_t count);
+
+    /**
+     * Writes item, followed by the item.span - 1 data entries which are written in place later, by counter
+     * increments or log records. The data entries are left erased, only their state is changed. The index
+     * of the item is stored in index.
+     */
+    esp_err_t writeReservedItem(Item& item, size_t& index);
+
+    /**
+     * Reads the value of the counter item which findItem has found at index, and the number of bits of its data
+     * entries which are cleared already.
+     */
+    esp_err_t readCounterAt(size_t index, const Item& item, uint32_t& value, size_t& clearedBits) const;
+
+    /**
+     * Adds count to the counter at index by clearing the bits following its clearedBits cleared ones. Only the
+     * words holding these bits are written. The caller checks that the data entries have enough bits left.
+     */
+    esp_err_t incrementCounterAt(size_t index, size_t clearedBits, size_t count);
+
+    /**
+     * Finds the first erased data entry of the log block which findItem has found at index. Records are written
+     * in order, so the entries are searched by bisection. item.span - 1 is stored in slot if the block is full.
+     */
+    esp_err_t findFreeLogSlot(size_t index, const Item& item, size_t& slot) const;
+
+    bool isLogBlockFull(size_t index, const Item& item) const;
+
+    esp_err_t writeLogRecordAt(size_t index, size_t slot, const LogRecord& record);
+
+    /**
+     * Reads the record in data entry slot of the log block at index. Returns ESP_ERR_NVS_NOT_FOUND if the data
+     * entry is still erased. The checksum of the record isn't checked.
+     */
+    esp_err_t readLogRecordAt(size_t index, size_t slot, LogRecord& record) const;
+
     esp_err_t eraseItem(uint8_t nsIndex, ItemType datatype, const char* key, uint8_t chunkIdx = CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
 
     esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, uint8_t chunkIdx = CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
 
     esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, size_t &itemIndex, Item& item, uint8_t chunkIdx = CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
 
+    /**
+     * Finds an item again at the index where findItem has found it, without searching the page. Returns
+     * ESP_ERR_NVS_NOT_FOUND if the item generation of the page has changed since then, or the item isn't there.
+     */
+    esp_err_t findItemAt(size_t index, uint32_t itemGeneration, uint8_t nsIndex, ItemType datatype, const char* key, Item& item) const;
+
+    /**
+     * Changes whenever items may have been removed from the page, i.e. when items are erased or the page is freed.
+     */
+    uint32_t getItemGeneration() const
+    {
+        return mItemGeneration;
+    }
+
     template<typename T>
     esp_err_t writeItem(uint8_t nsIndex, const char* key, const T& value)
     {
@@ -140,17 +252,105 @@ public:
     }
     size_t getVarDataTailroom() const ;
 
+    size_t getFreeEntryCount() const;
+
     esp_err_t markFull();
 
     esp_err_t markFreeing();
 
-    esp_err_t copyItems(Page& other);
+    /**
+     * Marks a page whose items have been copied by the garbage collection as retired instead of erasing it,
+     * so that snapshots can still read it. After a restart, it is erased before it is used again.
+     */
+    esp_err_t markRetired();
+
+    typedef CompressedEnumTable<bool, 1, ENTRY_COUNT> TLogBlockTable;
+
+    /**
+     * Copies the items to other. The full log blocks set in droppedLogBlocks, by the index of their header,
+     * are dropped instead, see PageManager::findDroppedLogBlocks.
+     */
+    esp_err_t copyItems(Page& other, const TLogBlockTable* droppedLogBlocks = nullptr);
+
+    typedef CompressedEnumTable<bool, 1, 256> TNamespaceTable;
+
+    /**
+     * Namespaces which have been erased by a tombstone, see PageManager::markNamespaceErased.
+     * Their items are dropped by copyItems instead of copied.
+     */
+    void setErasedNamespaces(const TNamespaceTable* namespaces)
+    {
+        mErasedNamespaces = namespaces;
+    }
+
+    /**
+     * Lock of the Storage the page belongs to. While it is held shared, the page is only read: corrupted
+     * items found by readers are left to the next writer instead of being erased.
+     */
+    void setLock(const RWLock* lock)
+    {
+        mLock = lock;
+    }
+
+    bool isReadOnly() const;
+
+    /**
+     * Entries of the page taken by items of erased namespaces, which the garbage collection gets back.
+     * Counted again by countErasedNamespaceEntries whenever the erased namespaces change.
+     */
+    size_t getErasedNamespaceEntryCount() const
+    {
+        return mErasedNamespaceEntryCount;
+    }
+
+    esp_err_t countErasedNamespaceEntries();
+
+    /**
+     * Entries taken by the items of each namespace, and entries in use on all pages, kept up to date by the
+     * pages of a PageManager as items are written, erased and copied. Items with a corrupted header are only
+     * counted as used. The items are also counted by keys, if it isn't null.
+     */
+    struct EntryCounts
+    {
+        uint32_t namespaces[256];
+        size_t used;
+        OrderedIndex* keys;
+    };
+
+    /**
+     * Adds the items of the page to counts, which is kept up to date from then on.
+     */
+    esp_err_t startCounting(EntryCounts* counts);
 
     esp_err_t erase();
 
     void debugDump() const;
 
-    esp_err_t calcEntries(nvs_stats_t &nvsStats);
+    struct Snapshot;
+
+    /**
+     * Records the current entry states and pins the page, see Snapshot.
+     */
+    void takeSnapshot(Snapshot& snapshot);
+
+    static void releaseSnapshot(Snapshot& snapshot);
+
+    /**
+     * Like findItem with a null key, but finds the items which were written when the snapshot was taken.
+     * Returns ESP_ERR_NVS_INVALID_STATE if the page has been erased since.
+     */
+    esp_err_t findItem(const Snapshot& snapshot, uint8_t nsIndex, ItemType datatype, size_t &itemIndex, Item& item) const;
+
+    /**
+     * Like readItemAt, but reads an item which findItem has found in the snapshot.
+     * Returns ESP_ERR_NVS_INVALID_STATE if the page has been erased since.
+     */
+    esp_err_t readItemAt(const Snapshot& snapshot, size_t index, const Item& item, void* data, size_t dataSize) const;
+
+    bool isPinned() const
+    {
+        return mPins.load() != 0;
+    }
 
 protected:
 
@@ -190,14 +390,72 @@ protected:
 
     esp_err_t readEntry(size_t index, Item& dst) const;
 
+    /**
+     * The count entries from index as they are stored, if the partition maps them and doesn't encrypt them,
+     * otherwise nullptr and the entries have to be read.
+     */
+    const uint8_t* getMappedEntries(size_t index, size_t count) const
+    {
+        if (count == 0 || mPartition->is_encrypted()) {
+            return nullptr;
+        }
+        return static_cast<const uint8_t*>(mPartition->get_mapped_ptr(getEntryAddress(index), count * ENTRY_SIZE));
+    }
+
+    esp_err_t readItemData(size_t index, const Item& item, uint8_t* dst) const;
+
+    esp_err_t readItemValue(size_t index, const Item& item, void* data, size_t dataSize) const;
+
     esp_err_t writeEntry(const Item& item);
 
     esp_err_t writeEntryData(const uint8_t* data, size_t size);
 
+    esp_err_t writeEntryDataAt(size_t index, const uint8_t* data, size_t size);
+
+    esp_err_t markEntriesWritten(size_t count);
+
+    /**
+     * Marks the next count entries as written without writing them, so that they stay erased on flash.
+     */
+    esp_err_t reserveEntries(size_t count);
+
     esp_err_t eraseEntryAndSpan(size_t index);
 
     void updateFirstUsedEntry(size_t index, size_t span);
 
+    void countItem(const Item& item, bool add)
+    {
+        if (mEntryCounts == nullptr) {
+            return;
+        }
+        if (add) {
+            mEntryCounts->namespaces[item.nsIndex] += item.span;
+        } else {
+            mEntryCounts->namespaces[item.nsIndex] -= item.span;
+        }
+        if (mEntryCounts->keys != nullptr) {
+            mEntryCounts->keys->countItem(item, add);
+        }
+    }
+
+    void addUsedEntries(size_t count)
+    {
+        mUsedEntryCount += count;
+        if (mEntryCounts != nullptr) {
+            mEntryCounts->used += count;
+        }
+    }
+
+    void removeUsedEntries(size_t count)
+    {
+        mUsedEntryCount -= count;
+        if (mEntryCounts != nullptr) {
+            mEntryCounts->used -= count;
+        }
+    }
+
+    esp_err_t countItems(bool add);
+
     static constexpr size_t getAlignmentForType(ItemType type)
     {
         return static_cast<uint8_t>(type) & 0x0f;
@@ -223,11 +481,21 @@ protected:
     size_t mFirstUsedEntry = INVALID_ENTRY;
     uint16_t mUsedEntryCount = 0;
     uint16_t mErasedEntryCount = 0;
+    uint16_t mErasedNamespaceEntryCount = 0;
+    uint32_t mGeneration = 0;            // incremented whenever the page is erased
+    uint32_t mItemGeneration = 0;        // incremented whenever items are erased or the page is freed
+    std::atomic<uint32_t> mPins;         // number of snapshots containing the page
 
     HashList mHashList;
 
     Partition *mPartition;
 
+    const TNamespaceTable* mErasedNamespaces = nullptr;
+
+    const RWLock* mLock = nullptr;
+
+    EntryCounts* mEntryCounts = nullptr;
+
     static const uint32_t HEADER_OFFSET = 0;
     static const uint32_t ENTRY_TABLE_OFFSET = HEADER_OFFSET + 32;
     static const uint32_t ENTRY_DATA_OFFSET = ENTRY_TABLE_OFFSET + 32;
@@ -235,9 +503,22 @@ protected:
     static_assert(sizeof(Header) == 32, "header size must be 32 bytes");
     static_assert(ENTRY_TABLE_OFFSET % 32 == 0, "entry table offset should be aligned");
     static_assert(ENTRY_DATA_OFFSET % 32 == 0, "entry data offset should be aligned");
+    static_assert(sizeof(LogRecord) == ENTRY_SIZE, "log record must fill an entry");
 
 }; // class Page
 
+/**
+ * Entry states of a page at the time a snapshot was taken. Erasing an item only changes its state,
+ * so the items which were written then stay readable as long as the page itself isn't erased.
+ * The garbage collection only erases a pinned page when it runs short of free pages, see PageManager::requestNewPage.
+ */
+struct Page::Snapshot
+{
+    Page* page;
+    uint32_t generation;
+    TEntryTable entries;
+};
+
 } // namespace nvs
 
 
@@ -15,7 +15,7 @@
 
 namespace nvs
 {
-esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t sectorCount)
+esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t sectorCount, const RWLock* lock)
 {
     if (partition == nullptr) {
         return ESP_ERR_INVALID_ARG;
@@ -25,6 +25,10 @@ esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t
     mPageCount = sectorCount;
     mPageList.clear();
     mFreePageList.clear();
+    mRetiredPageList.clear();
+    ++mLoadCount;
+    clearSnapshotPool();
+    std::fill_n(mErasedNamespaces.data(), mErasedNamespaces.byteSize() / 4, 0);
     mPages.reset(new (nothrow) Page[sectorCount]);
 
     if (!mPages) return ESP_ERR_NO_MEM;
@@ -34,6 +38,8 @@ esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t
         if (err != ESP_OK) {
             return err;
         }
+        mPages[i].setErasedNamespaces(&mErasedNamespaces);
+        mPages[i].setLock(lock);
         uint32_t seqNumber;
         if (mPages[i].getSeqNumber(seqNumber) != ESP_OK) {
             mFreePageList.push_back(&mPages[i]);
@@ -52,6 +58,10 @@ esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t
 
     if (mPageList.empty()) {
         mSeqNumber = 0;
+        auto err = startCounting();
+        if (err != ESP_OK) {
+            return err;
+        }
         return activatePage();
     } else {
         uint32_t lastSeqNo;
@@ -59,21 +69,22 @@ esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t
         mSeqNumber = lastSeqNo + 1;
     }
 
-    // if power went out after a new item for the given key was written,
-    // but before the old one was erased, we end up with a duplicate item
+    // if power went out after new items were written, but before the old ones were erased,
+    // we end up with duplicate items. Old items are always erased before another page becomes
+    // active, so only the items of the last page may have duplicates.
     Page& lastPage = back();
-    size_t lastItemIndex = SIZE_MAX;
+    auto last = PageManager::TPageListIterator(&lastPage);
     Item item;
     size_t itemIndex = 0;
     while (lastPage.findItem(Page::NS_ANY, ItemType::ANY, nullptr, itemIndex, item) == ESP_OK) {
         itemIndex += item.span;
-        lastItemIndex = itemIndex;
-    }
 
-    if (lastItemIndex != SIZE_MAX) {
-        auto last = PageManager::TPageListIterator(&lastPage);
-        TPageListIterator it;
+        // new log blocks are written without erasing the old ones
+        if (item.datatype == ItemType::LOG) {
+            continue;
+        }
 
+        TPageListIterator it;
         for (it = begin(); it != last; ++it) {
 
             if ((it->state() != Page::PageState::FREEING) &&
@@ -112,7 +123,12 @@ esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t
             }
             newPage = &mPageList.back();
 
-            err = it->copyItems(*newPage);
+            Page::TLogBlockTable droppedLogBlocks;
+            err = findDroppedLogBlocks(*it, droppedLogBlocks);
+            if (err != ESP_OK) {
+                return err;
+            }
+            err = it->copyItems(*newPage, &droppedLogBlocks);
             if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
                 return err;
             }
@@ -134,11 +150,21 @@ esp_err_t PageManager::load(Partition *partition, uint32_t baseSector, uint32_t
         return ESP_ERR_NVS_NO_FREE_PAGES;
     }
 
-    return ESP_OK;
+    return startCounting();
 }
 
 esp_err_t PageManager::requestNewPage()
 {
+    // pages still pinned by a snapshot when they were freed are only erased now, when needed. A pinned
+    // page is erased rather than letting the garbage collection retire another one, so that an iterator
+    // which is never released holds one sector at most.
+    if (mFreePageList.size() < 2 && !mRetiredPageList.empty()) {
+        esp_err_t err = reclaimRetiredPage();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
     if (mFreePageList.empty()) {
         return ESP_ERR_NVS_INVALID_STATE;
     }
@@ -148,12 +174,12 @@ esp_err_t PageManager::requestNewPage()
         return activatePage();
     }
 
-    // find the page with the higest number of erased items
+    // find the page with the higest number of erased items, counting the items of erased namespaces
     TPageListIterator maxUnusedItemsPageIt;
     size_t maxUnusedItems = 0;
     for (auto it = begin(); it != end(); ++it) {
 
-        auto unused =  Page::ENTRY_COUNT - it->getUsedEntryCount();
+        auto unused =  Page::ENTRY_COUNT - it->getUsedEntryCount() + it->getErasedNamespaceEntryCount();
         if (unused > maxUnusedItems) {
             maxUnusedItemsPageIt = it;
             maxUnusedItems = unused;
@@ -180,33 +206,153 @@ esp_err_t PageManager::requestNewPage()
     if (err != ESP_OK) {
         return err;
     }
-    err = erasedPage->copyItems(*newPage);
+    Page::TLogBlockTable droppedLogBlocks;
+    err = findDroppedLogBlocks(*erasedPage, droppedLogBlocks);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = erasedPage->copyItems(*newPage, &droppedLogBlocks);
     if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
         return err;
     }
 
+#ifndef NDEBUG
+    // dropped log blocks and items of erased namespaces aren't copied
+    assert(usedEntries >= newPage->getUsedEntryCount());
+#endif
+
+    // readers of a snapshot may still read the items which were copied, so the page isn't erased yet
+    if (erasedPage->isPinned()) {
+        err = erasedPage->markRetired();
+        if (err != ESP_OK) {
+            return err;
+        }
+        mPageList.erase(maxUnusedItemsPageIt);
+        mRetiredPageList.push_back(erasedPage);
+        return ESP_OK;
+    }
+
     err = erasedPage->erase();
     if (err != ESP_OK) {
         return err;
     }
 
-#ifndef NDEBUG
-    assert(usedEntries == newPage->getUsedEntryCount());
-#endif
-
     mPageList.erase(maxUnusedItemsPageIt);
     mFreePageList.push_back(erasedPage);
 
     return ESP_OK;
 }
 
+esp_err_t PageManager::findDroppedLogBlocks(Page& page, Page::TLogBlockTable& dropped)
+{
+    std::fill_n(dropped.data(), dropped.byteSize() / 4, 0);
+    size_t blockIndex = 0;
+    Item block;
+    esp_err_t err;
+    while ((err = page.findItem(Page::NS_ANY, ItemType::LOG, nullptr, blockIndex, block)) == ESP_OK) {
+        if (page.isLogBlockFull(blockIndex, block)) {
+            const uint32_t nextSeq = block.logBlock.firstSeq + (block.span - 1);
+            for (auto it = begin(); it != end() && !dropped.get(blockIndex); ++it) {
+                size_t itemIndex = 0;
+                Item item;
+                while ((err = it->findItem(block.nsIndex, ItemType::LOG, block.key, itemIndex, item)) == ESP_OK) {
+                    if (item.logBlock.firstSeq == nextSeq && it->isLogBlockFull(itemIndex, item)) {
+                        dropped.set(blockIndex, true);
+                        break;
+                    }
+                    itemIndex += item.span;
+                }
+                if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+                    return err;
+                }
+            }
+        }
+        blockIndex += block.span;
+    }
+    return (err == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : err;
+}
+
+esp_err_t PageManager::reclaimRetiredPage()
+{
+    // a page which is no longer pinned is erased first. Otherwise the snapshots pinning the oldest one
+    // become invalid when it is erased.
+    TPageListIterator it;
+    for (it = mRetiredPageList.begin(); it != mRetiredPageList.end() && it->isPinned(); ++it) {
+    }
+    if (it == mRetiredPageList.end()) {
+        it = mRetiredPageList.begin();
+    }
+    if (it != mRetiredPageList.end()) {
+        Page* page = it;
+        auto err = page->erase();
+        if (err != ESP_OK) {
+            return err;
+        }
+        mRetiredPageList.erase(it);
+        mFreePageList.push_back(page);
+    }
+    return ESP_OK;
+}
+
+PageManager::Snapshot* PageManager::takeSnapshot()
+{
+    Snapshot* snapshot = nullptr;
+    for (size_t i = 0; i < SNAPSHOT_POOL_SIZE && snapshot == nullptr; ++i) {
+        snapshot = mSnapshotPool[i].exchange(nullptr);
+    }
+    if (snapshot == nullptr) {
+        snapshot = new (std::nothrow) Snapshot;
+        if (!snapshot) {
+            return nullptr;
+        }
+        // room for all pages, so that the snapshot can be reused whichever pages are in use
+        snapshot->pages.reset(new (std::nothrow) Page::Snapshot[mPageCount]);
+        if (!snapshot->pages) {
+            delete snapshot;
+            return nullptr;
+        }
+    }
+    snapshot->loadCount = mLoadCount;
+    size_t i = 0;
+    for (auto it = begin(); it != end(); ++it) {
+        it->takeSnapshot(snapshot->pages[i++]);
+    }
+    snapshot->pageCount = i;
+    return snapshot;
+}
+
+void PageManager::releaseSnapshot(Snapshot* snapshot)
+{
+    if (snapshot->loadCount != mLoadCount) {
+        delete snapshot;
+        return;
+    }
+    for (size_t i = 0; i < snapshot->pageCount; ++i) {
+        Page::releaseSnapshot(snapshot->pages[i]);
+    }
+    for (size_t i = 0; i < SNAPSHOT_POOL_SIZE; ++i) {
+        Snapshot* empty = nullptr;
+        if (mSnapshotPool[i].compare_exchange_strong(empty, snapshot)) {
+            return;
+        }
+    }
+    delete snapshot;
+}
+
+void PageManager::clearSnapshotPool()
+{
+    for (size_t i = 0; i < SNAPSHOT_POOL_SIZE; ++i) {
+        delete mSnapshotPool[i].exchange(nullptr);
+    }
+}
+
 esp_err_t PageManager::activatePage()
 {
     if (mFreePageList.empty()) {
         return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
     }
     Page* p = &mFreePageList.front();
-    if (p->state() == Page::PageState::CORRUPT) {
+    if (p->state() == Page::PageState::CORRUPT || p->state() == Page::PageState::RETIRED) {
         auto err = p->erase();
         if (err != ESP_OK) {
             return err;
@@ -219,26 +365,74 @@ esp_err_t PageManager::activatePage()
     return ESP_OK;
 }
 
-esp_err_t PageManager::fillStats(nvs_stats_t& nvsStats)
+esp_err_t PageManager::markNamespaceErased(uint8_t nsIndex)
+{
+    mErasedNamespaces.set(nsIndex, true);
+    mOrderedIndex.dropNamespace(nsIndex);
+    return countErasedNamespaceEntries();
+}
+
+esp_err_t PageManager::unmarkNamespaceErased(uint8_t nsIndex)
+{
+    mErasedNamespaces.set(nsIndex, false);
+    return countErasedNamespaceEntries();
+}
+
+esp_err_t PageManager::countErasedNamespaceEntries()
 {
-    nvsStats.used_entries      = 0;
-    nvsStats.free_entries      = 0;
-    nvsStats.total_entries     = 0;
-    esp_err_t err = ESP_OK;
-
-    // list of used pages
-    for (auto p = mPageList.begin(); p != mPageList.end(); ++p) {
-        err = p->calcEntries(nvsStats);
+    for (auto it = begin(); it != end(); ++it) {
+        auto err = it->countErasedNamespaceEntries();
         if (err != ESP_OK) {
             return err;
         }
     }
+    return ESP_OK;
+}
 
-    // free pages
-    nvsStats.total_entries += mFreePageList.size() * Page::ENTRY_COUNT;
-    nvsStats.free_entries  += mFreePageList.size() * Page::ENTRY_COUNT;
+esp_err_t PageManager::startCounting()
+{
+    std::fill_n(mEntryCounts.namespaces, sizeof(mEntryCounts.namespaces) / sizeof(mEntryCounts.namespaces[0]), 0);
+    mEntryCounts.used = 0;
+    mEntryCounts.keys = &mOrderedIndex;
+    mOrderedIndex.clear();
+    // free pages count the items written to them later
+    for (uint32_t i = 0; i < mPageCount; ++i) {
+        auto err = mPages[i].startCounting(&mEntryCounts);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
 
-    return err;
+esp_err_t PageManager::indexNamespace(uint8_t nsIndex)
+{
+    auto err = mOrderedIndex.addNamespace(nsIndex);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (auto it = begin(); it != end() && mOrderedIndex.isIndexed(nsIndex); ++it) {
+        Item item;
+        size_t itemIndex = 0;
+        while ((err = it->findItem(nsIndex, ItemType::ANY, nullptr, itemIndex, item)) == ESP_OK) {
+            mOrderedIndex.countItem(item, true);
+            itemIndex += item.span;
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            mOrderedIndex.dropNamespace(nsIndex);
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t PageManager::fillStats(nvs_stats_t& nvsStats)
+{
+    // erased entries are free as well, they are reclaimed by the garbage collection
+    nvsStats.total_entries = mPageCount * Page::ENTRY_COUNT;
+    nvsStats.used_entries  = mEntryCounts.used;
+    nvsStats.free_entries  = nvsStats.total_entries - nvsStats.used_entries;
+    return ESP_OK;
 }
 
 } // namespace nvs
@@ -14,6 +14,7 @@
 #ifndef nvs_pagemanager_hpp
 #define nvs_pagemanager_hpp
 
+#include <atomic>
 #include <memory>
 #include <list>
 #include "nvs_types.hpp"
@@ -31,7 +32,15 @@ public:
 
     PageManager() {}
 
-    esp_err_t load(Partition *partition, uint32_t baseSector, uint32_t sectorCount);
+    ~PageManager()
+    {
+        clearSnapshotPool();
+    }
+
+    /**
+     * Loads the pages of the partition. lock is the lock of the Storage, see Page::setLock.
+     */
+    esp_err_t load(Partition *partition, uint32_t baseSector, uint32_t sectorCount, const RWLock* lock = nullptr);
 
     TPageListIterator begin()
     {
@@ -54,24 +63,121 @@ public:
 
     esp_err_t requestNewPage();
 
+    /**
+     * Leaves the items of the namespace to the garbage collection, which frees the pages holding them
+     * first and drops the items instead of copying them. The items of each page are counted, which
+     * reads their headers but doesn't write anything.
+     */
+    esp_err_t markNamespaceErased(uint8_t nsIndex);
+
+    /**
+     * Called once no items of the namespace are left, before its index is used again.
+     */
+    esp_err_t unmarkNamespaceErased(uint8_t nsIndex);
+
+    bool isNamespaceErased(uint8_t nsIndex) const
+    {
+        return mErasedNamespaces.get(nsIndex);
+    }
+
     esp_err_t fillStats(nvs_stats_t& nvsStats);
 
+    /**
+     * Entries taken by the items of the namespace, without reading anything.
+     */
+    size_t getNamespaceEntryCount(uint8_t nsIndex) const
+    {
+        return mEntryCounts.namespaces[nsIndex];
+    }
+
+    /**
+     * Keys of the namespaces which have been listed in key order, see OrderedIndex.
+     */
+    const OrderedIndex& getOrderedIndex() const
+    {
+        return mOrderedIndex;
+    }
+
+    /**
+     * Adds the keys of the namespace to the ordered index, reading the item headers of all pages.
+     * Afterwards, the namespace is either indexed or marked as too large.
+     */
+    esp_err_t indexNamespace(uint8_t nsIndex);
+
     uint32_t getBaseSector()
     {
         return mBaseSector;
     }
 
+    /**
+     * Changes whenever the pages are loaded again, which replaces all Page objects.
+     */
+    uint32_t getLoadCount() const
+    {
+        return mLoadCount;
+    }
+
+    /**
+     * The pages in use and the states of their entries at one point in time, for readers which
+     * need a consistent view across several calls without holding the lock in between.
+     */
+    struct Snapshot
+    {
+        uint32_t loadCount;
+        size_t pageCount;
+        std::unique_ptr<Page::Snapshot[]> pages;
+    };
+
+    /**
+     * Returns nullptr if there isn't enough memory. A few released snapshots are kept and reused, so
+     * repeated iterations only allocate the first time. Readers take and release snapshots while holding
+     * the lock shared, so the kept ones are exchanged atomically.
+     */
+    Snapshot* takeSnapshot();
+
+    void releaseSnapshot(Snapshot* snapshot);
+
+    /**
+     * Page of the snapshot, or nullptr if the partition has been loaded again since it was taken.
+     */
+    const Page* getPage(const Snapshot& snapshot, size_t index) const
+    {
+        return (snapshot.loadCount == mLoadCount) ? snapshot.pages[index].page : nullptr;
+    }
+
 protected:
     friend class Iterator;
 
     esp_err_t activatePage();
 
+    esp_err_t reclaimRetiredPage();
+
+    /**
+     * Finds the full log blocks of page which the garbage collection drops: those followed by another full block
+     * of their log. The newest full block of a log is kept, so that its records aren't all dropped at once.
+     */
+    esp_err_t findDroppedLogBlocks(Page& page, Page::TLogBlockTable& dropped);
+
+    esp_err_t countErasedNamespaceEntries();
+
+    esp_err_t startCounting();
+
+    void clearSnapshotPool();
+
+    static const size_t SNAPSHOT_POOL_SIZE = 2;
+
     TPageList mPageList;
     TPageList mFreePageList;
+    TPageList mRetiredPageList; // freed by the garbage collection while pinned by a snapshot
     std::unique_ptr<Page[]> mPages;
     uint32_t mBaseSector;
     uint32_t mPageCount;
     uint32_t mSeqNumber;
+    uint32_t mLoadCount = 0;
+    Page::TNamespaceTable mErasedNamespaces;
+    Page::EntryCounts mEntryCounts;
+    OrderedIndex mOrderedIndex{NVS_ORDERED_INDEX_KEYS};
+    std::atomic<Snapshot*> mSnapshotPool[SNAPSHOT_POOL_SIZE] = {};
 }; // class PageManager
 
 
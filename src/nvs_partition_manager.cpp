@@ -75,6 +75,11 @@ error:
 
 esp_err_t NVSPartitionManager::init_custom(Partition *partition, uint32_t baseSector, uint32_t sectorCount)
 {
+    esp_err_t err = Lock::init();
+    if (err != ESP_OK) {
+        return err;
+    }
+
     Storage* new_storage = nullptr;
     Storage* storage = lookup_storage_from_name(partition->get_partition_name());
     if (storage == nullptr) {
@@ -96,7 +101,7 @@ esp_err_t NVSPartitionManager::init_custom(Partition *partition, uint32_t baseSe
         }
     }
 
-    esp_err_t err = storage->init(baseSector, sectorCount);
+    err = storage->init(baseSector, sectorCount);
     if (new_storage != nullptr) {
         if (err == ESP_OK) {
             nvs_storage_list.push_back(new_storage);
@@ -229,6 +234,15 @@ size_t NVSPartitionManager::open_handles_size()
     return nvs_handles.size();
 }
 
+void NVSPartitionManager::move_handles(Storage* storage, uint8_t old_ns_index, uint8_t new_ns_index)
+{
+    for (auto it = nvs_handles.begin(); it != nvs_handles.end(); ++it) {
+        if (it->mStoragePtr == storage && it->mNsIndex == old_ns_index) {
+            it->mNsIndex = new_ns_index;
+        }
+    }
+}
+
 Storage* NVSPartitionManager::lookup_storage_from_name(const char* name)
 {
     auto it = find_if(begin(nvs_storage_list), end(nvs_storage_list), [=](Storage& e) -> bool {
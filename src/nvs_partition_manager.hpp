@@ -45,6 +45,11 @@ public:
 
     size_t open_handles_size();
 
+    /**
+     * Lets the open handles of a namespace follow it to the new index it got when it was erased.
+     */
+    void move_handles(Storage* storage, uint8_t old_ns_index, uint8_t new_ns_index);
+
 protected:
     NVSPartitionManager() { }
 
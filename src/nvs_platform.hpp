@@ -14,6 +14,8 @@
 #ifndef nvs_platform_h
 #define nvs_platform_h
 
+#include <atomic>
+#include "esp_err.h"
 
 #ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
@@ -22,60 +24,266 @@
 namespace nvs
 {
 
-class Lock
+/**
+ * Reader/writer lock: any number of shared holders or one exclusive holder.
+ * Writers hold mMutex for as long as they hold the lock, so they keep the priority inheritance of a mutex
+ * against other writers and against readers waiting to enter. Readers only take mMutex to enter, and a
+ * writer which holds it waits on mDrained until the readers which are inside have left. While it waits,
+ * the readers don't inherit its priority.
+ * The lock does nothing until init() has been called.
+ */
+class RWLock
 {
 public:
-    Lock()
+    RWLock() : mMutex(nullptr), mDrained(nullptr), mReaders(0) { }
+
+    RWLock(const RWLock&) = delete;
+
+    RWLock& operator=(const RWLock&) = delete;
+
+    ~RWLock()
+    {
+        uninit();
+    }
+
+    esp_err_t init()
+    {
+        if (mMutex) {
+            return ESP_OK;
+        }
+        mMutex = xSemaphoreCreateMutex();
+        if (!mMutex) {
+            return ESP_ERR_NO_MEM;
+        }
+        mDrained = xSemaphoreCreateBinary();
+        if (!mDrained) {
+            vSemaphoreDelete(mMutex);
+            mMutex = nullptr;
+            return ESP_ERR_NO_MEM;
+        }
+        return ESP_OK;
+    }
+
+    void uninit()
     {
-        if (mSemaphore) {
-            xSemaphoreTake(mSemaphore, portMAX_DELAY);
+        if (mMutex) {
+            vSemaphoreDelete(mMutex);
+            vSemaphoreDelete(mDrained);
         }
+        mMutex = nullptr;
+        mDrained = nullptr;
     }
 
-    ~Lock()
+    void lock()
     {
-        if (mSemaphore) {
-            xSemaphoreGive(mSemaphore);
+        if (mMutex) {
+            xSemaphoreTake(mMutex, portMAX_DELAY);
+            /* No reader enters any more. mDrained may have been given before, so the count is checked
+             * again after each take */
+            while (mReaders.load() != 0) {
+                xSemaphoreTake(mDrained, portMAX_DELAY);
+            }
         }
     }
 
-    static esp_err_t init()
+    void unlock()
     {
-        if (mSemaphore) {
-            return ESP_OK;
+        if (mMutex) {
+            xSemaphoreGive(mMutex);
         }
-        mSemaphore = xSemaphoreCreateMutex();
-        if (!mSemaphore) {
-            return ESP_ERR_NO_MEM;
+    }
+
+    void lock_shared()
+    {
+        if (mMutex) {
+            xSemaphoreTake(mMutex, portMAX_DELAY);
+            mReaders++;
+            xSemaphoreGive(mMutex);
         }
-        return ESP_OK;
     }
 
-    static void uninit()
+    void unlock_shared()
     {
-        if (mSemaphore) {
-            vSemaphoreDelete(mSemaphore);
+        if (mMutex) {
+            if (--mReaders == 0) {
+                xSemaphoreGive(mDrained);
+            }
         }
-        mSemaphore = nullptr;
     }
 
-    static SemaphoreHandle_t mSemaphore;
+    /**
+     * True while the lock is held shared.
+     */
+    bool isShared() const
+    {
+        return mReaders.load(std::memory_order_relaxed) != 0;
+    }
+
+private:
+    SemaphoreHandle_t mMutex;
+    SemaphoreHandle_t mDrained;
+    std::atomic<uint32_t> mReaders;
 };
 } // namespace nvs
 
 #else // ESP_PLATFORM
+#include <condition_variable>
+#include <mutex>
+
 namespace nvs
 {
-class Lock
+
+/**
+ * Reader/writer lock: any number of shared holders or one exclusive holder.
+ * The lock does nothing until init() has been called.
+ */
+class RWLock
 {
 public:
-    Lock() { }
-    ~Lock() { }
-    static void init() {}
-    static void uninit() {}
+    RWLock() : mInitialized(false), mWriter(false), mReaders(0) { }
+
+    RWLock(const RWLock&) = delete;
+
+    RWLock& operator=(const RWLock&) = delete;
+
+    esp_err_t init()
+    {
+        mInitialized = true;
+        return ESP_OK;
+    }
+
+    void uninit()
+    {
+        mInitialized = false;
+    }
+
+    void lock()
+    {
+        if (mInitialized) {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return !mWriter && mReaders == 0; });
+            mWriter = true;
+        }
+    }
+
+    void unlock()
+    {
+        if (mInitialized) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mWriter = false;
+            mCondition.notify_all();
+        }
+    }
+
+    void lock_shared()
+    {
+        if (mInitialized) {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return !mWriter; });
+            mReaders++;
+        }
+    }
+
+    void unlock_shared()
+    {
+        if (mInitialized) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (--mReaders == 0) {
+                mCondition.notify_all();
+            }
+        }
+    }
+
+    /**
+     * True while the lock is held shared.
+     */
+    bool isShared() const
+    {
+        return mReaders.load(std::memory_order_relaxed) != 0;
+    }
+
+private:
+    std::atomic<bool> mInitialized;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mWriter;
+    std::atomic<uint32_t> mReaders; // modified with mMutex held
 };
 } // namespace nvs
 #endif // ESP_PLATFORM
 
+namespace nvs
+{
+
+/**
+ * Exclusive acquisition of a lock for the lifetime of the object.
+ *
+ * Without an argument, this is the global lock of the handle table and the partition registry.
+ * Operations on stored data hold the global lock shared, so that partitions and handles stay valid,
+ * and the lock of their Storage exclusively if they modify the data. Operations on different
+ * partitions therefore run in parallel; opening, closing and (de)initializing hold the global lock
+ * exclusively and wait for all of them.
+ */
+class Lock
+{
+public:
+    Lock() : mLock(mRegistry)
+    {
+        mLock.lock();
+    }
+
+    explicit Lock(RWLock& lock) : mLock(lock)
+    {
+        mLock.lock();
+    }
+
+    ~Lock()
+    {
+        mLock.unlock();
+    }
+
+    static esp_err_t init()
+    {
+        return mRegistry.init();
+    }
+
+    static void uninit()
+    {
+        mRegistry.uninit();
+    }
+
+    static RWLock mRegistry;
+
+private:
+    RWLock& mLock;
+};
+
+/**
+ * Shared acquisition of a lock for the lifetime of the object, for operations which only read.
+ * Without an argument, this is the global lock of the handle table and the partition registry.
+ */
+class SharedLock
+{
+public:
+    SharedLock() : mLock(Lock::mRegistry)
+    {
+        mLock.lock_shared();
+    }
+
+    explicit SharedLock(RWLock& lock) : mLock(lock)
+    {
+        mLock.lock_shared();
+    }
+
+    ~SharedLock()
+    {
+        mLock.unlock_shared();
+    }
+
+private:
+    RWLock& mLock;
+};
+} // namespace nvs
+
 
 #endif /* nvs_platform_h */
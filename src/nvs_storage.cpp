@@ -12,6 +12,9 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "nvs_storage.hpp"
+#include "nvs_platform.hpp"
+#include <algorithm>
+#include <cstdio>
 
 #ifndef ESP_PLATFORM
 #include <map>
@@ -24,6 +27,7 @@ namespace nvs
 Storage::~Storage()
 {
     clearNamespaces();
+    mSharedBlobs.clearAndFreeNodes();
 }
 
 void Storage::clearNamespaces()
@@ -51,6 +55,7 @@ esp_err_t Storage::populateBlobIndices(TBlobIndexList& blobIdxList)
             entry->nsIndex = item.nsIndex;
             entry->chunkStart = item.blobIndex.chunkStart;
             entry->chunkCount = item.blobIndex.chunkCount;
+            entry->chunkVerMap = item.blobIndex.chunkVerMap;
 
             blobIdxList.push_back(entry);
             itemIndex += item.span;
@@ -70,16 +75,20 @@ void Storage::eraseOrphanDataBlobs(TBlobIndexList& blobIdxList)
          * belong to same family.
          * 1) VER_0_OFFSET <= chunkIndex < VER_1_OFFSET-1 => Version0 chunks
          * 2) VER_1_OFFSET <= chunkIndex < VER_ANY => Version1 chunks
+         * A chunk belongs to a blob index if its chunk number is within chunkCount and its version
+         * is the one recorded by the index for this chunk number.
          */
         while (p.findItem(Page::NS_ANY, ItemType::BLOB_DATA, nullptr, itemIndex, item) == ESP_OK) {
 
             auto iter = std::find_if(blobIdxList.begin(),
                     blobIdxList.end(),
                     [=] (const BlobIndexNode& e) -> bool
-                    {return (strncmp(item.key, e.key, sizeof(e.key) - 1) == 0)
+                    {
+                        uint8_t chunkNum = item.chunkIndex & ~static_cast<uint8_t>(VerOffset::VER_1_OFFSET);
+                        return (strncmp(item.key, e.key, sizeof(e.key) - 1) == 0)
                             && (item.nsIndex == e.nsIndex)
-                            && (item.chunkIndex >=  static_cast<uint8_t> (e.chunkStart))
-                            && (item.chunkIndex < static_cast<uint8_t> (e.chunkStart) + e.chunkCount);});
+                            && (chunkNum < e.chunkCount)
+                            && (item.chunkIndex == blobChunkIndex(e.chunkStart, e.chunkVerMap, chunkNum));});
             if (iter == std::end(blobIdxList)) {
                 p.eraseItem(item.nsIndex, item.datatype, item.key, item.chunkIndex);
             }
@@ -88,9 +97,90 @@ void Storage::eraseOrphanDataBlobs(TBlobIndexList& blobIdxList)
     }
 }
 
+void Storage::sharedBlobKey(const Item& ref, char* key)
+{
+    /* A blob has less than 128 chunks, so its size fits into 24 bits */
+    snprintf(key, Item::MAX_KEY_LENGTH + 1, "%08x%06x", static_cast<unsigned>(ref.blobRef.dataCrc32),
+            static_cast<unsigned>(ref.blobRef.dataSize));
+}
+
+esp_err_t Storage::loadSharedBlobs()
+{
+    mSharedBlobs.clearAndFreeNodes();
+    if (!mSharedBlobsEnabled) {
+        return ESP_OK;
+    }
+
+    for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
+        Page& p = *it;
+        size_t itemIndex = 0;
+        Item item;
+        while (p.findItem(Page::NS_ANY, ItemType::BLOB_IDX, nullptr, itemIndex, item) == ESP_OK) {
+            if (item.nsIndex == Page::NS_SHARED) {
+                SharedBlobNode* entry = new (std::nothrow) SharedBlobNode;
+
+                if (!entry) return ESP_ERR_NO_MEM;
+
+                item.getKey(entry->key, sizeof(entry->key));
+                entry->refCount = 0;
+                mSharedBlobs.push_back(entry);
+            }
+            itemIndex += item.span;
+        }
+    }
+
+    for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
+        Page& p = *it;
+        size_t itemIndex = 0;
+        Item item;
+        /* If the power went off while a blob was converted to or from a reference, both the
+         * reference and the blob index exist. Either one is a valid result of the write, so the
+         * blob index is kept. References to a shared blob which doesn't exist are removed as well */
+        while (p.findItem(Page::NS_ANY, ItemType::BLOB_REF, nullptr, itemIndex, item) == ESP_OK) {
+            if (mPageManager.isNamespaceErased(item.nsIndex)) {
+                itemIndex += item.span;
+                continue;
+            }
+            char sharedKey[Item::MAX_KEY_LENGTH + 1];
+            sharedBlobKey(item, sharedKey);
+            auto node = std::find_if(mSharedBlobs.begin(), mSharedBlobs.end(), [=] (const SharedBlobNode& e) -> bool {
+                return strncmp(sharedKey, e.key, sizeof(e.key) - 1) == 0;
+            });
+
+            Page* findPage = nullptr;
+            Item blobItem;
+            if (node == mSharedBlobs.end()
+                    || findItem(item.nsIndex, ItemType::BLOB_IDX, item.key, findPage, blobItem) == ESP_OK
+                    || findItem(item.nsIndex, ItemType::BLOB, item.key, findPage, blobItem) == ESP_OK) {
+                p.eraseItem(item.nsIndex, ItemType::BLOB_REF, item.key);
+            } else {
+                node->refCount++;
+            }
+            itemIndex += item.span;
+        }
+    }
+
+    /* Shared blobs which were written, but no reference to them, or whose last reference was erased */
+    for (auto it = mSharedBlobs.begin(); it != mSharedBlobs.end(); ) {
+        SharedBlobNode* node = &*it;
+        ++it;
+        if (node->refCount == 0) {
+            eraseMultiPageBlob(Page::NS_SHARED, node->key);
+            mSharedBlobs.erase(node);
+            delete node;
+        }
+    }
+    return ESP_OK;
+}
+
 esp_err_t Storage::init(uint32_t baseSector, uint32_t sectorCount)
 {
-    auto err = mPageManager.load(mPartition, baseSector, sectorCount);
+    auto err = mLock.init();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = mPageManager.load(mPartition, baseSector, sectorCount, &mLock);
     if (err != ESP_OK) {
         mState = StorageState::INVALID;
         return err;
@@ -120,7 +210,25 @@ esp_err_t Storage::init(uint32_t baseSector, uint32_t sectorCount)
     }
     mNamespaceUsage.set(0, true);
     mNamespaceUsage.set(255, true);
+    /* Shared blobs use an index which isn't handed out to namespaces, unless a namespace already has
+     * it. The index is only reserved while shared blobs are stored, see writeSharedBlob */
+    mSharedBlobsEnabled = !mNamespaceUsage.get(Page::NS_SHARED);
     mState = StorageState::ACTIVE;
+    if (mSharedBlobsEnabled) {
+        size_t sharedEntries;
+        err = calcEntriesInNamespace(Page::NS_SHARED, sharedEntries);
+        if (err != ESP_OK) {
+            mState = StorageState::INVALID;
+            return err;
+        }
+        mNamespaceUsage.set(Page::NS_SHARED, sharedEntries != 0);
+    }
+
+    err = loadNamespaceTombstones();
+    if (err != ESP_OK) {
+        mState = StorageState::INVALID;
+        return err;
+    }
 
     // Populate list of multi-page index entries.
     TBlobIndexList blobIdxList;
@@ -136,6 +244,13 @@ esp_err_t Storage::init(uint32_t baseSector, uint32_t sectorCount)
     // Purge the blob index list
     blobIdxList.clearAndFreeNodes();
 
+    // Count the references to shared blobs and remove the ones which aren't referenced.
+    err = loadSharedBlobs();
+    if (err != ESP_OK) {
+        mState = StorageState::INVALID;
+        return err;
+    }
+
 #ifndef ESP_PLATFORM
     debugCheck();
 #endif
@@ -148,9 +263,15 @@ bool Storage::isValid() const
 }
 
 esp_err_t Storage::findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, Item& item, uint8_t chunkIdx, VerOffset chunkStart)
+{
+    size_t itemIndex;
+    return findItem(nsIndex, datatype, key, page, itemIndex, item, chunkIdx, chunkStart);
+}
+
+esp_err_t Storage::findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, size_t& itemIndex, Item& item, uint8_t chunkIdx, VerOffset chunkStart)
 {
     for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
-        size_t itemIndex = 0;
+        itemIndex = 0;
         auto err = it->findItem(nsIndex, datatype, key, itemIndex, item, chunkIdx, chunkStart);
         if (err == ESP_OK) {
             page = it;
@@ -160,7 +281,7 @@ esp_err_t Storage::findItem(uint8_t nsIndex, ItemType datatype, const char* key,
     return ESP_ERR_NVS_NOT_FOUND;
 }
 
-esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize, VerOffset chunkStart)
+esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize, VerOffset chunkStart, uint16_t chunkVerMap)
 {
     uint8_t chunkCount = 0;
     TUsedPageList usedPages;
@@ -191,7 +312,7 @@ esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const vo
                     return err;
                 }
             }
-            err = mPageManager.requestNewPage();
+            err = requestNewPage();
             if (err != ESP_OK) {
                 return err;
             } else if(getCurrentPage().getVarDataTailroom() == tailroom) {
@@ -211,7 +332,7 @@ esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const vo
         remainingSize -= chunkSize;
 
         err = page.writeItem(nsIndex, ItemType::BLOB_DATA, key,
-                static_cast<const uint8_t*> (data) + offset, chunkSize, static_cast<uint8_t> (chunkStart) + chunkCount);
+                static_cast<const uint8_t*> (data) + offset, chunkSize, blobChunkIndex(chunkStart, chunkVerMap, chunkCount), mCompress);
         chunkCount++;
         assert(err != ESP_ERR_NVS_PAGE_FULL);
         if (err != ESP_OK) {
@@ -231,7 +352,7 @@ esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const vo
                         break;
                     }
                 }
-                err = mPageManager.requestNewPage();
+                err = requestNewPage();
                 if (err != ESP_OK) {
                     break;
                 }
@@ -245,6 +366,10 @@ esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const vo
             item.blobIndex.dataSize = dataSize;
             item.blobIndex.chunkCount = chunkCount;
             item.blobIndex.chunkStart = chunkStart;
+            if (chunkCount < CHUNK_VER_MAP_BITS) {
+                chunkVerMap |= ~((1 << chunkCount) - 1);
+            }
+            item.blobIndex.chunkVerMap = chunkVerMap;
 
             err = getCurrentPage().writeItem(nsIndex, ItemType::BLOB_IDX, key, item.data, sizeof(item.data));
             assert(err != ESP_ERR_NVS_PAGE_FULL);
@@ -254,20 +379,169 @@ esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const vo
 
     if (err != ESP_OK) {
         /* Anything failed, then we should erase all the written chunks*/
-        int ii=0;
+        uint8_t ii = 0;
         for (auto it = std::begin(usedPages); it != std::end(usedPages); it++) {
-            it->mPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, ii++);
+            it->mPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, blobChunkIndex(chunkStart, chunkVerMap, ii++));
         }
     }
     usedPages.clearAndFreeNodes();
     return err;
 }
 
+esp_err_t Storage::writeMultiPageBlobDelta(uint8_t nsIndex, const char* key, const void* data, size_t dataSize, const Item& blobIndex)
+{
+    uint8_t chunkCount = blobIndex.blobIndex.chunkCount;
+    VerOffset prevStart = blobIndex.blobIndex.chunkStart;
+    uint16_t prevVerMap = blobIndex.blobIndex.chunkVerMap;
+
+    /* Chunk boundaries are kept, so this only works if the size is unchanged */
+    if (dataSize != blobIndex.blobIndex.dataSize || chunkCount > CHUNK_VER_MAP_BITS) {
+        return ESP_ERR_NVS_CONTENT_DIFFERS;
+    }
+
+    /* Compare chunk by chunk to find out which ones are being modified */
+    size_t chunkSizes[CHUNK_VER_MAP_BITS];
+    uint16_t changedChunks = 0;
+    size_t offset = 0;
+    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
+        uint8_t chunkIdx = blobChunkIndex(prevStart, prevVerMap, chunkNum);
+        Page* findPage = nullptr;
+        Item item;
+        auto err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, chunkIdx);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            return ESP_ERR_NVS_CONTENT_DIFFERS;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        chunkSizes[chunkNum] = item.varLength.dataSize;
+        if (offset + chunkSizes[chunkNum] > dataSize) {
+            return ESP_ERR_NVS_CONTENT_DIFFERS;
+        }
+        err = findPage->cmpItem(nsIndex, ItemType::BLOB_DATA, key, static_cast<const uint8_t*>(data) + offset, chunkSizes[chunkNum], chunkIdx);
+        if (err == ESP_ERR_NVS_CONTENT_DIFFERS || err == ESP_ERR_NVS_NOT_FOUND) {
+            changedChunks |= 1 << chunkNum;
+        } else if (err != ESP_OK) {
+            return err;
+        }
+        offset += chunkSizes[chunkNum];
+    }
+    if (offset != dataSize) {
+        return ESP_ERR_NVS_CONTENT_DIFFERS;
+    }
+    if (changedChunks == 0) {
+        return ESP_OK;
+    }
+    if (changedChunks == (1 << chunkCount) - 1) {
+        /* A complete rewrite may place the chunks better */
+        return ESP_ERR_NVS_CONTENT_DIFFERS;
+    }
+
+    /* Write new versions of the modified chunks, then the new index. Until the index is written, the new
+     * chunks are orphans and the old blob stays intact. */
+    VerOffset nextStart = (prevStart == VerOffset::VER_1_OFFSET) ? VerOffset::VER_0_OFFSET : VerOffset::VER_1_OFFSET;
+    uint16_t nextVerMap = 0xffff;
+    esp_err_t err = ESP_OK;
+    uint8_t chunkNum;
+    offset = 0;
+    for (chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
+        uint8_t chunkIdx = blobChunkIndex(prevStart, prevVerMap, chunkNum);
+        if (changedChunks & (1 << chunkNum)) {
+            chunkIdx ^= static_cast<uint8_t>(VerOffset::VER_1_OFFSET);
+            err = writeToCurrentPage(nsIndex, ItemType::BLOB_DATA, key, static_cast<const uint8_t*>(data) + offset, chunkSizes[chunkNum], chunkIdx);
+            if (err != ESP_OK) {
+                break;
+            }
+        }
+        if ((chunkIdx & static_cast<uint8_t>(VerOffset::VER_1_OFFSET)) != static_cast<uint8_t>(nextStart)) {
+            nextVerMap &= ~(1 << chunkNum);
+        }
+        offset += chunkSizes[chunkNum];
+    }
+
+    if (err == ESP_OK) {
+        Item item;
+        std::fill_n(item.data, sizeof(item.data), 0xff);
+        item.blobIndex.dataSize = dataSize;
+        item.blobIndex.chunkCount = chunkCount;
+        item.blobIndex.chunkStart = nextStart;
+        item.blobIndex.chunkVerMap = nextVerMap;
+
+        err = writeToCurrentPage(nsIndex, ItemType::BLOB_IDX, key, item.data, sizeof(item.data));
+    }
+
+    if (err != ESP_OK) {
+        /* Anything failed, then we should erase all the written chunks*/
+        for (uint8_t i = 0; i < chunkNum; i++) {
+            if (changedChunks & (1 << i)) {
+                uint8_t chunkIdx = blobChunkIndex(prevStart, prevVerMap, i) ^ static_cast<uint8_t>(VerOffset::VER_1_OFFSET);
+                Page* findPage = nullptr;
+                Item item;
+                if (findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, chunkIdx) == ESP_OK) {
+                    findPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, chunkIdx);
+                }
+            }
+        }
+        return err;
+    }
+
+    /* Erase the previous index, then the chunks it no longer shares with the new one */
+    Page* findPage = nullptr;
+    Item item;
+    err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, Page::CHUNK_ANY, prevStart);
+    if (err == ESP_OK) {
+        err = findPage->eraseItem(nsIndex, ItemType::BLOB_IDX, key, Page::CHUNK_ANY, prevStart);
+    }
+    for (chunkNum = 0; err == ESP_OK && chunkNum < chunkCount; chunkNum++) {
+        if (!(changedChunks & (1 << chunkNum))) {
+            continue;
+        }
+        uint8_t chunkIdx = blobChunkIndex(prevStart, prevVerMap, chunkNum);
+        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, chunkIdx);
+        if (err == ESP_OK) {
+            err = findPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, chunkIdx);
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_ERR_FLASH_OP_FAIL) {
+        return ESP_ERR_NVS_REMOVE_FAILED;
+    }
+    return err;
+}
+
+esp_err_t Storage::writeToCurrentPage(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx)
+{
+    Page& page = getCurrentPage();
+    auto err = page.writeItem(nsIndex, datatype, key, data, dataSize, chunkIdx, mCompress);
+    if (err == ESP_ERR_NVS_PAGE_FULL) {
+        if (page.state() != Page::PageState::FULL) {
+            err = page.markFull();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        err = requestNewPage();
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        err = getCurrentPage().writeItem(nsIndex, datatype, key, data, dataSize, chunkIdx, mCompress);
+        if (err == ESP_ERR_NVS_PAGE_FULL) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+    }
+    return err;
+}
+
 esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize)
 {
     if (mState != StorageState::ACTIVE) {
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
+    if (isReservedByBlobWriter(nsIndex, key)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
 
     Page* findPage = nullptr;
     Item item;
@@ -283,19 +557,48 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
         return err;
     }
 
+    if (datatype == ItemType::BLOB && mDeduplicate && mSharedBlobsEnabled && dataSize >= SHARED_BLOB_MIN_SIZE) {
+        err = writeSharedBlob(nsIndex, key, data, dataSize);
+        if (err != ESP_ERR_NVS_CONTENT_DIFFERS) {
+#ifndef ESP_PLATFORM
+            if (err == ESP_OK) {
+                debugCheck();
+            }
+#endif
+            return err;
+        }
+        /* A different blob with the same checksum and size is shared already, so this one is stored
+         * for this key only */
+    }
+
     if (datatype == ItemType::BLOB) {
         VerOffset prevStart,  nextStart;
         prevStart = nextStart = VerOffset::VER_0_OFFSET;
+        uint16_t nextVerMap = 0xffff;
         if (findPage) {
-            // Do a sanity check that the item in question is actually being modified.
-            // If it isn't, it is cheaper to purposefully not write out new data.
-            // since it may invoke an erasure of flash.
-            if (cmpMultiPageBlob(nsIndex, key, data, dataSize) == ESP_OK) {
+            if (mBlobDeltaWrites) {
+                // Only rewrite the chunks which are actually being modified. If none is,
+                // it is cheaper to purposefully not write out new data, since it may invoke an erasure of flash.
+                err = writeMultiPageBlobDelta(nsIndex, key, data, dataSize, item);
+                if (err != ESP_ERR_NVS_CONTENT_DIFFERS) {
+#ifndef ESP_PLATFORM
+                    if (err == ESP_OK) {
+                        debugCheck();
+                    }
+#endif
+                    return err;
+                }
+            } else if (cmpMultiPageBlob(nsIndex, key, data, dataSize) == ESP_OK) {
+                // Do a sanity check that the item in question is actually being modified.
+                // If it isn't, it is cheaper to purposefully not write out new data.
+                // since it may invoke an erasure of flash.
                 return ESP_OK;
             }
 
             if (findPage->state() == Page::PageState::UNINITIALIZED ||
-                    findPage->state() == Page::PageState::INVALID) {
+                    findPage->state() == Page::PageState::INVALID ||
+                    findPage->state() == Page::PageState::CORRUPT ||
+                    findPage->state() == Page::PageState::RETIRED) {
                 ESP_ERROR_CHECK(findItem(nsIndex, datatype, key, findPage, item));
             }
             /* Get the version of the previous index with same <ns,key> */
@@ -305,9 +608,16 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
             /* Toggle the version by changing the offset */
             nextStart
                 = (prevStart == VerOffset::VER_1_OFFSET) ? VerOffset::VER_0_OFFSET : VerOffset::VER_1_OFFSET;
+
+            /* Chunks kept from the other version by a partial rewrite still occupy their chunkIndex,
+             * so the new version of such a chunk has to go to the opposite one */
+            nextVerMap = item.blobIndex.chunkVerMap;
+            if (item.blobIndex.chunkCount < CHUNK_VER_MAP_BITS) {
+                nextVerMap |= ~((1 << item.blobIndex.chunkCount) - 1);
+            }
         }
         /* Write the blob with new version*/
-        err = writeMultiPageBlob(nsIndex, key, data, dataSize, nextStart);
+        err = writeMultiPageBlob(nsIndex, key, data, dataSize, nextStart, nextVerMap);
 
         if (err == ESP_ERR_NVS_PAGE_FULL) {
             return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
@@ -329,6 +639,12 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
 
             findPage = nullptr;
         } else {
+            /* The key may have referred to a shared blob */
+            err = eraseBlobRef(nsIndex, key);
+            if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+                return err;
+            }
+
             /* Support for earlier versions where BLOBS were stored without index */
             err = findItem(nsIndex, datatype, key, findPage, item);
             if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
@@ -344,35 +660,19 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
             return ESP_OK;
         }
 
-        Page& page = getCurrentPage();
-        err = page.writeItem(nsIndex, datatype, key, data, dataSize);
-        if (err == ESP_ERR_NVS_PAGE_FULL) {
-            if (page.state() != Page::PageState::FULL) {
-                err = page.markFull();
-                if (err != ESP_OK) {
-                    return err;
-                }
-            }
-            err = mPageManager.requestNewPage();
-            if (err != ESP_OK) {
-                return err;
-            }
-
-            err = getCurrentPage().writeItem(nsIndex, datatype, key, data, dataSize);
-            if (err == ESP_ERR_NVS_PAGE_FULL) {
-                return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
-            }
-            if (err != ESP_OK) {
-                return err;
-            }
-        } else if (err != ESP_OK) {
+        err = writeToCurrentPage(nsIndex, datatype, key, data, dataSize);
+        if (err != ESP_OK) {
             return err;
         }
     }
 
     if (findPage) {
+        /* The page may have been freed while writing, the item is on another page then. A page freed
+         * while a snapshot refers to it is marked retired until it is erased. */
         if (findPage->state() == Page::PageState::UNINITIALIZED ||
-                findPage->state() == Page::PageState::INVALID) {
+                findPage->state() == Page::PageState::INVALID ||
+                findPage->state() == Page::PageState::CORRUPT ||
+                findPage->state() == Page::PageState::RETIRED) {
             ESP_ERROR_CHECK(findItem(nsIndex, datatype, key, findPage, item));
         }
         err = findPage->eraseItem(nsIndex, datatype, key);
@@ -389,97 +689,483 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
     return ESP_OK;
 }
 
-esp_err_t Storage::createOrOpenNamespace(const char* nsName, bool canCreate, uint8_t& nsIndex)
+/* Checks a value passed to writeItems */
+static esp_err_t checkWriteRequest(const nvs_set_item_t& request)
 {
-    if (mState != StorageState::ACTIVE) {
-        return ESP_ERR_NVS_NOT_INITIALIZED;
+    if (request.key == nullptr || request.value == nullptr) {
+        return ESP_ERR_INVALID_ARG;
     }
-    auto it = std::find_if(mNamespaces.begin(), mNamespaces.end(), [=] (const NamespaceEntry& e) -> bool {
-        return strncmp(nsName, e.mName, sizeof(e.mName) - 1) == 0;
-    });
-    if (it == std::end(mNamespaces)) {
-        if (!canCreate) {
-            return ESP_ERR_NVS_NOT_FOUND;
-        }
+    if (strlen(request.key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    switch (request.type) {
+    case NVS_TYPE_U8:
+    case NVS_TYPE_I8:
+    case NVS_TYPE_U16:
+    case NVS_TYPE_I16:
+    case NVS_TYPE_U32:
+    case NVS_TYPE_I32:
+    case NVS_TYPE_U64:
+    case NVS_TYPE_I64:
+    case NVS_TYPE_BLOB:
+        return ESP_OK;
+    case NVS_TYPE_STR:
+        return (strlen(static_cast<const char*>(request.value)) + 1 > Page::CHUNK_MAX_SIZE) ? ESP_ERR_NVS_VALUE_TOO_LONG : ESP_OK;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+}
 
-        uint8_t ns;
-        for (ns = 1; ns < 255; ++ns) {
-            if (mNamespaceUsage.get(ns) == false) {
-                break;
-            }
-        }
+/* A value passed to writeItems which is written to the active page, and the item holding its previous value */
+struct BatchWrite {
+    nvs_set_item_t* request;
+    size_t dataSize;
+    Page* prevPage;
+    size_t prevIndex;
+};
 
-        if (ns == 255) {
-            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
-        }
+static bool batchWriteKeyLess(const BatchWrite& a, const BatchWrite& b)
+{
+    if (a.request->type != b.request->type) {
+        return a.request->type < b.request->type;
+    }
+    int cmp = strcmp(a.request->key, b.request->key);
+    return (cmp != 0) ? cmp < 0 : a.request < b.request;
+}
 
-        NamespaceEntry* entry = new (std::nothrow) NamespaceEntry;
-        if (!entry) {
-            return ESP_ERR_NO_MEM;
-        }
+static bool batchWriteOrderLess(const BatchWrite& a, const BatchWrite& b)
+{
+    return a.request < b.request;
+}
 
-        auto err = writeItem(Page::NS_INDEX, ItemType::U8, nsName, &ns, sizeof(ns));
-        if (err != ESP_OK) {
-            return err;
+/* Finds the items holding the previous values, searching each page for all values which haven't been found
+ * on the previous pages. If compare is set, values which are stored already are removed from writes. */
+static size_t findPreviousItems(PageManager& pageManager, uint8_t nsIndex, BatchWrite* writes, size_t count, bool compare)
+{
+    for (size_t i = 0; i < count; ++i) {
+        writes[i].prevPage = nullptr;
+    }
+    for (auto it = std::begin(pageManager); it != std::end(pageManager); ++it) {
+        for (size_t i = 0; i < count; ++i) {
+            BatchWrite& write = writes[i];
+            Item item;
+            size_t index = 0;
+            if (write.prevPage != nullptr
+                    || it->findItem(nsIndex, static_cast<ItemType>(write.request->type), write.request->key, index, item) != ESP_OK) {
+                continue;
+            }
+            write.prevPage = it;
+            write.prevIndex = index;
+            if (compare && it->cmpItemAt(write.prevIndex, item, write.request->value, write.dataSize) == ESP_OK) {
+                write.request = nullptr;
+            }
         }
-        mNamespaceUsage.set(ns, true);
-        nsIndex = ns;
-
-        entry->mIndex = ns;
-        strncpy(entry->mName, nsName, sizeof(entry->mName) - 1);
-        entry->mName[sizeof(entry->mName) - 1] = 0;
-        mNamespaces.push_back(entry);
-
-    } else {
-        nsIndex = it->mIndex;
     }
-    return ESP_OK;
+    if (!compare) {
+        return count;
+    }
+    return std::remove_if(writes, writes + count, [](const BatchWrite& write) {
+        return write.request == nullptr;
+    }) - writes;
 }
 
-esp_err_t Storage::readMultiPageBlob(uint8_t nsIndex, const char* key, void* data, size_t dataSize)
+/* Writes the entries of a batch to the active page, then erases the previous values with one call for each page */
+static esp_err_t writeBatch(Page& page, const Item* entries, size_t entryCount, BatchWrite* writes, size_t count, size_t* indices)
 {
-    Item item;
-    Page* findPage = nullptr;
-
-    /* First read the blob index */
-    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+    if (count == 0) {
+        return ESP_OK;
+    }
+    auto err = page.writeEntries(entries, entryCount);
     if (err != ESP_OK) {
         return err;
     }
-
-    uint8_t chunkCount = item.blobIndex.chunkCount;
-    VerOffset chunkStart = item.blobIndex.chunkStart;
-    size_t readSize = item.blobIndex.dataSize;
-    size_t offset = 0;
-
-    assert(dataSize == readSize);
-
-    /* Now read corresponding chunks */
-    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
-        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, static_cast<uint8_t> (chunkStart) + chunkNum);
-        if (err != ESP_OK) {
-            if (err == ESP_ERR_NVS_NOT_FOUND) {
-                break;
+    for (size_t i = 0; i < count; ++i) {
+        Page* prevPage = writes[i].prevPage;
+        if (prevPage == nullptr) {
+            continue;
+        }
+        size_t indexCount = 0;
+        for (size_t j = i; j < count; ++j) {
+            if (writes[j].prevPage == prevPage) {
+                indices[indexCount++] = writes[j].prevIndex;
+                writes[j].prevPage = nullptr;
             }
-            return err;
         }
-        err = findPage->readItem(nsIndex, ItemType::BLOB_DATA, key, static_cast<uint8_t*>(data) + offset, item.varLength.dataSize, static_cast<uint8_t> (chunkStart) + chunkNum);
+        err = prevPage->eraseItemsAt(indices, indexCount);
+        if (err == ESP_ERR_FLASH_OP_FAIL) {
+            return ESP_ERR_NVS_REMOVE_FAILED;
+        }
         if (err != ESP_OK) {
             return err;
         }
-        assert(static_cast<uint8_t> (chunkStart) + chunkNum == item.chunkIndex);
-        offset += item.varLength.dataSize;
-    }
-    if (err == ESP_OK) {
-        assert(offset == dataSize);
-    }
-    if (err == ESP_ERR_NVS_NOT_FOUND) {
-        eraseMultiPageBlob(nsIndex, key); // cleanup if a chunk is not found
     }
-    return err;
+    return ESP_OK;
 }
 
-esp_err_t Storage::cmpMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize)
+esp_err_t Storage::writeItems(uint8_t nsIndex, nvs_set_item_t* items, size_t count)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    std::unique_ptr<BatchWrite[]> writes(new (std::nothrow) BatchWrite[count]);
+    std::unique_ptr<Item[]> entries(new (std::nothrow) Item[Page::ENTRY_COUNT]);
+    std::unique_ptr<size_t[]> indices(new (std::nothrow) size_t[Page::ENTRY_COUNT]);
+    if (!writes || !entries || !indices) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t writeCount = 0;
+    for (size_t i = 0; i < count; ++i) {
+        items[i].err = checkWriteRequest(items[i]);
+        if (items[i].err == ESP_OK && isReservedByBlobWriter(nsIndex, items[i].key)) {
+            items[i].err = ESP_ERR_NVS_INVALID_STATE;
+        }
+        if (items[i].err != ESP_OK || items[i].type == NVS_TYPE_BLOB) {
+            continue;
+        }
+        BatchWrite& write = writes[writeCount++];
+        write.request = &items[i];
+        if (items[i].type == NVS_TYPE_STR) {
+            write.dataSize = strlen(static_cast<const char*>(items[i].value)) + 1;
+        } else {
+            write.dataSize = static_cast<uint8_t>(items[i].type) & 0x0f;
+        }
+    }
+
+    /* Of several values with the same key and type, only the last one is written */
+    std::sort(writes.get(), writes.get() + writeCount, batchWriteKeyLess);
+    size_t uniqueCount = 0;
+    for (size_t i = 0; i < writeCount; ++i) {
+        if (i + 1 < writeCount && writes[i].request->type == writes[i + 1].request->type
+                && strcmp(writes[i].request->key, writes[i + 1].request->key) == 0) {
+            continue;
+        }
+        writes[uniqueCount++] = writes[i];
+    }
+    std::sort(writes.get(), writes.get() + uniqueCount, batchWriteOrderLess);
+    writeCount = findPreviousItems(mPageManager, nsIndex, writes.get(), uniqueCount, true);
+
+    /* The values are collected in entries as long as they fit into the active page */
+    esp_err_t err = ESP_OK;
+    size_t entryCount = 0;
+    size_t batchBegin = 0;
+    for (size_t i = 0; i < writeCount; ++i) {
+        BatchWrite& write = writes[i];
+        ItemType datatype = static_cast<ItemType>(write.request->type);
+        if (entryCount + Page::getEntryCount(datatype, write.dataSize) > Page::ENTRY_COUNT) {
+            err = writeBatch(getCurrentPage(), entries.get(), entryCount, writes.get() + batchBegin, i - batchBegin, indices.get());
+            if (err != ESP_OK) {
+                break;
+            }
+            batchBegin = i;
+            entryCount = 0;
+        }
+        size_t itemEntries = Page::encodeItem(nsIndex, datatype, write.request->key, write.request->value, write.dataSize,
+                mCompress, entries.get() + entryCount);
+        if (entryCount + itemEntries <= getCurrentPage().getFreeEntryCount()) {
+            entryCount += itemEntries;
+            continue;
+        }
+
+        err = writeBatch(getCurrentPage(), entries.get(), entryCount, writes.get() + batchBegin, i - batchBegin, indices.get());
+        if (err != ESP_OK) {
+            break;
+        }
+        memmove(entries.get(), entries.get() + entryCount, itemEntries * sizeof(Item));
+        batchBegin = i;
+        entryCount = 0;
+
+        Page& page = getCurrentPage();
+        if (page.state() != Page::PageState::FULL) {
+            err = page.markFull();
+            if (err != ESP_OK) {
+                break;
+            }
+        }
+        err = requestNewPage();
+        if (err != ESP_OK) {
+            break;
+        }
+        /* The garbage collection may have moved the previous values */
+        findPreviousItems(mPageManager, nsIndex, writes.get() + i, writeCount - i, false);
+        if (itemEntries > getCurrentPage().getFreeEntryCount()) {
+            write.request->err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+            batchBegin = i + 1;
+            continue;
+        }
+        entryCount = itemEntries;
+    }
+    if (err == ESP_OK) {
+        err = writeBatch(getCurrentPage(), entries.get(), entryCount, writes.get() + batchBegin, writeCount - batchBegin, indices.get());
+    }
+    if (err != ESP_OK) {
+        for (size_t i = batchBegin; i < writeCount; ++i) {
+            writes[i].request->err = err;
+        }
+    }
+
+    /* Blobs are written one by one, since they may span several pages */
+    for (size_t i = 0; i < count; ++i) {
+        if (items[i].err == ESP_OK && items[i].type == NVS_TYPE_BLOB) {
+            items[i].err = writeItem(nsIndex, ItemType::BLOB, items[i].key, items[i].value, items[i].length);
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (items[i].err != ESP_OK) {
+            return items[i].err;
+        }
+    }
+#ifndef ESP_PLATFORM
+    debugCheck();
+#endif
+    return ESP_OK;
+}
+
+esp_err_t Storage::writeSharedBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize)
+{
+    /* The data is stored once in namespace NS_SHARED, with a key made of its checksum and size.
+     * The key the blob is written for only gets a reference to it */
+    Item ref(nsIndex, ItemType::BLOB_REF, 1, key);
+    ref.blobRef.dataSize = dataSize;
+    ref.blobRef.dataCrc32 = Item::calculateCrc32(static_cast<const uint8_t*>(data), dataSize);
+    char sharedKey[Item::MAX_KEY_LENGTH + 1];
+    sharedBlobKey(ref, sharedKey);
+
+    Page* findPage = nullptr;
+    Item item;
+    char prevSharedKey[Item::MAX_KEY_LENGTH + 1];
+    auto err = findBlobRef(nsIndex, key, findPage, item, prevSharedKey);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        return err;
+    }
+    bool hasPrevRef = (err == ESP_OK);
+
+    if (!hasPrevRef && cmpMultiPageBlob(nsIndex, key, data, dataSize) == ESP_OK) {
+        /* Stored for this key only, but unchanged. Rewriting it isn't worth an erasure of flash */
+        return ESP_OK;
+    }
+
+    auto node = std::find_if(mSharedBlobs.begin(), mSharedBlobs.end(), [=] (const SharedBlobNode& e) -> bool {
+        return strncmp(sharedKey, e.key, sizeof(e.key) - 1) == 0;
+    });
+    if (node != mSharedBlobs.end()) {
+        /* The same data was written before, for this or another key */
+        err = cmpMultiPageBlob(Page::NS_SHARED, sharedKey, data, dataSize);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (hasPrevRef && strcmp(prevSharedKey, sharedKey) == 0) {
+            return ESP_OK;
+        }
+    } else {
+        SharedBlobNode* entry = new (std::nothrow) SharedBlobNode;
+        if (!entry) {
+            return ESP_ERR_NO_MEM;
+        }
+        /* From the first shared blob on, the index isn't handed out to namespaces */
+        mNamespaceUsage.set(Page::NS_SHARED, true);
+        err = writeMultiPageBlob(Page::NS_SHARED, sharedKey, data, dataSize, VerOffset::VER_0_OFFSET);
+        if (err != ESP_OK) {
+            delete entry;
+            return (err == ESP_ERR_NVS_PAGE_FULL) ? ESP_ERR_NVS_NOT_ENOUGH_SPACE : err;
+        }
+        strncpy(entry->key, sharedKey, sizeof(entry->key));
+        entry->refCount = 0;
+        mSharedBlobs.push_back(entry);
+        node = entry;
+    }
+
+    node->refCount++;
+    err = writeToCurrentPage(nsIndex, ItemType::BLOB_REF, key, ref.data, sizeof(ref.data));
+    if (err != ESP_OK) {
+        releaseSharedBlob(sharedKey);
+        return err;
+    }
+
+    /* Remove the previous value. An earlier reference is found before the one just written */
+    if (hasPrevRef) {
+        err = findItem(nsIndex, ItemType::BLOB_REF, key, findPage, item);
+        if (err == ESP_OK) {
+            err = findPage->eraseItem(nsIndex, ItemType::BLOB_REF, key);
+        }
+        if (err == ESP_OK) {
+            err = releaseSharedBlob(prevSharedKey);
+        }
+    } else {
+        err = eraseMultiPageBlob(nsIndex, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            /* Support for earlier versions where BLOBS were stored without index */
+            err = findItem(nsIndex, ItemType::BLOB, key, findPage, item);
+            if (err == ESP_OK) {
+                err = findPage->eraseItem(nsIndex, ItemType::BLOB, key);
+            }
+        }
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_ERR_FLASH_OP_FAIL) {
+        return ESP_ERR_NVS_REMOVE_FAILED;
+    }
+    return err;
+}
+
+esp_err_t Storage::findBlobRef(uint8_t nsIndex, const char* key, Page* &page, Item& ref, char* sharedKey)
+{
+    if (!mSharedBlobsEnabled) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    auto err = findItem(nsIndex, ItemType::BLOB_REF, key, page, ref);
+    if (err == ESP_OK) {
+        sharedBlobKey(ref, sharedKey);
+    }
+    return err;
+}
+
+esp_err_t Storage::eraseBlobRef(uint8_t nsIndex, const char* key)
+{
+    Item item;
+    Page* findPage = nullptr;
+    char sharedKey[Item::MAX_KEY_LENGTH + 1];
+    auto err = findBlobRef(nsIndex, key, findPage, item, sharedKey);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = findPage->eraseItem(nsIndex, ItemType::BLOB_REF, key);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return releaseSharedBlob(sharedKey);
+}
+
+esp_err_t Storage::releaseSharedBlob(const char* sharedKey)
+{
+    auto node = std::find_if(mSharedBlobs.begin(), mSharedBlobs.end(), [=] (const SharedBlobNode& e) -> bool {
+        return strncmp(sharedKey, e.key, sizeof(e.key) - 1) == 0;
+    });
+    if (node == mSharedBlobs.end() || --node->refCount > 0) {
+        return ESP_OK;
+    }
+
+    /* If the shared blob can't be erased now, it is removed during the next init */
+    SharedBlobNode* entry = &*node;
+    mSharedBlobs.erase(entry);
+    delete entry;
+    return eraseMultiPageBlob(Page::NS_SHARED, sharedKey);
+}
+
+esp_err_t Storage::createOrOpenNamespace(const char* nsName, bool canCreate, uint8_t& nsIndex)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    auto it = std::find_if(mNamespaces.begin(), mNamespaces.end(), [=] (const NamespaceEntry& e) -> bool {
+        return strncmp(nsName, e.mName, sizeof(e.mName) - 1) == 0;
+    });
+    if (it == std::end(mNamespaces)) {
+        if (!canCreate) {
+            return ESP_ERR_NVS_NOT_FOUND;
+        }
+
+        uint8_t ns = findFreeNamespaceIndex();
+        if (ns == 255) {
+            /* The indices of erased namespaces are taken until their items are gone */
+            for (uint8_t erased = 1; erased < 255; ++erased) {
+                if (mPageManager.isNamespaceErased(erased)) {
+                    auto err = purgeErasedNamespace(erased);
+                    if (err != ESP_OK) {
+                        return err;
+                    }
+                }
+            }
+            ns = findFreeNamespaceIndex();
+        }
+
+        if (ns == 255) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+
+        NamespaceEntry* entry = new (std::nothrow) NamespaceEntry;
+        if (!entry) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        auto err = writeItem(Page::NS_INDEX, ItemType::U8, nsName, &ns, sizeof(ns));
+        if (err != ESP_OK) {
+            return err;
+        }
+        mNamespaceUsage.set(ns, true);
+        if (ns == Page::NS_SHARED) {
+            mSharedBlobsEnabled = false;
+        }
+        nsIndex = ns;
+
+        entry->mIndex = ns;
+        strncpy(entry->mName, nsName, sizeof(entry->mName) - 1);
+        entry->mName[sizeof(entry->mName) - 1] = 0;
+        mNamespaces.push_back(entry);
+
+    } else {
+        nsIndex = it->mIndex;
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::readMultiPageBlob(uint8_t nsIndex, const char* key, void* data, size_t dataSize)
+{
+    Item item;
+    Page* findPage = nullptr;
+
+    /* First read the blob index */
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    assert(dataSize == item.blobIndex.dataSize);
+    return readMultiPageBlobChunks(nsIndex, key, item, data);
+}
+
+esp_err_t Storage::readMultiPageBlobChunks(uint8_t nsIndex, const char* key, const Item& blobIndex, void* data)
+{
+    Item item;
+    Page* findPage = nullptr;
+    esp_err_t err = ESP_OK;
+    uint8_t chunkCount = blobIndex.blobIndex.chunkCount;
+    VerOffset chunkStart = blobIndex.blobIndex.chunkStart;
+    uint16_t chunkVerMap = blobIndex.blobIndex.chunkVerMap;
+    size_t offset = 0;
+
+    /* Now read corresponding chunks */
+    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
+        uint8_t chunkIdx = blobChunkIndex(chunkStart, chunkVerMap, chunkNum);
+        size_t itemIndex;
+        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, itemIndex, item, chunkIdx);
+        if (err != ESP_OK) {
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                break;
+            }
+            return err;
+        }
+        err = findPage->readItemAt(itemIndex, item, static_cast<uint8_t*>(data) + offset, item.varLength.dataSize);
+        if (err != ESP_OK) {
+            return err;
+        }
+        assert(chunkIdx == item.chunkIndex);
+        offset += item.varLength.dataSize;
+    }
+    if (err == ESP_OK) {
+        assert(offset == blobIndex.blobIndex.dataSize);
+    }
+    if (err == ESP_ERR_NVS_NOT_FOUND && !mLock.isShared()) {
+        eraseMultiPageBlob(nsIndex, key); // cleanup if a chunk is not found
+    }
+    return err;
+}
+
+esp_err_t Storage::cmpMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize)
 {
     Item item;
     Page* findPage = nullptr;
@@ -492,6 +1178,7 @@ esp_err_t Storage::cmpMultiPageBlob(uint8_t nsIndex, const char* key, const void
 
     uint8_t chunkCount = item.blobIndex.chunkCount;
     VerOffset chunkStart = item.blobIndex.chunkStart;
+    uint16_t chunkVerMap = item.blobIndex.chunkVerMap;
     size_t readSize = item.blobIndex.dataSize;
     size_t offset = 0;
 
@@ -499,139 +1186,1311 @@ esp_err_t Storage::cmpMultiPageBlob(uint8_t nsIndex, const char* key, const void
         return ESP_ERR_NVS_CONTENT_DIFFERS;
     }
 
-    /* Now read corresponding chunks */
-    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
-        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, static_cast<uint8_t> (chunkStart) + chunkNum);
-        if (err != ESP_OK) {
-            if (err == ESP_ERR_NVS_NOT_FOUND) {
-                break;
-            }
-            return err;
+    /* Now read corresponding chunks */
+    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
+        uint8_t chunkIdx = blobChunkIndex(chunkStart, chunkVerMap, chunkNum);
+        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, chunkIdx);
+        if (err != ESP_OK) {
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                break;
+            }
+            return err;
+        }
+        err = findPage->cmpItem(nsIndex, ItemType::BLOB_DATA, key, static_cast<const uint8_t*>(data) + offset, item.varLength.dataSize, chunkIdx);
+        if (err != ESP_OK) {
+            return err;
+        }
+        assert(chunkIdx == item.chunkIndex);
+        offset += item.varLength.dataSize;
+    }
+    if (err == ESP_OK) {
+        assert(offset == dataSize);
+    }
+    return err;
+}
+
+esp_err_t Storage::readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    Item item;
+    Page* findPage = nullptr;
+    if (datatype == ItemType::BLOB) {
+        auto err = readMultiPageBlob(nsIndex, key, data, dataSize);
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+
+        char sharedKey[Item::MAX_KEY_LENGTH + 1];
+        err = findBlobRef(nsIndex, key, findPage, item, sharedKey);
+        if (err == ESP_OK) {
+            assert(dataSize == item.blobRef.dataSize);
+            return readMultiPageBlob(Page::NS_SHARED, sharedKey, data, dataSize);
+        } // else check if the blob is stored with earlier version format without index
+    }
+
+    auto err = findItem(nsIndex, datatype, key, findPage, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return findPage->readItem(nsIndex, datatype, key, data, dataSize);
+
+}
+
+esp_err_t Storage::readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize, ItemLocation& location)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (datatype == ItemType::BLOB) {
+        location.page = nullptr;
+        return readItem(nsIndex, datatype, key, data, dataSize);
+    }
+
+    Item item;
+    if (location.page != nullptr && location.loadCount == mPageManager.getLoadCount()
+            && location.page->findItemAt(location.index, location.itemGeneration, nsIndex, datatype, key, item) == ESP_OK) {
+        return location.page->readItemAt(location.index, item, data, dataSize);
+    }
+
+    location.page = nullptr;
+    Page* findPage = nullptr;
+    size_t itemIndex;
+    auto err = findItem(nsIndex, datatype, key, findPage, itemIndex, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+    location.page = findPage;
+    location.loadCount = mPageManager.getLoadCount();
+    location.itemGeneration = findPage->getItemGeneration();
+    location.index = itemIndex;
+    return findPage->readItemAt(itemIndex, item, data, dataSize);
+}
+
+esp_err_t Storage::readItem(uint8_t nsIndex, ItemType datatype, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t& dataSize)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    Item item;
+    Page* findPage = nullptr;
+    size_t itemIndex;
+    void* data;
+    if (datatype == ItemType::BLOB) {
+        /* Blobs are looked up in the same order as readItem does */
+        uint8_t blobNsIndex = nsIndex;
+        const char* blobKey = key;
+        char sharedKey[Item::MAX_KEY_LENGTH + 1];
+        auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+        if (err == ESP_ERR_NVS_NOT_FOUND && findBlobRef(nsIndex, key, findPage, item, sharedKey) == ESP_OK) {
+            blobNsIndex = Page::NS_SHARED;
+            blobKey = sharedKey;
+            err = findItem(blobNsIndex, ItemType::BLOB_IDX, blobKey, findPage, item);
+        }
+        if (err == ESP_OK) {
+            dataSize = item.blobIndex.dataSize;
+            data = alloc(arg, dataSize);
+            if (data == nullptr && dataSize != 0) {
+                return ESP_ERR_NO_MEM;
+            }
+            return readMultiPageBlobChunks(blobNsIndex, blobKey, item, data);
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        } // else check if the blob is stored with earlier version format without index
+    }
+
+    auto err = findItem(nsIndex, datatype, key, findPage, itemIndex, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+    dataSize = item.varLength.dataSize;
+    data = alloc(arg, dataSize);
+    if (data == nullptr && dataSize != 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    return findPage->readItemAt(itemIndex, item, data, dataSize);
+}
+
+/* Checks a value requested from readItems. Values which can be read are not found until they are. */
+static esp_err_t checkRequest(const nvs_get_item_t& request)
+{
+    if (request.key == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    switch (request.type) {
+    case NVS_TYPE_U8:
+    case NVS_TYPE_I8:
+    case NVS_TYPE_U16:
+    case NVS_TYPE_I16:
+    case NVS_TYPE_U32:
+    case NVS_TYPE_I32:
+    case NVS_TYPE_U64:
+    case NVS_TYPE_I64:
+        return (request.out_value != nullptr) ? ESP_ERR_NVS_NOT_FOUND : ESP_ERR_INVALID_ARG;
+    case NVS_TYPE_STR:
+    case NVS_TYPE_BLOB:
+        return ESP_ERR_NVS_NOT_FOUND;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+}
+
+/* Sets the length of a requested string or blob like nvs_get_str and nvs_get_blob do */
+static esp_err_t setRequestLength(nvs_get_item_t& request, size_t dataSize)
+{
+    bool fits = request.out_value == nullptr || request.length >= dataSize;
+    request.length = dataSize;
+    return fits ? ESP_OK : ESP_ERR_NVS_INVALID_LENGTH;
+}
+
+esp_err_t Storage::readItems(uint8_t nsIndex, nvs_get_item_t* items, size_t count)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    size_t pending = 0;
+    for (size_t i = 0; i < count; ++i) {
+        items[i].err = checkRequest(items[i]);
+        if (items[i].err == ESP_ERR_NVS_NOT_FOUND && items[i].type != NVS_TYPE_BLOB) {
+            ++pending;
+        }
+    }
+
+    /* Each page is searched for all values which haven't been found on the previous pages,
+     * which is the order in which readItem would find them */
+    for (auto it = std::begin(mPageManager); it != std::end(mPageManager) && pending > 0; ++it) {
+        for (size_t i = 0; i < count; ++i) {
+            nvs_get_item_t& request = items[i];
+            if (request.err != ESP_ERR_NVS_NOT_FOUND || request.type == NVS_TYPE_BLOB) {
+                continue;
+            }
+            size_t itemIndex = 0;
+            Item item;
+            if (it->findItem(nsIndex, static_cast<ItemType>(request.type), request.key, itemIndex, item) != ESP_OK) {
+                continue;
+            }
+            --pending;
+            if (item.datatype != ItemType::SZ) {
+                /* the size of an integer is encoded in the lower bits of its type */
+                size_t dataSize = static_cast<uint8_t>(item.datatype) & 0x0f;
+                request.err = it->readItemAt(itemIndex, item, request.out_value, dataSize);
+                continue;
+            }
+            request.err = setRequestLength(request, item.varLength.dataSize);
+            if (request.err == ESP_OK && request.out_value != nullptr) {
+                request.err = it->readItemAt(itemIndex, item, request.out_value, request.length);
+            }
+        }
+    }
+
+    /* Blobs may be stored in several ways, which are tried in order by readItem */
+    for (size_t i = 0; i < count; ++i) {
+        nvs_get_item_t& request = items[i];
+        if (request.err != ESP_ERR_NVS_NOT_FOUND || request.type != NVS_TYPE_BLOB) {
+            continue;
+        }
+        size_t dataSize;
+        request.err = getItemDataSize(nsIndex, ItemType::BLOB, request.key, dataSize);
+        if (request.err == ESP_OK) {
+            request.err = setRequestLength(request, dataSize);
+        }
+        if (request.err == ESP_OK && request.out_value != nullptr) {
+            request.err = readItem(nsIndex, ItemType::BLOB, request.key, request.out_value, dataSize);
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (items[i].err != ESP_OK) {
+            return items[i].err;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::eraseMultiPageBlob(uint8_t nsIndex, const char* key, VerOffset chunkStart)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    Item item;
+    Page* findPage = nullptr;
+
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, Page::CHUNK_ANY, chunkStart);
+    if (err != ESP_OK) {
+        return err;
+    }
+    /* Erase the index first and make children blobs orphan*/
+    err = findPage->eraseItem(nsIndex, ItemType::BLOB_IDX, key, Page::CHUNK_ANY, chunkStart);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    uint8_t chunkCount = item.blobIndex.chunkCount;
+    uint16_t chunkVerMap = item.blobIndex.chunkVerMap;
+
+    if (chunkStart == VerOffset::VER_ANY) {
+        chunkStart = item.blobIndex.chunkStart;
+    } else {
+        assert(chunkStart == item.blobIndex.chunkStart);
+    }
+
+    /* Now erase corresponding chunks*/
+    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
+        uint8_t chunkIdx = blobChunkIndex(chunkStart, chunkVerMap, chunkNum);
+        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, chunkIdx);
+
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            continue; // Keep erasing other chunks
+        }
+        err = findPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, chunkIdx);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t Storage::openBlobWriter(uint8_t nsIndex, const char* key, size_t bufferSize, BlobWriter& writer)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (writer.isOpen()) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    if (strlen(key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    if (bufferSize == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (bufferSize > Page::CHUNK_MAX_SIZE) {
+        bufferSize = Page::CHUNK_MAX_SIZE;
+    }
+    /* Another writer of the key would write chunks with the same indices */
+    if (isReservedByBlobWriter(nsIndex, key)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    Item item;
+    Page* findPage = nullptr;
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        return err;
+    }
+
+    /* The chunks are written with the toggled version, like in writeItem, so that they stay orphans
+     * until the new index is written */
+    writer.hasPrevIndex = (err == ESP_OK);
+    writer.prevStart = VerOffset::VER_0_OFFSET;
+    writer.chunkStart = VerOffset::VER_0_OFFSET;
+    writer.chunkVerMap = 0xffff;
+    if (writer.hasPrevIndex) {
+        writer.prevStart = item.blobIndex.chunkStart;
+        writer.chunkStart
+            = (writer.prevStart == VerOffset::VER_1_OFFSET) ? VerOffset::VER_0_OFFSET : VerOffset::VER_1_OFFSET;
+        writer.chunkVerMap = item.blobIndex.chunkVerMap;
+        if (item.blobIndex.chunkCount < CHUNK_VER_MAP_BITS) {
+            writer.chunkVerMap |= ~((1 << item.blobIndex.chunkCount) - 1);
+        }
+    }
+
+    writer.buffer = new (std::nothrow) uint8_t[bufferSize];
+    if (!writer.buffer) {
+        return ESP_ERR_NO_MEM;
+    }
+    strncpy(writer.key, key, sizeof(writer.key) - 1);
+    writer.key[sizeof(writer.key) - 1] = 0;
+    writer.nsIndex = nsIndex;
+    writer.chunkCount = 0;
+    writer.dataSize = 0;
+    writer.bufferSize = bufferSize;
+    writer.bufferUsed = 0;
+    mBlobWriters.push_back(&writer);
+    return ESP_OK;
+}
+
+void Storage::closeBlobWriter(BlobWriter& writer)
+{
+    mBlobWriters.erase(&writer);
+    delete[] writer.buffer;
+    writer.buffer = nullptr;
+}
+
+bool Storage::isReservedByBlobWriter(uint8_t nsIndex, const char* key)
+{
+    return std::any_of(mBlobWriters.begin(), mBlobWriters.end(), [=] (const BlobWriter& w) -> bool {
+        return w.nsIndex == nsIndex && (key == nullptr || strcmp(w.key, key) == 0);
+    });
+}
+
+esp_err_t Storage::flushBlobWriter(BlobWriter& writer, bool all)
+{
+    while (writer.bufferUsed == writer.bufferSize || (all && writer.bufferUsed > 0)) {
+        if (writer.chunkCount >= (Page::CHUNK_ANY - 1) / 2) {
+            return ESP_ERR_NVS_VALUE_TOO_LONG;
+        }
+
+        Page& page = getCurrentPage();
+        size_t tailroom = page.getVarDataTailroom();
+        if (tailroom < writer.bufferUsed && tailroom < Page::CHUNK_MAX_SIZE / 10) {
+            /* Tailroom is too small to be worth another chunk */
+            if (page.state() != Page::PageState::FULL) {
+                auto err = page.markFull();
+                if (err != ESP_OK) {
+                    return err;
+                }
+            }
+            auto err = requestNewPage();
+            if (err != ESP_OK) {
+                return err;
+            }
+            if (getCurrentPage().getVarDataTailroom() == tailroom) {
+                return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+            }
+            continue;
+        }
+
+        /* Write what fits onto the current page, the rest stays in the buffer */
+        size_t chunkSize = std::min(writer.bufferUsed, tailroom);
+        uint8_t chunkIdx = blobChunkIndex(writer.chunkStart, writer.chunkVerMap, writer.chunkCount);
+        auto err = page.writeItem(writer.nsIndex, ItemType::BLOB_DATA, writer.key, writer.buffer, chunkSize, chunkIdx, mCompress);
+        assert(err != ESP_ERR_NVS_PAGE_FULL);
+        if (err != ESP_OK) {
+            return err;
+        }
+        writer.chunkCount++;
+        writer.bufferUsed -= chunkSize;
+        memmove(writer.buffer, writer.buffer + chunkSize, writer.bufferUsed);
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::appendBlobWriter(BlobWriter& writer, const void* data, size_t dataSize)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (!writer.isOpen()) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+    while (dataSize > 0) {
+        size_t copySize = std::min(dataSize, writer.bufferSize - writer.bufferUsed);
+        memcpy(writer.buffer + writer.bufferUsed, src, copySize);
+        writer.bufferUsed += copySize;
+        writer.dataSize += copySize;
+        src += copySize;
+        dataSize -= copySize;
+
+        auto err = flushBlobWriter(writer, false);
+        if (err != ESP_OK) {
+            abortBlobWriter(writer);
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::finalizeBlobWriter(BlobWriter& writer)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (!writer.isOpen()) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    auto err = flushBlobWriter(writer, true);
+    if (err == ESP_OK && writer.chunkCount == 0) {
+        /* An empty blob still consists of one (empty) chunk */
+        err = writeToCurrentPage(writer.nsIndex, ItemType::BLOB_DATA, writer.key, nullptr, 0,
+                blobChunkIndex(writer.chunkStart, writer.chunkVerMap, 0));
+        if (err == ESP_OK) {
+            writer.chunkCount = 1;
+        }
+    }
+
+    /* Make sure the previous index is still the one the chunk versions were chosen for */
+    Item item;
+    Page* findPage = nullptr;
+    bool hasPrevIndex = false;
+    if (err == ESP_OK) {
+        err = findItem(writer.nsIndex, ItemType::BLOB_IDX, writer.key, findPage, item);
+        if (err == ESP_OK) {
+            hasPrevIndex = true;
+            if (!writer.hasPrevIndex || item.blobIndex.chunkStart != writer.prevStart) {
+                err = ESP_ERR_NVS_INVALID_STATE;
+            }
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+
+    if (err == ESP_OK) {
+        std::fill_n(item.data, sizeof(item.data), 0xff);
+        item.blobIndex.dataSize = writer.dataSize;
+        item.blobIndex.chunkCount = writer.chunkCount;
+        item.blobIndex.chunkStart = writer.chunkStart;
+        item.blobIndex.chunkVerMap = writer.chunkVerMap;
+        if (writer.chunkCount < CHUNK_VER_MAP_BITS) {
+            item.blobIndex.chunkVerMap |= ~((1 << writer.chunkCount) - 1);
+        }
+        err = writeToCurrentPage(writer.nsIndex, ItemType::BLOB_IDX, writer.key, item.data, sizeof(item.data));
+    }
+
+    if (err != ESP_OK) {
+        abortBlobWriter(writer);
+        return err;
+    }
+
+    closeBlobWriter(writer);
+
+    if (hasPrevIndex) {
+        /* Erase the blob with earlier version*/
+        err = eraseMultiPageBlob(writer.nsIndex, writer.key, writer.prevStart);
+    } else {
+        /* Support for earlier versions where BLOBS were stored without index */
+        err = findItem(writer.nsIndex, ItemType::BLOB, writer.key, findPage, item);
+        if (err == ESP_OK) {
+            err = findPage->eraseItem(writer.nsIndex, ItemType::BLOB, writer.key);
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            /* The key may have referred to a shared blob */
+            err = eraseBlobRef(writer.nsIndex, writer.key);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+            }
+        }
+    }
+    if (err == ESP_ERR_FLASH_OP_FAIL) {
+        return ESP_ERR_NVS_REMOVE_FAILED;
+    }
+#ifndef ESP_PLATFORM
+    if (err == ESP_OK) {
+        debugCheck();
+    }
+#endif
+    return err;
+}
+
+void Storage::abortBlobWriter(BlobWriter& writer)
+{
+    if (!writer.isOpen()) {
+        return;
+    }
+
+    /* No index refers to the chunks written so far. If they can't be erased now, they are
+     * removed as orphans during the next init */
+    if (mState == StorageState::ACTIVE) {
+        eraseBlobWriterChunks(writer);
+    }
+    closeBlobWriter(writer);
+}
+
+void Storage::eraseBlobWriterChunks(BlobWriter& writer)
+{
+    /* The writer's chunks have the chunk indices the current index doesn't use. Chunks the current
+     * index refers to are never erased, should it have been replaced while the writer was open */
+    Item index;
+    Page* findPage = nullptr;
+    bool hasIndex = (findItem(writer.nsIndex, ItemType::BLOB_IDX, writer.key, findPage, index) == ESP_OK);
+    for (uint8_t chunkNum = 0; chunkNum < writer.chunkCount; chunkNum++) {
+        uint8_t chunkIdx = blobChunkIndex(writer.chunkStart, writer.chunkVerMap, chunkNum);
+        if (hasIndex) {
+            bool used = false;
+            for (uint8_t i = 0; i < index.blobIndex.chunkCount && !used; i++) {
+                used = (blobChunkIndex(index.blobIndex.chunkStart, index.blobIndex.chunkVerMap, i) == chunkIdx);
+            }
+            if (used) {
+                continue;
+            }
+        }
+        Item item;
+        if (findItem(writer.nsIndex, ItemType::BLOB_DATA, writer.key, findPage, item, chunkIdx) == ESP_OK) {
+            findPage->eraseItem(writer.nsIndex, ItemType::BLOB_DATA, writer.key, chunkIdx);
+        }
+    }
+}
+
+esp_err_t Storage::openBlobReader(uint8_t nsIndex, const char* key, BlobReader& reader)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (strlen(key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    reader.open = false;
+    strncpy(reader.key, key, sizeof(reader.key) - 1);
+    reader.key[sizeof(reader.key) - 1] = 0;
+    reader.nsIndex = nsIndex;
+
+    Item item;
+    Page* findPage = nullptr;
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+    if (err == ESP_ERR_NVS_NOT_FOUND && findBlobRef(nsIndex, key, findPage, item, reader.key) == ESP_OK) {
+        /* The shared blob the key refers to is read instead */
+        reader.nsIndex = Page::NS_SHARED;
+        err = findItem(reader.nsIndex, ItemType::BLOB_IDX, reader.key, findPage, item);
+    }
+    if (err == ESP_OK) {
+        reader.hasIndex = true;
+        reader.chunkStart = item.blobIndex.chunkStart;
+        reader.chunkVerMap = item.blobIndex.chunkVerMap;
+        reader.chunkCount = item.blobIndex.chunkCount;
+        reader.dataSize = item.blobIndex.dataSize;
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        /* Support for earlier versions where BLOBS were stored without index */
+        reader.hasIndex = false;
+        reader.chunkCount = 1;
+        reader.dataSize = 0;
+    } else {
+        return err;
+    }
+
+    reader.offset = 0;
+    reader.chunkNum = 0;
+    reader.chunkOffset = 0;
+    err = findBlobReaderChunk(reader, findPage, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+    reader.chunkSize = item.varLength.dataSize;
+    if (!reader.hasIndex) {
+        reader.dataSize = reader.chunkSize;
+    }
+    reader.open = true;
+    return ESP_OK;
+}
+
+esp_err_t Storage::findBlobReaderChunk(BlobReader& reader, Page* &page, Item& item)
+{
+    if (!reader.hasIndex) {
+        return findItem(reader.nsIndex, ItemType::BLOB, reader.key, page, item);
+    }
+    uint8_t chunkIdx = blobChunkIndex(reader.chunkStart, reader.chunkVerMap, reader.chunkNum);
+    return findItem(reader.nsIndex, ItemType::BLOB_DATA, reader.key, page, item, chunkIdx);
+}
+
+esp_err_t Storage::readBlobReader(BlobReader& reader, void* data, size_t dataSize, size_t& readSize)
+{
+    readSize = 0;
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (!reader.isOpen()) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    uint8_t* dst = static_cast<uint8_t*>(data);
+    while (dataSize > 0 && reader.offset < reader.dataSize) {
+        Item item;
+        Page* findPage = nullptr;
+        esp_err_t err;
+
+        /* Skip to the chunk containing the current offset, only looking at the chunk headers */
+        while (reader.offset >= reader.chunkOffset + reader.chunkSize) {
+            if (reader.chunkNum + 1 >= reader.chunkCount) {
+                return ESP_ERR_NVS_NOT_FOUND;
+            }
+            reader.chunkOffset += reader.chunkSize;
+            reader.chunkNum++;
+            err = findBlobReaderChunk(reader, findPage, item);
+            if (err != ESP_OK) {
+                return err;
+            }
+            reader.chunkSize = item.varLength.dataSize;
+        }
+
+        if (!findPage) {
+            err = findBlobReaderChunk(reader, findPage, item);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        size_t copySize = std::min(dataSize, reader.chunkOffset + reader.chunkSize - reader.offset);
+        err = findPage->readItemRange(reader.nsIndex, item.datatype, reader.key, reader.offset - reader.chunkOffset,
+                dst, copySize, item.chunkIndex);
+        if (err != ESP_OK) {
+            return err;
+        }
+        reader.offset += copySize;
+        readSize += copySize;
+        dst += copySize;
+        dataSize -= copySize;
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::readBlobRange(uint8_t nsIndex, const char* key, size_t offset, void* data, size_t dataSize)
+{
+    BlobReader reader;
+    auto err = openBlobReader(nsIndex, key, reader);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (offset > reader.dataSize || dataSize > reader.dataSize - offset) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    reader.offset = offset;
+    size_t readSize;
+    err = readBlobReader(reader, data, dataSize, readSize);
+    if (err != ESP_OK) {
+        return err;
+    }
+    assert(readSize == dataSize);
+    return ESP_OK;
+}
+
+esp_err_t Storage::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (isReservedByBlobWriter(nsIndex, key)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    if (datatype == ItemType::BLOB) {
+        auto err = eraseMultiPageBlob(nsIndex, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = eraseBlobRef(nsIndex, key);
+        }
+        return err;
+    }
+
+    Item item;
+    Page* findPage = nullptr;
+    auto err = findItem(nsIndex, datatype, key, findPage, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (item.datatype == ItemType::BLOB_DATA || item.datatype == ItemType::BLOB_IDX) {
+        return eraseMultiPageBlob(nsIndex, key);
+    }
+
+    if (item.datatype == ItemType::BLOB_REF) {
+        return eraseBlobRef(nsIndex, key);
+    }
+
+    if (item.datatype == ItemType::LOG) {
+        return eraseLog(nsIndex, key);
+    }
+
+    return findPage->eraseItem(nsIndex, datatype, key);
+}
+
+/* Mask of the low bytes of a uint64_t which hold an integer of the given type */
+static uint64_t integerMask(ItemType datatype)
+{
+    size_t size = static_cast<uint8_t>(datatype) & 0x0f;
+    return (size == sizeof(uint64_t)) ? UINT64_MAX : (UINT64_C(1) << (8 * size)) - 1;
+}
+
+esp_err_t Storage::readIntegerItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, size_t& itemIndex, uint64_t& value)
+{
+    Item item;
+    page = nullptr;
+    auto err = findItem(nsIndex, datatype, key, page, itemIndex, item);
+    if (err != ESP_OK) {
+        return err;
+    }
+    value = 0;
+    return page->readItemAt(itemIndex, item, &value, static_cast<uint8_t>(datatype) & 0x0f);
+}
+
+esp_err_t Storage::replaceIntegerItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* page, size_t itemIndex, uint64_t value)
+{
+    uint32_t itemGeneration = (page != nullptr) ? page->getItemGeneration() : 0;
+    auto err = writeToCurrentPage(nsIndex, datatype, key, &value, static_cast<uint8_t>(datatype) & 0x0f);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (page != nullptr) {
+        err = eraseReplacedItem(nsIndex, datatype, key, page, itemIndex, itemGeneration);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+#ifndef ESP_PLATFORM
+    debugCheck();
+#endif
+    return ESP_OK;
+}
+
+esp_err_t Storage::eraseReplacedItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* page, size_t itemIndex, uint32_t itemGeneration)
+{
+    /* The garbage collection may have moved the old item while a new page was requested. It is then
+     * still found before the new one. */
+    if (page->getItemGeneration() != itemGeneration) {
+        Item item;
+        ESP_ERROR_CHECK(findItem(nsIndex, datatype, key, page, itemIndex, item));
+    }
+    auto err = page->eraseItemsAt(&itemIndex, 1);
+    if (err == ESP_ERR_FLASH_OP_FAIL) {
+        return ESP_ERR_NVS_REMOVE_FAILED;
+    }
+    return err;
+}
+
+esp_err_t Storage::writeReservedItemToCurrentPage(Item& item, Page* &page, size_t& index)
+{
+    page = &getCurrentPage();
+    auto err = page->writeReservedItem(item, index);
+    if (err == ESP_ERR_NVS_PAGE_FULL) {
+        if (page->state() != Page::PageState::FULL) {
+            err = page->markFull();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        err = requestNewPage();
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        page = &getCurrentPage();
+        err = page->writeReservedItem(item, index);
+        if (err == ESP_ERR_NVS_PAGE_FULL) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+    }
+    return err;
+}
+
+esp_err_t Storage::incrementCounter(uint8_t nsIndex, const char* key, uint32_t delta, uint32_t& value)
+{
+    if (strlen(key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    Page* page = nullptr;
+    size_t itemIndex;
+    Item item;
+    uint32_t current = 0;
+    size_t clearedBits = 0;
+    auto err = findItem(nsIndex, ItemType::COUNTER, key, page, itemIndex, item);
+    if (err == ESP_OK) {
+        err = page->readCounterAt(itemIndex, item, current, clearedBits);
+    }
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        page = nullptr;
+    } else if (err != ESP_OK) {
+        return err;
+    }
+
+    if (page != nullptr) {
+        if (delta == 0) {
+            value = current;
+            return ESP_OK;
+        }
+        if (clearedBits + delta <= (item.span - 1) * Page::ENTRY_SIZE * 8) {
+            err = page->incrementCounterAt(itemIndex, clearedBits, delta);
+            if (err != ESP_OK) {
+                return err;
+            }
+            value = current + delta;
+            return ESP_OK;
+        }
+    }
+
+    /* Bits of encrypted data can't be cleared in place, so there every increment writes a new counter */
+    const size_t dataEntries = mPartition->is_encrypted() ? 0 : NVS_COUNTER_DATA_ENTRIES;
+    uint32_t itemGeneration = (page != nullptr) ? page->getItemGeneration() : 0;
+    Item counter(nsIndex, ItemType::COUNTER, 1 + dataEntries, key);
+    counter.counter.base = current + delta;
+    Page* newPage;
+    size_t newIndex;
+    err = writeReservedItemToCurrentPage(counter, newPage, newIndex);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (page != nullptr) {
+        err = eraseReplacedItem(nsIndex, ItemType::COUNTER, key, page, itemIndex, itemGeneration);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+#ifndef ESP_PLATFORM
+    debugCheck();
+#endif
+    value = current + delta;
+    return ESP_OK;
+}
+
+esp_err_t Storage::incrementItem(uint8_t nsIndex, ItemType datatype, const char* key, uint64_t delta, uint64_t& value)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (isReservedByBlobWriter(nsIndex, key)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    if (datatype == ItemType::COUNTER) {
+        uint32_t counter;
+        auto err = incrementCounter(nsIndex, key, static_cast<uint32_t>(delta), counter);
+        if (err == ESP_OK) {
+            value = counter;
+        }
+        return err;
+    }
+    if (!isIntegerType(datatype)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    Page* page;
+    size_t itemIndex;
+    uint64_t current = 0;
+    auto err = readIntegerItem(nsIndex, datatype, key, page, itemIndex, current);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        page = nullptr;
+    } else if (err != ESP_OK) {
+        return err;
+    }
+
+    const uint64_t mask = integerMask(datatype);
+    if (page != nullptr && (delta & mask) == 0) {
+        value = current;
+        return ESP_OK;
+    }
+    err = replaceIntegerItem(nsIndex, datatype, key, page, itemIndex, (current + delta) & mask);
+    if (err != ESP_OK) {
+        return err;
+    }
+    value = (current + delta) & mask;
+    return ESP_OK;
+}
+
+esp_err_t Storage::compareAndSwapItem(uint8_t nsIndex, ItemType datatype, const char* key, uint64_t& expected, uint64_t desired)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (isReservedByBlobWriter(nsIndex, key)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    if (!isIntegerType(datatype)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    Page* page;
+    size_t itemIndex;
+    uint64_t current;
+    auto err = readIntegerItem(nsIndex, datatype, key, page, itemIndex, current);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    const uint64_t mask = integerMask(datatype);
+    if (current != (expected & mask)) {
+        expected = current;
+        return ESP_ERR_NVS_VALUE_CHANGED;
+    }
+    if (current == (desired & mask)) {
+        return ESP_OK;
+    }
+    return replaceIntegerItem(nsIndex, datatype, key, page, itemIndex, desired & mask);
+}
+
+esp_err_t Storage::findNewestLogBlock(uint8_t nsIndex, const char* key, Page* &page, size_t& index, Item& block)
+{
+    /* The garbage collection copies the newest full block of a log along with the open one, so the newest block
+     * isn't always on the last page which holds blocks of the log */
+    page = nullptr;
+    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
+        size_t itemIndex = 0;
+        Item item;
+        esp_err_t err;
+        while ((err = it->findItem(nsIndex, ItemType::LOG, key, itemIndex, item)) == ESP_OK) {
+            if (page == nullptr || item.logBlock.firstSeq > block.logBlock.firstSeq) {
+                page = it;
+                index = itemIndex;
+                block = item;
+            }
+            itemIndex += item.span;
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
+    return (page != nullptr) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t Storage::findLogBlockAfter(uint8_t nsIndex, const char* key, uint32_t seq, Page* &page, size_t& index, Item& block)
+{
+    page = nullptr;
+    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
+        size_t itemIndex = 0;
+        Item item;
+        esp_err_t err;
+        while ((err = it->findItem(nsIndex, ItemType::LOG, key, itemIndex, item)) == ESP_OK) {
+            if (item.logBlock.firstSeq + (item.span - 1) > seq
+                    && (page == nullptr || item.logBlock.firstSeq < block.logBlock.firstSeq)) {
+                page = it;
+                index = itemIndex;
+                block = item;
+            }
+            itemIndex += item.span;
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
+    return (page != nullptr) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t Storage::writeLogBlock(uint8_t nsIndex, const char* key, uint32_t firstSeq, Page* &page, size_t& index, Item& block)
+{
+    block = Item(nsIndex, ItemType::LOG, 1 + NVS_LOG_BLOCK_RECORDS, key);
+    block.logBlock.firstSeq = firstSeq;
+    auto err = writeReservedItemToCurrentPage(block, page, index);
+#ifndef ESP_PLATFORM
+    if (err == ESP_OK) {
+        debugCheck();
+    }
+#endif
+    return err;
+}
+
+esp_err_t Storage::appendLogRecord(uint8_t nsIndex, const char* key, const void* data, size_t size, uint32_t& seq)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (strlen(key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    if (size > LogRecord::MAX_SIZE) {
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    }
+    if (isReservedByBlobWriter(nsIndex, key)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    Page* page;
+    size_t index;
+    Item block;
+    size_t slot = 0;
+    auto err = findNewestLogBlock(nsIndex, key, page, index, block);
+    if (err == ESP_OK) {
+        err = page->findFreeLogSlot(index, block, slot);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (slot == block.span - 1u) {
+            // the power went off before the next block was written
+            err = writeLogBlock(nsIndex, key, block.logBlock.firstSeq + slot, page, index, block);
+            slot = 0;
+        }
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = writeLogBlock(nsIndex, key, 0, page, index, block);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = page->writeLogRecordAt(index, slot, LogRecord(data, size));
+    if (err != ESP_OK) {
+        return err;
+    }
+    seq = block.logBlock.firstSeq + slot;
+
+    /* The next block is written as soon as this one is full, so that the log always has a block with erased data
+     * entries, which the garbage collection copies, and sequence numbers aren't reused. If that fails, the record
+     * is appended already and the next append writes the block again. */
+    if (slot + 2 == block.span) {
+        return writeLogBlock(nsIndex, key, seq + 1, page, index, block);
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::readLogRecord(uint8_t nsIndex, const char* key, uint32_t& seq, void* data, size_t& size)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    uint32_t next = seq;
+    while (true) {
+        Page* page;
+        size_t index;
+        Item block;
+        auto err = findLogBlockAfter(nsIndex, key, next, page, index, block);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        const uint32_t firstSeq = block.logBlock.firstSeq;
+        for (size_t slot = (next > firstSeq) ? next - firstSeq : 0; slot < block.span - 1u; ++slot) {
+            LogRecord record;
+            err = page->readLogRecordAt(index, slot, record);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                break;
+            }
+            if (err != ESP_OK) {
+                return err;
+            }
+            if (record.crc32 != record.calculateCrc32() || record.size > LogRecord::MAX_SIZE) {
+                continue;
+            }
+            if (data != nullptr) {
+                if (size < record.size) {
+                    return ESP_ERR_NVS_INVALID_LENGTH;
+                }
+                memcpy(data, record.data, record.size);
+            }
+            size = record.size;
+            seq = firstSeq + slot;
+            return ESP_OK;
+        }
+        next = firstSeq + (block.span - 1);
+    }
+}
+
+esp_err_t Storage::eraseLog(uint8_t nsIndex, const char* key)
+{
+    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
+        esp_err_t err;
+        while ((err = it->eraseItem(nsIndex, ItemType::LOG, key)) == ESP_OK) {
         }
-        err = findPage->cmpItem(nsIndex, ItemType::BLOB_DATA, key, static_cast<const uint8_t*>(data) + offset, item.varLength.dataSize, static_cast<uint8_t> (chunkStart) + chunkNum);
-        if (err != ESP_OK) {
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
             return err;
         }
-        assert(static_cast<uint8_t> (chunkStart) + chunkNum == item.chunkIndex);
-        offset += item.varLength.dataSize;
-    }
-    if (err == ESP_OK) {
-        assert(offset == dataSize);
     }
-    return err;
+    return ESP_OK;
 }
 
-esp_err_t Storage::readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize)
+esp_err_t Storage::eraseNamespace(uint8_t nsIndex)
 {
     if (mState != StorageState::ACTIVE) {
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
-
-    Item item;
-    Page* findPage = nullptr;
-    if (datatype == ItemType::BLOB) {
-        auto err = readMultiPageBlob(nsIndex, key, data, dataSize);
-        if (err != ESP_ERR_NVS_NOT_FOUND) {
-            return err;
-        } // else check if the blob is stored with earlier version format without index
+    if (isReservedByBlobWriter(nsIndex, nullptr)) {
+        return ESP_ERR_NVS_INVALID_STATE;
     }
 
-    auto err = findItem(nsIndex, datatype, key, findPage, item);
-    if (err != ESP_OK) {
-        return err;
+    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
+        while (true) {
+            auto err = it->eraseItem(nsIndex, ItemType::ANY, nullptr);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                break;
+            }
+            else if (err != ESP_OK) {
+                return err;
+            }
+        }
     }
-    return findPage->readItem(nsIndex, datatype, key, data, dataSize);
 
+    /* Shared blobs only referenced from this namespace aren't needed any more */
+    return loadSharedBlobs();
 }
 
-esp_err_t Storage::eraseMultiPageBlob(uint8_t nsIndex, const char* key, VerOffset chunkStart)
+esp_err_t Storage::eraseNamespace(uint8_t nsIndex, uint8_t& newNsIndex)
 {
     if (mState != StorageState::ACTIVE) {
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
-    Item item;
-    Page* findPage = nullptr;
+    if (isReservedByBlobWriter(nsIndex, nullptr)) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
 
-    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, Page::CHUNK_ANY, chunkStart);
+    newNsIndex = nsIndex;
+    auto entry = std::find_if(mNamespaces.begin(), mNamespaces.end(), [=] (const NamespaceEntry& e) -> bool {
+        return e.mIndex == nsIndex;
+    });
+    if (entry == std::end(mNamespaces) || findFreeNamespaceIndex() == 255
+            || mPageManager.getNamespaceEntryCount(nsIndex) < TOMBSTONE_MIN_ENTRIES) {
+        return eraseNamespace(nsIndex);
+    }
+
+    /* The tombstone is written before the name is bound to the new index. If the power goes off in
+     * between, loadNamespaceTombstones binds it. */
+    auto err = writeToCurrentPage(Page::NS_INDEX, ItemType::NS_TOMBSTONE, entry->mName, &nsIndex, sizeof(nsIndex), nsIndex);
+    if (err == ESP_ERR_NVS_NOT_ENOUGH_SPACE) {
+        // erasing the items one by one doesn't need any free entries
+        return eraseNamespace(nsIndex);
+    }
     if (err != ESP_OK) {
         return err;
     }
-    /* Erase the index first and make children blobs orphan*/
-    err = findPage->eraseItem(nsIndex, ItemType::BLOB_IDX, key, Page::CHUNK_ANY, chunkStart);
+
+    err = moveNamespace(*entry);
     if (err != ESP_OK) {
+        // nothing has been erased yet
+        Page* findPage = nullptr;
+        Item item;
+        if (findItem(Page::NS_INDEX, ItemType::NS_TOMBSTONE, entry->mName, findPage, item, nsIndex) == ESP_OK) {
+            findPage->eraseItem(Page::NS_INDEX, ItemType::NS_TOMBSTONE, entry->mName, nsIndex);
+        }
         return err;
     }
+    newNsIndex = entry->mIndex;
 
-    uint8_t chunkCount = item.blobIndex.chunkCount;
+    err = mPageManager.markNamespaceErased(nsIndex);
+    if (err != ESP_OK) {
+        return err;
+    }
 
-    if (chunkStart == VerOffset::VER_ANY) {
-        chunkStart = item.blobIndex.chunkStart;
-    } else {
-        assert(chunkStart == item.blobIndex.chunkStart);
+    /* Shared blobs only referenced from this namespace aren't needed any more */
+    return loadSharedBlobs();
+}
+
+esp_err_t Storage::loadNamespaceTombstones()
+{
+    Page::TNamespaceTable tombstones;
+    std::fill_n(tombstones.data(), tombstones.byteSize() / 4, 0);
+    for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
+        size_t itemIndex = 0;
+        Item item;
+        while (it->findItem(Page::NS_INDEX, ItemType::NS_TOMBSTONE, nullptr, itemIndex, item) == ESP_OK) {
+            tombstones.set(item.chunkIndex, true);
+            itemIndex += item.span;
+        }
     }
 
-    /* Now erase corresponding chunks*/
-    for (uint8_t chunkNum = 0; chunkNum < chunkCount; chunkNum++) {
-        err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, static_cast<uint8_t> (chunkStart) + chunkNum);
+    for (size_t nsIndex = 1; nsIndex < 255; ++nsIndex) {
+        if (!tombstones.get(nsIndex)) {
+            continue;
+        }
+        mNamespaceUsage.set(nsIndex, true);
 
-        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        size_t usedEntries;
+        auto err = calcEntriesInNamespace(nsIndex, usedEntries);
+        if (err != ESP_OK) {
             return err;
-        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
-            continue; // Keep erasing other chunks
         }
-        err = findPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, static_cast<uint8_t> (chunkStart) + chunkNum);
+        /* The tombstone has done its job once the garbage collection has dropped all items */
+        if (usedEntries == 0) {
+            err = purgeErasedNamespace(nsIndex);
+            if (err != ESP_OK) {
+                return err;
+            }
+            continue;
+        }
+
+        err = mPageManager.markNamespaceErased(nsIndex);
         if (err != ESP_OK) {
             return err;
         }
 
+        auto entry = std::find_if(mNamespaces.begin(), mNamespaces.end(), [=] (const NamespaceEntry& e) -> bool {
+            return e.mIndex == nsIndex;
+        });
+        if (entry != std::end(mNamespaces)) {
+            // the power went off before the name was bound to a new index
+            err = moveNamespace(*entry);
+            if (err == ESP_ERR_NVS_NOT_ENOUGH_SPACE) {
+                err = purgeErasedNamespace(nsIndex);
+            }
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
     }
-
     return ESP_OK;
 }
 
-esp_err_t Storage::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key)
+uint8_t Storage::findFreeNamespaceIndex()
 {
-    if (mState != StorageState::ACTIVE) {
-        return ESP_ERR_NVS_NOT_INITIALIZED;
+    uint8_t ns;
+    for (ns = 1; ns < 255; ++ns) {
+        if (mNamespaceUsage.get(ns) == false) {
+            break;
+        }
     }
+    return ns;
+}
 
-    if (datatype == ItemType::BLOB) {
-        return eraseMultiPageBlob(nsIndex, key);
+/* Binds the name of the namespace to an unused index */
+esp_err_t Storage::moveNamespace(NamespaceEntry& entry)
+{
+    uint8_t ns = findFreeNamespaceIndex();
+    if (ns == 255) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
     }
 
-    Item item;
-    Page* findPage = nullptr;
-    auto err = findItem(nsIndex, datatype, key, findPage, item);
+    auto err = writeItem(Page::NS_INDEX, ItemType::U8, entry.mName, &ns, sizeof(ns));
     if (err != ESP_OK) {
         return err;
     }
+    mNamespaceUsage.set(ns, true);
+    if (ns == Page::NS_SHARED) {
+        mSharedBlobsEnabled = false;
+    }
+    entry.mIndex = ns;
+    return ESP_OK;
+}
 
-    if (item.datatype == ItemType::BLOB_DATA || item.datatype == ItemType::BLOB_IDX) {
-        return eraseMultiPageBlob(nsIndex, key);
+/* Erases the items left behind by a tombstone one by one, then the tombstone, so that the index can be used again */
+esp_err_t Storage::purgeErasedNamespace(uint8_t nsIndex)
+{
+    auto err = eraseNamespace(nsIndex);
+    if (err != ESP_OK) {
+        return err;
     }
+    return releaseErasedNamespace(nsIndex);
+}
 
-    return findPage->eraseItem(nsIndex, datatype, key);
+/* Erases the tombstone of a namespace whose items are gone, so that the index can be used again */
+esp_err_t Storage::releaseErasedNamespace(uint8_t nsIndex)
+{
+    esp_err_t err;
+    for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
+        while ((err = it->eraseItem(Page::NS_INDEX, ItemType::NS_TOMBSTONE, nullptr, nsIndex)) == ESP_OK) {
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
+
+    if (mPageManager.isNamespaceErased(nsIndex)) {
+        err = mPageManager.unmarkNamespaceErased(nsIndex);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    auto entry = std::find_if(mNamespaces.begin(), mNamespaces.end(), [=] (const NamespaceEntry& e) -> bool {
+        return e.mIndex == nsIndex;
+    });
+    if (entry == std::end(mNamespaces)) {
+        mNamespaceUsage.set(nsIndex, false);
+    }
+    return ESP_OK;
 }
 
-esp_err_t Storage::eraseNamespace(uint8_t nsIndex)
+esp_err_t Storage::requestNewPage()
 {
-    if (mState != StorageState::ACTIVE) {
-        return ESP_ERR_NVS_NOT_INITIALIZED;
+    auto err = mPageManager.requestNewPage();
+    if (err != ESP_OK) {
+        return err;
     }
 
-    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
-        while (true) {
-            auto err = it->eraseItem(nsIndex, ItemType::ANY, nullptr);
-            if (err == ESP_ERR_NVS_NOT_FOUND) {
-                break;
-            }
-            else if (err != ESP_OK) {
+    /* The garbage collection may have dropped the last items of erased namespaces, their indices are
+     * released right away instead of at the next init */
+    for (size_t nsIndex = 1; nsIndex < 255; ++nsIndex) {
+        if (mPageManager.isNamespaceErased(nsIndex) && mPageManager.getNamespaceEntryCount(nsIndex) == 0) {
+            err = releaseErasedNamespace(nsIndex);
+            if (err != ESP_OK) {
                 return err;
             }
         }
     }
     return ESP_OK;
-
 }
 
 esp_err_t Storage::getItemDataSize(uint8_t nsIndex, ItemType datatype, const char* key, size_t& dataSize)
@@ -648,6 +2507,14 @@ esp_err_t Storage::getItemDataSize(uint8_t nsIndex, ItemType datatype, const cha
             return err;
         }
         err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            char sharedKey[Item::MAX_KEY_LENGTH + 1];
+            err = findBlobRef(nsIndex, key, findPage, item, sharedKey);
+            if (err == ESP_OK) {
+                dataSize = item.blobRef.dataSize;
+            }
+            return err;
+        }
         if (err != ESP_OK) {
             return err;
         }
@@ -670,6 +2537,8 @@ void Storage::debugDump()
 void Storage::debugCheck()
 {
     std::map<std::string, Page*> keys;
+    size_t namespaceEntries[256] = {};
+    size_t totalEntries = 0;
 
     for (auto p = mPageManager.begin(); p != mPageManager.end(); ++p) {
         size_t itemIndex = 0;
@@ -678,6 +2547,10 @@ void Storage::debugCheck()
         while (p->findItem(Page::NS_ANY, ItemType::ANY, nullptr, itemIndex, item) == ESP_OK) {
             std::stringstream keyrepr;
             keyrepr << static_cast<unsigned>(item.nsIndex) << "_" << static_cast<unsigned>(item.datatype) << "_" << item.key <<"_"<<static_cast<unsigned>(item.chunkIndex);
+            if (item.datatype == ItemType::LOG) {
+                // blocks of a log have the same key
+                keyrepr << "_" << item.logBlock.firstSeq;
+            }
             std::string keystr = keyrepr.str();
             if (keys.find(keystr) != std::end(keys)) {
                 printf("Duplicate key: %s\n", keystr.c_str());
@@ -687,9 +2560,19 @@ void Storage::debugCheck()
             keys.insert(std::make_pair(keystr, static_cast<Page*>(p)));
             itemIndex += item.span;
             usedCount += item.span;
+            namespaceEntries[item.nsIndex] += item.span;
         }
         assert(usedCount == p->getUsedEntryCount());
+        totalEntries += usedCount;
+    }
+
+    // the counts are kept up to date by the pages
+    for (size_t nsIndex = 0; nsIndex < 256; ++nsIndex) {
+        assert(namespaceEntries[nsIndex] == mPageManager.getNamespaceEntryCount(nsIndex));
     }
+    nvs_stats_t stats;
+    mPageManager.fillStats(stats);
+    assert(totalEntries == stats.used_entries);
 }
 #endif //ESP_PLATFORM
 
@@ -707,28 +2590,16 @@ esp_err_t Storage::calcEntriesInNamespace(uint8_t nsIndex, size_t& usedEntries)
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
 
-    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
-        size_t itemIndex = 0;
-        Item item;
-        while (true) {
-            auto err = it->findItem(nsIndex, ItemType::ANY, nullptr, itemIndex, item);
-            if (err == ESP_ERR_NVS_NOT_FOUND) {
-                break;
-            }
-            else if (err != ESP_OK) {
-                return err;
-            }
-            usedEntries += item.span;
-            itemIndex   += item.span;
-            if (itemIndex >= it->ENTRY_COUNT) break;
-        }
-    }
+    usedEntries = mPageManager.getNamespaceEntryCount(nsIndex);
     return ESP_OK;
 }
 
 void Storage::fillEntryInfo(Item &item, nvs_entry_info_t &info)
 {
     info.type = static_cast<nvs_type_t>(item.datatype);
+    if (item.datatype == ItemType::BLOB_REF) {
+        info.type = NVS_TYPE_BLOB;
+    }
     strncpy(info.key, item.key, sizeof(info.key));
 
     for (auto &name : mNamespaces) {
@@ -739,11 +2610,99 @@ void Storage::fillEntryInfo(Item &item, nvs_entry_info_t &info)
     }
 }
 
-bool Storage::findEntry(nvs_opaque_iterator_t* it, const char* namespace_name)
+/* Inserts the key of item into the listed entries sorted by key, unless it's listed already or
+ * the entries are full of smaller keys. The largest key is dropped to make room. */
+static void insertListedKey(const Item& item, nvs_entry_info_t* entries, size_t& listed, size_t count)
+{
+    auto pos = std::lower_bound(entries, entries + listed, item.key, [](const nvs_entry_info_t& entry, const char* key) {
+        return strncmp(entry.key, key, sizeof(entry.key)) < 0;
+    });
+    if (pos == entries + count || (pos != entries + listed && strncmp(pos->key, item.key, sizeof(pos->key)) == 0)) {
+        return;
+    }
+    if (listed < count) {
+        ++listed;
+    }
+    std::move_backward(pos, entries + listed - 1, entries + listed);
+    strncpy(pos->key, item.key, sizeof(pos->key));
+    pos->type = OrderedIndex::listedType(item.datatype);
+}
+
+esp_err_t Storage::scanKeys(uint8_t nsIndex, const char* from, const char* to, nvs_entry_info_t* entries, size_t& count)
+{
+    size_t listed = 0;
+    for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
+        Item item;
+        size_t itemIndex = 0;
+        esp_err_t err;
+        while ((err = it->findItem(nsIndex, ItemType::ANY, nullptr, itemIndex, item)) == ESP_OK) {
+            itemIndex += item.span;
+            if ((from != nullptr && strncmp(item.key, from, sizeof(item.key)) < 0)
+                    || (to != nullptr && strncmp(item.key, to, sizeof(item.key)) >= 0)) {
+                continue;
+            }
+            insertListedKey(item, entries, listed, count);
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
+    count = listed;
+    return ESP_OK;
+}
+
+esp_err_t Storage::listKeys(uint8_t nsIndex, const char* from, const char* to, nvs_entry_info_t* entries, size_t& count)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    const OrderedIndex& index = mPageManager.getOrderedIndex();
+    if (!index.isIndexed(nsIndex) && !index.isTooLarge(nsIndex) && !mLock.isShared()) {
+        auto err = mPageManager.indexNamespace(nsIndex);
+        if (err != ESP_OK && err != ESP_ERR_NO_MEM) {
+            return err;
+        }
+    }
+    if (index.isIndexed(nsIndex)) {
+        index.listKeys(nsIndex, from, to, entries, count);
+    } else {
+        auto err = scanKeys(nsIndex, from, to, entries, count);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    for (auto &name : mNamespaces) {
+        if (name.mIndex == nsIndex) {
+            for (size_t i = 0; i < count; ++i) {
+                strncpy(entries[i].namespace_name, name.mName, sizeof(entries[i].namespace_name));
+            }
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+bool Storage::findEntry(nvs_opaque_iterator_t* it, const char* namespace_name, const char* keyPrefix)
 {
     it->entryIndex = 0;
     it->nsIndex = Page::NS_ANY;
-    it->page = mPageManager.begin();
+    it->pageIndex = 0;
+    it->keyPrefixLength = 0;
+    it->snapshot = nullptr;
+    if (keyPrefix != nullptr) {
+        it->keyPrefixLength = strlen(keyPrefix);
+        if (it->keyPrefixLength > Item::MAX_KEY_LENGTH) {
+            return false;
+        }
+        memcpy(it->keyPrefix, keyPrefix, it->keyPrefixLength);
+    }
+    // later writes aren't seen by the iteration, and items it hasn't reached yet aren't moved by the garbage collection
+    it->snapshot = mPageManager.takeSnapshot();
+    if (it->snapshot == nullptr) {
+        return false;
+    }
 
     if (namespace_name != nullptr) {
         if(createOrOpenNamespace(namespace_name, false, it->nsIndex) != ESP_OK) {
@@ -751,7 +2710,7 @@ bool Storage::findEntry(nvs_opaque_iterator_t* it, const char* namespace_name)
         }
     }
 
-    return nextEntry(it);
+    return nextEntry(it) == ESP_OK;
 }
 
 inline bool isIterableItem(Item& item)
@@ -768,26 +2727,115 @@ inline bool isMultipageBlob(Item& item)
                     || item.chunkIndex == static_cast<uint8_t>(VerOffset::VER_1_OFFSET)));
 }
 
-bool Storage::nextEntry(nvs_opaque_iterator_t* it)
+esp_err_t Storage::nextEntry(nvs_opaque_iterator_t* it)
 {
     Item item;
     esp_err_t err;
-
-    for (auto page = it->page; page != mPageManager.end(); ++page) {
-        do {
-            err = page->findItem(it->nsIndex, (ItemType)it->type, nullptr, it->entryIndex, item);
+    /* Blobs are also found by their references to shared blobs, which themselves aren't listed */
+    ItemType datatype = (it->type == NVS_TYPE_BLOB) ? ItemType::ANY : static_cast<ItemType>(it->type);
+    const PageManager::Snapshot& snapshot = *it->snapshot;
+
+    for (; it->pageIndex < snapshot.pageCount; ++it->pageIndex) {
+        /* The page is gone if the partition has been loaded again, or if the garbage collection had to
+         * erase it because no other page was free. The iteration can't continue then. */
+        const Page* page = mPageManager.getPage(snapshot, it->pageIndex);
+        if (page == nullptr) {
+            return ESP_ERR_NVS_INVALID_STATE;
+        }
+        while ((err = page->findItem(snapshot.pages[it->pageIndex], it->nsIndex, datatype, it->entryIndex, item)) == ESP_OK) {
+            /* Logs are listed once, by their newest block */
+            if (item.datatype == ItemType::LOG && page->isLogBlockFull(it->entryIndex, item)) {
+                it->entryIndex += item.span;
+                continue;
+            }
+            it->itemIndex = it->entryIndex;
             it->entryIndex += item.span;
-            if(err == ESP_OK && isIterableItem(item) && !isMultipageBlob(item)) {
+            if (it->type == NVS_TYPE_BLOB
+                    && item.datatype != ItemType::BLOB_DATA && item.datatype != ItemType::BLOB_REF) {
+                continue;
+            }
+            if (mSharedBlobsEnabled && item.nsIndex == Page::NS_SHARED) {
+                continue;
+            }
+            if (mPageManager.isNamespaceErased(item.nsIndex)) {
+                continue;
+            }
+            if (strncmp(item.key, it->keyPrefix, it->keyPrefixLength) != 0) {
+                continue;
+            }
+            if (isIterableItem(item) && !isMultipageBlob(item)) {
+                it->item = item;
                 fillEntryInfo(item, it->entry_info);
-                it->page = page;
-                return true;
+                return ESP_OK;
             }
-        } while (err != ESP_ERR_NVS_NOT_FOUND);
+        }
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
 
         it->entryIndex = 0;
     }
 
-    return false;
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t Storage::readEntryValue(nvs_opaque_iterator_t* it, void* data, size_t& dataSize)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    const Item& item = it->item;
+    if (item.datatype == ItemType::BLOB_DATA || item.datatype == ItemType::BLOB_REF) {
+        /* The entry is the first chunk of the blob or a reference to a shared blob */
+        size_t blobSize;
+        auto err = getItemDataSize(item.nsIndex, ItemType::BLOB, item.key, blobSize);
+        if (err != ESP_OK) {
+            return err;
+        }
+        bool fits = data == nullptr || dataSize >= blobSize;
+        dataSize = blobSize;
+        if (!fits) {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        return (data == nullptr) ? ESP_OK : readItem(item.nsIndex, ItemType::BLOB, item.key, data, blobSize);
+    }
+    if (item.datatype == ItemType::LOG) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+
+    size_t valueSize = isVariableLengthType(item.datatype) ? item.varLength.dataSize
+            : static_cast<uint8_t>(item.datatype) & 0x0f;
+    bool fits = data == nullptr || dataSize >= valueSize;
+    dataSize = valueSize;
+    if (!fits) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    if (data == nullptr) {
+        return ESP_OK;
+    }
+
+    const Page* page = mPageManager.getPage(*it->snapshot, it->pageIndex);
+    if (page == nullptr) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    return page->readItemAt(it->snapshot->pages[it->pageIndex], it->itemIndex, item, data, valueSize);
+}
+
+esp_err_t Storage::readEntryBlobRange(nvs_opaque_iterator_t* it, size_t offset, void* data, size_t dataSize)
+{
+    if (it->item.datatype != ItemType::BLOB_DATA && it->item.datatype != ItemType::BLOB_REF) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+    return readBlobRange(it->item.nsIndex, it->item.key, offset, data, dataSize);
+}
+
+void Storage::releaseEntryIterator(nvs_opaque_iterator_t* it)
+{
+    if (it->snapshot != nullptr) {
+        mPageManager.releaseSnapshot(it->snapshot);
+        it->snapshot = nullptr;
+    }
 }
 
 
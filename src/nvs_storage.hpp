@@ -21,12 +21,76 @@
 #include "nvs_page.hpp"
 #include "nvs_pagemanager.hpp"
 #include "partition.hpp"
+#include "nvs_platform.hpp"
+#include "sdkconfig.h"
+
+#ifdef CONFIG_NVS_COUNTER_DATA_ENTRIES
+#define NVS_COUNTER_DATA_ENTRIES CONFIG_NVS_COUNTER_DATA_ENTRIES
+#else
+#define NVS_COUNTER_DATA_ENTRIES 4
+#endif
+
+#ifdef CONFIG_NVS_LOG_BLOCK_RECORDS
+#define NVS_LOG_BLOCK_RECORDS CONFIG_NVS_LOG_BLOCK_RECORDS
+#else
+#define NVS_LOG_BLOCK_RECORDS 16
+#endif
 
 //extern void dumpBytes(const uint8_t* data, size_t count);
 
 namespace nvs
 {
 
+/**
+ * State of a multi-page blob which is written piece by piece, see Storage::openBlobWriter.
+ *
+ * Appended data is collected in buffer and written out as a blob data chunk whenever the buffer is full.
+ * While the writer is open, Storage keeps it in a list which reserves its key.
+ */
+struct BlobWriter : public intrusive_list_node<BlobWriter> {
+    char key[Item::MAX_KEY_LENGTH + 1];
+    uint8_t nsIndex;
+    bool hasPrevIndex;
+    VerOffset prevStart;
+    VerOffset chunkStart;
+    uint16_t chunkVerMap;
+    uint8_t chunkCount;
+    size_t dataSize;
+    uint8_t* buffer = nullptr;
+    size_t bufferSize;
+    size_t bufferUsed;
+
+    bool isOpen() const
+    {
+        return buffer != nullptr;
+    }
+};
+
+/**
+ * Read position within a blob which is read piece by piece, see Storage::openBlobReader.
+ *
+ * Blobs stored without an index by earlier versions are read as a single chunk.
+ */
+struct BlobReader {
+    char key[Item::MAX_KEY_LENGTH + 1];
+    uint8_t nsIndex;
+    bool hasIndex;
+    VerOffset chunkStart;
+    uint16_t chunkVerMap;
+    uint8_t chunkCount;
+    size_t dataSize;
+    size_t offset;
+    uint8_t chunkNum;
+    size_t chunkOffset;
+    size_t chunkSize;
+    bool open = false;
+
+    bool isOpen() const
+    {
+        return open;
+    }
+};
+
 class Storage : public intrusive_list_node<Storage>
 {
     enum class StorageState : uint32_t {
@@ -54,11 +118,28 @@ class Storage : public intrusive_list_node<Storage>
             uint8_t nsIndex;
             uint8_t chunkCount;
             VerOffset chunkStart;
+            uint16_t chunkVerMap;
     };
 
     typedef intrusive_list<BlobIndexNode> TBlobIndexList;
 
+    struct SharedBlobNode: public intrusive_list_node<SharedBlobNode> {
+        public:
+            char key[Item::MAX_KEY_LENGTH + 1];
+            uint16_t refCount;
+    };
+
+    typedef intrusive_list<SharedBlobNode> TSharedBlobList;
+
+    typedef intrusive_list<BlobWriter> TBlobWriterList;
+
 public:
+    /** Blobs of at least this size are shared between keys if deduplication is enabled */
+    static const size_t SHARED_BLOB_MIN_SIZE = 1024;
+
+    /** Namespaces using fewer entries are erased item by item, which takes fewer writes than a tombstone */
+    static const size_t TOMBSTONE_MIN_ENTRIES = 8;
+
     ~Storage();
 
     Storage(Partition *partition) : mPartition(partition) {
@@ -75,12 +156,74 @@ public:
 
     esp_err_t writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize);
 
+    /**
+     * Writes several values. The values which differ from the stored ones are written to consecutive entries of
+     * the active page, before their previous values are erased. The result of each value is stored in its err field,
+     * the error of the first value which couldn't be written is returned.
+     */
+    esp_err_t writeItems(uint8_t nsIndex, nvs_set_item_t* items, size_t count);
+
     esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize);
 
+    /**
+     * Where readItem has found an item. Reading the item again with the same location skips the search of the
+     * pages, as long as no item has been erased from its page since.
+     */
+    struct ItemLocation {
+        Page* page = nullptr;
+        uint32_t loadCount;
+        uint32_t itemGeneration;
+        size_t index;
+    };
+
+    /**
+     * Like readItem, but tries location first and updates it. Blobs are always searched.
+     */
+    esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize, ItemLocation& location);
+
+    /**
+     * Reads a string or blob whose size isn't known to the caller. The item is found once, then alloc is called
+     * with its size for the buffer it is read into. ESP_ERR_NO_MEM is returned if alloc returns nullptr.
+     */
+    esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, nvs_alloc_cb_t alloc, void* arg, size_t& dataSize);
+
+    /**
+     * Reads several values with a single search of the pages. The result of each value is stored in its err field,
+     * the error of the first value which couldn't be read is returned.
+     */
+    esp_err_t readItems(uint8_t nsIndex, nvs_get_item_t* items, size_t count);
+
     esp_err_t getItemDataSize(uint8_t nsIndex, ItemType datatype, const char* key, size_t& dataSize);
 
     esp_err_t eraseItem(uint8_t nsIndex, ItemType datatype, const char* key);
 
+    /**
+     * Adds delta to an integer item, a missing item counts as 0. The result is stored in value, truncated to the
+     * size of datatype. The item is searched once, its new value is written before the old one is erased.
+     * Counters are incremented in place while bits of their data entries are left, see Page::incrementCounterAt.
+     */
+    esp_err_t incrementItem(uint8_t nsIndex, ItemType datatype, const char* key, uint64_t delta, uint64_t& value);
+
+    /**
+     * Replaces an integer item by desired if it equals expected. Otherwise ESP_ERR_NVS_VALUE_CHANGED is returned
+     * and expected is set to the stored value. Values are kept in the low bytes of the uint64_t arguments.
+     */
+    esp_err_t compareAndSwapItem(uint8_t nsIndex, ItemType datatype, const char* key, uint64_t& expected, uint64_t desired);
+
+    /**
+     * Appends a record of at most LogRecord::MAX_SIZE bytes to the log key and stores its sequence number in seq.
+     * Records are written into the erased data entries of the newest block of the log, a new block is only
+     * written when that one is full. The garbage collection drops full blocks instead of copying them.
+     */
+    esp_err_t appendLogRecord(uint8_t nsIndex, const char* key, const void* data, size_t size, uint32_t& seq);
+
+    /**
+     * Reads the first record of the log key whose sequence number is seq or higher, and stores its sequence
+     * number in seq. On input size is the size of data, it is set to the size of the record. data may be
+     * nullptr to only look the record up.
+     */
+    esp_err_t readLogRecord(uint8_t nsIndex, const char* key, uint32_t& seq, void* data, size_t& size);
+
     template<typename T>
     esp_err_t writeItem(uint8_t nsIndex, const char* key, const T& value)
     {
@@ -100,6 +243,14 @@ public:
 
     esp_err_t eraseNamespace(uint8_t nsIndex);
 
+    /**
+     * Erases all items of the namespace with a tombstone: only a tombstone for nsIndex is written and the
+     * name of the namespace is bound to the unused index newNsIndex. The items left behind are dropped by
+     * the garbage collection. If no name is bound to nsIndex or no other index is free, the items are
+     * erased one by one like eraseNamespace(nsIndex) does, and newNsIndex is nsIndex.
+     */
+    esp_err_t eraseNamespace(uint8_t nsIndex, uint8_t& newNsIndex);
+
     const Partition *getPart() const
     {
         return mPartition;
@@ -110,19 +261,77 @@ public:
         return mPartition->get_partition_name();
     }
 
+    esp_err_t flush()
+    {
+        return mPartition->flush();
+    }
+
     uint32_t getBaseSector()
     {
         return mPageManager.getBaseSector();
     }
 
-    esp_err_t writeMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize, VerOffset chunkStart);
+    /**
+     * Lock of this partition's data, see Lock. It is initialized by init().
+     */
+    RWLock& getLock()
+    {
+        return mLock;
+    }
+
+    /**
+     * Enables or disables compression of strings and blob data written from now on.
+     * Compressed data can be read regardless of this setting.
+     */
+    void setCompression(bool enable)
+    {
+        mCompress = enable;
+    }
+
+    /**
+     * Enables or disables sharing of identical blobs written from now on between keys.
+     * Shared blobs can be read regardless of this setting.
+     */
+    void setDeduplication(bool enable)
+    {
+        mDeduplicate = enable;
+    }
+
+    /**
+     * Enables or disables rewriting only the modified chunks of multi-page blobs updated from now on.
+     * Blobs whose chunks were partially rewritten can be read regardless of this setting.
+     */
+    void setBlobDeltaWrites(bool enable)
+    {
+        mBlobDeltaWrites = enable;
+    }
+
+    esp_err_t writeMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize, VerOffset chunkStart, uint16_t chunkVerMap = 0xffff);
+
+    esp_err_t writeMultiPageBlobDelta(uint8_t nsIndex, const char* key, const void* data, size_t dataSize, const Item& blobIndex);
 
     esp_err_t readMultiPageBlob(uint8_t nsIndex, const char* key, void* data, size_t dataSize);
 
+    esp_err_t readMultiPageBlobChunks(uint8_t nsIndex, const char* key, const Item& blobIndex, void* data);
+
     esp_err_t cmpMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize);
 
     esp_err_t eraseMultiPageBlob(uint8_t nsIndex, const char* key, VerOffset chunkStart = VerOffset::VER_ANY);
 
+    esp_err_t openBlobWriter(uint8_t nsIndex, const char* key, size_t bufferSize, BlobWriter& writer);
+
+    esp_err_t appendBlobWriter(BlobWriter& writer, const void* data, size_t dataSize);
+
+    esp_err_t finalizeBlobWriter(BlobWriter& writer);
+
+    void abortBlobWriter(BlobWriter& writer);
+
+    esp_err_t openBlobReader(uint8_t nsIndex, const char* key, BlobReader& reader);
+
+    esp_err_t readBlobReader(BlobReader& reader, void* data, size_t dataSize, size_t& readSize);
+
+    esp_err_t readBlobRange(uint8_t nsIndex, const char* key, size_t offset, void* data, size_t dataSize);
+
     void debugDump();
 
     void debugCheck();
@@ -131,9 +340,36 @@ public:
 
     esp_err_t calcEntriesInNamespace(uint8_t nsIndex, size_t& usedEntries);
 
-    bool findEntry(nvs_opaque_iterator_t*, const char* name);
-
-    bool nextEntry(nvs_opaque_iterator_t* it);
+    /**
+     * Lists the keys of the namespace in [from, to) in key order, see NVSHandle::list_keys. Unless the lock is
+     * shared, a namespace which isn't in the ordered index yet is added to it.
+     */
+    esp_err_t listKeys(uint8_t nsIndex, const char* from, const char* to, nvs_entry_info_t* entries, size_t& count);
+
+    /**
+     * Starts the iteration of it. If keyPrefix isn't null, only the entries whose keys start with it are listed.
+     */
+    bool findEntry(nvs_opaque_iterator_t*, const char* name, const char* keyPrefix = nullptr);
+
+    /**
+     * Moves it to the next entry. Returns ESP_ERR_NVS_NOT_FOUND once all the entries have been listed, and
+     * ESP_ERR_NVS_INVALID_STATE if a page of the snapshot was erased before the iteration reached it.
+     */
+    esp_err_t nextEntry(nvs_opaque_iterator_t* it);
+
+    /**
+     * Reads the value of the entry the iterator is on, as it was when the iteration started, from where nextEntry
+     * has found it. Blobs are read from their chunks like readItem does, they and counters may have changed since.
+     * The size of the value is stored in dataSize, only the size is read if data is null.
+     */
+    esp_err_t readEntryValue(nvs_opaque_iterator_t* it, void* data, size_t& dataSize);
+
+    esp_err_t readEntryBlobRange(nvs_opaque_iterator_t* it, size_t offset, void* data, size_t dataSize);
+
+    /**
+     * Releases the snapshot taken by findEntry. Iterators have to be released before the storage is deleted.
+     */
+    void releaseEntryIterator(nvs_opaque_iterator_t* it);
 
 protected:
 
@@ -148,10 +384,72 @@ protected:
 
     void eraseOrphanDataBlobs(TBlobIndexList&);
 
+    esp_err_t loadSharedBlobs();
+
+    esp_err_t loadNamespaceTombstones();
+
+    uint8_t findFreeNamespaceIndex();
+
+    esp_err_t moveNamespace(NamespaceEntry& entry);
+
+    esp_err_t purgeErasedNamespace(uint8_t nsIndex);
+
+    esp_err_t releaseErasedNamespace(uint8_t nsIndex);
+
+    esp_err_t requestNewPage();
+
+    static void sharedBlobKey(const Item& ref, char* key);
+
+    esp_err_t writeSharedBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize);
+
+    esp_err_t findBlobRef(uint8_t nsIndex, const char* key, Page* &page, Item& ref, char* sharedKey);
+
+    esp_err_t eraseBlobRef(uint8_t nsIndex, const char* key);
+
+    esp_err_t releaseSharedBlob(const char* sharedKey);
+
     void fillEntryInfo(Item &item, nvs_entry_info_t &info);
 
+    esp_err_t scanKeys(uint8_t nsIndex, const char* from, const char* to, nvs_entry_info_t* entries, size_t& count);
+
+    esp_err_t flushBlobWriter(BlobWriter& writer, bool all);
+
+    void closeBlobWriter(BlobWriter& writer);
+
+    /**
+     * Returns true if a blob writer is open for key, or for any key of the namespace if key is null.
+     * Other writes to such keys fail with ESP_ERR_NVS_INVALID_STATE until the writer is closed.
+     */
+    bool isReservedByBlobWriter(uint8_t nsIndex, const char* key);
+
+    void eraseBlobWriterChunks(BlobWriter& writer);
+
+    esp_err_t findBlobReaderChunk(BlobReader& reader, Page* &page, Item& item);
+
+    esp_err_t writeToCurrentPage(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx = Page::CHUNK_ANY);
+
     esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, Item& item, uint8_t chunkIdx = Page::CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
 
+    esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, size_t& itemIndex, Item& item, uint8_t chunkIdx = Page::CHUNK_ANY, VerOffset chunkStart = VerOffset::VER_ANY);
+
+    esp_err_t readIntegerItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, size_t& itemIndex, uint64_t& value);
+
+    esp_err_t replaceIntegerItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* page, size_t itemIndex, uint64_t value);
+
+    esp_err_t eraseReplacedItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* page, size_t itemIndex, uint32_t itemGeneration);
+
+    esp_err_t incrementCounter(uint8_t nsIndex, const char* key, uint32_t delta, uint32_t& value);
+
+    esp_err_t writeReservedItemToCurrentPage(Item& item, Page* &page, size_t& index);
+
+    esp_err_t findNewestLogBlock(uint8_t nsIndex, const char* key, Page* &page, size_t& index, Item& block);
+
+    esp_err_t findLogBlockAfter(uint8_t nsIndex, const char* key, uint32_t seq, Page* &page, size_t& index, Item& block);
+
+    esp_err_t writeLogBlock(uint8_t nsIndex, const char* key, uint32_t firstSeq, Page* &page, size_t& index, Item& block);
+
+    esp_err_t eraseLog(uint8_t nsIndex, const char* key);
+
 protected:
     Partition *mPartition;
     size_t mPageCount;
@@ -159,6 +457,25 @@ protected:
     TNamespaces mNamespaces;
     CompressedEnumTable<bool, 1, 256> mNamespaceUsage;
     StorageState mState = StorageState::INVALID;
+    TSharedBlobList mSharedBlobs;
+    TBlobWriterList mBlobWriters;
+    bool mSharedBlobsEnabled = false;
+#ifdef CONFIG_NVS_COMPRESSION
+    bool mCompress = true;
+#else
+    bool mCompress = false;
+#endif
+#ifdef CONFIG_NVS_BLOB_DEDUPLICATION
+    bool mDeduplicate = true;
+#else
+    bool mDeduplicate = false;
+#endif
+#ifdef CONFIG_NVS_BLOB_DELTA_WRITES
+    bool mBlobDeltaWrites = true;
+#else
+    bool mBlobDeltaWrites = false;
+#endif
+    RWLock mLock;
 };
 
 } // namespace nvs
@@ -169,8 +486,14 @@ struct nvs_opaque_iterator_t
     uint8_t nsIndex;
     size_t entryIndex;
     nvs::Storage *storage;
-    intrusive_list<nvs::Page>::iterator page;
+    nvs::PageManager::Snapshot *snapshot; // pages as they were when the iteration started
+    size_t pageIndex;
+    char keyPrefix[NVS_KEY_NAME_MAX_SIZE]; // only keys starting with it are listed
+    size_t keyPrefixLength;
+    nvs::Item item; // item of the entry the iterator is on
+    size_t itemIndex; // index of item in its page
     nvs_entry_info_t entry_info;
+    bool inPlace; // held in a buffer of the caller, see nvs_entry_find_in_place
 };
 
 #endif /* nvs_storage_hpp */
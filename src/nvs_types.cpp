@@ -50,4 +50,12 @@ uint32_t Item::calculateCrc32(const uint8_t* data, size_t size)
     return result;
 }
 
+uint32_t LogRecord::calculateCrc32() const
+{
+    uint32_t result = 0xffffffff;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(this);
+    result = crc32_le(result, p + offsetof(LogRecord, size), sizeof(LogRecord) - offsetof(LogRecord, size));
+    return result;
+}
+
 } // namespace nvs
@@ -33,6 +33,8 @@ namespace nvs
  * with a new version. The version is saved in the highest bit of Item::chunkIndex as well as in
  * Item::blobIndex::chunkStart.
  * If a chunk is modified and hence re-written, the version swaps: 0x0 -> 0x80 or 0x80 -> 0x0.
+ * When only some chunks of a blob are re-written, the unchanged chunks keep their version. This is recorded in
+ * Item::blobIndex::chunkVerMap for the first CHUNK_VER_MAP_BITS chunks (see blobChunkIndex).
  */
 enum class VerOffset: uint8_t {
     VER_0_OFFSET = 0x0,
@@ -40,6 +42,21 @@ enum class VerOffset: uint8_t {
     VER_ANY = 0xff,
 };
 
+static const uint8_t CHUNK_VER_MAP_BITS = 16;
+
+/**
+ * Returns the chunkIndex of blob data chunk number chunkNum, given chunkStart and chunkVerMap of its blob index.
+ * Chunks whose bit in chunkVerMap is cleared were kept from the other version.
+ */
+inline uint8_t blobChunkIndex(VerOffset chunkStart, uint16_t chunkVerMap, uint8_t chunkNum)
+{
+    uint8_t chunkIdx = static_cast<uint8_t>(chunkStart) + chunkNum;
+    if (chunkNum < CHUNK_VER_MAP_BITS && !(chunkVerMap & (1 << chunkNum))) {
+        chunkIdx ^= static_cast<uint8_t>(VerOffset::VER_1_OFFSET);
+    }
+    return chunkIdx;
+}
+
 inline bool isVariableLengthType(ItemType type)
 {
     return (type == ItemType::BLOB ||
@@ -47,6 +64,19 @@ inline bool isVariableLengthType(ItemType type)
             type == ItemType::BLOB_DATA);
 }
 
+/* Types whose items are followed by data entries, counted in their span */
+inline bool hasDataEntries(ItemType type)
+{
+    return isVariableLengthType(type) || type == ItemType::COUNTER || type == ItemType::LOG;
+}
+
+inline bool isIntegerType(ItemType type)
+{
+    uint8_t size = static_cast<uint8_t>(type) & 0x0f;
+    return ((static_cast<uint8_t>(type) & 0xe0) == 0 &&
+            (size == 1 || size == 2 || size == 4 || size == 8));
+}
+
 class Item
 {
 public:
@@ -61,15 +91,28 @@ public:
             union {
                 struct {
                     uint16_t dataSize;
-                    uint16_t reserved;
+                    uint16_t compressedSize; // Size of the stored data if compressed, 0xffff if stored as is
                     uint32_t dataCrc32;
                 } varLength;
                 struct {
                     uint32_t   dataSize;
                     uint8_t    chunkCount; // Number of children data blobs.
                     VerOffset  chunkStart; // Offset from which the chunkIndex for children blobs starts
-                    uint16_t   reserved;
+                    uint16_t   chunkVerMap; // Bit n cleared: chunk n was kept from the other version
+
                 } blobIndex;
+                struct {
+                    uint32_t dataSize;
+                    uint32_t dataCrc32; // Checksum of the data, names the shared blob holding it
+                } blobRef;
+                struct {
+                    uint32_t base; // Value before any bit of the data entries was cleared
+                    uint32_t reserved;
+                } counter;
+                struct {
+                    uint32_t firstSeq; // Sequence number of the record in the first data entry
+                    uint32_t reserved;
+                } logBlock;
                 uint8_t data[8];
             };
         };
@@ -117,6 +160,35 @@ public:
     }
 };
 
+/**
+ * Data entry of a log block, holding one record. Records are written into the erased data entries of the
+ * block in order, a record whose checksum doesn't match was cut off by a power loss and is skipped.
+ */
+class LogRecord
+{
+public:
+    uint32_t crc32; // Checksum of the other fields
+    uint8_t  size;
+    uint8_t  reserved[3];
+    uint8_t  data[NVS_LOG_RECORD_MAX_SIZE];
+
+    static const size_t MAX_SIZE = sizeof(data);
+
+    LogRecord()
+    {
+    }
+
+    LogRecord(const void* data_, size_t size_) : size(static_cast<uint8_t>(size_))
+    {
+        std::fill_n(reserved, sizeof(reserved), 0xff);
+        std::fill_n(data, sizeof(data), 0xff);
+        memcpy(data, data_, size_);
+        crc32 = calculateCrc32();
+    }
+
+    uint32_t calculateCrc32() const;
+};
+
 } // namespace nvs
 
 #endif /* nvs_types_h */
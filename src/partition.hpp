@@ -52,6 +52,31 @@ public:
      * Return the partition size in bytes.
      */
     virtual uint32_t get_size() = 0;
+
+    /**
+     * Whether write encrypts the data. Bits of encrypted data can't be cleared in place.
+     */
+    virtual bool is_encrypted()
+    {
+        return false;
+    }
+
+    /**
+     * Address at which size bytes from src_offset can be read directly, or nullptr if they aren't
+     * memory-mapped. The mapping shows the data as read_raw returns it and follows writes and erases.
+     */
+    virtual const void* get_mapped_ptr(size_t src_offset, size_t size)
+    {
+        return nullptr;
+    }
+
+    /**
+     * Makes the data written so far durable, for partitions which buffer writes. Called by nvs_commit.
+     */
+    virtual esp_err_t flush()
+    {
+        return ESP_OK;
+    }
 };
 
 } // nvs
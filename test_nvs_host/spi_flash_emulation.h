@@ -14,6 +14,7 @@
 #ifndef spi_flash_emulation_h
 #define spi_flash_emulation_h
 
+#include <atomic>
 #include <vector>
 #include <cassert>
 #include <algorithm>
@@ -232,12 +233,13 @@ protected:
     std::vector<uint32_t> mData;
     std::vector<uint32_t> mEraseCnt;
 
-    mutable size_t mReadOps = 0;
+    // reads may come from several threads holding the NVS lock shared
+    mutable std::atomic<size_t> mReadOps{0};
     mutable size_t mWriteOps = 0;
-    mutable size_t mReadBytes = 0;
+    mutable std::atomic<size_t> mReadBytes{0};
     mutable size_t mWriteBytes = 0;
     mutable size_t mEraseOps = 0;
-    mutable size_t mTotalTime = 0;
+    mutable std::atomic<size_t> mTotalTime{0};
     size_t mLowerSectorBound = 0;
     size_t mUpperSectorBound = 0;
 
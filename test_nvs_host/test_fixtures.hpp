@@ -101,6 +101,23 @@ public:
         return size;
     }
 
+    const void* get_mapped_ptr(size_t src_offset, size_t size) override
+    {
+        if (!mapped || src_offset + size > flash_emu->size()) {
+            return nullptr;
+        }
+        return flash_emu->bytes() + src_offset;
+    }
+
+    /**
+     * Lets NVS read the emulated flash directly, like a memory-mapped partition. Such reads aren't
+     * counted by the emulator.
+     */
+    void set_mapped(bool mapped)
+    {
+        this->mapped = mapped;
+    }
+
 private:
     const char *partition_name;
 
@@ -109,6 +126,8 @@ private:
     uint32_t address;
 
     uint32_t size;
+
+    bool mapped = false;
 };
 
 struct PartitionEmulationFixture {
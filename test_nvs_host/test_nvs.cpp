@@ -19,6 +19,10 @@
 #include "nvs_partition_manager.hpp"
 #include "nvs_partition.hpp"
 #include "mbedtls/aes.h"
+#include "nvs_compress.hpp"
+#include "nvs_platform.hpp"
+#include "nvs_file_partition.hpp"
+#include "nvs_mmap_partition.hpp"
 #include <sstream>
 #include <iostream>
 #include <fstream>
@@ -27,6 +31,14 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <string>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <set>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <array>
 
 #include "test_fixtures.hpp"
 
@@ -1606,8 +1618,13 @@ TEST_CASE("recovery after failure to write data", "[nvs]")
     PartitionEmulationFixture f(0, 3);
     const char str[] = "value 0123456789abcdef012345678value 0123456789abcdef012345678";
 
+#if CONFIG_NVS_COALESCE_WRITES
+    // make flash write fail exactly in Page::writeEntries, after the header and the first data entry
+    f.emu.failAfter(25);
+#else
     // make flash write fail exactly in Page::writeEntryData
     f.emu.failAfter(17);
+#endif
     {
         Storage storage(&f.part);
         TEST_ESP_OK(storage.init(0, 3));
@@ -1960,7 +1977,11 @@ TEST_CASE("Recovery from power-off when the entry being erased is not on active
     TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
 
     f.emu.clearStats();
+#if CONFIG_NVS_COALESCE_WRITES
+    f.emu.failAfter(Page::CHUNK_MAX_SIZE/4 + 72);
+#else
     f.emu.failAfter(Page::CHUNK_MAX_SIZE/4 + 75);
+#endif
     TEST_ESP_OK( nvs_set_blob(handle, "1a", blob, blob_size) );
     TEST_ESP_OK( nvs_set_blob(handle, "1b", blob, blob_size) );
 
@@ -2195,6 +2216,531 @@ TEST_CASE("Check that orphaned blobs are erased during init", "[nvs]")
     TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key3", blob, sizeof(blob)));
 }
 
+TEST_CASE("Modification of a multi-page blob only rewrites the modified chunks", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE * 3;
+    static uint8_t blob[blob_size];
+    static uint8_t blob_read[blob_size];
+    PartitionEmulationFixture f(0, 8);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 8));
+    storage.setBlobDeltaWrites(true);
+
+    memset(blob, 0x11, blob_size);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob, blob_size));
+
+    // change a few bytes in the middle chunk, then in the first one, then the middle one again
+    const size_t offsets[] = {blob_size / 2, 10, blob_size / 2 + 100};
+    for (size_t offset : offsets) {
+        memset(blob + offset, static_cast<int>(offset), 32);
+        f.emu.clearStats();
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob, blob_size));
+        CHECK(f.emu.getWriteBytes() < 2 * Page::CHUNK_MAX_SIZE);
+
+        // unchanged chunks must survive the orphan clean-up during init
+        TEST_ESP_OK(storage.init(0, 8));
+        memset(blob_read, 0xee, blob_size);
+        TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", blob_read, blob_size));
+        CHECK(memcmp(blob, blob_read, blob_size) == 0);
+    }
+
+    // a full rewrite of a partially rewritten blob works as well
+    memset(blob, 0x22, blob_size);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob, blob_size));
+    TEST_ESP_OK(storage.init(0, 8));
+    TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", blob_read, blob_size));
+    CHECK(memcmp(blob, blob_read, blob_size) == 0);
+
+    TEST_ESP_OK(storage.eraseItem(1, ItemType::BLOB, "key"));
+    size_t used = 0;
+    TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+    CHECK(used == 0);
+}
+
+TEST_CASE("Multi-page blobs are rewritten as a whole unless delta writes are enabled", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE * 3;
+    static uint8_t blob[blob_size];
+    static uint8_t blob_read[blob_size];
+    PartitionEmulationFixture f(0, 8);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 8));
+    storage.setBlobDeltaWrites(false);
+
+    memset(blob, 0x11, blob_size);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob, blob_size));
+    memset(blob + blob_size / 2, 0x22, 32);
+    f.emu.clearStats();
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob, blob_size));
+    CHECK(f.emu.getWriteBytes() > blob_size);
+
+    // identical data is still not written again
+    f.emu.clearStats();
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob, blob_size));
+    CHECK(f.emu.getWriteOps() == 0);
+
+    TEST_ESP_OK(storage.init(0, 8));
+    TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", blob_read, blob_size));
+    CHECK(memcmp(blob, blob_read, blob_size) == 0);
+}
+
+TEST_CASE("Recovery from power-off during partial modification of a multi-page blob", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE * 3;
+    static uint8_t blob_old[blob_size];
+    static uint8_t blob_new[blob_size];
+    static uint8_t blob_read[blob_size];
+    memset(blob_old, 0x11, blob_size);
+    memcpy(blob_new, blob_old, blob_size);
+    memset(blob_new + blob_size / 2, 0x22, 64);
+
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 8);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 8));
+        storage.setBlobDeltaWrites(true);
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob_old, blob_size));
+
+        f.emu.failAfter(failAfter);
+        bool done = storage.writeItem(1, ItemType::BLOB, "key", blob_new, blob_size) == ESP_OK;
+        f.emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK(storage.init(0, 8));
+        memset(blob_read, 0xee, blob_size);
+        TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", blob_read, blob_size));
+        bool isOld = memcmp(blob_old, blob_read, blob_size) == 0;
+        bool isNew = memcmp(blob_new, blob_read, blob_size) == 0;
+        CHECK((isOld || isNew));
+        if (done) {
+            CHECK(isNew);
+            break;
+        }
+    }
+}
+
+TEST_CASE("Power-off during rewrite of a partially modified multi-page blob with a new size", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE * 3;
+    const size_t new_size = blob_size - 1000;
+    static uint8_t blob_old[blob_size];
+    static uint8_t blob_new[blob_size];
+    static uint8_t blob_read[blob_size];
+    memset(blob_old, 0x11, blob_size);
+    memset(blob_new, 0x33, new_size);
+
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 8);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 8));
+        storage.setBlobDeltaWrites(true);
+        blob_old[blob_size / 2] = 0x11;
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob_old, blob_size));
+        // leaves the first and the last chunk with the other version
+        blob_old[blob_size / 2] = 0x22;
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob_old, blob_size));
+
+        f.emu.failAfter(failAfter);
+        bool done = storage.writeItem(1, ItemType::BLOB, "key", blob_new, new_size) == ESP_OK;
+        f.emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK(storage.init(0, 8));
+        size_t size = 0;
+        TEST_ESP_OK(storage.getItemDataSize(1, ItemType::BLOB, "key", size));
+        CHECK((size == blob_size || size == new_size));
+        TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", blob_read, size));
+        CHECK(memcmp((size == blob_size) ? blob_old : blob_new, blob_read, size) == 0);
+        if (done) {
+            CHECK(size == new_size);
+            TEST_ESP_OK(storage.eraseItem(1, ItemType::BLOB, "key"));
+            size_t used = 0;
+            TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+            CHECK(used == 0);
+            break;
+        }
+    }
+}
+
+TEST_CASE("Recovery from power-off while writing a blob piece by piece", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE + 1000;
+    static uint8_t blob_old[blob_size];
+    static uint8_t blob_new[blob_size];
+    static uint8_t blob_read[blob_size];
+    memset(blob_old, 0x11, blob_size);
+    memset(blob_new, 0x22, blob_size);
+
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 8);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 8));
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", blob_old, blob_size));
+
+        BlobWriter writer;
+        TEST_ESP_OK(storage.openBlobWriter(1, "key", 1024, writer));
+        f.emu.failAfter(failAfter);
+        bool done = true;
+        for (size_t offset = 0; done && offset < blob_size; offset += 700) {
+            done = storage.appendBlobWriter(writer, blob_new + offset, std::min<size_t>(700, blob_size - offset)) == ESP_OK;
+        }
+        done = done && storage.finalizeBlobWriter(writer) == ESP_OK;
+        CHECK(!writer.isOpen());
+        f.emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK(storage.init(0, 8));
+        memset(blob_read, 0xee, blob_size);
+        TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", blob_read, blob_size));
+        bool isOld = memcmp(blob_old, blob_read, blob_size) == 0;
+        bool isNew = memcmp(blob_new, blob_read, blob_size) == 0;
+        CHECK((isOld || isNew));
+        if (done) {
+            CHECK(isNew);
+            TEST_ESP_OK(storage.eraseItem(1, ItemType::BLOB, "key"));
+            size_t used = 0;
+            TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+            CHECK(used == 0);
+            break;
+        }
+    }
+}
+
+TEST_CASE("Ranges of a multi-page blob can be read without reading the whole blob", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE * 2 + 1000;
+    static uint8_t blob[blob_size];
+    uint8_t buf[300];
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("test", NVS_READWRITE, &handle));
+    for (size_t i = 0; i < blob_size; ++i) {
+        blob[i] = static_cast<uint8_t>(i * 7);
+    }
+    TEST_ESP_OK(nvs_set_blob(handle, "key", blob, blob_size));
+    // leave some chunks with the other version
+    blob[10] = 0x55;
+    TEST_ESP_OK(nvs_set_blob(handle, "key", blob, blob_size));
+
+    std::mt19937 gen(42);
+    for (int i = 0; i < 200; ++i) {
+        size_t len = std::uniform_int_distribution<size_t>(0, sizeof(buf))(gen);
+        size_t offset = std::uniform_int_distribution<size_t>(0, blob_size - len)(gen);
+        INFO("offset=" << offset << " len=" << len);
+        memset(buf, 0xee, sizeof(buf));
+        f.emu.clearStats();
+        TEST_ESP_OK(nvs_get_blob_range(handle, "key", offset, buf, len));
+        CHECK(memcmp(buf, blob + offset, len) == 0);
+        CHECK(f.emu.getReadBytes() < blob_size / 2);
+    }
+    // range spanning the chunk boundary, and the whole blob
+    TEST_ESP_OK(nvs_get_blob_range(handle, "key", Page::CHUNK_MAX_SIZE - 150, buf, sizeof(buf)));
+    CHECK(memcmp(buf, blob + Page::CHUNK_MAX_SIZE - 150, sizeof(buf)) == 0);
+    static uint8_t blob_read[blob_size];
+    TEST_ESP_OK(nvs_get_blob_range(handle, "key", 0, blob_read, blob_size));
+    CHECK(memcmp(blob_read, blob, blob_size) == 0);
+
+    TEST_ESP_ERR(nvs_get_blob_range(handle, "key", blob_size - 10, buf, 11), ESP_ERR_NVS_INVALID_LENGTH);
+    TEST_ESP_ERR(nvs_get_blob_range(handle, "key", blob_size + 1, buf, 0), ESP_ERR_NVS_INVALID_LENGTH);
+    TEST_ESP_ERR(nvs_get_blob_range(handle, "nokey", 0, buf, 1), ESP_ERR_NVS_NOT_FOUND);
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Blob present in old-format can be read piece by piece", "[nvs]")
+{
+    PartitionEmulationFixture f(0, 3);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+
+    uint8_t blob[100];
+    for (size_t i = 0; i < sizeof(blob); ++i) {
+        blob[i] = static_cast<uint8_t>(i);
+    }
+    Page p;
+    p.load(&f.part, 0);
+    TEST_ESP_OK(p.writeItem(1, ItemType::BLOB, "key", blob, sizeof(blob)));
+    TEST_ESP_OK(storage.init(0, 3));
+
+    BlobReader reader;
+    TEST_ESP_OK(storage.openBlobReader(1, "key", reader));
+    CHECK(reader.dataSize == sizeof(blob));
+    uint8_t buf[sizeof(blob)];
+    size_t readSize;
+    TEST_ESP_OK(storage.readBlobReader(reader, buf, 33, readSize));
+    CHECK(readSize == 33);
+    TEST_ESP_OK(storage.readBlobReader(reader, buf + 33, sizeof(buf), readSize));
+    CHECK(readSize == sizeof(blob) - 33);
+    TEST_ESP_OK(storage.readBlobReader(reader, buf, sizeof(buf), readSize));
+    CHECK(readSize == 0);
+    CHECK(memcmp(buf, blob, sizeof(blob)) == 0);
+
+    TEST_ESP_OK(storage.readBlobRange(1, "key", 50, buf, 50));
+    CHECK(memcmp(buf, blob + 50, 50) == 0);
+}
+
+static std::string make_json_config(size_t size, int version)
+{
+    std::stringstream ss;
+    ss << "{\"version\":" << version << ",\"networks\":[";
+    for (int i = 0; ss.tellp() < static_cast<std::streamoff>(size) - 80; ++i) {
+        ss << "{\"ssid\":\"network_" << i << "\",\"channel\":" << (i % 13 + 1)
+           << ",\"auth\":\"wpa2\",\"hidden\":false},";
+    }
+    std::string str = ss.str();
+    str.resize(size - 3, ' ');
+    return str + "]}";
+}
+
+TEST_CASE("Strings and blobs are stored compressed if enabled", "[nvs]")
+{
+    PartitionEmulationFixture f(0, 8);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 8));
+    storage.setCompression(true);
+
+    std::string json = make_json_config(2000, 1);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "json", json.c_str(), json.size() + 1));
+    size_t used = 0;
+    TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+    CHECK(used < (json.size() + 1) / Page::ENTRY_SIZE / 2);
+
+    // writing the same value again is detected without writing anything
+    f.emu.clearStats();
+    TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "json", json.c_str(), json.size() + 1));
+    CHECK(f.emu.getWriteOps() == 0);
+
+    // a multi-page blob with compressed chunks, partially modified
+    const size_t blob_size = Page::CHUNK_MAX_SIZE * 2 + 100;
+    std::vector<uint8_t> blob(blob_size);
+    for (size_t i = 0; i < blob_size; ++i) {
+        blob[i] = static_cast<uint8_t>((i / 64) & 0x3);
+    }
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "blob", blob.data(), blob.size()));
+    blob[blob_size - 10] = 0x55;
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "blob", blob.data(), blob.size()));
+
+    // incompressible data is stored as is
+    std::mt19937 gen(3);
+    std::vector<uint8_t> random(500);
+    for (auto& b : random) {
+        b = static_cast<uint8_t>(gen());
+    }
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "random", random.data(), random.size()));
+
+    // everything can be read back, also with compression disabled and after re-init
+    storage.setCompression(false);
+    TEST_ESP_OK(storage.init(0, 8));
+    std::vector<char> str_read(json.size() + 1);
+    TEST_ESP_OK(storage.readItem(1, ItemType::SZ, "json", str_read.data(), str_read.size()));
+    CHECK(json == str_read.data());
+    size_t size;
+    TEST_ESP_OK(storage.getItemDataSize(1, ItemType::SZ, "json", size));
+    CHECK(size == json.size() + 1);
+    std::vector<uint8_t> blob_read(blob_size);
+    TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "blob", blob_read.data(), blob_read.size()));
+    CHECK(blob == blob_read);
+    uint8_t range[100];
+    TEST_ESP_OK(storage.readBlobRange(1, "blob", blob_size - 50, range, 50));
+    CHECK(memcmp(range, blob.data() + blob_size - 50, 50) == 0);
+    std::vector<uint8_t> random_read(random.size());
+    TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "random", random_read.data(), random_read.size()));
+    CHECK(random == random_read);
+
+    // a modified value replaces the compressed one
+    json = make_json_config(2000, 2);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "json", json.c_str(), json.size() + 1));
+    TEST_ESP_OK(storage.readItem(1, ItemType::SZ, "json", str_read.data(), str_read.size()));
+    CHECK(json == str_read.data());
+}
+
+TEST_CASE("Identical blobs written for several keys are stored once", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE + 1000;
+    static uint8_t blob[blob_size];
+    static uint8_t blob_read[blob_size];
+    for (size_t i = 0; i < blob_size; ++i) {
+        blob[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    NVSPartitionManager::get_instance()->lookup_storage_from_name(NVS_DEFAULT_PART_NAME)->setDeduplication(true);
+    nvs_handle_t handle_1, handle_2;
+    TEST_ESP_OK(nvs_open("ns1", NVS_READWRITE, &handle_1));
+    TEST_ESP_OK(nvs_open("ns2", NVS_READWRITE, &handle_2));
+
+    TEST_ESP_OK(nvs_set_blob(handle_1, "a", blob, blob_size));
+    nvs_stats_t stats_one;
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats_one));
+
+    // the other copies only take one entry each
+    f.emu.clearStats();
+    TEST_ESP_OK(nvs_set_blob(handle_1, "b", blob, blob_size));
+    TEST_ESP_OK(nvs_set_blob(handle_2, "c", blob, blob_size));
+    CHECK(f.emu.getWriteBytes() < 3 * Page::ENTRY_SIZE);
+    nvs_stats_t stats;
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats));
+    CHECK(stats.used_entries == stats_one.used_entries + 2);
+
+    // writing a copy again doesn't write anything
+    f.emu.clearStats();
+    TEST_ESP_OK(nvs_set_blob(handle_2, "c", blob, blob_size));
+    CHECK(f.emu.getWriteOps() == 0);
+
+    size_t size = 0;
+    TEST_ESP_OK(nvs_get_blob(handle_2, "c", nullptr, &size));
+    CHECK(size == blob_size);
+    TEST_ESP_OK(nvs_get_blob(handle_2, "c", blob_read, &size));
+    CHECK(memcmp(blob, blob_read, blob_size) == 0);
+    TEST_ESP_OK(nvs_get_blob_range(handle_1, "b", blob_size - 100, blob_read, 100));
+    CHECK(memcmp(blob + blob_size - 100, blob_read, 100) == 0);
+
+    // each copy is listed as a blob of its own key, the shared data isn't listed
+    int count = 0;
+    for (nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, NULL, NVS_TYPE_BLOB); it; it = nvs_entry_next(it)) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        CHECK(info.type == NVS_TYPE_BLOB);
+        CHECK(strlen(info.namespace_name) > 0);
+        ++count;
+    }
+    CHECK(count == 3);
+
+    // modifying one copy leaves the others unchanged
+    uint8_t modified[blob_size];
+    memcpy(modified, blob, blob_size);
+    modified[10] ^= 0xff;
+    TEST_ESP_OK(nvs_set_blob(handle_1, "a", modified, blob_size));
+    TEST_ESP_OK(nvs_get_blob(handle_1, "b", blob_read, &size));
+    CHECK(memcmp(blob, blob_read, blob_size) == 0);
+    TEST_ESP_OK(nvs_get_blob(handle_1, "a", blob_read, &size));
+    CHECK(memcmp(modified, blob_read, blob_size) == 0);
+
+    // the shared data is erased together with its last reference, also after re-init
+    TEST_ESP_OK(nvs_erase_key(handle_1, "b"));
+    TEST_ESP_OK(nvs_erase_all(handle_2));
+    TEST_ESP_OK(nvs_commit(handle_2));
+    nvs_close(handle_1);
+    nvs_close(handle_2);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    TEST_ESP_OK(nvs_open("ns1", NVS_READWRITE, &handle_1));
+    TEST_ESP_OK(nvs_get_blob(handle_1, "a", blob_read, &size));
+    CHECK(memcmp(modified, blob_read, blob_size) == 0);
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats));
+    CHECK(stats.used_entries == stats_one.used_entries);
+    TEST_ESP_OK(nvs_erase_key(handle_1, "a"));
+    nvs_close(handle_1);
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats));
+    CHECK(stats.used_entries == 2);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("The namespace index of shared blobs is only reserved once a blob is shared", "[nvs]")
+{
+    const size_t blob_size = Storage::SHARED_BLOB_MIN_SIZE;
+    uint8_t blob[blob_size];
+    std::fill_n(blob, blob_size, 0x5a);
+    char name[16];
+    uint8_t nsIndex;
+    {
+        // without shared blobs, all 254 indices are handed out to namespaces
+        PartitionEmulationFixture f(0, 8);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 8));
+        for (int i = 1; i < 255; ++i) {
+            snprintf(name, sizeof(name), "ns%d", i);
+            TEST_ESP_OK(storage.createOrOpenNamespace(name, true, nsIndex));
+        }
+        CHECK(nsIndex == 254);
+        // then blobs are stored privately
+        storage.setDeduplication(true);
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "a", blob, blob_size));
+        TEST_ESP_OK(storage.writeItem(2, ItemType::BLOB, "b", blob, blob_size));
+        size_t used;
+        TEST_ESP_OK(storage.calcEntriesInNamespace(2, used));
+        CHECK(used > 1);
+    }
+    {
+        PartitionEmulationFixture f(0, 8);
+        {
+            Storage storage(&f.part);
+            TEST_ESP_OK(storage.init(0, 8));
+            storage.setDeduplication(true);
+            TEST_ESP_OK(storage.createOrOpenNamespace("ns1", true, nsIndex));
+            TEST_ESP_OK(storage.writeItem(nsIndex, ItemType::BLOB, "a", blob, blob_size));
+            TEST_ESP_OK(storage.writeItem(nsIndex, ItemType::BLOB, "b", blob, blob_size));
+        }
+        // after a restart, the stored shared blob keeps the index reserved
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 8));
+        for (int i = 2; i < 254; ++i) {
+            snprintf(name, sizeof(name), "ns%d", i);
+            TEST_ESP_OK(storage.createOrOpenNamespace(name, true, nsIndex));
+        }
+        TEST_ESP_ERR(storage.createOrOpenNamespace("ns254", true, nsIndex), ESP_ERR_NVS_NOT_ENOUGH_SPACE);
+        uint8_t blob_read[blob_size];
+        TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "b", blob_read, blob_size));
+        CHECK(memcmp(blob, blob_read, blob_size) == 0);
+    }
+}
+
+TEST_CASE("Recovery from power-off while a blob is converted to or from a shared blob", "[nvs]")
+{
+    const size_t blob_size = Page::CHUNK_MAX_SIZE + 1000;
+    static uint8_t blob_old[blob_size];
+    static uint8_t blob_new[blob_size];
+    static uint8_t blob_read[blob_size];
+    memset(blob_old, 0x11, blob_size);
+    memset(blob_new, 0x22, blob_size);
+
+    // 0: private blob replaced by a reference, 1: reference replaced by another one,
+    // 2: reference replaced by a private blob
+    for (int variant = 0; variant < 3; ++variant) {
+        for (uint32_t failAfter = 0; ; ++failAfter) {
+            INFO("variant=" << variant << " failAfter=" << failAfter);
+            PartitionEmulationFixture f(0, 8);
+            Storage storage(&f.part);
+            TEST_ESP_OK(storage.init(0, 8));
+            storage.setDeduplication(true);
+            TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "b", blob_new, blob_size));
+            storage.setDeduplication(variant != 0);
+            TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "a", blob_old, blob_size));
+            storage.setDeduplication(variant != 2);
+
+            f.emu.failAfter(failAfter);
+            bool done = storage.writeItem(1, ItemType::BLOB, "a", blob_new, blob_size) == ESP_OK;
+            f.emu.failAfter(UINT32_MAX);
+
+            TEST_ESP_OK(storage.init(0, 8));
+            memset(blob_read, 0xee, blob_size);
+            TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "a", blob_read, blob_size));
+            bool isOld = memcmp(blob_old, blob_read, blob_size) == 0;
+            bool isNew = memcmp(blob_new, blob_read, blob_size) == 0;
+            CHECK((isOld || isNew));
+            TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "b", blob_read, blob_size));
+            CHECK(memcmp(blob_new, blob_read, blob_size) == 0);
+
+            TEST_ESP_OK(storage.eraseItem(1, ItemType::BLOB, "a"));
+            TEST_ESP_OK(storage.eraseItem(1, ItemType::BLOB, "b"));
+            size_t used = 0;
+            TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+            CHECK(used == 0);
+            TEST_ESP_OK(storage.calcEntriesInNamespace(Page::NS_SHARED, used));
+            CHECK(used == 0);
+            if (done) {
+                CHECK(isNew);
+                break;
+            }
+        }
+    }
+}
+
 TEST_CASE("nvs blob fragmentation test", "[nvs]")
 {
     PartitionEmulationFixture f(0, 4);
@@ -2435,6 +2981,7 @@ TEST_CASE("Recovery from power-off during modification of blob present in old-fo
     TEST_ESP_OK(p.writeItem(1, ItemType::BLOB_DATA, "singlepage", hexdata, sizeof(hexdata), 0));
     /* All pages are stored. Now store the index.*/
     Item item;
+    std::fill_n(item.data, sizeof(item.data), 0xff);
     item.blobIndex.dataSize = sizeof(hexdata);
     item.blobIndex.chunkCount = 1;
     item.blobIndex.chunkStart = VerOffset::VER_0_OFFSET;
@@ -2490,6 +3037,7 @@ TEST_CASE("Recovery from power-off during modification of blob present in old-fo
     TEST_ESP_OK(p.writeItem(1, ItemType::BLOB_DATA, "singlepage", hexdata, sizeof(hexdata), 0));
     /* All pages are stored. Now store the index.*/
     Item item;
+    std::fill_n(item.data, sizeof(item.data), 0xff);
     item.blobIndex.dataSize = sizeof(hexdata);
     item.blobIndex.chunkCount = 1;
     item.blobIndex.chunkStart = VerOffset::VER_0_OFFSET;
@@ -3487,6 +4035,2750 @@ TEST_CASE("check and read data from partition generated via manufacturing utilit
 }
 #endif
 
+TEST_CASE("benchmark compression of strings and blobs", "[nvs][compress]")
+{
+    std::vector<std::pair<std::string, std::vector<uint8_t> > > payloads;
+
+    std::string json = make_json_config(2000, 1);
+    payloads.emplace_back("JSON config", std::vector<uint8_t>(json.begin(), json.end()));
+
+    struct CalibrationEntry {
+        uint16_t id;
+        uint8_t flags;
+        uint8_t reserved;
+        int32_t offset;
+        float gain;
+    };
+    std::vector<uint8_t> table;
+    for (uint16_t i = 0; i < 2000 / sizeof(CalibrationEntry); ++i) {
+        CalibrationEntry e = {i, static_cast<uint8_t>(i % 4 == 0), 0, (i % 7) - 3, 1.0f};
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&e);
+        table.insert(table.end(), p, p + sizeof(e));
+    }
+    payloads.emplace_back("lookup table", table);
+
+    std::mt19937 gen(4);
+    std::vector<uint8_t> random(2000);
+    for (auto& b : random) {
+        b = static_cast<uint8_t>(gen());
+    }
+    payloads.emplace_back("random data", random);
+
+    const int updates = 200;
+    for (auto& payload : payloads) {
+        std::vector<uint8_t>& data = payload.second;
+        size_t entries[2];
+        for (int compress = 0; compress < 2; ++compress) {
+            PartitionEmulationFixture f(0, 8);
+            Storage storage(&f.part);
+            TEST_ESP_OK(storage.init(0, 8));
+            storage.setCompression(compress);
+            TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", data.data(), data.size()));
+            TEST_ESP_OK(storage.calcEntriesInNamespace(1, entries[compress]));
+
+            f.emu.clearStats();
+            std::vector<uint8_t> value = data;
+            for (int i = 0; i < updates; ++i) {
+                value[i % value.size()] ^= 0x01;
+                TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "key", value.data(), value.size()));
+            }
+            std::vector<uint8_t> read(value.size());
+            TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "key", read.data(), read.size()));
+            CHECK(read == value);
+            s_perf << "Compression " << (compress ? "on " : "off") << ", " << payload.first << " (" << data.size()
+                   << " bytes): " << entries[compress] << " entries, " << updates << " updates: "
+                   << f.emu.getEraseOps() << "E " << f.emu.getWriteBytes() << "Wb " << f.emu.getTotalTime() << " us"
+                   << std::endl;
+        }
+        CHECK(entries[1] <= entries[0]);
+
+        const int rounds = 1000;
+        std::vector<uint8_t> compressed(data.size());
+        std::vector<uint8_t> decompressed(data.size());
+        size_t compressedSize = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            compressedSize = nvs::compress(data.data(), data.size(), compressed.data(), compressed.size());
+        }
+        auto mid = std::chrono::steady_clock::now();
+        for (int i = 0; compressedSize && i < rounds; ++i) {
+            CHECK(nvs::decompress(compressed.data(), compressedSize, decompressed.data(), decompressed.size()));
+        }
+        auto end = std::chrono::steady_clock::now();
+        double mb = static_cast<double>(data.size()) * rounds / 1e6;
+        s_perf << "Codec, " << payload.first << ": ratio " << (compressedSize ? static_cast<double>(data.size()) / compressedSize : 1.0)
+               << ", compress " << mb / std::chrono::duration<double>(mid - start).count() << " MB/s, decompress ";
+        // data which doesn't compress is stored as is, and never decompressed
+        if (compressedSize) {
+            s_perf << mb / std::chrono::duration<double>(end - mid).count() << " MB/s";
+        } else {
+            s_perf << "n/a";
+        }
+        s_perf << " (host)" << std::endl;
+    }
+}
+
+TEST_CASE("Readers holding the lock shared leave corrupted items to the next writer", "[nvs][lock]")
+{
+    PartitionEmulationFixture f(0, 4);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 4));
+    TEST_ESP_OK(storage.writeItem(1, "key", static_cast<int32_t>(42)));
+    // corrupt the value of the first entry, so that its CRC doesn't match
+    uint32_t zero = 0;
+    f.emu.write(64 + 24, &zero, 4);
+
+    int32_t value;
+    nvs_stats_t stats;
+    {
+        SharedLock lock(storage.getLock());
+        TEST_ESP_ERR(storage.readItem(1, "key", value), ESP_ERR_NVS_NOT_FOUND);
+    }
+    TEST_ESP_OK(storage.fillStats(stats));
+    CHECK(stats.used_entries == 1);
+    {
+        Lock lock(storage.getLock());
+        TEST_ESP_ERR(storage.readItem(1, "key", value), ESP_ERR_NVS_NOT_FOUND);
+    }
+    TEST_ESP_OK(storage.fillStats(stats));
+    CHECK(stats.used_entries == 0);
+}
+
+TEST_CASE("Readers of one partition leave the other partitions writable", "[nvs][lock]")
+{
+    PartitionEmulationFixture f1(0, 4, "part1");
+    PartitionEmulationFixture f2(0, 4, "part2");
+    Storage storage1(&f1.part);
+    Storage storage2(&f2.part);
+    TEST_ESP_OK(storage1.init(0, 4));
+    TEST_ESP_OK(storage2.init(0, 4));
+    TEST_ESP_OK(storage2.writeItem(1, "key", static_cast<int32_t>(42)));
+    uint32_t zero = 0;
+    f2.emu.write(64 + 24, &zero, 4);
+
+    int32_t value;
+    nvs_stats_t stats;
+    {
+        SharedLock lock(storage1.getLock());
+        Lock lock2(storage2.getLock());
+        TEST_ESP_ERR(storage2.readItem(1, "key", value), ESP_ERR_NVS_NOT_FOUND);
+    }
+    TEST_ESP_OK(storage2.fillStats(stats));
+    CHECK(stats.used_entries == 0);
+}
+
+TEST_CASE("benchmark concurrent reads with shared and exclusive locking", "[nvs][lock]")
+{
+    PartitionEmulationFixture f(0, 8);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 8));
+    const int key_count = 32;
+    for (int i = 0; i < key_count; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ESP_OK(storage.writeItem(1, key, i));
+    }
+    std::vector<uint8_t> blob(2000, 0x5a);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "blob", blob.data(), blob.size()));
+
+    const int reads_per_thread = 2000;
+    for (int shared = 0; shared < 2; ++shared) {
+        for (int threads = 1; threads <= 4; threads *= 2) {
+            // Catch assertions aren't thread safe, so failures are only counted in the threads
+            std::atomic<bool> stop(false);
+            std::atomic<size_t> writes(0);
+            std::atomic<size_t> errors(0);
+            auto start = std::chrono::steady_clock::now();
+            std::thread writer([&] {
+                for (int32_t i = 0; !stop; ++i) {
+                    Lock lock(storage.getLock());
+                    if (storage.writeItem(2, "counter", i) != ESP_OK) {
+                        ++errors;
+                    }
+                    ++writes;
+                }
+            });
+            std::vector<std::thread> readers;
+            for (int t = 0; t < threads; ++t) {
+                readers.emplace_back([&, t] {
+                    std::vector<uint8_t> blob_read(blob.size());
+                    for (int i = 0; i < reads_per_thread; ++i) {
+                        char key[16];
+                        snprintf(key, sizeof(key), "key%d", (i + t) % key_count);
+                        int32_t value;
+                        esp_err_t err;
+                        if (shared) {
+                            SharedLock lock(storage.getLock());
+                            err = (i % 8) ? storage.readItem(1, key, value)
+                                : storage.readItem(1, ItemType::BLOB, "blob", blob_read.data(), blob_read.size());
+                        } else {
+                            Lock lock(storage.getLock());
+                            err = (i % 8) ? storage.readItem(1, key, value)
+                                : storage.readItem(1, ItemType::BLOB, "blob", blob_read.data(), blob_read.size());
+                        }
+                        if (err != ESP_OK) {
+                            ++errors;
+                        }
+                    }
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            stop = true;
+            writer.join();
+            CHECK(errors == 0);
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            s_perf << "Concurrent reads, " << (shared ? "shared" : "exclusive") << " lock, " << threads
+                   << " reader threads + 1 writer: " << static_cast<size_t>(threads * reads_per_thread / elapsed)
+                   << " reads/s, " << static_cast<size_t>(writes / elapsed) << " writes/s ("
+                   << std::thread::hardware_concurrency() << " cores, host)" << std::endl;
+        }
+    }
+}
+
+TEST_CASE("Operations on different partitions hold separate locks", "[nvs][lock]")
+{
+    PartitionEmulationFixture f1(0, 4, "part1");
+    PartitionEmulationFixture f2(0, 4, "part2");
+    Lock::init();
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f1.part, 0, 4));
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f2.part, 0, 4));
+    nvs_handle_t handle1, handle2;
+    TEST_ESP_OK(nvs_open_from_partition("part1", "ns", NVS_READWRITE, &handle1));
+    TEST_ESP_OK(nvs_open_from_partition("part2", "ns", NVS_READWRITE, &handle2));
+    Storage* storage1 = NVSPartitionManager::get_instance()->lookup_storage_from_name("part1");
+    REQUIRE(storage1 != nullptr);
+
+    std::atomic<bool> written(false);
+    std::thread writer;
+    {
+        // while part1 is held exclusively, part2 can still be written and read
+        Lock lock(storage1->getLock());
+        writer = std::thread([&] {
+            int32_t value = 0;
+            written = nvs_set_i32(handle2, "key", 42) == ESP_OK
+                    && nvs_get_i32(handle2, "key", &value) == ESP_OK && value == 42;
+        });
+        writer.join();
+    }
+    CHECK(written);
+
+    nvs_close(handle1);
+    nvs_close(handle2);
+    TEST_ESP_OK(nvs_flash_deinit_partition("part1"));
+    TEST_ESP_OK(nvs_flash_deinit_partition("part2"));
+}
+
+TEST_CASE("benchmark parallel writes to separate partitions", "[nvs][lock]")
+{
+    const int max_threads = 4;
+    const int writes_per_thread = 2000;
+    const char* names[max_threads] = {"part0", "part1", "part2", "part3"};
+    std::vector<std::unique_ptr<PartitionEmulationFixture>> fixtures;
+    for (int i = 0; i < max_threads; ++i) {
+        fixtures.emplace_back(new PartitionEmulationFixture(0, 8, names[i]));
+        TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&fixtures.back()->part, 0, 8));
+    }
+    Lock::init();
+
+    for (int separate = 0; separate < 2; ++separate) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            nvs_handle_t handles[max_threads];
+            for (int t = 0; t < threads; ++t) {
+                TEST_ESP_OK(nvs_open_from_partition(names[separate ? t : 0], "ns", NVS_READWRITE, &handles[t]));
+            }
+            // Catch assertions aren't thread safe, so failures are only counted in the threads
+            std::atomic<size_t> errors(0);
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> writers;
+            for (int t = 0; t < threads; ++t) {
+                writers.emplace_back([&, t] {
+                    char key[16];
+                    snprintf(key, sizeof(key), "key%d", t);
+                    for (int32_t i = 0; i < writes_per_thread; ++i) {
+                        int32_t value;
+                        if (nvs_set_i32(handles[t], key, i) != ESP_OK
+                                || nvs_get_i32(handles[t], key, &value) != ESP_OK || value != i) {
+                            ++errors;
+                        }
+                    }
+                });
+            }
+            for (auto& writer : writers) {
+                writer.join();
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            CHECK(errors == 0);
+            for (int t = 0; t < threads; ++t) {
+                nvs_close(handles[t]);
+            }
+            s_perf << "Parallel writes, " << threads << " threads, " << (separate ? threads : 1)
+                   << " partition(s): " << static_cast<size_t>(threads * writes_per_thread / elapsed)
+                   << " set+get/s (" << std::thread::hardware_concurrency() << " cores, host)" << std::endl;
+        }
+    }
+
+    for (int i = 0; i < max_threads; ++i) {
+        TEST_ESP_OK(nvs_flash_deinit_partition(names[i]));
+    }
+}
+
+/* Fills the first page with "key0".."key9", the second one with "keyB" and the third one partially
+ * with "keyC". The second page is then the next one freed by the garbage collection. */
+static void write_pages_for_snapshot(nvs_handle_t handle)
+{
+    for (int i = 0; i < 10; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ESP_OK(nvs_set_i32(handle, key, i));
+    }
+    for (int i = 0; i < static_cast<int>(Page::ENTRY_COUNT); ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    TEST_ESP_OK(nvs_set_i32(handle, "keyB", 0));
+    for (int i = 0; i < static_cast<int>(Page::ENTRY_COUNT); ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    TEST_ESP_OK(nvs_set_i32(handle, "keyC", 0));
+    for (int i = 0; i < 20; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+}
+
+static size_t count_retired_pages(SpiFlashEmulator& emu, size_t sectors)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < sectors; ++i) {
+        uint32_t state = 0;
+        emu.read(&state, i * SPI_FLASH_SEC_SIZE, sizeof(state));
+        if (state == static_cast<uint32_t>(Page::PageState::RETIRED)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+static std::multiset<std::string> list_keys(nvs_iterator_t it)
+{
+    std::multiset<std::string> keys;
+    for (; it != nullptr; it = nvs_entry_next(it)) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        keys.insert(info.key);
+    }
+    return keys;
+}
+
+TEST_CASE("Iterators list the entries as they were when they were created", "[nvs][snapshot]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    write_pages_for_snapshot(handle);
+    auto expected = list_keys(nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY));
+    CHECK(expected.size() == 13);
+
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    std::multiset<std::string> listed{info.key};
+
+    // "keyB" is moved by the garbage collection, and its page is kept for the iterator
+    for (int i = 0; i < 100; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    CHECK(count_retired_pages(f.emu, 4) == 1);
+    TEST_ESP_OK(nvs_set_i32(handle, "key3", 33));
+    TEST_ESP_OK(nvs_erase_key(handle, "key5"));
+    TEST_ESP_OK(nvs_set_i32(handle, "new", 0));
+
+    auto rest = list_keys(nvs_entry_next(it));
+    listed.insert(rest.begin(), rest.end());
+    CHECK(listed == expected);
+
+    // the kept page is counted as free, and erased when it's needed
+    nvs_stats_t stats;
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats));
+    CHECK(stats.free_entries == 4 * Page::ENTRY_COUNT - stats.used_entries);
+    for (int i = 0; i < 1000; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    CHECK(count_retired_pages(f.emu, 4) == 0);
+    int32_t value;
+    TEST_ESP_OK(nvs_get_i32(handle, "key3", &value));
+    CHECK(value == 33);
+    TEST_ESP_OK(nvs_get_i32(handle, "keyB", &value));
+    TEST_ESP_ERR(nvs_get_i32(handle, "key5", &value), ESP_ERR_NVS_NOT_FOUND);
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Writes erase pages of an iterator if no other page is free", "[nvs][snapshot]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    write_pages_for_snapshot(handle);
+
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    for (int32_t i = 0; i < 300; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+
+    // the iteration ends at the page which has been erased
+    auto listed = list_keys(it);
+    CHECK(listed.size() == 10);
+    CHECK(listed.count("keyB") == 0);
+
+    int32_t value;
+    TEST_ESP_OK(nvs_get_i32(handle, "filler", &value));
+    CHECK(value == 299);
+    TEST_ESP_OK(nvs_get_i32(handle, "keyB", &value));
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Iterators report the erased pages they couldn't list", "[nvs][snapshot]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    write_pages_for_snapshot(handle);
+
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    size_t listed = 1;
+    esp_err_t err;
+    while ((err = nvs_entry_advance(&it)) == ESP_OK) {
+        ++listed;
+    }
+    CHECK(err == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(it == nullptr);
+    CHECK(listed == 13);
+    TEST_ESP_ERR(nvs_entry_advance(&it), ESP_ERR_INVALID_ARG);
+
+    it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    for (int32_t i = 0; i < 300; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    // a single page is kept for the iterator, the one it still needed was erased
+    CHECK(count_retired_pages(f.emu, 4) <= 1);
+    listed = 1;
+    while ((err = nvs_entry_advance(&it)) == ESP_OK) {
+        ++listed;
+    }
+    CHECK(err == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(it == nullptr);
+    CHECK(listed == 10);
+
+    nvs::Entries entries(NVS_DEFAULT_PART_NAME, "ns");
+    listed = 0;
+    for (auto pos = entries.begin(); pos != entries.end(); ++pos) {
+        if (listed++ == 0) {
+            for (int32_t i = 0; i < 300; ++i) {
+                TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+            }
+        }
+    }
+    CHECK(entries.error() == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(listed < 13);
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Writes replace a value which is moved off a page kept for an iterator", "[nvs][snapshot]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    write_pages_for_snapshot(handle);
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    // fill the active page, so that writing keyB frees the page holding its old value
+    for (int32_t i = 0; i < 93; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    REQUIRE(count_retired_pages(f.emu, 4) == 0);
+    TEST_ESP_OK(nvs_set_i32(handle, "keyB", 1));
+    REQUIRE(count_retired_pages(f.emu, 4) == 1);
+    nvs_release_iterator(it);
+
+    int32_t value;
+    TEST_ESP_OK(nvs_get_i32(handle, "keyB", &value));
+    CHECK(value == 1);
+    it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    CHECK(list_keys(it).count("keyB") == 1);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Pages kept for an iterator are erased after a restart", "[nvs][snapshot]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    write_pages_for_snapshot(handle);
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    for (int32_t i = 0; i < 100; ++i) {
+        TEST_ESP_OK(nvs_set_i32(handle, "filler", i));
+    }
+    REQUIRE(count_retired_pages(f.emu, 4) == 1);
+
+    // load the partition again, as after a power-off
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 4));
+    CHECK(count_retired_pages(f.emu, 4) == 1);
+    int32_t value;
+    TEST_ESP_OK(storage.readItem(1, "filler", value));
+    CHECK(value == 99);
+    TEST_ESP_OK(storage.readItem(1, "keyB", value));
+    for (int i = 0; i < 10; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ESP_OK(storage.readItem(1, key, value));
+        CHECK(value == i);
+    }
+    for (int32_t i = 0; i < 1000; ++i) {
+        TEST_ESP_OK(storage.writeItem(1, "filler", i));
+    }
+    CHECK(count_retired_pages(f.emu, 4) == 0);
+
+    nvs_release_iterator(it);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("nvs_get_items reads several values and reports the result of each", "[nvs][batch]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_set_i8(handle, "i8", -3));
+    TEST_ESP_OK(nvs_set_u16(handle, "u16", 1000));
+    TEST_ESP_OK(nvs_set_i32(handle, "i32", -100000));
+    TEST_ESP_OK(nvs_set_u64(handle, "u64", 0x123456789abcdefULL));
+    TEST_ESP_OK(nvs_set_str(handle, "str", "some string"));
+    const uint8_t small_blob[] = {1, 2, 3, 4, 5};
+    TEST_ESP_OK(nvs_set_blob(handle, "small", small_blob, sizeof(small_blob)));
+    std::vector<uint8_t> big_blob(Page::CHUNK_MAX_SIZE + 500);
+    for (size_t i = 0; i < big_blob.size(); ++i) {
+        big_blob[i] = static_cast<uint8_t>(i * 3);
+    }
+    TEST_ESP_OK(nvs_set_blob(handle, "big", big_blob.data(), big_blob.size()));
+    // pushes the later values to other pages
+    std::vector<uint8_t> filler(3000, 0xaa);
+    TEST_ESP_OK(nvs_set_blob(handle, "filler", filler.data(), filler.size()));
+    TEST_ESP_OK(nvs_set_u32(handle, "late", 77));
+    TEST_ESP_OK(nvs_set_i8(handle, "i8", -4));
+
+    int8_t i8 = 0;
+    uint16_t u16 = 0;
+    int32_t i32 = 0;
+    uint64_t u64 = 0;
+    uint32_t late = 0;
+    char str[32];
+    uint8_t small_read[sizeof(small_blob)];
+    std::vector<uint8_t> big_read(big_blob.size());
+    nvs_get_item_t items[] = {
+        {"i8", NVS_TYPE_I8, &i8, 0, ESP_FAIL},
+        {"u16", NVS_TYPE_U16, &u16, 0, ESP_FAIL},
+        {"i32", NVS_TYPE_I32, &i32, 0, ESP_FAIL},
+        {"u64", NVS_TYPE_U64, &u64, 0, ESP_FAIL},
+        {"str", NVS_TYPE_STR, str, sizeof(str), ESP_FAIL},
+        {"small", NVS_TYPE_BLOB, small_read, sizeof(small_read), ESP_FAIL},
+        {"big", NVS_TYPE_BLOB, big_read.data(), big_read.size(), ESP_FAIL},
+        {"late", NVS_TYPE_U32, &late, 0, ESP_FAIL},
+    };
+    const size_t count = sizeof(items) / sizeof(items[0]);
+    TEST_ESP_OK(nvs_get_items(handle, items, count));
+    for (size_t i = 0; i < count; ++i) {
+        TEST_ESP_OK(items[i].err);
+    }
+    CHECK(i8 == -4);
+    CHECK(u16 == 1000);
+    CHECK(i32 == -100000);
+    CHECK(u64 == 0x123456789abcdefULL);
+    CHECK(late == 77);
+    CHECK(strcmp(str, "some string") == 0);
+    CHECK(items[4].length == strlen("some string") + 1);
+    CHECK(memcmp(small_read, small_blob, sizeof(small_blob)) == 0);
+    CHECK(items[5].length == sizeof(small_blob));
+    CHECK(big_read == big_blob);
+
+    int32_t value = 5;
+    char short_str[4];
+    nvs_get_item_t failing[] = {
+        {"u16", NVS_TYPE_U16, &u16, 0, ESP_OK},
+        {"nokey", NVS_TYPE_I32, &value, 0, ESP_OK},
+        {"u16", NVS_TYPE_I32, &value, 0, ESP_OK},
+        {"str", NVS_TYPE_STR, short_str, sizeof(short_str), ESP_OK},
+        {"str", NVS_TYPE_STR, nullptr, 0, ESP_OK},
+        {"big", NVS_TYPE_BLOB, nullptr, 0, ESP_OK},
+        {"small", NVS_TYPE_BLOB, small_read, 2, ESP_OK},
+        {"nokey", NVS_TYPE_BLOB, small_read, sizeof(small_read), ESP_OK},
+        {"i32", NVS_TYPE_I32, nullptr, 0, ESP_OK},
+        {"i32", NVS_TYPE_ANY, &value, 0, ESP_OK},
+        {nullptr, NVS_TYPE_I32, &value, 0, ESP_OK},
+    };
+    TEST_ESP_ERR(nvs_get_items(handle, failing, sizeof(failing) / sizeof(failing[0])), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(failing[0].err);
+    TEST_ESP_ERR(failing[1].err, ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_ERR(failing[2].err, ESP_ERR_NVS_NOT_FOUND);
+    CHECK(value == 5);
+    TEST_ESP_ERR(failing[3].err, ESP_ERR_NVS_INVALID_LENGTH);
+    CHECK(failing[3].length == strlen("some string") + 1);
+    TEST_ESP_OK(failing[4].err);
+    CHECK(failing[4].length == strlen("some string") + 1);
+    TEST_ESP_OK(failing[5].err);
+    CHECK(failing[5].length == big_blob.size());
+    TEST_ESP_ERR(failing[6].err, ESP_ERR_NVS_INVALID_LENGTH);
+    CHECK(failing[6].length == sizeof(small_blob));
+    TEST_ESP_ERR(failing[7].err, ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_ERR(failing[8].err, ESP_ERR_INVALID_ARG);
+    TEST_ESP_ERR(failing[9].err, ESP_ERR_INVALID_ARG);
+    TEST_ESP_ERR(failing[10].err, ESP_ERR_INVALID_ARG);
+
+    TEST_ESP_OK(nvs_get_items(handle, nullptr, 0));
+    TEST_ESP_ERR(nvs_get_items(handle, nullptr, 1), ESP_ERR_INVALID_ARG);
+    nvs_close(handle);
+    TEST_ESP_ERR(nvs_get_items(handle, items, count), ESP_ERR_NVS_INVALID_HANDLE);
+
+    // the same through the C++ handle
+    esp_err_t result;
+    std::shared_ptr<NVSHandle> cpp_handle = open_nvs_handle("ns", NVS_READONLY, &result);
+    TEST_ESP_OK(result);
+    for (size_t i = 0; i < count; ++i) {
+        items[i].err = ESP_FAIL;
+    }
+    TEST_ESP_OK(cpp_handle->get_items(items, count));
+    CHECK(i8 == -4);
+    CHECK(big_read == big_blob);
+    cpp_handle.reset();
+
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("benchmark batch get against single gets", "[nvs][batch]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    const size_t key_count = 200;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < key_count; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        keys.push_back(key);
+        if (i % 4 == 0) {
+            TEST_ESP_OK(nvs_set_str(handle, key, ("value of " + keys.back()).c_str()));
+        } else {
+            TEST_ESP_OK(nvs_set_u32(handle, key, i));
+        }
+    }
+
+    std::vector<uint32_t> values(key_count);
+    std::vector<std::array<char, 32> > strings(key_count);
+    const int rounds = 20;
+    f.emu.clearStats();
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < key_count; ++i) {
+            if (i % 4 == 0) {
+                size_t len = strings[i].size();
+                TEST_ESP_OK(nvs_get_str(handle, keys[i].c_str(), strings[i].data(), &len));
+            } else {
+                TEST_ESP_OK(nvs_get_u32(handle, keys[i].c_str(), &values[i]));
+            }
+        }
+    }
+    double single_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t single_reads = f.emu.getReadOps();
+
+    std::vector<nvs_get_item_t> items(key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        if (i % 4 == 0) {
+            items[i] = {keys[i].c_str(), NVS_TYPE_STR, strings[i].data(), strings[i].size(), ESP_FAIL};
+        } else {
+            items[i] = {keys[i].c_str(), NVS_TYPE_U32, &values[i], 0, ESP_FAIL};
+        }
+    }
+    f.emu.clearStats();
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (auto& item : items) {
+            item.length = (item.type == NVS_TYPE_STR) ? strings[0].size() : 0;
+        }
+        TEST_ESP_OK(nvs_get_items(handle, items.data(), items.size()));
+    }
+    double batch_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t batch_reads = f.emu.getReadOps();
+
+    for (size_t i = 0; i < key_count; ++i) {
+        if (i % 4 == 0) {
+            CHECK(std::string(strings[i].data()) == "value of " + keys[i]);
+        } else {
+            CHECK(values[i] == i);
+        }
+    }
+    CHECK(batch_reads <= single_reads);
+    s_perf << "Get " << key_count << " values (1/4 strings): single gets " << single_reads / rounds << " reads, "
+           << static_cast<size_t>(single_time * 1e6 / rounds) << " us; batch get " << batch_reads / rounds << " reads, "
+           << static_cast<size_t>(batch_time * 1e6 / rounds) << " us (host)" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("nvs_set_items writes several values and reports the result of each", "[nvs][batch]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_set_u16(handle, "u16", 1000));
+    TEST_ESP_OK(nvs_set_str(handle, "str", "old string"));
+
+    int8_t i8 = -4;
+    uint16_t u16 = 2000;
+    int32_t i32 = -100000;
+    uint64_t u64 = 0x123456789abcdefULL;
+    uint32_t first = 1;
+    uint32_t last = 2;
+    std::vector<uint8_t> blob(Page::CHUNK_MAX_SIZE + 500);
+    for (size_t i = 0; i < blob.size(); ++i) {
+        blob[i] = static_cast<uint8_t>(i * 3);
+    }
+    nvs_set_item_t items[] = {
+        {"i8", NVS_TYPE_I8, &i8, 0, ESP_FAIL},
+        {"u16", NVS_TYPE_U16, &u16, 0, ESP_FAIL},
+        {"dup", NVS_TYPE_U32, &first, 0, ESP_FAIL},
+        {"i32", NVS_TYPE_I32, &i32, 0, ESP_FAIL},
+        {"blob", NVS_TYPE_BLOB, blob.data(), blob.size(), ESP_FAIL},
+        {"u64", NVS_TYPE_U64, &u64, 0, ESP_FAIL},
+        {"str", NVS_TYPE_STR, "a new and longer string", 0, ESP_FAIL},
+        {"dup", NVS_TYPE_U32, &last, 0, ESP_FAIL},
+    };
+    const size_t count = sizeof(items) / sizeof(items[0]);
+    TEST_ESP_OK(nvs_set_items(handle, items, count));
+    for (size_t i = 0; i < count; ++i) {
+        TEST_ESP_OK(items[i].err);
+    }
+
+    int8_t i8_read;
+    uint16_t u16_read;
+    int32_t i32_read;
+    uint64_t u64_read;
+    uint32_t dup_read;
+    char str_read[32];
+    size_t len = sizeof(str_read);
+    std::vector<uint8_t> blob_read(blob.size());
+    size_t blob_len = blob_read.size();
+    TEST_ESP_OK(nvs_get_i8(handle, "i8", &i8_read));
+    TEST_ESP_OK(nvs_get_u16(handle, "u16", &u16_read));
+    TEST_ESP_OK(nvs_get_i32(handle, "i32", &i32_read));
+    TEST_ESP_OK(nvs_get_u64(handle, "u64", &u64_read));
+    TEST_ESP_OK(nvs_get_u32(handle, "dup", &dup_read));
+    TEST_ESP_OK(nvs_get_str(handle, "str", str_read, &len));
+    TEST_ESP_OK(nvs_get_blob(handle, "blob", blob_read.data(), &blob_len));
+    CHECK(i8_read == i8);
+    CHECK(u16_read == u16);
+    CHECK(i32_read == i32);
+    CHECK(u64_read == u64);
+    CHECK(dup_read == last);
+    CHECK(strcmp(str_read, "a new and longer string") == 0);
+    CHECK(blob_read == blob);
+    nvs_stats_t stats;
+    TEST_ESP_OK(nvs_get_stats(NULL, &stats));
+    size_t used_entries = stats.used_entries;
+
+    // nothing is written if the values are stored already
+    f.emu.clearStats();
+    TEST_ESP_OK(nvs_set_items(handle, items, count));
+    CHECK(f.emu.getWriteOps() == 0);
+    TEST_ESP_OK(nvs_get_stats(NULL, &stats));
+    CHECK(stats.used_entries == used_entries);
+
+    char long_key[NVS_KEY_NAME_MAX_SIZE + 1];
+    memset(long_key, 'k', sizeof(long_key) - 1);
+    long_key[sizeof(long_key) - 1] = 0;
+    std::string long_str(Page::CHUNK_MAX_SIZE, 'x');
+    uint32_t value = 5;
+    nvs_set_item_t failing[] = {
+        {"good", NVS_TYPE_U32, &value, 0, ESP_FAIL},
+        {nullptr, NVS_TYPE_U32, &value, 0, ESP_OK},
+        {"null", NVS_TYPE_U32, nullptr, 0, ESP_OK},
+        {"any", NVS_TYPE_ANY, &value, 0, ESP_OK},
+        {long_key, NVS_TYPE_U32, &value, 0, ESP_OK},
+        {"long", NVS_TYPE_STR, long_str.c_str(), 0, ESP_OK},
+    };
+    TEST_ESP_ERR(nvs_set_items(handle, failing, sizeof(failing) / sizeof(failing[0])), ESP_ERR_INVALID_ARG);
+    TEST_ESP_OK(failing[0].err);
+    TEST_ESP_ERR(failing[1].err, ESP_ERR_INVALID_ARG);
+    TEST_ESP_ERR(failing[2].err, ESP_ERR_INVALID_ARG);
+    TEST_ESP_ERR(failing[3].err, ESP_ERR_INVALID_ARG);
+    TEST_ESP_ERR(failing[4].err, ESP_ERR_NVS_KEY_TOO_LONG);
+    TEST_ESP_ERR(failing[5].err, ESP_ERR_NVS_VALUE_TOO_LONG);
+    TEST_ESP_OK(nvs_get_u32(handle, "good", &dup_read));
+    CHECK(dup_read == value);
+
+    TEST_ESP_OK(nvs_set_items(handle, nullptr, 0));
+    TEST_ESP_ERR(nvs_set_items(handle, nullptr, 1), ESP_ERR_INVALID_ARG);
+    nvs_close(handle);
+    TEST_ESP_ERR(nvs_set_items(handle, items, count), ESP_ERR_NVS_INVALID_HANDLE);
+    TEST_ESP_OK(nvs_open("ns", NVS_READONLY, &handle));
+    TEST_ESP_ERR(nvs_set_items(handle, items, count), ESP_ERR_NVS_READ_ONLY);
+    nvs_close(handle);
+
+    // the same through the C++ handle
+    esp_err_t result;
+    std::shared_ptr<NVSHandle> cpp_handle = open_nvs_handle("ns", NVS_READWRITE, &result);
+    TEST_ESP_OK(result);
+    i8 = 42;
+    TEST_ESP_OK(cpp_handle->set_items(items, count));
+    TEST_ESP_OK(cpp_handle->get_item("i8", i8_read));
+    CHECK(i8_read == 42);
+    cpp_handle.reset();
+
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Batch writes continue on a new page when the active page is full", "[nvs][batch]")
+{
+    PartitionEmulationFixture f(0, 4);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 4));
+    const size_t key_count = 150;
+    std::vector<std::string> keys;
+    std::vector<uint32_t> values(key_count);
+    std::vector<nvs_set_item_t> items(key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        keys.push_back("key" + std::to_string(i));
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        items[i] = {keys[i].c_str(), NVS_TYPE_U32, &values[i], 0, ESP_FAIL};
+    }
+
+    // every round replaces all values, so the pages are filled and freed several times
+    for (uint32_t round = 0; round < 5; ++round) {
+        for (size_t i = 0; i < key_count; ++i) {
+            values[i] = round * 1000 + i;
+        }
+        TEST_ESP_OK(storage.writeItems(1, items.data(), items.size()));
+        for (size_t i = 0; i < key_count; ++i) {
+            uint32_t value;
+            TEST_ESP_OK(storage.readItem(1, keys[i].c_str(), value));
+            CHECK(value == round * 1000 + i);
+        }
+        size_t used = 0;
+        TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+        CHECK(used == key_count);
+    }
+
+    TEST_ESP_OK(storage.init(0, 4));
+    for (size_t i = 0; i < key_count; ++i) {
+        uint32_t value;
+        TEST_ESP_OK(storage.readItem(1, keys[i].c_str(), value));
+        CHECK(value == 4000 + i);
+    }
+}
+
+TEST_CASE("Recovery from power-off during a batch write", "[nvs][batch]")
+{
+    const size_t int_count = 100;
+    const size_t str_count = 10;
+    std::vector<std::string> keys;
+    std::vector<uint32_t> old_values(int_count), new_values(int_count);
+    std::vector<std::string> old_strings, new_strings;
+    std::vector<nvs_set_item_t> old_items, new_items;
+    for (size_t i = 0; i < int_count + str_count; ++i) {
+        keys.push_back("key" + std::to_string(i));
+    }
+    for (size_t i = 0; i < str_count; ++i) {
+        old_strings.push_back("old string value number " + std::to_string(i + 10));
+        new_strings.push_back("new string value number " + std::to_string(i + 10));
+    }
+    for (size_t i = 0; i < int_count; ++i) {
+        old_values[i] = i;
+        new_values[i] = i + 1000;
+        old_items.push_back({keys[i].c_str(), NVS_TYPE_U32, &old_values[i], 0, ESP_FAIL});
+        new_items.push_back({keys[i].c_str(), NVS_TYPE_U32, &new_values[i], 0, ESP_FAIL});
+    }
+    for (size_t i = 0; i < str_count; ++i) {
+        old_items.push_back({keys[int_count + i].c_str(), NVS_TYPE_STR, old_strings[i].c_str(), 0, ESP_FAIL});
+        new_items.push_back({keys[int_count + i].c_str(), NVS_TYPE_STR, new_strings[i].c_str(), 0, ESP_FAIL});
+    }
+    size_t entry_count = int_count + str_count * Page::getEntryCount(ItemType::SZ, old_strings[0].size() + 1);
+    const std::string filler(1000, 'f');
+
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 4);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 4));
+        // the previous values start in the middle of the first page
+        TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "filler", filler.c_str(), filler.size() + 1));
+        TEST_ESP_OK(storage.writeItems(1, old_items.data(), old_items.size()));
+        TEST_ESP_OK(storage.eraseItem(1, ItemType::SZ, "filler"));
+
+        f.emu.failAfter(failAfter);
+        bool done = storage.writeItems(1, new_items.data(), new_items.size()) == ESP_OK;
+        f.emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK(storage.init(0, 4));
+        size_t used = 0;
+        TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+        CHECK(used == entry_count);
+        bool all_new = true;
+        for (size_t i = 0; i < int_count; ++i) {
+            uint32_t value;
+            TEST_ESP_OK(storage.readItem(1, keys[i].c_str(), value));
+            CHECK((value == old_values[i] || value == new_values[i]));
+            all_new = all_new && value == new_values[i];
+        }
+        for (size_t i = 0; i < str_count; ++i) {
+            char str[64];
+            TEST_ESP_OK(storage.readItem(1, ItemType::SZ, keys[int_count + i].c_str(), str, sizeof(str)));
+            CHECK((old_strings[i] == str || new_strings[i] == str));
+            all_new = all_new && new_strings[i] == str;
+        }
+        // a value written after the recovery isn't shadowed by a copy left by the batch
+        uint32_t value = 5000;
+        TEST_ESP_OK(storage.writeItem(1, keys[0].c_str(), value));
+        TEST_ESP_OK(storage.init(0, 4));
+        TEST_ESP_OK(storage.readItem(1, keys[0].c_str(), value));
+        CHECK(value == 5000);
+        if (done) {
+            CHECK(all_new);
+            break;
+        }
+    }
+}
+
+TEST_CASE("benchmark batch set against single sets", "[nvs][batch]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    const size_t key_count = 100;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < key_count; ++i) {
+        keys.push_back("key" + std::to_string(i));
+        TEST_ESP_OK(nvs_set_u32(handle, keys[i].c_str(), 0));
+    }
+
+    // half of the values change in every round
+    const uint32_t rounds = 20;
+    f.emu.clearStats();
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 1; round <= rounds; ++round) {
+        for (size_t i = 0; i < key_count; ++i) {
+            TEST_ESP_OK(nvs_set_u32(handle, keys[i].c_str(), (i % 2 == 0) ? round : 0));
+        }
+    }
+    double single_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t single_writes = f.emu.getWriteOps();
+
+    std::vector<uint32_t> values(key_count);
+    std::vector<nvs_set_item_t> items(key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        items[i] = {keys[i].c_str(), NVS_TYPE_U32, &values[i], 0, ESP_FAIL};
+    }
+    f.emu.clearStats();
+    start = std::chrono::steady_clock::now();
+    for (uint32_t round = 1; round <= rounds; ++round) {
+        for (size_t i = 0; i < key_count; i += 2) {
+            values[i] = rounds + round;
+        }
+        TEST_ESP_OK(nvs_set_items(handle, items.data(), items.size()));
+    }
+    double batch_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t batch_writes = f.emu.getWriteOps();
+
+    for (size_t i = 0; i < key_count; ++i) {
+        uint32_t value;
+        TEST_ESP_OK(nvs_get_u32(handle, keys[i].c_str(), &value));
+        CHECK(value == values[i]);
+    }
+    CHECK(batch_writes < single_writes);
+    s_perf << "Set " << key_count << " u32 values, " << key_count / 2 << " changed: single sets "
+           << single_writes / rounds << " writes, " << static_cast<size_t>(single_time * 1e6 / rounds)
+           << " us; batch set " << batch_writes / rounds << " writes, " << static_cast<size_t>(batch_time * 1e6 / rounds)
+           << " us (host)" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+static void* alloc_test_buffer(void* arg, size_t length)
+{
+    std::vector<uint8_t>* buffer = static_cast<std::vector<uint8_t>*>(arg);
+    buffer->assign(length, 0xee);
+    return buffer->data();
+}
+
+static void* fail_test_alloc(void* arg, size_t length)
+{
+    *static_cast<size_t*>(arg) = length;
+    return nullptr;
+}
+
+TEST_CASE("Strings and blobs of unknown length can be read with a single lookup", "[nvs][alloc]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    NVSPartitionManager::get_instance()->lookup_storage_from_name(NVS_DEFAULT_PART_NAME)->setDeduplication(true);
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    const char* str = "a string of some length";
+    std::vector<uint8_t> big_blob(Page::CHUNK_MAX_SIZE + 1000);
+    for (size_t i = 0; i < big_blob.size(); ++i) {
+        big_blob[i] = static_cast<uint8_t>(i * 7);
+    }
+    const uint8_t small_blob[] = {1, 2, 3, 4, 5};
+    TEST_ESP_OK(nvs_set_str(handle, "str", str));
+    TEST_ESP_OK(nvs_set_str(handle, "empty", ""));
+    TEST_ESP_OK(nvs_set_blob(handle, "small", small_blob, sizeof(small_blob)));
+    TEST_ESP_OK(nvs_set_blob(handle, "big", big_blob.data(), big_blob.size()));
+    // stored once and referenced by both keys
+    TEST_ESP_OK(nvs_set_blob(handle, "copy", big_blob.data(), big_blob.size()));
+
+    std::vector<uint8_t> buffer;
+    size_t length = 0;
+    TEST_ESP_OK(nvs_get_str_alloc(handle, "str", alloc_test_buffer, &buffer, &length));
+    CHECK(length == strlen(str) + 1);
+    CHECK(buffer.size() == length);
+    CHECK(strcmp(reinterpret_cast<char*>(buffer.data()), str) == 0);
+    TEST_ESP_OK(nvs_get_str_alloc(handle, "empty", alloc_test_buffer, &buffer, nullptr));
+    CHECK(buffer.size() == 1);
+    CHECK(buffer[0] == 0);
+    TEST_ESP_OK(nvs_get_blob_alloc(handle, "small", alloc_test_buffer, &buffer, &length));
+    CHECK(length == sizeof(small_blob));
+    CHECK(memcmp(buffer.data(), small_blob, sizeof(small_blob)) == 0);
+    TEST_ESP_OK(nvs_get_blob_alloc(handle, "big", alloc_test_buffer, &buffer, &length));
+    CHECK(length == big_blob.size());
+    CHECK(buffer == big_blob);
+    buffer.clear();
+    TEST_ESP_OK(nvs_get_blob_alloc(handle, "copy", alloc_test_buffer, &buffer, &length));
+    CHECK(buffer == big_blob);
+
+    // the callback isn't called if the value can't be found
+    size_t requested = 0;
+    TEST_ESP_ERR(nvs_get_str_alloc(handle, "nokey", fail_test_alloc, &requested, &length), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_ERR(nvs_get_blob_alloc(handle, "str", fail_test_alloc, &requested, &length), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_ERR(nvs_get_str_alloc(handle, "small", fail_test_alloc, &requested, &length), ESP_ERR_NVS_NOT_FOUND);
+    CHECK(requested == 0);
+    TEST_ESP_ERR(nvs_get_blob_alloc(handle, "big", fail_test_alloc, &requested, &length), ESP_ERR_NO_MEM);
+    CHECK(requested == big_blob.size());
+    TEST_ESP_ERR(nvs_get_str_alloc(handle, "str", nullptr, nullptr, &length), ESP_ERR_INVALID_ARG);
+
+    // nvs_get_str and nvs_get_blob still report the length if the buffer is too small
+    char short_str[4];
+    length = sizeof(short_str);
+    TEST_ESP_ERR(nvs_get_str(handle, "str", short_str, &length), ESP_ERR_NVS_INVALID_LENGTH);
+    CHECK(length == strlen(str) + 1);
+    length = big_blob.size() - 1;
+    TEST_ESP_ERR(nvs_get_blob(handle, "big", buffer.data(), &length), ESP_ERR_NVS_INVALID_LENGTH);
+    CHECK(length == big_blob.size());
+    nvs_close(handle);
+    TEST_ESP_ERR(nvs_get_str_alloc(handle, "str", alloc_test_buffer, &buffer, &length), ESP_ERR_NVS_INVALID_HANDLE);
+
+    // the C++ handle resizes the string or vector
+    esp_err_t result;
+    std::shared_ptr<NVSHandle> cpp_handle = open_nvs_handle("ns", NVS_READONLY, &result);
+    TEST_ESP_OK(result);
+    std::string str_read = "unchanged";
+    TEST_ESP_OK(cpp_handle->get_string("str", str_read));
+    CHECK(str_read == str);
+    TEST_ESP_OK(cpp_handle->get_string("empty", str_read));
+    CHECK(str_read.empty());
+    str_read = "unchanged";
+    TEST_ESP_ERR(cpp_handle->get_string("nokey", str_read), ESP_ERR_NVS_NOT_FOUND);
+    CHECK(str_read == "unchanged");
+    std::vector<uint8_t> blob_read;
+    TEST_ESP_OK(cpp_handle->get_blob("big", blob_read));
+    CHECK(blob_read == big_blob);
+    TEST_ESP_OK(cpp_handle->get_blob("small", blob_read));
+    CHECK(blob_read == std::vector<uint8_t>(small_blob, small_blob + sizeof(small_blob)));
+    TEST_ESP_ERR(cpp_handle->get_blob("str", blob_read), ESP_ERR_NVS_NOT_FOUND);
+    CHECK(blob_read.size() == sizeof(small_blob));
+    cpp_handle.reset();
+
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("benchmark reading strings of unknown length", "[nvs][alloc]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    const size_t key_count = 100;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < key_count; ++i) {
+        keys.push_back("key" + std::to_string(i));
+        TEST_ESP_OK(nvs_set_str(handle, keys[i].c_str(), ("value of " + keys[i]).c_str()));
+    }
+
+    // querying the length first, then reading the string
+    const int rounds = 20;
+    std::vector<char> str;
+    f.emu.clearStats();
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < key_count; ++i) {
+            size_t length = 0;
+            TEST_ESP_OK(nvs_get_str(handle, keys[i].c_str(), nullptr, &length));
+            str.resize(length);
+            TEST_ESP_OK(nvs_get_str(handle, keys[i].c_str(), str.data(), &length));
+        }
+    }
+    double query_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t query_reads = f.emu.getReadOps();
+
+    std::vector<uint8_t> buffer;
+    f.emu.clearStats();
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < key_count; ++i) {
+            TEST_ESP_OK(nvs_get_str_alloc(handle, keys[i].c_str(), alloc_test_buffer, &buffer, nullptr));
+        }
+    }
+    double alloc_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t alloc_reads = f.emu.getReadOps();
+    CHECK(std::string(reinterpret_cast<char*>(buffer.data())) == "value of " + keys.back());
+
+    CHECK(alloc_reads < query_reads);
+    s_perf << "Get " << key_count << " strings of unknown length: length query and get " << query_reads / rounds
+           << " reads, " << static_cast<size_t>(query_time * 1e6 / rounds) << " us; get with allocator "
+           << alloc_reads / rounds << " reads, " << static_cast<size_t>(alloc_time * 1e6 / rounds) << " us (host)" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Values read again through a handle are found at their remembered location", "[nvs][hint]")
+{
+    PartitionEmulationFixture f(0, 5);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 5));
+    nvs_handle_t reader, writer;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &writer));
+    TEST_ESP_OK(nvs_open("ns", NVS_READONLY, &reader));
+    TEST_ESP_OK(nvs_set_u32(writer, "first", 1));
+    for (int i = 0; i < 200; ++i) {
+        TEST_ESP_OK(nvs_set_u32(writer, ("filler" + std::to_string(i)).c_str(), i));
+    }
+    TEST_ESP_OK(nvs_set_u32(writer, "last", 2));
+    TEST_ESP_OK(nvs_set_str(writer, "str", "string value"));
+
+    uint32_t value = 0;
+    TEST_ESP_OK(nvs_get_u32(reader, "last", &value));
+    CHECK(value == 2);
+    char str[16];
+    size_t len = sizeof(str);
+    TEST_ESP_OK(nvs_get_str(reader, "str", str, &len));
+
+    // a new value erases the remembered one
+    TEST_ESP_OK(nvs_set_u32(writer, "last", 3));
+    TEST_ESP_OK(nvs_get_u32(reader, "last", &value));
+    CHECK(value == 3);
+    TEST_ESP_OK(nvs_get_u32(reader, "last", &value));
+    CHECK(value == 3);
+    TEST_ESP_OK(nvs_erase_key(writer, "last"));
+    TEST_ESP_ERR(nvs_get_u32(reader, "last", &value), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(nvs_set_u32(writer, "last", 4));
+    TEST_ESP_OK(nvs_get_u32(reader, "last", &value));
+    CHECK(value == 4);
+
+    // a value of another type isn't read from the remembered location
+    int8_t i8 = 0;
+    TEST_ESP_ERR(nvs_get_i8(reader, "last", &i8), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(nvs_get_u32(reader, "last", &value));
+    CHECK(value == 4);
+
+    // the garbage collection moves the remembered value of the first page
+    TEST_ESP_OK(nvs_get_u32(reader, "first", &value));
+    CHECK(value == 1);
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < 200; ++i) {
+            TEST_ESP_OK(nvs_set_u32(writer, ("filler" + std::to_string(i)).c_str(), round * 1000 + i));
+        }
+        TEST_ESP_OK(nvs_get_u32(reader, "first", &value));
+        CHECK(value == 1);
+        TEST_ESP_OK(nvs_get_u32(reader, "last", &value));
+        CHECK(value == 4);
+        len = sizeof(str);
+        TEST_ESP_OK(nvs_get_str(reader, "str", str, &len));
+        CHECK(strcmp(str, "string value") == 0);
+    }
+
+    // more keys than locations are remembered
+    for (int round = 0; round < 2; ++round) {
+        for (uint32_t i = 0; i < 2 * NVS_HANDLE_LOCATION_HINTS; ++i) {
+            TEST_ESP_OK(nvs_get_u32(reader, ("filler" + std::to_string(i)).c_str(), &value));
+            CHECK(value == 3000 + i);
+        }
+    }
+
+    TEST_ESP_OK(nvs_erase_all(writer));
+    TEST_ESP_ERR(nvs_get_u32(reader, "first", &value), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(nvs_set_u32(writer, "first", 5));
+    TEST_ESP_OK(nvs_get_u32(reader, "first", &value));
+    CHECK(value == 5);
+
+    nvs_close(reader);
+    nvs_close(writer);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Item locations aren't used after the storage has been loaded again", "[nvs][hint]")
+{
+    PartitionEmulationFixture f(0, 4);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 4));
+    TEST_ESP_OK(storage.writeItem(1, "key", 1u));
+    Storage::ItemLocation location;
+    uint32_t value = 0;
+    TEST_ESP_OK(storage.readItem(1, ItemType::U32, "key", &value, sizeof(value), location));
+    CHECK(value == 1);
+    REQUIRE(location.page != nullptr);
+
+    TEST_ESP_OK(storage.init(0, 4));
+    TEST_ESP_OK(storage.writeItem(1, "key", 2u));
+    TEST_ESP_OK(storage.readItem(1, ItemType::U32, "key", &value, sizeof(value), location));
+    CHECK(value == 2);
+
+    // the location of one key isn't used for another one
+    TEST_ESP_OK(storage.writeItem(1, "other", 3u));
+    TEST_ESP_OK(storage.readItem(1, ItemType::U32, "other", &value, sizeof(value), location));
+    CHECK(value == 3);
+}
+
+TEST_CASE("benchmark reading values again through the same handle", "[nvs][hint]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    for (int i = 0; i < 800; ++i) {
+        TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i)).c_str(), i));
+    }
+    const char* keys[] = {"key790", "key795", "key799"};
+    Storage* storage = NVSPartitionManager::get_instance()->lookup_storage_from_name(NVS_DEFAULT_PART_NAME);
+    uint8_t ns_index;
+    TEST_ESP_OK(storage->createOrOpenNamespace("ns", false, ns_index));
+
+    const int rounds = 2000;
+    uint32_t value;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (auto key : keys) {
+            TEST_ESP_OK(storage->readItem(ns_index, ItemType::U32, key, &value, sizeof(value)));
+        }
+    }
+    double search_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (auto key : keys) {
+            TEST_ESP_OK(nvs_get_u32(handle, key, &value));
+        }
+    }
+    double hint_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    CHECK(value == 799);
+
+    s_perf << "Read 3 u32 values on the last of 8 used pages again: search "
+           << static_cast<size_t>(search_time * 1e9 / rounds / 3) << " ns, remembered location through handle "
+           << static_cast<size_t>(hint_time * 1e9 / rounds / 3) << " ns per get (host)" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("nvs_inc_* adds to a value, starting at 0", "[nvs][inc]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+
+    uint32_t boots;
+    TEST_ESP_OK(nvs_inc_u32(handle, "boots", 1, &boots));
+    CHECK(boots == 1);
+    TEST_ESP_OK(nvs_inc_u32(handle, "boots", 1, &boots));
+    TEST_ESP_OK(nvs_inc_u32(handle, "boots", 5, nullptr));
+    TEST_ESP_OK(nvs_get_u32(handle, "boots", &boots));
+    CHECK(boots == 7);
+
+    // results wrap around, unsigned values are decreased by passing the wrapped delta
+    uint8_t u8;
+    TEST_ESP_OK(nvs_set_u8(handle, "u8", 250));
+    TEST_ESP_OK(nvs_inc_u8(handle, "u8", 10, &u8));
+    CHECK(u8 == 4);
+    TEST_ESP_OK(nvs_inc_u8(handle, "u8", static_cast<uint8_t>(-5), &u8));
+    CHECK(u8 == 255);
+    int16_t i16;
+    TEST_ESP_OK(nvs_inc_i16(handle, "i16", -300, &i16));
+    CHECK(i16 == -300);
+    TEST_ESP_OK(nvs_get_i16(handle, "i16", &i16));
+    CHECK(i16 == -300);
+    int64_t i64;
+    TEST_ESP_OK(nvs_set_i64(handle, "i64", INT64_MAX));
+    TEST_ESP_OK(nvs_inc_i64(handle, "i64", 1, &i64));
+    CHECK(i64 == INT64_MIN);
+
+    // the old value is erased, and no write is needed if nothing is added
+    size_t used;
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 4);
+    f.emu.clearStats();
+    TEST_ESP_OK(nvs_inc_u32(handle, "boots", 0, &boots));
+    CHECK(boots == 7);
+    CHECK(f.emu.getWriteOps() == 0);
+
+    nvs_handle_t ro_handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READONLY, &ro_handle));
+    CHECK(nvs_inc_u32(ro_handle, "boots", 1, &boots) == ESP_ERR_NVS_READ_ONLY);
+    nvs_close(ro_handle);
+
+    auto cxx_handle = nvs::open_nvs_handle("ns", NVS_READWRITE);
+    REQUIRE(cxx_handle);
+    uint32_t value;
+    TEST_ESP_OK(cxx_handle->increment_item("boots", 3u, value));
+    CHECK(value == 10);
+
+    nvs_close(handle);
+    cxx_handle.reset();
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("nvs_cas_* replaces a value only if it has the expected value", "[nvs][inc]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+
+    uint32_t expected = 0;
+    CHECK(nvs_cas_u32(handle, "seq", &expected, 1) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(nvs_cas_u32(handle, "seq", nullptr, 1) == ESP_ERR_INVALID_ARG);
+
+    TEST_ESP_OK(nvs_set_u32(handle, "seq", 5));
+    CHECK(nvs_cas_u32(handle, "seq", &expected, 1) == ESP_ERR_NVS_VALUE_CHANGED);
+    CHECK(expected == 5);
+    TEST_ESP_OK(nvs_cas_u32(handle, "seq", &expected, 6));
+    CHECK(expected == 5);
+    uint32_t value;
+    TEST_ESP_OK(nvs_get_u32(handle, "seq", &value));
+    CHECK(value == 6);
+
+    // negative values are compared in the size of their type
+    int8_t i8 = -2;
+    TEST_ESP_OK(nvs_set_i8(handle, "i8", -1));
+    CHECK(nvs_cas_i8(handle, "i8", &i8, 3) == ESP_ERR_NVS_VALUE_CHANGED);
+    CHECK(i8 == -1);
+    TEST_ESP_OK(nvs_cas_i8(handle, "i8", &i8, -100));
+    TEST_ESP_OK(nvs_get_i8(handle, "i8", &i8));
+    CHECK(i8 == -100);
+
+    auto cxx_handle = nvs::open_nvs_handle("ns", NVS_READWRITE);
+    REQUIRE(cxx_handle);
+    uint32_t cxx_expected = 1;
+    CHECK(cxx_handle->compare_and_swap_item("seq", cxx_expected, 7u) == ESP_ERR_NVS_VALUE_CHANGED);
+    CHECK(cxx_expected == 6);
+    TEST_ESP_OK(cxx_handle->compare_and_swap_item("seq", cxx_expected, 7u));
+    TEST_ESP_OK(nvs_get_u32(handle, "seq", &value));
+    CHECK(value == 7);
+
+    size_t used;
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 2);
+
+    nvs_close(handle);
+    cxx_handle.reset();
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Increments continue when the garbage collection moves the old value", "[nvs][inc]")
+{
+    PartitionEmulationFixture f(0, 3);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    uint64_t value = 0;
+    for (uint32_t i = 1; i <= 1000; ++i) {
+        TEST_ESP_OK(storage.incrementItem(1, ItemType::U32, "counter", 1, value));
+        REQUIRE(value == i);
+        if (i % 7 == 0) {
+            TEST_ESP_OK(storage.writeItem(1, "other", i));
+        }
+    }
+    size_t used = 0;
+    TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+    CHECK(used == 2);
+    TEST_ESP_OK(storage.init(0, 3));
+    uint32_t counter;
+    TEST_ESP_OK(storage.readItem(1, "counter", counter));
+    CHECK(counter == 1000);
+}
+
+TEST_CASE("Recovery from power-off during increments", "[nvs][inc]")
+{
+    // enough increments to fill two pages, so that the last one needs the garbage collection
+    const uint32_t count = 200;
+    const std::string filler(3000, 'f');
+    const size_t filler_entries = Page::getEntryCount(ItemType::SZ, filler.size() + 1);
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 3);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 3));
+        TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "filler", filler.c_str(), filler.size() + 1));
+
+        f.emu.failAfter(failAfter);
+        uint32_t done = 0;
+        uint64_t value;
+        while (done < count && storage.incrementItem(1, ItemType::U16, "counter", 1, value) == ESP_OK) {
+            ++done;
+        }
+        f.emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK(storage.init(0, 3));
+        uint16_t counter = 0;
+        esp_err_t err = storage.readItem(1, "counter", counter);
+        CHECK((err == ESP_OK || (err == ESP_ERR_NVS_NOT_FOUND && done == 0)));
+        CHECK((counter == done || counter == done + 1));
+        size_t used = 0;
+        TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+        CHECK(used == filler_entries + (err == ESP_OK ? 1 : 0));
+        TEST_ESP_OK(storage.incrementItem(1, ItemType::U16, "counter", 1, value));
+        CHECK(value == counter + 1u);
+        if (done == count) {
+            break;
+        }
+    }
+}
+
+TEST_CASE("benchmark increment against get and set", "[nvs][inc]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    for (int i = 0; i < 300; ++i) {
+        TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i)).c_str(), i));
+    }
+    TEST_ESP_OK(nvs_set_u32(handle, "counter", 0));
+
+    // every write is followed by Storage::debugCheck on the host, its reads are left out
+    Storage* storage = NVSPartitionManager::get_instance()->lookup_storage_from_name(NVS_DEFAULT_PART_NAME);
+    f.emu.clearStats();
+    storage->debugCheck();
+    const size_t check_reads = f.emu.getReadOps();
+
+    const uint32_t rounds = 200;
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < rounds; ++i) {
+        uint32_t value;
+        TEST_ESP_OK(nvs_get_u32(handle, "counter", &value));
+        TEST_ESP_OK(nvs_set_u32(handle, "counter", value + 1));
+    }
+    size_t get_set_reads = f.emu.getReadOps() - rounds * check_reads;
+
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < rounds; ++i) {
+        TEST_ESP_OK(nvs_inc_u32(handle, "counter", 1, nullptr));
+    }
+    size_t inc_reads = f.emu.getReadOps() - rounds * check_reads;
+
+    uint32_t value;
+    TEST_ESP_OK(nvs_get_u32(handle, "counter", &value));
+    CHECK(value == 2 * rounds);
+    CHECK(inc_reads < get_set_reads);
+    s_perf << "Increment a u32 counter stored after 300 values: get and set " << static_cast<double>(get_set_reads) / rounds
+           << " reads, nvs_inc_u32 " << static_cast<double>(inc_reads) / rounds << " reads" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Counters are incremented by clearing bits in place", "[nvs][counter]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+
+    uint32_t value;
+    TEST_ESP_ERR(nvs_get_counter(handle, "boots", &value), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(nvs_inc_counter(handle, "boots", 1, &value));
+    CHECK(value == 1);
+    size_t used;
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 1 + NVS_COUNTER_DATA_ENTRIES);
+
+    // each increment writes a single word until all bits of the data entries are cleared
+    const uint32_t bits = NVS_COUNTER_DATA_ENTRIES * Page::ENTRY_SIZE * 8;
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < bits; ++i) {
+        TEST_ESP_OK(nvs_inc_counter(handle, "boots", 1, &value));
+        REQUIRE(value == i + 2);
+    }
+    CHECK(f.emu.getWriteOps() == bits);
+    CHECK(f.emu.getWriteBytes() == bits * sizeof(uint32_t));
+
+    // then a new counter replaces the old one
+    TEST_ESP_OK(nvs_inc_counter(handle, "boots", 1, &value));
+    CHECK(value == bits + 2);
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 1 + NVS_COUNTER_DATA_ENTRIES);
+
+    // larger deltas clear several words with one write
+    f.emu.clearStats();
+    TEST_ESP_OK(nvs_inc_counter(handle, "boots", 40, nullptr));
+    CHECK(f.emu.getWriteOps() == 1);
+    CHECK(f.emu.getWriteBytes() == 2 * sizeof(uint32_t));
+    TEST_ESP_OK(nvs_inc_counter(handle, "boots", 0, &value));
+    CHECK(value == bits + 42);
+    CHECK(f.emu.getWriteOps() == 1);
+
+    // counters are kept apart from u32 values, and survive a restart
+    TEST_ESP_ERR(nvs_get_u32(handle, "boots", &value), ESP_ERR_NVS_NOT_FOUND);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_get_counter(handle, "boots", &value));
+    CHECK(value == bits + 42);
+
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_COUNTER);
+    REQUIRE(it != nullptr);
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    CHECK(std::string(info.key) == "boots");
+    CHECK(nvs_entry_next(it) == nullptr);
+
+    TEST_ESP_OK(nvs_erase_key(handle, "boots"));
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 0);
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Counters on encrypted partitions are written again on every increment", "[nvs][counter]")
+{
+    nvs_sec_cfg_t xts_cfg;
+    for (int count = 0; count < NVS_KEY_SIZE; count++) {
+        xts_cfg.eky[count] = 0x11;
+        xts_cfg.tky[count] = 0x22;
+    }
+    EncryptedPartitionFixture f(&xts_cfg, 0, 3);
+    for (uint32_t i = 0; i < 3; ++i) {
+        f.emu.erase(i);
+    }
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    uint64_t value;
+    for (uint32_t i = 1; i <= 300; ++i) {
+        TEST_ESP_OK(storage.incrementItem(1, ItemType::COUNTER, "counter", 1, value));
+        REQUIRE(value == i);
+    }
+    size_t used = 0;
+    TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+    CHECK(used == 1);
+    TEST_ESP_OK(storage.init(0, 3));
+    uint32_t counter;
+    TEST_ESP_OK(storage.readItem(1, ItemType::COUNTER, "counter", &counter, sizeof(counter)));
+    CHECK(counter == 300);
+}
+
+TEST_CASE("Counters continue when the garbage collection moves them", "[nvs][counter]")
+{
+    PartitionEmulationFixture f(0, 3);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    const uint32_t count = 5000;
+    uint64_t value = 0;
+    for (uint32_t i = 1; i <= count; ++i) {
+        TEST_ESP_OK(storage.incrementItem(1, ItemType::COUNTER, "counter", 1, value));
+        REQUIRE(value == i);
+        if (i % 5 == 0) {
+            TEST_ESP_OK(storage.writeItem(1, "other", i));
+        }
+    }
+    size_t used = 0;
+    TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+    CHECK(used == 2 + NVS_COUNTER_DATA_ENTRIES);
+    TEST_ESP_OK(storage.init(0, 3));
+    uint32_t counter;
+    TEST_ESP_OK(storage.readItem(1, ItemType::COUNTER, "counter", &counter, sizeof(counter)));
+    CHECK(counter == count);
+}
+
+TEST_CASE("Recovery from power-off during counter increments", "[nvs][counter]")
+{
+    // deltas of 7 clear up to two words at once, and run out of bits on every 147th increment
+    const uint32_t count = 320;
+    const uint32_t delta = 7;
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 3);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 3));
+
+        f.emu.failAfter(failAfter);
+        uint32_t done = 0;
+        uint64_t value;
+        while (done < count && storage.incrementItem(1, ItemType::COUNTER, "counter", delta, value) == ESP_OK) {
+            ++done;
+        }
+        f.emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK(storage.init(0, 3));
+        uint32_t counter = 0;
+        esp_err_t err = storage.readItem(1, ItemType::COUNTER, "counter", &counter, sizeof(counter));
+        CHECK((err == ESP_OK || (err == ESP_ERR_NVS_NOT_FOUND && done == 0)));
+        CHECK(counter >= done * delta);
+        CHECK(counter <= (done + 1) * delta);
+        size_t used = 0;
+        TEST_ESP_OK(storage.calcEntriesInNamespace(1, used));
+        CHECK(used == (err == ESP_OK ? 1 + NVS_COUNTER_DATA_ENTRIES : 0));
+        TEST_ESP_OK(storage.incrementItem(1, ItemType::COUNTER, "counter", 1, value));
+        CHECK(value == counter + 1u);
+        if (done == count) {
+            break;
+        }
+    }
+}
+
+TEST_CASE("benchmark counter increments against integer increments", "[nvs][counter]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+
+    const uint32_t rounds = 2000;
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < rounds; ++i) {
+        TEST_ESP_OK(nvs_inc_u32(handle, "u32", 1, nullptr));
+    }
+    size_t inc_writes = f.emu.getWriteOps();
+    size_t inc_bytes = f.emu.getWriteBytes();
+    size_t inc_erases = f.emu.getEraseOps();
+
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < rounds; ++i) {
+        TEST_ESP_OK(nvs_inc_counter(handle, "counter", 1, nullptr));
+    }
+    size_t counter_writes = f.emu.getWriteOps();
+    size_t counter_bytes = f.emu.getWriteBytes();
+    size_t counter_erases = f.emu.getEraseOps();
+
+    uint32_t value;
+    TEST_ESP_OK(nvs_get_u32(handle, "u32", &value));
+    CHECK(value == rounds);
+    TEST_ESP_OK(nvs_get_counter(handle, "counter", &value));
+    CHECK(value == rounds);
+    CHECK(counter_bytes < inc_bytes);
+    s_perf << "Increment a counter " << rounds << " times: nvs_inc_u32 " << static_cast<double>(inc_writes) / rounds
+           << " writes, " << static_cast<double>(inc_bytes) / rounds << " bytes, " << inc_erases
+           << " page erases; nvs_inc_counter " << static_cast<double>(counter_writes) / rounds << " writes, "
+           << static_cast<double>(counter_bytes) / rounds << " bytes, " << counter_erases << " page erases" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("nvs_append_log appends records which are read back by sequence", "[nvs][log]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+
+    uint32_t seq = 0;
+    uint8_t record[NVS_LOG_RECORD_MAX_SIZE + 1];
+    size_t size = sizeof(record);
+    TEST_ESP_ERR(nvs_read_log(handle, "events", &seq, record, &size), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_ERR(nvs_append_log(handle, "events", record, sizeof(record), &seq), ESP_ERR_NVS_VALUE_TOO_LONG);
+
+    // each record is written into one entry, blocks are written when the previous one is full
+    const uint32_t count = 3 * NVS_LOG_BLOCK_RECORDS + 5;
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string event = "event " + std::to_string(i);
+        TEST_ESP_OK(nvs_append_log(handle, "events", event.c_str(), event.size(), &seq));
+        REQUIRE(seq == i);
+    }
+    CHECK(f.emu.getWriteOps() <= count + 4 * 4);
+    CHECK(f.emu.getWriteBytes() <= count * Page::ENTRY_SIZE + 4 * 2 * Page::ENTRY_SIZE);
+    size_t used;
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 4 * (1 + NVS_LOG_BLOCK_RECORDS));
+
+    // records survive a restart, and are read in order
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        size = sizeof(record);
+        TEST_ESP_OK(nvs_read_log(handle, "events", &next, record, &size));
+        REQUIRE(next == i);
+        CHECK(std::string(reinterpret_cast<char*>(record), size) == "event " + std::to_string(i));
+        ++next;
+    }
+    TEST_ESP_ERR(nvs_read_log(handle, "events", &next, record, &size), ESP_ERR_NVS_NOT_FOUND);
+    next = 7;
+    size = 3;
+    TEST_ESP_ERR(nvs_read_log(handle, "events", &next, record, &size), ESP_ERR_NVS_INVALID_LENGTH);
+    TEST_ESP_OK(nvs_read_log(handle, "events", &next, nullptr, &size));
+    CHECK(size == strlen("event 7"));
+    TEST_ESP_OK(nvs_append_log(handle, "events", "next", 4, &seq));
+    CHECK(seq == count);
+
+    // a log is listed once, and erased as a whole
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY);
+    REQUIRE(it != nullptr);
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    CHECK(std::string(info.key) == "events");
+    CHECK(info.type == NVS_TYPE_LOG);
+    CHECK(nvs_entry_next(it) == nullptr);
+    TEST_ESP_OK(nvs_erase_key(handle, "events"));
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 0);
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("The garbage collection drops the oldest records of logs", "[nvs][log]")
+{
+    PartitionEmulationFixture f(0, 3);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    TEST_ESP_OK(storage.writeItem(1, "config", 42u));
+    const uint32_t count = 3000;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t seq;
+        TEST_ESP_OK(storage.appendLogRecord(1, "events", &i, sizeof(i), seq));
+        REQUIRE(seq == i);
+        if (i % 50 == 0) {
+            TEST_ESP_OK(storage.writeItem(1, "other", i));
+        }
+    }
+
+    // the records which are left are the newest ones, at least the last full block
+    TEST_ESP_OK(storage.init(0, 3));
+    uint32_t seq = 0;
+    uint32_t prev = 0;
+    size_t left = 0;
+    uint32_t value;
+    size_t size = sizeof(value);
+    while (storage.readLogRecord(1, "events", seq, &value, size) == ESP_OK) {
+        CHECK(value == seq);
+        CHECK((left == 0 || seq > prev));
+        prev = seq;
+        ++seq;
+        ++left;
+    }
+    CHECK(prev == count - 1);
+    CHECK(left >= NVS_LOG_BLOCK_RECORDS);
+    CHECK(left < count / 10);
+    uint32_t config;
+    TEST_ESP_OK(storage.readItem(1, "config", config));
+    CHECK(config == 42);
+}
+
+TEST_CASE("The garbage collection keeps the newest full block of a log", "[nvs][log]")
+{
+    PartitionEmulationFixture f(0, 3);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    // the first page is full of items which are kept, so that the garbage collection takes the page of the log
+    for (uint32_t i = 0; i < Page::ENTRY_COUNT; ++i) {
+        TEST_ESP_OK(storage.writeItem(1, ("key" + std::to_string(i)).c_str(), i));
+    }
+    uint32_t seq;
+    for (uint32_t i = 0; i < NVS_LOG_BLOCK_RECORDS; ++i) {
+        TEST_ESP_OK(storage.appendLogRecord(1, "events", &i, sizeof(i), seq));
+    }
+
+    // the only records are in a full block, followed by an empty one
+    for (uint32_t i = 0; i < 10 * Page::ENTRY_COUNT; ++i) {
+        TEST_ESP_OK(storage.writeItem(1, "other", i));
+    }
+    TEST_ESP_OK(storage.init(0, 3));
+    for (uint32_t i = 0; i < NVS_LOG_BLOCK_RECORDS; ++i) {
+        uint32_t next = i;
+        uint32_t value;
+        size_t size = sizeof(value);
+        TEST_ESP_OK(storage.readLogRecord(1, "events", next, &value, size));
+        CHECK(next == i);
+        CHECK(value == i);
+    }
+
+    // once the next block is full, the older one is dropped
+    for (uint32_t i = NVS_LOG_BLOCK_RECORDS; i < 2 * NVS_LOG_BLOCK_RECORDS; ++i) {
+        TEST_ESP_OK(storage.appendLogRecord(1, "events", &i, sizeof(i), seq));
+        REQUIRE(seq == i);
+    }
+    for (uint32_t i = 0; i < 10 * Page::ENTRY_COUNT; ++i) {
+        TEST_ESP_OK(storage.writeItem(1, "other", i));
+    }
+    TEST_ESP_OK(storage.init(0, 3));
+    uint32_t next = 0;
+    uint32_t value;
+    size_t size = sizeof(value);
+    TEST_ESP_OK(storage.readLogRecord(1, "events", next, &value, size));
+    CHECK(next == NVS_LOG_BLOCK_RECORDS);
+    CHECK(value == NVS_LOG_BLOCK_RECORDS);
+    TEST_ESP_OK(storage.appendLogRecord(1, "events", &next, sizeof(next), seq));
+    CHECK(seq == 2 * NVS_LOG_BLOCK_RECORDS);
+}
+
+TEST_CASE("Logs work on encrypted partitions", "[nvs][log]")
+{
+    nvs_sec_cfg_t xts_cfg;
+    for (int count = 0; count < NVS_KEY_SIZE; count++) {
+        xts_cfg.eky[count] = 0x11;
+        xts_cfg.tky[count] = 0x22;
+    }
+    EncryptedPartitionFixture f(&xts_cfg, 0, 3);
+    for (uint32_t i = 0; i < 3; ++i) {
+        f.emu.erase(i);
+    }
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    const uint32_t count = 2 * NVS_LOG_BLOCK_RECORDS + 3;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t seq;
+        TEST_ESP_OK(storage.appendLogRecord(1, "events", &i, sizeof(i), seq));
+        REQUIRE(seq == i);
+    }
+    TEST_ESP_OK(storage.init(0, 3));
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t seq = i;
+        uint32_t value;
+        size_t size = sizeof(value);
+        TEST_ESP_OK(storage.readLogRecord(1, "events", seq, &value, size));
+        CHECK(seq == i);
+        CHECK(value == i);
+    }
+}
+
+TEST_CASE("The garbage collection leaves the erased records of log blocks erased on encrypted partitions", "[nvs][log]")
+{
+    nvs_sec_cfg_t xts_cfg;
+    for (int count = 0; count < NVS_KEY_SIZE; count++) {
+        xts_cfg.eky[count] = 0x11;
+        xts_cfg.tky[count] = 0x22;
+    }
+    EncryptedPartitionFixture f(&xts_cfg, 0, 3);
+    for (uint32_t i = 0; i < 3; ++i) {
+        f.emu.erase(i);
+    }
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 3));
+    // the first page is full of items which are kept, so that the garbage collection takes the page of the log
+    for (uint32_t i = 0; i < Page::ENTRY_COUNT; ++i) {
+        TEST_ESP_OK(storage.writeItem(1, ("key" + std::to_string(i)).c_str(), i));
+    }
+    const uint32_t count = NVS_LOG_BLOCK_RECORDS / 2;
+    uint32_t seq;
+    for (uint32_t i = 0; i < count; ++i) {
+        TEST_ESP_OK(storage.appendLogRecord(1, "events", &i, sizeof(i), seq));
+    }
+
+    // the block is copied by several garbage collections
+    for (uint32_t i = 0; i < 10 * Page::ENTRY_COUNT; ++i) {
+        TEST_ESP_OK(storage.writeItem(1, "other", i));
+    }
+    TEST_ESP_OK(storage.init(0, 3));
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t next = i;
+        uint32_t value;
+        size_t size = sizeof(value);
+        TEST_ESP_OK(storage.readLogRecord(1, "events", next, &value, size));
+        CHECK(next == i);
+        CHECK(value == i);
+    }
+    uint32_t next = count;
+    uint32_t value;
+    size_t size = sizeof(value);
+    TEST_ESP_ERR(storage.readLogRecord(1, "events", next, &value, size), ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(storage.appendLogRecord(1, "events", &count, sizeof(count), seq));
+    CHECK(seq == count);
+}
+
+TEST_CASE("Recovery from power-off during log appends", "[nvs][log]")
+{
+    const uint32_t count = 2 * NVS_LOG_BLOCK_RECORDS + 3;
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 3);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 3));
+
+        f.emu.failAfter(failAfter);
+        uint32_t done = 0;
+        uint32_t seq;
+        while (done < count && storage.appendLogRecord(1, "events", &done, sizeof(done), seq) == ESP_OK) {
+            ++done;
+        }
+        f.emu.failAfter(UINT32_MAX);
+
+        // records which were appended are still there, a record which was cut off is skipped
+        TEST_ESP_OK(storage.init(0, 3));
+        uint32_t next = 0;
+        uint32_t value;
+        size_t size = sizeof(value);
+        uint32_t read = 0;
+        while (storage.readLogRecord(1, "events", next, &value, size) == ESP_OK) {
+            CHECK(value == next);
+            ++next;
+            ++read;
+        }
+        CHECK((read == done || read == done + 1));
+        TEST_ESP_OK(storage.appendLogRecord(1, "events", &done, sizeof(done), seq));
+        CHECK(seq >= read);
+        if (done == count) {
+            break;
+        }
+    }
+}
+
+TEST_CASE("benchmark log appends against rotating keys", "[nvs][log]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    Storage* storage = NVSPartitionManager::get_instance()->lookup_storage_from_name(NVS_DEFAULT_PART_NAME);
+
+    // every write is followed by Storage::debugCheck on the host, its reads are left out
+    f.emu.clearStats();
+    storage->debugCheck();
+    const size_t check_reads = f.emu.getReadOps();
+
+    const uint32_t rounds = 1000;
+    const uint32_t keys = 16;
+    uint8_t event[8] = {};
+    f.emu.clearStats();
+    for (uint32_t i = 0; i < rounds; ++i) {
+        event[0] = static_cast<uint8_t>(i);
+        TEST_ESP_OK(nvs_set_blob(handle, ("log" + std::to_string(i % keys)).c_str(), event, sizeof(event)));
+    }
+    size_t keys_reads = f.emu.getReadOps() - rounds * check_reads;
+    size_t keys_bytes = f.emu.getWriteBytes();
+    size_t keys_erases = f.emu.getEraseOps();
+    TEST_ESP_OK(nvs_erase_all(handle));
+
+    f.emu.clearStats();
+    size_t block_checks = 0;
+    for (uint32_t i = 0; i < rounds; ++i) {
+        event[0] = static_cast<uint8_t>(i);
+        uint32_t seq;
+        TEST_ESP_OK(nvs_append_log(handle, "log", event, sizeof(event), &seq));
+        if (seq % NVS_LOG_BLOCK_RECORDS == NVS_LOG_BLOCK_RECORDS - 1) {
+            ++block_checks;
+        }
+    }
+    size_t log_reads = f.emu.getReadOps() - block_checks * check_reads;
+    size_t log_bytes = f.emu.getWriteBytes();
+    size_t log_erases = f.emu.getEraseOps();
+
+    CHECK(log_bytes < keys_bytes);
+    s_perf << "Append " << rounds << " records of 8 bytes: rotating " << keys << " keys "
+           << static_cast<double>(keys_reads) / rounds << " reads, " << static_cast<double>(keys_bytes) / rounds
+           << " bytes written, " << keys_erases << " page erases; nvs_append_log "
+           << static_cast<double>(log_reads) / rounds << " reads, " << static_cast<double>(log_bytes) / rounds
+           << " bytes written, " << log_erases << " page erases" << std::endl;
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("nvs_erase_all writes a tombstone instead of erasing each item", "[nvs][tombstone]")
+{
+    PartitionEmulationFixture f(0, 6);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 6));
+    nvs_handle_t handle;
+    nvs_handle_t other;
+    nvs_handle_t reader;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_open("other", NVS_READWRITE, &other));
+    TEST_ESP_OK(nvs_open("ns", NVS_READONLY, &reader));
+
+    const uint32_t count = 200;
+    for (uint32_t i = 0; i < count; ++i) {
+        TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i)).c_str(), i));
+    }
+    TEST_ESP_OK(nvs_set_u32(other, "key0", 42));
+
+    f.emu.clearStats();
+    TEST_ESP_OK(nvs_erase_all(handle));
+    CHECK(f.emu.getWriteOps() < 10);
+    CHECK(f.emu.getEraseOps() == 0);
+
+    // all handles of the namespace follow it to its new index
+    uint32_t value;
+    CHECK(nvs_get_u32(handle, "key0", &value) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(nvs_get_u32(reader, "key199", &value) == ESP_ERR_NVS_NOT_FOUND);
+    size_t used;
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 0);
+    TEST_ESP_OK(nvs_set_u32(handle, "key1", 1000));
+    TEST_ESP_OK(nvs_get_u32(reader, "key1", &value));
+    CHECK(value == 1000);
+    TEST_ESP_OK(nvs_get_u32(other, "key0", &value));
+    CHECK(value == 42);
+
+    size_t listed = 0;
+    for (nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, nullptr, NVS_TYPE_ANY); it != nullptr; it = nvs_entry_next(it)) {
+        ++listed;
+    }
+    CHECK(listed == 2);
+
+    nvs_close(handle);
+    nvs_close(other);
+    nvs_close(reader);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 6));
+    TEST_ESP_OK(nvs_open("ns", NVS_READONLY, &handle));
+    CHECK(nvs_get_u32(handle, "key0", &value) == ESP_ERR_NVS_NOT_FOUND);
+    TEST_ESP_OK(nvs_get_u32(handle, "key1", &value));
+    CHECK(value == 1000);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("The garbage collection reclaims the entries of erased namespaces", "[nvs][tombstone]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+
+    // more items are written than fit into the partition, which only works if the erased ones are reclaimed
+    for (uint32_t round = 0; round < 5; ++round) {
+        for (uint32_t i = 0; i < 2 * Page::ENTRY_COUNT; ++i) {
+            TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i)).c_str(), round));
+        }
+        f.emu.clearStats();
+        TEST_ESP_OK(nvs_erase_all(handle));
+        CHECK(f.emu.getWriteOps() < 10);
+    }
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+
+    // tombstones whose items are all gone are erased on init
+    PartitionEmulationFixture g(0, 4);
+    Storage storage(&g.part);
+    TEST_ESP_OK(storage.init(0, 4));
+    uint8_t nsIndex;
+    TEST_ESP_OK(storage.createOrOpenNamespace("ns", true, nsIndex));
+    for (size_t i = 0; i < Storage::TOMBSTONE_MIN_ENTRIES; ++i) {
+        TEST_ESP_OK(storage.writeItem(nsIndex, ("key" + std::to_string(i)).c_str(), 1));
+    }
+    uint8_t newNsIndex;
+    TEST_ESP_OK(storage.eraseNamespace(nsIndex, newNsIndex));
+    CHECK(newNsIndex != nsIndex);
+    for (size_t i = 0; i < Storage::TOMBSTONE_MIN_ENTRIES; ++i) {
+        TEST_ESP_OK(storage.eraseItem(nsIndex, ("key" + std::to_string(i)).c_str()));
+    }
+    TEST_ESP_OK(storage.init(0, 4));
+    for (uint32_t sector = 0; sector < 4; ++sector) {
+        Page page;
+        TEST_ESP_OK(page.load(&g.part, sector));
+        CHECK(page.findItem(Page::NS_INDEX, ItemType::NS_TOMBSTONE, nullptr) == ESP_ERR_NVS_NOT_FOUND);
+    }
+}
+
+TEST_CASE("Indexes of erased namespaces are used again when all are taken", "[nvs][tombstone]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    for (uint32_t i = 0; i < 300; ++i) {
+        for (size_t k = 0; k < Storage::TOMBSTONE_MIN_ENTRIES; ++k) {
+            TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(k)).c_str(), i));
+        }
+        TEST_ESP_OK(nvs_erase_all(handle));
+        uint32_t value;
+        CHECK(nvs_get_u32(handle, "key0", &value) == ESP_ERR_NVS_NOT_FOUND);
+    }
+    nvs_handle_t other;
+    TEST_ESP_OK(nvs_open("other", NVS_READWRITE, &other));
+    TEST_ESP_OK(nvs_set_u32(other, "key", 1));
+    nvs_close(other);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Indexes of erased namespaces are released once the garbage collection has dropped their items", "[nvs][tombstone]")
+{
+    PartitionEmulationFixture f(0, 4);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 4));
+    uint8_t nsIndex;
+    TEST_ESP_OK(storage.createOrOpenNamespace("ns", true, nsIndex));
+    uint8_t fillerNsIndex;
+    TEST_ESP_OK(storage.createOrOpenNamespace("filler", true, fillerNsIndex));
+    // the first page only holds items of the erased namespace, so the garbage collection frees it first
+    for (size_t i = 0; i < Page::ENTRY_COUNT - 10; ++i) {
+        TEST_ESP_OK(storage.writeItem(nsIndex, ("key" + std::to_string(i)).c_str(), 1));
+    }
+    uint8_t newNsIndex;
+    TEST_ESP_OK(storage.eraseNamespace(nsIndex, newNsIndex));
+    CHECK(newNsIndex != nsIndex);
+
+    // without a restart, the tombstone is erased once the items are gone
+    for (uint32_t i = 0; i < 2 * Page::ENTRY_COUNT + 20; ++i) {
+        TEST_ESP_OK(storage.writeItem(fillerNsIndex, ("key" + std::to_string(i)).c_str(), i));
+    }
+    for (uint32_t sector = 0; sector < 4; ++sector) {
+        Page page;
+        TEST_ESP_OK(page.load(&f.part, sector));
+        CHECK(page.findItem(Page::NS_INDEX, ItemType::NS_TOMBSTONE, nullptr) == ESP_ERR_NVS_NOT_FOUND);
+    }
+    uint8_t reusedNsIndex;
+    TEST_ESP_OK(storage.createOrOpenNamespace("next", true, reusedNsIndex));
+    CHECK(reusedNsIndex == nsIndex);
+}
+
+TEST_CASE("Namespaces with few items are erased item by item", "[nvs][tombstone]")
+{
+    PartitionEmulationFixture f(0, 4);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 4));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_set_u32(handle, "key", 1));
+    nvs_stats_t before;
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &before));
+    TEST_ESP_OK(nvs_erase_all(handle));
+    nvs_stats_t after;
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &after));
+    CHECK(after.used_entries == before.used_entries - 1);
+    CHECK(after.namespace_count == before.namespace_count);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Recovery from power-off during nvs_erase_all", "[nvs][tombstone]")
+{
+    const uint32_t count = 20;
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO("failAfter=" << failAfter);
+        PartitionEmulationFixture f(0, 3);
+        Storage storage(&f.part);
+        TEST_ESP_OK(storage.init(0, 3));
+        uint8_t nsIndex;
+        TEST_ESP_OK(storage.createOrOpenNamespace("ns", true, nsIndex));
+        for (uint32_t i = 0; i < count; ++i) {
+            TEST_ESP_OK(storage.writeItem(nsIndex, ("key" + std::to_string(i)).c_str(), i));
+        }
+
+        f.emu.failAfter(failAfter);
+        uint8_t newNsIndex;
+        esp_err_t err = storage.eraseNamespace(nsIndex, newNsIndex);
+        f.emu.failAfter(UINT32_MAX);
+
+        // either all items are there or none
+        TEST_ESP_OK(storage.init(0, 3));
+        TEST_ESP_OK(storage.createOrOpenNamespace("ns", false, nsIndex));
+        size_t used;
+        TEST_ESP_OK(storage.calcEntriesInNamespace(nsIndex, used));
+        if (err == ESP_OK) {
+            CHECK(used == 0);
+        } else {
+            CHECK((used == 0 || used == count));
+        }
+        TEST_ESP_OK(storage.writeItem(nsIndex, "key", 1));
+        if (err == ESP_OK) {
+            break;
+        }
+    }
+}
+
+TEST_CASE("benchmark nvs_erase_all with tombstones against erasing each item", "[nvs][tombstone]")
+{
+    PartitionEmulationFixture f(0, 10);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 10));
+    const uint32_t count = 500;
+    size_t writes[2];
+    size_t bytes[2];
+    for (int tombstone = 0; tombstone < 2; ++tombstone) {
+        uint8_t nsIndex;
+        TEST_ESP_OK(storage.createOrOpenNamespace("ns", true, nsIndex));
+        for (uint32_t i = 0; i < count; ++i) {
+            TEST_ESP_OK(storage.writeItem(nsIndex, ("key" + std::to_string(i)).c_str(), i));
+        }
+        f.emu.clearStats();
+        if (tombstone) {
+            uint8_t newNsIndex;
+            TEST_ESP_OK(storage.eraseNamespace(nsIndex, newNsIndex));
+        } else {
+            TEST_ESP_OK(storage.eraseNamespace(nsIndex));
+        }
+        writes[tombstone] = f.emu.getWriteOps();
+        bytes[tombstone] = f.emu.getWriteBytes();
+    }
+
+    CHECK(writes[1] < writes[0]);
+    s_perf << "Erase a namespace of " << count << " items: one by one " << writes[0] << " writes, "
+           << bytes[0] << " bytes; tombstone " << writes[1] << " writes, " << bytes[1] << " bytes" << std::endl;
+}
+
+TEST_CASE("nvs_get_stats and nvs_get_used_entry_count read counters instead of the flash", "[nvs][stats]")
+{
+    PartitionEmulationFixture f(0, 5);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 5));
+    nvs_handle_t handle;
+    nvs_handle_t other;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_open("other", NVS_READWRITE, &other));
+
+    // enough rewrites for the garbage collection to move items between pages
+    uint8_t blob[100] = {};
+    for (uint32_t i = 0; i < 2000; ++i) {
+        TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i % 50)).c_str(), i));
+        if (i % 10 == 0) {
+            blob[0] = static_cast<uint8_t>(i);
+            TEST_ESP_OK(nvs_set_blob(other, "blob", blob, sizeof(blob)));
+        }
+    }
+    TEST_ESP_OK(nvs_erase_key(handle, "key0"));
+
+    f.emu.clearStats();
+    nvs_stats_t stats;
+    size_t used;
+    size_t other_used;
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats));
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    TEST_ESP_OK(nvs_get_used_entry_count(other, &other_used));
+    CHECK(f.emu.getReadOps() == 0);
+
+    CHECK(used == 49);
+    // blob index, and a chunk with its data entries
+    CHECK(other_used == 2 + (sizeof(blob) + Page::ENTRY_SIZE - 1) / Page::ENTRY_SIZE);
+    CHECK(stats.used_entries == used + other_used + 2);
+    CHECK(stats.total_entries == 5 * Page::ENTRY_COUNT);
+    CHECK(stats.free_entries == stats.total_entries - stats.used_entries);
+    nvs_close(handle);
+    nvs_close(other);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+
+    // the counts are the same after they have been counted again on init
+    nvs_stats_t loaded;
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 5));
+    TEST_ESP_OK(nvs_get_stats(NVS_DEFAULT_PART_NAME, &loaded));
+    CHECK(loaded.used_entries == stats.used_entries);
+    TEST_ESP_OK(nvs_open("ns", NVS_READONLY, &handle));
+    TEST_ESP_OK(nvs_get_used_entry_count(handle, &used));
+    CHECK(used == 49);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Iterators filter keys by prefix and read the values of their entries", "[nvs][iterator]")
+{
+    PartitionEmulationFixture f(0, 5);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 5));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    TEST_ESP_OK(nvs_set_u8(handle, "cfg.u8", 8));
+    TEST_ESP_OK(nvs_set_i64(handle, "cfg.i64", -64));
+    TEST_ESP_OK(nvs_set_str(handle, "cfg.str", "value"));
+    TEST_ESP_OK(nvs_inc_counter(handle, "cfg.counter", 3, nullptr));
+    uint8_t blob[3000];
+    for (size_t i = 0; i < sizeof(blob); ++i) {
+        blob[i] = static_cast<uint8_t>(i * 7);
+    }
+    TEST_ESP_OK(nvs_set_blob(handle, "cfg.blob", blob, sizeof(blob)));
+    TEST_ESP_OK(nvs_set_u8(handle, "other", 1));
+    TEST_ESP_OK(nvs_set_u8(handle, "cf", 1));
+
+    std::set<std::string> keys;
+    nvs_iterator_t it = nvs_entry_find_prefix(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY, "cfg.");
+    for (; it != nullptr; it = nvs_entry_next(it)) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        keys.insert(info.key);
+        size_t length = 0;
+        TEST_ESP_OK(nvs_entry_get_value(it, nullptr, &length));
+        std::vector<uint8_t> value(length);
+        size_t short_length = length - 1;
+        TEST_ESP_ERR(nvs_entry_get_value(it, value.data(), &short_length), ESP_ERR_NVS_INVALID_LENGTH);
+        CHECK(short_length == length);
+        TEST_ESP_OK(nvs_entry_get_value(it, value.data(), &length));
+        if (info.type == NVS_TYPE_U8) {
+            CHECK(length == 1);
+            CHECK(value[0] == 8);
+        } else if (info.type == NVS_TYPE_I64) {
+            int64_t i64;
+            REQUIRE(length == sizeof(i64));
+            memcpy(&i64, value.data(), sizeof(i64));
+            CHECK(i64 == -64);
+        } else if (info.type == NVS_TYPE_STR) {
+            CHECK(std::string(reinterpret_cast<char*>(value.data())) == "value");
+            CHECK(length == 6);
+        } else if (info.type == NVS_TYPE_COUNTER) {
+            uint32_t counter;
+            REQUIRE(length == sizeof(counter));
+            memcpy(&counter, value.data(), sizeof(counter));
+            CHECK(counter == 3);
+        } else {
+            REQUIRE(info.type == NVS_TYPE_BLOB);
+            CHECK(length == sizeof(blob));
+            CHECK(memcmp(value.data(), blob, sizeof(blob)) == 0);
+            uint8_t range[10];
+            TEST_ESP_OK(nvs_entry_get_blob_range(it, 2500, range, sizeof(range)));
+            CHECK(memcmp(range, blob + 2500, sizeof(range)) == 0);
+        }
+    }
+    CHECK(keys == std::set<std::string>{"cfg.u8", "cfg.i64", "cfg.str", "cfg.counter", "cfg.blob"});
+
+    // the value is the one stored when the iterator was created
+    it = nvs_entry_find_prefix(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_U8, "other");
+    REQUIRE(it != nullptr);
+    TEST_ESP_OK(nvs_set_u8(handle, "other", 2));
+    uint8_t u8;
+    size_t length = sizeof(u8);
+    TEST_ESP_OK(nvs_entry_get_value(it, &u8, &length));
+    CHECK(u8 == 1);
+    TEST_ESP_ERR(nvs_entry_get_blob_range(it, 0, &u8, 1), ESP_ERR_NVS_TYPE_MISMATCH);
+    CHECK(nvs_entry_next(it) == nullptr);
+
+    CHECK(nvs_entry_find_prefix(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY, "none") == nullptr);
+    CHECK(nvs_entry_find_prefix(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY, "a_much_too_long_prefix") == nullptr);
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("benchmark reading a namespace with an iterator against nvs_get_* per entry", "[nvs][iterator]")
+{
+    PartitionEmulationFixture f(0, 10);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    const uint32_t count = 300;
+    for (uint32_t i = 0; i < count; ++i) {
+        TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i)).c_str(), i));
+    }
+
+    uint64_t sums[2] = {};
+    size_t reads[2];
+    for (int values = 0; values < 2; ++values) {
+        f.emu.clearStats();
+        nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_U32);
+        for (; it != nullptr; it = nvs_entry_next(it)) {
+            uint32_t value;
+            if (values) {
+                size_t length = sizeof(value);
+                TEST_ESP_OK(nvs_entry_get_value(it, &value, &length));
+            } else {
+                nvs_entry_info_t info;
+                nvs_entry_info(it, &info);
+                TEST_ESP_OK(nvs_get_u32(handle, info.key, &value));
+            }
+            sums[values] += value;
+        }
+        reads[values] = f.emu.getReadOps();
+    }
+
+    CHECK(sums[0] == count * (count - 1) / 2);
+    CHECK(sums[1] == sums[0]);
+    CHECK(reads[1] < reads[0]);
+    s_perf << "Read " << count << " u32 values of a namespace: iterator and nvs_get_u32 " << reads[0]
+           << " reads, iterator values " << reads[1] << " reads" << std::endl;
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Iterators in caller memory list the entries and reuse released snapshots", "[nvs][iterator]")
+{
+    PartitionEmulationFixture f(0, 5);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 5));
+    nvs_handle_t handle;
+    TEST_ESP_OK(nvs_open("ns", NVS_READWRITE, &handle));
+    const uint32_t count = 20;
+    for (uint32_t i = 0; i < count; ++i) {
+        TEST_ESP_OK(nvs_set_u32(handle, ("key" + std::to_string(i)).c_str(), i));
+    }
+
+    CHECK(nvs_entry_find_in_place(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY, nullptr) == nullptr);
+    nvs_iterator_buffer_t buffer;
+    CHECK(nvs_entry_find_in_place(NVS_DEFAULT_PART_NAME, "none", NVS_TYPE_ANY, &buffer) == nullptr);
+
+    nvs::PageManager::Snapshot* snapshot = nullptr;
+    for (int pass = 0; pass < 3; ++pass) {
+        nvs_iterator_t it = nvs_entry_find_in_place(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_U32, &buffer);
+        REQUIRE(it == reinterpret_cast<nvs_iterator_t>(&buffer));
+        // the snapshot released by the pass before is taken again
+        if (pass > 0) {
+            CHECK(it->snapshot == snapshot);
+        }
+        snapshot = it->snapshot;
+        uint64_t sum = 0;
+        for (; it != nullptr; it = nvs_entry_next(it)) {
+            uint32_t value;
+            size_t length = sizeof(value);
+            TEST_ESP_OK(nvs_entry_get_value(it, &value, &length));
+            sum += value;
+        }
+        CHECK(sum == count * (count - 1) / 2);
+    }
+
+    // two iterations at once each have their own snapshot
+    nvs_iterator_buffer_t other;
+    nvs_iterator_t first = nvs_entry_find_in_place(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY, &buffer);
+    nvs_iterator_t second = nvs_entry_find_in_place(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY, &other);
+    REQUIRE(first != nullptr);
+    REQUIRE(second != nullptr);
+    CHECK(first->snapshot != second->snapshot);
+    nvs_release_iterator(first);
+    nvs_release_iterator(second);
+
+    std::set<std::string> keys;
+    for (nvs::Entry entry : nvs::Entries(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_U32)) {
+        keys.insert(entry.info().key);
+    }
+    CHECK(keys.size() == count);
+
+    // leaving the loop early releases the iterator
+    size_t listed = 0;
+    for (nvs::Entry entry : nvs::Entries(NVS_DEFAULT_PART_NAME, "ns")) {
+        uint32_t value;
+        size_t length = sizeof(value);
+        TEST_ESP_OK(entry.get_value(&value, length));
+        if (++listed == 5) {
+            break;
+        }
+    }
+    CHECK(listed == 5);
+    for (nvs::Entry entry : nvs::Entries(NVS_DEFAULT_PART_NAME, "none")) {
+        FAIL(entry.info().key);
+    }
+
+    nvs_close(handle);
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+static std::vector<std::string> list_all_keys(NVSHandle* handle, const char* from, const char* to,
+        size_t batch)
+{
+    std::vector<std::string> keys;
+    std::string next = (from != nullptr) ? from : "";
+    std::vector<nvs_entry_info_t> entries(batch);
+    while (true) {
+        size_t count = batch;
+        TEST_ESP_OK(handle->list_keys(next.empty() ? nullptr : next.c_str(), to, entries.data(), count));
+        // a later batch starts with the last key of the one before
+        for (size_t i = keys.empty() ? 0 : 1; i < count; ++i) {
+            keys.push_back(entries[i].key);
+        }
+        if (count < batch) {
+            return keys;
+        }
+        next = entries[count - 1].key;
+    }
+}
+
+TEST_CASE("NVSHandle::list_keys lists the keys in key order and by range", "[nvs][ordered]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    auto handle = nvs::open_nvs_handle("ns", NVS_READWRITE);
+    REQUIRE(handle);
+    auto other = nvs::open_nvs_handle("other", NVS_READWRITE);
+    REQUIRE(other);
+
+    std::vector<std::string> expected;
+    for (int i = 0; i < 40; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "t_%04d", i);
+        expected.push_back(key);
+    }
+    std::vector<std::string> shuffled = expected;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+    for (auto& key : shuffled) {
+        TEST_ESP_OK(handle->set_item(key.c_str(), 1u));
+        TEST_ESP_OK(other->set_item(key.c_str(), 1u));
+    }
+    CHECK(list_all_keys(handle.get(), nullptr, nullptr, 7) == expected);
+
+    // the index follows writes, erases and the garbage collection
+    uint8_t blob[1000] = {};
+    TEST_ESP_OK(handle->set_blob("blob", blob, sizeof(blob)));
+    TEST_ESP_OK(handle->erase_item("t_0003"));
+    for (int i = 0; i < 1000; ++i) {
+        TEST_ESP_OK(handle->set_item("t_0005", static_cast<uint32_t>(i)));
+    }
+    expected.erase(expected.begin() + 3);
+    expected.insert(expected.begin(), "blob");
+    CHECK(list_all_keys(handle.get(), nullptr, nullptr, 10) == expected);
+
+    nvs_entry_info_t entries[8];
+    size_t count = 8;
+    TEST_ESP_OK(handle->list_keys("t_0002", "t_0007", entries, count));
+    REQUIRE(count == 4);
+    CHECK(std::string(entries[0].key) == "t_0002");
+    CHECK(std::string(entries[1].key) == "t_0004");
+    CHECK(std::string(entries[3].key) == "t_0006");
+    CHECK(entries[3].type == NVS_TYPE_U32);
+    CHECK(std::string(entries[3].namespace_name) == "ns");
+    count = 8;
+    TEST_ESP_OK(handle->list_keys(nullptr, "t", entries, count));
+    REQUIRE(count == 1);
+    CHECK(entries[0].type == NVS_TYPE_BLOB);
+
+    // listing doesn't read the flash once the namespace is indexed
+    f.emu.clearStats();
+    count = 8;
+    TEST_ESP_OK(handle->list_keys("t_0010", nullptr, entries, count));
+    CHECK(f.emu.getReadOps() == 0);
+    CHECK(count == 8);
+
+    TEST_ESP_OK(handle->erase_all());
+    count = 8;
+    TEST_ESP_OK(handle->list_keys(nullptr, nullptr, entries, count));
+    CHECK(count == 0);
+    TEST_ESP_OK(handle->set_item("new", 1u));
+    count = 8;
+    TEST_ESP_OK(handle->list_keys(nullptr, nullptr, entries, count));
+    CHECK(count == 1);
+    CHECK(list_all_keys(other.get(), "t_0030", nullptr, 4).size() == 10);
+    CHECK(handle->list_keys(nullptr, nullptr, nullptr, count) == ESP_ERR_INVALID_ARG);
+
+    handle.reset();
+    other.reset();
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("NVSHandle::list_keys reads the pages for namespaces which don't fit in the index", "[nvs][ordered]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    auto handle = nvs::open_nvs_handle("ns", NVS_READWRITE);
+    REQUIRE(handle);
+
+    const int count = NVS_ORDERED_INDEX_KEYS + 50;
+    std::vector<std::string> expected;
+    for (int i = count - 1; i >= 0; --i) {
+        char key[16];
+        snprintf(key, sizeof(key), "k%05d", i);
+        TEST_ESP_OK(handle->set_item(key, static_cast<uint8_t>(i)));
+        expected.insert(expected.begin(), key);
+    }
+    TEST_ESP_OK(handle->set_blob("k00010", expected.data(), 100));
+    CHECK(list_all_keys(handle.get(), nullptr, nullptr, 16) == expected);
+    CHECK(list_all_keys(handle.get(), "k00100", "k00120", 3).size() == 20);
+
+    handle.reset();
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("benchmark listing a key range with the ordered index against sorting iterated keys", "[nvs][ordered]")
+{
+    PartitionEmulationFixture f(0, 8);
+    TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 8));
+    auto handle = nvs::open_nvs_handle("ns", NVS_READWRITE);
+    REQUIRE(handle);
+    const int count = 200;
+    for (int i = 0; i < count; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "t_%04d", (i * 37) % count);
+        TEST_ESP_OK(handle->set_item(key, i));
+    }
+
+    // keys t_0100 to t_0109, from all keys sorted in RAM
+    f.emu.clearStats();
+    std::vector<std::string> sorted;
+    for (nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, "ns", NVS_TYPE_ANY); it != nullptr; it = nvs_entry_next(it)) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        sorted.push_back(info.key);
+    }
+    std::sort(sorted.begin(), sorted.end());
+    auto first = std::lower_bound(sorted.begin(), sorted.end(), "t_0100");
+    std::vector<std::string> sorted_range(first, first + 10);
+    size_t sort_reads = f.emu.getReadOps();
+
+    // the first listing indexes the namespace, later ones don't read the flash
+    f.emu.clearStats();
+    auto indexed_range = list_all_keys(handle.get(), "t_0100", "t_0110", 16);
+    size_t index_reads = f.emu.getReadOps();
+    f.emu.clearStats();
+    CHECK(list_all_keys(handle.get(), "t_0100", "t_0110", 16) == indexed_range);
+    size_t indexed_reads = f.emu.getReadOps();
+
+    CHECK(indexed_range == sorted_range);
+    CHECK(indexed_reads == 0);
+    s_perf << "List 10 of " << count << " keys in key order: iterate and sort " << sort_reads << " reads, "
+           << sorted.size() * NVS_KEY_NAME_MAX_SIZE << " bytes of keys; ordered index " << index_reads
+           << " reads when built, " << indexed_reads << " reads afterwards" << std::endl;
+    handle.reset();
+    TEST_ESP_OK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME));
+}
+
+TEST_CASE("Items of a memory-mapped partition are read without flash reads", "[nvs][mmap]")
+{
+    PartitionEmulationFixture f(0, 8);
+    Storage storage(&f.part);
+    TEST_ESP_OK(storage.init(0, 8));
+
+    std::string str(1000, 'x');
+    for (size_t i = 0; i < str.size(); ++i) {
+        str[i] = static_cast<char>('a' + i % 26);
+    }
+    TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "str", str.c_str(), str.size() + 1));
+    std::vector<uint8_t> blob(Page::CHUNK_MAX_SIZE + 3000);
+    for (size_t i = 0; i < blob.size(); ++i) {
+        blob[i] = static_cast<uint8_t>(i * 13);
+    }
+    TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "blob", blob.data(), blob.size()));
+    storage.setCompression(true);
+    std::string json = make_json_config(2000, 1);
+    TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "json", json.c_str(), json.size() + 1));
+    TEST_ESP_OK(storage.writeItem(1, "u32", static_cast<uint32_t>(32)));
+
+    size_t reads[2];
+    for (int mapped = 0; mapped < 2; ++mapped) {
+        f.part.set_mapped(mapped);
+        f.emu.clearStats();
+        std::vector<char> str_read(str.size() + 1);
+        TEST_ESP_OK(storage.readItem(1, ItemType::SZ, "str", str_read.data(), str_read.size()));
+        CHECK(str == str_read.data());
+        std::vector<uint8_t> blob_read(blob.size());
+        TEST_ESP_OK(storage.readItem(1, ItemType::BLOB, "blob", blob_read.data(), blob_read.size()));
+        CHECK(blob_read == blob);
+        uint8_t range[40];
+        TEST_ESP_OK(storage.readBlobRange(1, "blob", Page::CHUNK_MAX_SIZE + 7, range, sizeof(range)));
+        CHECK(memcmp(range, blob.data() + Page::CHUNK_MAX_SIZE + 7, sizeof(range)) == 0);
+        std::vector<char> json_read(json.size() + 1);
+        TEST_ESP_OK(storage.readItem(1, ItemType::SZ, "json", json_read.data(), json_read.size()));
+        CHECK(json == json_read.data());
+        uint32_t u32;
+        TEST_ESP_OK(storage.readItem(1, "u32", u32));
+        CHECK(u32 == 32);
+        // unchanged values are compared with the stored ones, nothing is written
+        TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "str", str.c_str(), str.size() + 1));
+        TEST_ESP_OK(storage.writeItem(1, ItemType::BLOB, "blob", blob.data(), blob.size()));
+        TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "json", json.c_str(), json.size() + 1));
+        CHECK(f.emu.getWriteOps() == 0);
+        reads[mapped] = f.emu.getReadOps();
+    }
+    CHECK(reads[1] == 0);
+
+    // the mapping follows writes
+    str[0] = 'X';
+    TEST_ESP_OK(storage.writeItem(1, ItemType::SZ, "str", str.c_str(), str.size() + 1));
+    std::vector<char> str_read(str.size() + 1);
+    TEST_ESP_OK(storage.readItem(1, ItemType::SZ, "str", str_read.data(), str_read.size()));
+    CHECK(str == str_read.data());
+
+    s_perf << "Read and compare a string, a multi-page blob and a compressed string: " << reads[0]
+           << " flash reads, mapped " << reads[1] << " flash reads" << std::endl;
+}
+
+TEST_CASE("benchmark file and mmap partitions on the host", "[nvs][mmap]")
+{
+    const char *path = "test_host_partition.bin";
+    const uint32_t sectors = 64;
+    const int count = 2000;
+    double seconds[2];
+    for (int mapped = 0; mapped < 2; ++mapped) {
+        remove(path);
+        std::unique_ptr<Partition> part;
+        if (mapped) {
+            std::unique_ptr<MmapPartition> mmap_part(new MmapPartition("host"));
+            TEST_ESP_OK(mmap_part->init(path, sectors * SPI_FLASH_SEC_SIZE, MmapPartition::SyncPolicy::COMMIT));
+            part = std::move(mmap_part);
+        } else {
+            std::unique_ptr<FilePartition> file_part(new FilePartition("host"));
+            TEST_ESP_OK(file_part->init(path, sectors * SPI_FLASH_SEC_SIZE, false, 0));
+            part = std::move(file_part);
+        }
+        auto start = std::chrono::steady_clock::now();
+        TEST_ESP_OK(NVSPartitionManager::get_instance()->init_custom(part.get(), 0, sectors));
+        nvs_handle_t handle;
+        TEST_ESP_OK(nvs_open_from_partition("host", "ns", NVS_READWRITE, &handle));
+        for (int i = 0; i < count; ++i) {
+            TEST_ESP_OK(nvs_set_i32(handle, ("key" + std::to_string(i % 500)).c_str(), i));
+        }
+        TEST_ESP_OK(nvs_commit(handle));
+        int64_t sum = 0;
+        for (int i = 0; i < 500; ++i) {
+            int32_t value;
+            TEST_ESP_OK(nvs_get_i32(handle, ("key" + std::to_string(i)).c_str(), &value));
+            sum += value;
+        }
+        CHECK(sum == (count - 500 + count - 1) * 500 / 2);
+        nvs_close(handle);
+        TEST_ESP_OK(nvs_flash_deinit_partition("host"));
+        seconds[mapped] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    remove(path);
+    s_perf << "Write " << count << " and read 500 i32 values on the host: file partition " << seconds[0] * 1000
+           << " ms, mmap partition " << seconds[1] * 1000 << " ms" << std::endl;
+}
+
+#if CONFIG_NVS_COALESCE_WRITES
+TEST_CASE("the entries of an item are marked as written with one write", "[nvs]")
+{
+    PartitionEmulationFixture f(0, 4);
+    Page page;
+    TEST_ESP_OK(page.load(&f.part, 0));
+    TEST_ESP_OK(page.writeItem<uint8_t>(1, "ns", 1));
+
+    // 33 entries, written in three parts straight from the string, whose states span three words of the entry
+    // state table
+    std::string str(1000, 'x');
+    for (size_t i = 0; i < str.size(); ++i) {
+        str[i] = static_cast<char>('a' + i % 26);
+    }
+    f.emu.clearStats();
+    TEST_ESP_OK(page.writeItem(1, ItemType::SZ, "str", str.c_str(), str.size() + 1));
+    CHECK(f.emu.getWriteOps() == 3 + 1);
+
+    // 3 entries, assembled on the stack
+    f.emu.clearStats();
+    TEST_ESP_OK(page.writeItem(1, ItemType::SZ, "short", "0123456789abcdef0123456789abcdef", 33));
+    CHECK(f.emu.getWriteOps() == 2);
+
+    Page loaded;
+    TEST_ESP_OK(loaded.load(&f.part, 0));
+    CHECK(loaded.getUsedEntryCount() == 1 + 33 + 3);
+    std::vector<char> read(str.size() + 1);
+    TEST_ESP_OK(loaded.readItem(1, ItemType::SZ, "str", read.data(), read.size()));
+    CHECK(str == read.data());
+    char shortStr[33];
+    TEST_ESP_OK(loaded.readItem(1, ItemType::SZ, "short", shortStr, sizeof(shortStr)));
+    CHECK(strcmp(shortStr, "0123456789abcdef0123456789abcdef") == 0);
+}
+#endif
+
 /* Add new tests above */
 /* This test has to be the final one */
 
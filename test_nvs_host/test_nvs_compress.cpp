@@ -0,0 +1,100 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "catch.hpp"
+#include "nvs_compress.hpp"
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace nvs;
+
+static void check_roundtrip(const vector<uint8_t>& src)
+{
+    vector<uint8_t> compressed(src.size() + src.size() / 255 + 16);
+    size_t size = compress(src.data(), src.size(), compressed.data(), compressed.size());
+    REQUIRE(size > 0);
+    vector<uint8_t> out(src.size());
+    CHECK(decompress(compressed.data(), size, out.data(), out.size()));
+    CHECK(out == src);
+}
+
+TEST_CASE("compressed data decompresses to the original", "[compress]")
+{
+    check_roundtrip(vector<uint8_t>());
+    check_roundtrip(vector<uint8_t>{1, 2, 3});
+    check_roundtrip(vector<uint8_t>(4000, 0xab));
+
+    vector<uint8_t> text;
+    const char* line = "{\"ssid\":\"network\",\"channel\":6,\"enabled\":true},";
+    while (text.size() < 3000) {
+        text.insert(text.end(), line, line + strlen(line));
+        text.push_back(static_cast<uint8_t>('0' + text.size() % 10));
+    }
+    check_roundtrip(text);
+
+    std::mt19937 gen(1);
+    vector<uint8_t> random(4000);
+    for (auto& b : random) {
+        b = static_cast<uint8_t>(gen());
+    }
+    check_roundtrip(random);
+
+    // literal and match lengths needing several extension bytes
+    vector<uint8_t> mixed(random.begin(), random.begin() + 600);
+    mixed.insert(mixed.end(), 1000, 0x00);
+    mixed.insert(mixed.end(), random.begin(), random.begin() + 600);
+    check_roundtrip(mixed);
+}
+
+TEST_CASE("compression fails if the output doesn't fit", "[compress]")
+{
+    vector<uint8_t> src(1000, 0x11);
+    vector<uint8_t> dst(1000);
+    size_t size = compress(src.data(), src.size(), dst.data(), dst.size());
+    REQUIRE(size > 0);
+    CHECK(compress(src.data(), src.size(), dst.data(), size - 1) == 0);
+
+    std::mt19937 gen(2);
+    for (auto& b : src) {
+        b = static_cast<uint8_t>(gen());
+    }
+    CHECK(compress(src.data(), src.size(), dst.data(), src.size() - 1) == 0);
+}
+
+TEST_CASE("decompression rejects malformed data", "[compress]")
+{
+    vector<uint8_t> src(500, 0x22);
+    vector<uint8_t> compressed(500);
+    size_t size = compress(src.data(), src.size(), compressed.data(), compressed.size());
+    REQUIRE(size > 0);
+    vector<uint8_t> out(src.size());
+
+    // wrong output size
+    CHECK_FALSE(decompress(compressed.data(), size, out.data(), out.size() - 1));
+    out.push_back(0);
+    CHECK_FALSE(decompress(compressed.data(), size, out.data(), out.size()));
+    out.pop_back();
+
+    // truncated input
+    for (size_t i = 0; i < size; ++i) {
+        CHECK_FALSE(decompress(compressed.data(), i, out.data(), out.size()));
+    }
+
+    // match offset pointing before the start of the output
+    const uint8_t bad_offset[] = {0x10, 0x22, 0x02, 0x00, 0x00};
+    CHECK_FALSE(decompress(bad_offset, sizeof(bad_offset), out.data(), 5));
+    const uint8_t zero_offset[] = {0x10, 0x22, 0x00, 0x00, 0x00};
+    CHECK_FALSE(decompress(zero_offset, sizeof(zero_offset), out.data(), 5));
+}
@@ -191,3 +191,184 @@ TEST_CASE("NVSHandleSimple CXX api read/write blob", "[nvs cxx]")
 
     nvs::NVSPartitionManager::get_instance()->deinit_partition("nvs");
 }
+
+TEST_CASE("NVSHandleSimple CXX api write blob piece by piece", "[nvs cxx]")
+{
+    const uint32_t NVS_FLASH_SECTOR = 2;
+    const uint32_t NVS_FLASH_SECTOR_COUNT_MIN = 8;
+    PartitionEmulationFixture f(0, 10);
+    const size_t BLOB_SIZE = 9000;
+    vector<uint8_t> blob(BLOB_SIZE);
+    vector<uint8_t> read_blob(BLOB_SIZE);
+    size_t size;
+    esp_err_t result;
+    shared_ptr<nvs::NVSHandle> handle;
+
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f.part, NVS_FLASH_SECTOR, NVS_FLASH_SECTOR_COUNT_MIN)
+            == ESP_OK);
+
+    handle = nvs::open_nvs_handle("test_ns", NVS_READWRITE, &result);
+    CHECK(result == ESP_OK);
+    REQUIRE(handle);
+
+    CHECK(handle->append_blob(blob.data(), 1) == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->finalize_blob() == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->open_blob_writer("test", 0) == ESP_ERR_INVALID_ARG);
+    CHECK(handle->open_blob_writer("key_too_long_for_nvs", 512) == ESP_ERR_NVS_KEY_TOO_LONG);
+
+    for (size_t i = 0; i < BLOB_SIZE; ++i) {
+        blob[i] = static_cast<uint8_t>(i);
+    }
+    REQUIRE(handle->open_blob_writer("test", 512) == ESP_OK);
+    CHECK(handle->open_blob_writer("other", 512) == ESP_ERR_NVS_INVALID_STATE);
+    for (size_t offset = 0; offset < BLOB_SIZE; offset += 100) {
+        CHECK(handle->append_blob(blob.data() + offset, min<size_t>(100, BLOB_SIZE - offset)) == ESP_OK);
+    }
+    // nothing is visible before finalizing
+    CHECK(handle->get_item_size(nvs::ItemType::BLOB, "test", size) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(handle->finalize_blob() == ESP_OK);
+    CHECK(handle->get_item_size(nvs::ItemType::BLOB, "test", size) == ESP_OK);
+    CHECK(size == BLOB_SIZE);
+    CHECK(handle->get_blob("test", read_blob.data(), read_blob.size()) == ESP_OK);
+    CHECK(blob == read_blob);
+
+    // replace the value in a few large pieces
+    fill(blob.begin(), blob.end(), 0xa5);
+    REQUIRE(handle->open_blob_writer("test", 4096) == ESP_OK);
+    CHECK(handle->append_blob(blob.data(), 5000) == ESP_OK);
+    CHECK(handle->append_blob(blob.data() + 5000, BLOB_SIZE - 5000) == ESP_OK);
+    CHECK(handle->finalize_blob() == ESP_OK);
+    CHECK(handle->get_blob("test", read_blob.data(), read_blob.size()) == ESP_OK);
+    CHECK(blob == read_blob);
+
+    // an aborted writer leaves the previous value untouched
+    size_t used_before;
+    CHECK(handle->get_used_entry_count(used_before) == ESP_OK);
+    REQUIRE(handle->open_blob_writer("test", 512) == ESP_OK);
+    CHECK(handle->append_blob(blob.data(), 3000) == ESP_OK);
+    CHECK(handle->abort_blob() == ESP_OK);
+    CHECK(handle->append_blob(blob.data(), 1) == ESP_ERR_NVS_INVALID_STATE);
+    size_t used_after;
+    CHECK(handle->get_used_entry_count(used_after) == ESP_OK);
+    CHECK(used_after == used_before);
+    CHECK(handle->get_blob("test", read_blob.data(), read_blob.size()) == ESP_OK);
+    CHECK(blob == read_blob);
+
+    // empty blob
+    REQUIRE(handle->open_blob_writer("empty", 64) == ESP_OK);
+    CHECK(handle->finalize_blob() == ESP_OK);
+    CHECK(handle->get_item_size(nvs::ItemType::BLOB, "empty", size) == ESP_OK);
+    CHECK(size == 0);
+
+    // a writer which is still open when the handle is closed is aborted
+    REQUIRE(handle->open_blob_writer("test", 512) == ESP_OK);
+    CHECK(handle->append_blob(blob.data(), 3000) == ESP_OK);
+    handle.reset();
+    handle = nvs::open_nvs_handle("test_ns", NVS_READONLY, &result);
+    REQUIRE(handle);
+    CHECK(handle->get_used_entry_count(used_after) == ESP_OK);
+    CHECK(used_after == used_before + 2);
+    CHECK(handle->open_blob_writer("test", 512) == ESP_ERR_NVS_READ_ONLY);
+
+    handle.reset();
+    nvs::NVSPartitionManager::get_instance()->deinit_partition("nvs");
+}
+
+TEST_CASE("NVSHandleSimple CXX api reserves the key of a blob being written piece by piece", "[nvs cxx]")
+{
+    const uint32_t NVS_FLASH_SECTOR = 2;
+    const uint32_t NVS_FLASH_SECTOR_COUNT_MIN = 8;
+    PartitionEmulationFixture f(0, 10);
+    const size_t BLOB_SIZE = 6000;
+    vector<uint8_t> blob(BLOB_SIZE, 0x11);
+    vector<uint8_t> other(BLOB_SIZE, 0x22);
+    vector<uint8_t> read_blob(BLOB_SIZE);
+    esp_err_t result;
+
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f.part, NVS_FLASH_SECTOR, NVS_FLASH_SECTOR_COUNT_MIN)
+            == ESP_OK);
+
+    shared_ptr<nvs::NVSHandle> writer = nvs::open_nvs_handle("test_ns", NVS_READWRITE, &result);
+    REQUIRE(writer);
+    shared_ptr<nvs::NVSHandle> handle = nvs::open_nvs_handle("test_ns", NVS_READWRITE, &result);
+    REQUIRE(handle);
+    REQUIRE(handle->set_blob("test", other.data(), other.size()) == ESP_OK);
+
+    REQUIRE(writer->open_blob_writer("test", 1024) == ESP_OK);
+    CHECK(writer->append_blob(blob.data(), 3000) == ESP_OK);
+    // the key can't be written, erased or written by another writer in the meantime
+    CHECK(handle->set_blob("test", other.data(), other.size()) == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->set_item("test", static_cast<uint8_t>(1)) == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->erase_item("test") == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->erase_all() == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->open_blob_writer("test", 1024) == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->set_blob("other", other.data(), 100) == ESP_OK);
+    CHECK(writer->append_blob(blob.data() + 3000, BLOB_SIZE - 3000) == ESP_OK);
+    CHECK(writer->finalize_blob() == ESP_OK);
+    CHECK(handle->get_blob("test", read_blob.data(), read_blob.size()) == ESP_OK);
+    CHECK(read_blob == blob);
+
+    // after an aborted writer the key is free again and keeps its value
+    size_t used_before;
+    CHECK(handle->get_used_entry_count(used_before) == ESP_OK);
+    REQUIRE(writer->open_blob_writer("test", 1024) == ESP_OK);
+    CHECK(writer->append_blob(other.data(), 3000) == ESP_OK);
+    CHECK(handle->set_blob("test", other.data(), other.size()) == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(writer->abort_blob() == ESP_OK);
+    size_t used_after;
+    CHECK(handle->get_used_entry_count(used_after) == ESP_OK);
+    CHECK(used_after == used_before);
+    CHECK(handle->get_blob("test", read_blob.data(), read_blob.size()) == ESP_OK);
+    CHECK(read_blob == blob);
+    CHECK(handle->set_blob("test", other.data(), other.size()) == ESP_OK);
+    CHECK(handle->get_blob("test", read_blob.data(), read_blob.size()) == ESP_OK);
+    CHECK(read_blob == other);
+    CHECK(handle->erase_all() == ESP_OK);
+
+    writer.reset();
+    handle.reset();
+    nvs::NVSPartitionManager::get_instance()->deinit_partition("nvs");
+}
+
+TEST_CASE("NVSHandleSimple CXX api read blob piece by piece", "[nvs cxx]")
+{
+    const uint32_t NVS_FLASH_SECTOR = 2;
+    const uint32_t NVS_FLASH_SECTOR_COUNT_MIN = 8;
+    PartitionEmulationFixture f(0, 10);
+    const size_t BLOB_SIZE = 9000;
+    vector<uint8_t> blob(BLOB_SIZE);
+    vector<uint8_t> read_blob;
+    uint8_t buf[333];
+    size_t size;
+    size_t read_len;
+    esp_err_t result;
+    shared_ptr<nvs::NVSHandle> handle;
+
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f.part, NVS_FLASH_SECTOR, NVS_FLASH_SECTOR_COUNT_MIN)
+            == ESP_OK);
+
+    handle = nvs::open_nvs_handle("test_ns", NVS_READWRITE, &result);
+    CHECK(result == ESP_OK);
+    REQUIRE(handle);
+
+    for (size_t i = 0; i < BLOB_SIZE; ++i) {
+        blob[i] = static_cast<uint8_t>(i % 251);
+    }
+    CHECK(handle->set_blob("test", blob.data(), blob.size()) == ESP_OK);
+
+    CHECK(handle->read_blob(buf, sizeof(buf), read_len) == ESP_ERR_NVS_INVALID_STATE);
+    CHECK(handle->open_blob_reader("missing", size) == ESP_ERR_NVS_NOT_FOUND);
+    REQUIRE(handle->open_blob_reader("test", size) == ESP_OK);
+    CHECK(size == BLOB_SIZE);
+    do {
+        CHECK(handle->read_blob(buf, sizeof(buf), read_len) == ESP_OK);
+        read_blob.insert(read_blob.end(), buf, buf + read_len);
+    } while (read_len == sizeof(buf));
+    CHECK(blob == read_blob);
+
+    CHECK(handle->get_blob_range("test", 4000, buf, sizeof(buf)) == ESP_OK);
+    CHECK(vector<uint8_t>(buf, buf + sizeof(buf)) == vector<uint8_t>(blob.begin() + 4000, blob.begin() + 4000 + sizeof(buf)));
+
+    handle.reset();
+    nvs::NVSPartitionManager::get_instance()->deinit_partition("nvs");
+}
@@ -17,6 +17,9 @@
 #include "nvs_test_api.h"
 #include "nvs_handle_simple.hpp"
 #include "nvs_partition.hpp"
+#include "nvs_file_partition.hpp"
+#include "nvs_mmap_partition.hpp"
+#include "nvs_partition_manager.hpp"
 #include "spi_flash_emulation.h"
 
 #include "test_fixtures.hpp"
@@ -53,3 +56,139 @@ TEST_CASE("encrypted partition write size must be mod item size", "[nvs]")
     CHECK(fix.part.write(0, foo, sizeof (foo)) == ESP_OK);
     CHECK(fix.part.write(0, foo, sizeof (foo) * 2) == ESP_OK);
 }
+
+TEST_CASE("file partition behaves like NOR flash", "[nvs][file]")
+{
+    const char *path = "test_file_partition.bin";
+    remove(path);
+    FilePartition part("file");
+    CHECK(part.init(path, 1000) == ESP_ERR_INVALID_SIZE);
+    CHECK(part.init(path, 2 * SPI_FLASH_SEC_SIZE) == ESP_OK);
+    CHECK(part.init(path, 2 * SPI_FLASH_SEC_SIZE) == ESP_ERR_INVALID_STATE);
+    CHECK(part.get_size() == 2 * SPI_FLASH_SEC_SIZE);
+
+    // a new file is erased
+    uint8_t buf[64];
+    CHECK(part.read(SPI_FLASH_SEC_SIZE - 32, buf, sizeof(buf)) == ESP_OK);
+    CHECK(std::all_of(buf, buf + sizeof(buf), [](uint8_t b) { return b == 0xff; }));
+
+    // bits can only be cleared
+    uint32_t word = 0xa5a5a5a5;
+    CHECK(part.write(8, &word, sizeof(word)) == ESP_OK);
+    word = 0x05050505;
+    CHECK(part.write(8, &word, sizeof(word)) == ESP_OK);
+    word = 0xa5a5a5a5;
+    CHECK(part.write(8, &word, sizeof(word)) == ESP_ERR_FLASH_OP_FAIL);
+    CHECK(part.read_raw(8, &word, sizeof(word)) == ESP_OK);
+    CHECK(word == 0x05050505);
+    CHECK(part.write(2 * SPI_FLASH_SEC_SIZE - 2, &word, sizeof(word)) == ESP_ERR_INVALID_SIZE);
+
+    CHECK(part.erase_range(1, SPI_FLASH_SEC_SIZE) == ESP_ERR_INVALID_ARG);
+    CHECK(part.erase_range(SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE * 2) == ESP_ERR_INVALID_SIZE);
+    CHECK(part.erase_range(0, SPI_FLASH_SEC_SIZE) == ESP_OK);
+    CHECK(part.read(8, &word, sizeof(word)) == ESP_OK);
+    CHECK(word == 0xffffffff);
+    remove(path);
+}
+
+TEST_CASE("nvs data in a file partition persists across instances", "[nvs][file]")
+{
+    const char *path = "test_file_partition.bin";
+    remove(path);
+    for (int direct = 0; direct < 2; ++direct) {
+        for (int pass = 0; pass < 2; ++pass) {
+            FilePartition part("file");
+            esp_err_t err = part.init(path, 3 * SPI_FLASH_SEC_SIZE, direct, 0);
+            if (direct && err == ESP_ERR_NOT_SUPPORTED) {
+                WARN("O_DIRECT isn't supported by the file system of " << path);
+                break;
+            }
+            CHECK(err == ESP_OK);
+            CHECK(NVSPartitionManager::get_instance()->init_custom(&part, 0, 3) == ESP_OK);
+            nvs_handle_t handle;
+            CHECK(nvs_open_from_partition("file", "ns", NVS_READWRITE, &handle) == ESP_OK);
+            if (pass == 0) {
+                CHECK(nvs_set_i32(handle, "direct", direct) == ESP_OK);
+                CHECK(nvs_set_str(handle, "str", "stored in a file") == ESP_OK);
+                CHECK(nvs_commit(handle) == ESP_OK);
+            } else {
+                int32_t value;
+                CHECK(nvs_get_i32(handle, "direct", &value) == ESP_OK);
+                CHECK(value == direct);
+                char str[32];
+                size_t length = sizeof(str);
+                CHECK(nvs_get_str(handle, "str", str, &length) == ESP_OK);
+                CHECK(strcmp(str, "stored in a file") == 0);
+            }
+            nvs_close(handle);
+            CHECK(nvs_flash_deinit_partition("file") == ESP_OK);
+            CHECK(part.sync() == ESP_OK);
+        }
+    }
+    remove(path);
+}
+
+TEST_CASE("mmap partition behaves like NOR flash and is read in place", "[nvs][mmap]")
+{
+    const char *path = "test_mmap_partition.bin";
+    remove(path);
+    MmapPartition part("mmap");
+    CHECK(part.init(path, 1000) == ESP_ERR_INVALID_SIZE);
+    CHECK(part.init(path, 2 * SPI_FLASH_SEC_SIZE, MmapPartition::SyncPolicy::EACH_WRITE) == ESP_OK);
+    CHECK(part.init(path, 2 * SPI_FLASH_SEC_SIZE) == ESP_ERR_INVALID_STATE);
+
+    const uint8_t* mapped = static_cast<const uint8_t*>(part.get_mapped_ptr(0, 2 * SPI_FLASH_SEC_SIZE));
+    REQUIRE(mapped != nullptr);
+    CHECK(part.get_mapped_ptr(SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE + 1) == nullptr);
+    CHECK(std::all_of(mapped, mapped + 2 * SPI_FLASH_SEC_SIZE, [](uint8_t b) { return b == 0xff; }));
+
+    uint32_t word = 0xa5a5a5a5;
+    CHECK(part.write(SPI_FLASH_SEC_SIZE + 4, &word, sizeof(word)) == ESP_OK);
+    uint32_t words[2] = {0, 0xffffffff};
+    CHECK(part.write(SPI_FLASH_SEC_SIZE, words, sizeof(words)) == ESP_ERR_FLASH_OP_FAIL);
+    CHECK(memcmp(mapped + SPI_FLASH_SEC_SIZE, "\xff\xff\xff\xff\xa5\xa5\xa5\xa5", 8) == 0);
+    CHECK(part.write(2 * SPI_FLASH_SEC_SIZE - 2, &word, sizeof(word)) == ESP_ERR_INVALID_SIZE);
+
+    // writes reach the file
+    FILE* f = fopen(path, "rb");
+    REQUIRE(f != nullptr);
+    fseek(f, SPI_FLASH_SEC_SIZE + 4, SEEK_SET);
+    uint32_t stored = 0;
+    CHECK(fread(&stored, sizeof(stored), 1, f) == 1);
+    CHECK(stored == 0xa5a5a5a5);
+    fclose(f);
+
+    CHECK(part.erase_range(1, SPI_FLASH_SEC_SIZE) == ESP_ERR_INVALID_ARG);
+    CHECK(part.erase_range(SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE) == ESP_OK);
+    CHECK(part.read(SPI_FLASH_SEC_SIZE + 4, &word, sizeof(word)) == ESP_OK);
+    CHECK(word == 0xffffffff);
+    remove(path);
+}
+
+TEST_CASE("nvs data in an mmap partition persists with each sync policy", "[nvs][mmap]")
+{
+    const char *path = "test_mmap_partition.bin";
+    remove(path);
+    const MmapPartition::SyncPolicy policies[] = {
+        MmapPartition::SyncPolicy::EACH_WRITE,
+        MmapPartition::SyncPolicy::COMMIT,
+        MmapPartition::SyncPolicy::PERIODIC,
+    };
+    int32_t expected = 0;
+    for (auto policy : policies) {
+        MmapPartition part("mmap");
+        CHECK(part.init(path, 3 * SPI_FLASH_SEC_SIZE, policy, 0) == ESP_OK);
+        CHECK(NVSPartitionManager::get_instance()->init_custom(&part, 0, 3) == ESP_OK);
+        nvs_handle_t handle;
+        CHECK(nvs_open_from_partition("mmap", "ns", NVS_READWRITE, &handle) == ESP_OK);
+        int32_t value = -1;
+        CHECK(nvs_get_i32(handle, "value", &value) == ((expected == 0) ? ESP_ERR_NVS_NOT_FOUND : ESP_OK));
+        CHECK(value == ((expected == 0) ? -1 : expected));
+        expected = static_cast<int32_t>(policy) + 1;
+        CHECK(nvs_set_i32(handle, "value", expected) == ESP_OK);
+        CHECK(nvs_commit(handle) == ESP_OK);
+        nvs_close(handle);
+        CHECK(nvs_flash_deinit_partition("mmap") == ESP_OK);
+    }
+    remove(path);
+}
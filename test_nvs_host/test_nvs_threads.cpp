@@ -0,0 +1,262 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* These tests call the locked APIs from several threads at once. Build with TSAN=1 to run them
+ * under ThreadSanitizer. Catch assertions aren't thread safe, so the threads only count failures,
+ * which are checked after joining them. */
+
+#include "catch.hpp"
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nvs.h"
+#include "nvs_handle.hpp"
+#include "nvs_partition_manager.hpp"
+#include "test_fixtures.hpp"
+
+using namespace std;
+
+static const int THREAD_COUNT = 4;
+static const int ITERATIONS = 300;
+
+TEST_CASE("NVSHandleLocked can be shared by several threads", "[threads]")
+{
+    PartitionEmulationFixture f(0, 10, "test");
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 10) == ESP_OK);
+    esp_err_t result;
+    shared_ptr<nvs::NVSHandle> handle = nvs::open_nvs_handle_from_partition("test", "ns", NVS_READWRITE, &result);
+    REQUIRE(result == ESP_OK);
+
+    atomic<size_t> errors(0);
+    vector<thread> threads;
+    for (int t = 0; t < THREAD_COUNT; ++t) {
+        threads.emplace_back([&, t] {
+            char key[16];
+            char str_key[16];
+            char other_key[16];
+            snprintf(key, sizeof(key), "int%d", t);
+            snprintf(str_key, sizeof(str_key), "str%d", t);
+            snprintf(other_key, sizeof(other_key), "int%d", (t + 1) % THREAD_COUNT);
+            vector<uint8_t> blob(600, static_cast<uint8_t>(t));
+            for (int32_t i = 0; i < ITERATIONS; ++i) {
+                int32_t value;
+                if (handle->set_item(key, i) != ESP_OK || handle->get_item(key, value) != ESP_OK || value != i) {
+                    ++errors;
+                }
+                // the other thread's key is either not written yet or holds one of its values
+                esp_err_t err = handle->get_item(other_key, value);
+                if ((err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) || (err == ESP_OK && (value < 0 || value >= ITERATIONS))) {
+                    ++errors;
+                }
+
+                string str = to_string(i);
+                char str_read[16];
+                if (handle->set_string(str_key, str.c_str()) != ESP_OK
+                        || handle->get_string(str_key, str_read, sizeof(str_read)) != ESP_OK
+                        || str != str_read) {
+                    ++errors;
+                }
+
+                if (i % 16 == 0) {
+                    blob[0] = static_cast<uint8_t>(i);
+                    vector<uint8_t> blob_read(blob.size());
+                    size_t size;
+                    if (handle->set_blob("blob", blob.data(), blob.size()) != ESP_OK
+                            || handle->get_item_size(nvs::ItemType::BLOB, "blob", size) != ESP_OK
+                            || size != blob.size()
+                            || handle->get_blob("blob", blob_read.data(), blob_read.size()) != ESP_OK) {
+                        ++errors;
+                    }
+                    size_t used;
+                    if (handle->get_used_entry_count(used) != ESP_OK || handle->commit() != ESP_OK) {
+                        ++errors;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    CHECK(errors == 0);
+
+    for (int t = 0; t < THREAD_COUNT; ++t) {
+        char key[16];
+        snprintf(key, sizeof(key), "int%d", t);
+        int32_t value;
+        CHECK(handle->get_item(key, value) == ESP_OK);
+        CHECK(value == ITERATIONS - 1);
+    }
+
+    handle.reset();
+    nvs::NVSPartitionManager::get_instance()->deinit_partition("test");
+}
+
+TEST_CASE("C API can be used from several threads", "[threads]")
+{
+    PartitionEmulationFixture f1(0, 10, NVS_DEFAULT_PART_NAME);
+    PartitionEmulationFixture f2(0, 4, "other");
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f1.part, 0, 10) == ESP_OK);
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f2.part, 0, 4) == ESP_OK);
+
+    atomic<size_t> errors(0);
+    atomic<bool> stop(false);
+    vector<thread> threads;
+
+    // every writer opens its own handle, and reopens it now and then
+    for (int t = 0; t < THREAD_COUNT; ++t) {
+        threads.emplace_back([&, t] {
+            char ns[16];
+            snprintf(ns, sizeof(ns), "ns%d", t);
+            nvs_handle_t handle = 0;
+            for (int32_t i = 0; i < ITERATIONS; ++i) {
+                if (i % 50 == 0) {
+                    if (i != 0) {
+                        nvs_close(handle);
+                    }
+                    if (nvs_open(ns, NVS_READWRITE, &handle) != ESP_OK) {
+                        ++errors;
+                        return;
+                    }
+                }
+                int32_t value;
+                if (nvs_set_i32(handle, "counter", i) != ESP_OK
+                        || nvs_get_i32(handle, "counter", &value) != ESP_OK || value != i) {
+                    ++errors;
+                }
+                char str[16];
+                size_t len = sizeof(str);
+                snprintf(str, sizeof(str), "v%d", i);
+                if (nvs_set_str(handle, "str", str) != ESP_OK
+                        || nvs_get_str(handle, "str", str, &len) != ESP_OK || len != strlen(str) + 1) {
+                    ++errors;
+                }
+                if (i % 10 == 0 && (nvs_erase_key(handle, "str") != ESP_OK || nvs_commit(handle) != ESP_OK)) {
+                    ++errors;
+                }
+            }
+            nvs_close(handle);
+        });
+    }
+
+    // readers of the whole partition
+    threads.emplace_back([&] {
+        while (!stop) {
+            nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, nullptr, NVS_TYPE_ANY);
+            while (it) {
+                nvs_entry_info_t info;
+                nvs_entry_info(it, &info);
+                if (strlen(info.key) == 0) {
+                    ++errors;
+                }
+                it = nvs_entry_next(it);
+            }
+            nvs_stats_t stats;
+            if (nvs_get_stats(NVS_DEFAULT_PART_NAME, &stats) != ESP_OK || stats.used_entries > stats.total_entries) {
+                ++errors;
+            }
+        }
+    });
+
+    // another partition, used at the same time
+    threads.emplace_back([&] {
+        nvs_handle_t handle;
+        if (nvs_open_from_partition("other", "ns", NVS_READWRITE, &handle) != ESP_OK) {
+            ++errors;
+            return;
+        }
+        vector<uint8_t> blob(1000, 0x3c);
+        for (int i = 0; !stop; ++i) {
+            blob[0] = static_cast<uint8_t>(i);
+            vector<uint8_t> blob_read(blob.size());
+            size_t len = blob_read.size();
+            if (nvs_set_blob(handle, "blob", blob.data(), blob.size()) != ESP_OK
+                    || nvs_get_blob(handle, "blob", blob_read.data(), &len) != ESP_OK || blob_read != blob) {
+                ++errors;
+            }
+        }
+        nvs_close(handle);
+    });
+
+    for (int t = 0; t < THREAD_COUNT; ++t) {
+        threads[t].join();
+    }
+    stop = true;
+    for (size_t t = THREAD_COUNT; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    CHECK(errors == 0);
+
+    for (int t = 0; t < THREAD_COUNT; ++t) {
+        char ns[16];
+        snprintf(ns, sizeof(ns), "ns%d", t);
+        nvs_handle_t handle;
+        int32_t value;
+        REQUIRE(nvs_open(ns, NVS_READONLY, &handle) == ESP_OK);
+        CHECK(nvs_get_i32(handle, "counter", &value) == ESP_OK);
+        CHECK(value == ITERATIONS - 1);
+        nvs_close(handle);
+    }
+
+    CHECK(nvs_flash_deinit_partition("other") == ESP_OK);
+    CHECK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME) == ESP_OK);
+}
+
+TEST_CASE("Increments from several threads aren't lost", "[threads]")
+{
+    PartitionEmulationFixture f(0, 6, NVS_DEFAULT_PART_NAME);
+    REQUIRE(nvs::NVSPartitionManager::get_instance()->init_custom(&f.part, 0, 6) == ESP_OK);
+
+    atomic<size_t> errors(0);
+    vector<thread> threads;
+    for (int t = 0; t < THREAD_COUNT; ++t) {
+        threads.emplace_back([&] {
+            nvs_handle_t handle;
+            if (nvs_open("ns", NVS_READWRITE, &handle) != ESP_OK) {
+                ++errors;
+                return;
+            }
+            for (int i = 0; i < ITERATIONS; ++i) {
+                if (nvs_inc_u32(handle, "counter", 1, nullptr) != ESP_OK) {
+                    ++errors;
+                }
+                // the same with compare-and-swap, retried until no other thread got in between
+                uint32_t expected = 0;
+                esp_err_t err;
+                while ((err = nvs_cas_u32(handle, "cas", &expected, expected + 1)) == ESP_ERR_NVS_VALUE_CHANGED) {
+                }
+                if (err != ESP_OK && (err != ESP_ERR_NVS_NOT_FOUND || nvs_inc_u32(handle, "cas", 1, nullptr) != ESP_OK)) {
+                    ++errors;
+                }
+            }
+            nvs_close(handle);
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    CHECK(errors == 0);
+
+    nvs_handle_t handle;
+    REQUIRE(nvs_open("ns", NVS_READONLY, &handle) == ESP_OK);
+    uint32_t value;
+    CHECK(nvs_get_u32(handle, "counter", &value) == ESP_OK);
+    CHECK(value == THREAD_COUNT * ITERATIONS);
+    CHECK(nvs_get_u32(handle, "cas", &value) == ESP_OK);
+    CHECK(value == THREAD_COUNT * ITERATIONS);
+    nvs_close(handle);
+    CHECK(nvs_flash_deinit_partition(NVS_DEFAULT_PART_NAME) == ESP_OK);
+}